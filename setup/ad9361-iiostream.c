@@ -12,10 +12,12 @@
 #include <iio/iio-debug.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <signal.h>
 #include <stdio.h>
 #include <errno.h>
+#include <unistd.h>
 
 /* helper macros */
 #define MHZ(x) ((long long)(x*1000000.0 + .5))
@@ -28,7 +30,9 @@
 	} \
 }
 
+/* default stream geometry, see -b and -n */
 #define BLOCK_SIZE (1024 * 1024)
+#define NB_BLOCKS 4
 
 /* RX is input, TX is output */
 enum iodev { RX, TX };
@@ -43,6 +47,7 @@ struct stream_cfg {
 
 /* static scratch mem for strings */
 static char tmpstr[64];
+static char label[64];
 
 /* IIO structs required for streaming */
 static struct iio_context *ctx   = NULL;
@@ -174,15 +179,33 @@ bool cfg_ad9361_streaming_ch(struct stream_cfg *cfg, enum iodev type, int chid)
 	return true;
 }
 
-/* simple configuration and streaming */
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-b block_size] [-n blocks] [-t seconds] [uri]\n"
+		"  -b  samples per block (default %d, at least %d)\n"
+		"  -n  blocks per stream (default %d)\n"
+		"  -t  stop after this many seconds (default: on CTRL+C)\n",
+		prog, BLOCK_SIZE, STREAM_MIN_BLOCK_SIZE, NB_BLOCKS);
+	exit(1);
+}
+
+/* simple configuration and loopback measurement, TX port A cabled to RX port A */
 /* usage:
  * Default context, assuming local IIO devices, i.e., this script is run on ADALM-Pluto for example
  $./a.out
  * URI context, find out the uri by typing `iio_info -s` at the command line of the host PC
  $./a.out usb:x.x.x
+ * Latency and throughput for 64 kiS blocks, 8 in flight, over 10 seconds
+ $./a.out -b 65536 -n 8 -t 10
  */
 int main (int argc, char **argv)
 {
+	// Stream geometry
+	size_t block_size = BLOCK_SIZE;
+	unsigned int nb_blocks = NB_BLOCKS;
+	unsigned int seconds = 0;
+	int opt;
+
 	// Streaming devices
 	struct iio_device *tx;
 	struct iio_device *rx;
@@ -196,8 +219,20 @@ int main (int argc, char **argv)
 
 	int err;
 
-	// Listen to ctrl+c and IIO_ENSURE
+	while ((opt = getopt(argc, argv, "b:n:t:")) != -1) {
+		switch (opt) {
+		case 'b': block_size = strtoul(optarg, NULL, 0); break;
+		case 'n': nb_blocks = strtoul(optarg, NULL, 0); break;
+		case 't': seconds = strtoul(optarg, NULL, 0); break;
+		default: usage(argv[0]);
+		}
+	}
+	if (block_size < STREAM_MIN_BLOCK_SIZE || !nb_blocks || argc - optind > 1)
+		usage(argv[0]);
+
+	// Listen to ctrl+c, the -t alarm and IIO_ENSURE
 	signal(SIGINT, handle_sig);
+	signal(SIGALRM, handle_sig);
 
 	// RX stream config
 	rxcfg.bw_hz = MHZ(2);   // 2 MHz rf bandwidth
@@ -212,16 +247,9 @@ int main (int argc, char **argv)
 	txcfg.rfport = "A"; // port A (select for rf freq.)
 
 	printf("* Acquiring IIO context\n");
-	if (argc == 1) {
-		ctx = iio_create_context(NULL, NULL);
-		err = iio_err(ctx);
-		IIO_ENSURE(!err && "No context");
-	}
-	else if (argc == 2) {
-		ctx = iio_create_context(NULL, argv[1]);
-		err = iio_err(ctx);
-		IIO_ENSURE(!err && "No context");
-	}
+	ctx = iio_create_context(NULL, optind < argc ? argv[optind] : NULL);
+	err = iio_err(ctx);
+	IIO_ENSURE(!err && "No context");
 	IIO_ENSURE(iio_context_get_devices_count(ctx) > 0 && "No devices");
 
 	printf("* Acquiring AD9361 streaming devices\n");
@@ -256,15 +284,15 @@ int main (int argc, char **argv)
 	iio_channel_enable(tx0_i, txmask);
 	iio_channel_enable(tx0_q, txmask);
 
-	printf("* Creating non-cyclic IIO buffers with 1 MiS\n");
-	rxbuf = iio_device_create_buffer(rx, NULL, rxmask);
+	printf("* Creating non-cyclic IIO buffers\n");
+	rxbuf = iio_device_create_buffer(rx, 0, rxmask);
 	err = iio_err(rxbuf);
 	if (err) {
 		rxbuf = NULL;
 		dev_perror(rx, err, "Could not create RX buffer");
 		shutdown();
 	}
-	txbuf = iio_device_create_buffer(tx, NULL, txmask);
+	txbuf = iio_device_create_buffer(tx, 0, txmask);
 	err = iio_err(txbuf);
 	if (err) {
 		txbuf = NULL;
@@ -272,27 +300,33 @@ int main (int argc, char **argv)
 		shutdown();
 	}
 
-	rxstream = iio_buffer_create_stream(rxbuf, 4, BLOCK_SIZE);
+	printf("* Creating streams of %u blocks of %zu samples\n", nb_blocks, block_size);
+	rxstream = iio_buffer_create_stream(rxbuf, nb_blocks, block_size);
 	err = iio_err(rxstream);
 	if (err) {
 		rxstream = NULL;
-		dev_perror(rx, iio_err(rxstream), "Could not create RX stream");
+		dev_perror(rx, err, "Could not create RX stream");
 		shutdown();
 	}
 
-	txstream = iio_buffer_create_stream(txbuf, 4, BLOCK_SIZE);
+	txstream = iio_buffer_create_stream(txbuf, nb_blocks, block_size);
 	err = iio_err(txstream);
 	if (err) {
 		txstream = NULL;
-		dev_perror(tx, iio_err(txstream), "Could not create TX stream");
+		dev_perror(tx, err, "Could not create TX stream");
 		shutdown();
 	}
 
 	rx_sample_sz = iio_device_get_sample_size(rx, rxmask);
 	tx_sample_sz = iio_device_get_sample_size(tx, txmask);
 
+	snprintf(label, sizeof(label), "blocks=%u", nb_blocks);
+	set_stream_label(label);
+	if (seconds)
+		alarm(seconds);
+
 	printf("* Starting IO streaming (press CTRL+C to cancel)\n");
-	stream(rx_sample_sz, tx_sample_sz, BLOCK_SIZE,
+	stream(rx_sample_sz, tx_sample_sz, block_size,
 	       rxstream, txstream, rx0_i, tx0_i);
 
 	shutdown();
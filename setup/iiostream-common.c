@@ -0,0 +1,443 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * libiio - AD9361 IIO streaming example, loopback measurement
+ *
+ * Every TX block starts with a marker and is silent otherwise. A marker is
+ * a BPSK preamble (a 31 chip m-sequence) followed by 64 differential BPSK
+ * bits: the block sequence number, the CLOCK_MONOTONIC time at which the
+ * block was submitted, in microseconds, and a CRC-16 of both.
+ *
+ * RX blocks are searched for energy well above the noise floor, and each
+ * hit is refined by correlating with the preamble. The payload is decoded
+ * symbol against symbol, so a TX/RX LO offset of a few kHz is fine. The
+ * tail of each RX block is carried over so that markers straddling two
+ * blocks are found. The latency of a marker is the time between its TX
+ * block being submitted and the RX block holding it being handed out,
+ * which includes both kernel queues and one RX block of capture.
+ **/
+
+#include "iiostream-common.h"
+
+#include <iio/iio.h>
+#include <iio/iio-debug.h>
+#include <math.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define PN_CHIPS	31	/* m-sequence, x^5 + x^3 + 1 */
+#define CHIP_SAMPLES	4
+#define PAYLOAD_BITS	64
+#define BIT_SAMPLES	4
+#define PREAMBLE_LEN	(PN_CHIPS * CHIP_SAMPLES)
+#define MARKER_LEN	(PREAMBLE_LEN + PAYLOAD_BITS * BIT_SAMPLES)
+#define MARKER_AMPL	16384
+
+#define SEARCH		16	/* preamble offsets tried around an energy hit */
+#define MIN_CORR	0.6f	/* normalized preamble correlation */
+#define NOISE_WINDOW	64	/* samples per noise floor estimate */
+#define CARRY_MAX	(MARKER_LEN + 2 * SEARCH)
+
+#define HIST_SUB	8	/* latency histogram bins per octave of us */
+#define HIST_BINS	(32 * HIST_SUB)
+#define HIST_BAR	50
+
+static volatile sig_atomic_t stop;
+static const char *label = "";
+
+struct stream_stats {
+	unsigned long long rx_samples, tx_samples, sent;
+	unsigned long long markers, dropped, duplicated, corrupt;
+	bool have_seq;
+	unsigned long long last_seq;
+	double lat_min, lat_max, lat_sum, lat_last;
+	unsigned long long hist[HIST_BINS];
+};
+
+static int8_t pn[PN_CHIPS];
+
+void stop_stream(void)
+{
+	stop = 1;
+}
+
+void set_stream_label(const char *l)
+{
+	label = l;
+}
+
+static uint64_t now_us(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000ULL + t.tv_nsec / 1000;
+}
+
+static void pn_init(void)
+{
+	unsigned int s = 1, c;
+
+	for (c = 0; c < PN_CHIPS; c++) {
+		pn[c] = s & 1 ? 1 : -1;
+		s = ((s << 1) | (((s >> 4) ^ (s >> 2)) & 1)) & 0x1f;
+	}
+}
+
+/* CRC-16/CCITT-FALSE over the sequence number and timestamp */
+static uint16_t marker_crc(uint16_t seq, uint32_t ts)
+{
+	uint8_t b[6] = { seq >> 8, seq, ts >> 24, ts >> 16, ts >> 8, ts };
+	uint16_t crc = 0xffff;
+	int i, k;
+
+	for (i = 0; i < 6; i++) {
+		crc ^= b[i] << 8;
+		for (k = 0; k < 8; k++)
+			crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+	}
+	return crc;
+}
+
+/* Write the marker at p, one I/Q pair every stride int16 */
+static void put_marker(int16_t *p, size_t stride, uint16_t seq, uint32_t ts)
+{
+	uint64_t word = (uint64_t)seq << 48 | (uint64_t)ts << 16 | marker_crc(seq, ts);
+	int c, b, k;
+
+	for (c = 0; c < PN_CHIPS; c++)
+		for (k = 0; k < CHIP_SAMPLES; k++, p += stride) {
+			p[0] = pn[c] * MARKER_AMPL;
+			p[1] = 0;
+		}
+
+	/* A 1 keeps the phase of the symbol before, a 0 flips it */
+	for (b = PAYLOAD_BITS - 1, c = pn[PN_CHIPS - 1]; b >= 0; b--) {
+		if (!((word >> b) & 1))
+			c = -c;
+		for (k = 0; k < BIT_SAMPLES; k++, p += stride) {
+			p[0] = c * MARKER_AMPL;
+			p[1] = 0;
+		}
+	}
+}
+
+/*
+ * Correlate the preamble at w[off]; returns the correlation normalized to
+ * the window energy, 1 for a clean marker.
+ */
+static float correlate(const float *w, size_t off)
+{
+	float si = 0, sq = 0, e = 0;
+	int c, k;
+
+	w += 2 * off;
+	for (c = 0; c < PN_CHIPS; c++) {
+		float ai = 0, aq = 0;
+
+		for (k = 0; k < CHIP_SAMPLES; k++, w += 2) {
+			ai += w[0];
+			aq += w[1];
+			e += w[0] * w[0] + w[1] * w[1];
+		}
+		si += pn[c] * ai;
+		sq += pn[c] * aq;
+	}
+
+	return e > 0 ? sqrtf((si * si + sq * sq) / (e * PREAMBLE_LEN)) : 0;
+}
+
+/* Decode the payload of the marker at w[off]; false on a CRC mismatch */
+static bool decode(const float *w, size_t off, uint16_t *seq, uint32_t *ts)
+{
+	float pi = 0, pq = 0;
+	uint64_t word = 0;
+	int b, k;
+
+	/* The last preamble chip is the reference for the first bit */
+	w += 2 * (off + PREAMBLE_LEN - CHIP_SAMPLES);
+	for (k = 0; k < CHIP_SAMPLES; k++, w += 2) {
+		pi += w[0];
+		pq += w[1];
+	}
+
+	for (b = 0; b < PAYLOAD_BITS; b++) {
+		float si = 0, sq = 0;
+
+		for (k = 0; k < BIT_SAMPLES; k++, w += 2) {
+			si += w[0];
+			sq += w[1];
+		}
+		word = word << 1 | (si * pi + sq * pq > 0);
+		pi = si;
+		pq = sq;
+	}
+
+	*seq = word >> 48;
+	*ts = word >> 16;
+	return (uint16_t)word == marker_crc(*seq, *ts);
+}
+
+static int hist_bin(double us)
+{
+	int bin = us < 1 ? 0 : (int)(log2(us) * HIST_SUB);
+
+	return bin < HIST_BINS ? bin : HIST_BINS - 1;
+}
+
+static double hist_edge(int bin)
+{
+	return exp2((double)bin / HIST_SUB);
+}
+
+static void count_marker(struct stream_stats *st, uint16_t seq, double lat_us)
+{
+	if (st->have_seq) {
+		int16_t diff = seq - (uint16_t)st->last_seq;
+
+		if (diff <= 0) {
+			st->duplicated++;
+			return;
+		}
+		st->dropped += diff - 1;
+		st->last_seq += diff;
+	} else {
+		st->have_seq = true;
+		st->last_seq = seq;
+	}
+
+	if (!st->markers || lat_us < st->lat_min)
+		st->lat_min = lat_us;
+	if (lat_us > st->lat_max)
+		st->lat_max = lat_us;
+	st->lat_sum += lat_us;
+	st->lat_last = lat_us;
+	st->hist[hist_bin(lat_us)]++;
+	st->markers++;
+}
+
+/*
+ * Find the markers in w[scan..len) and return where the next search has
+ * to resume; markers too close to the end are left for the next block.
+ */
+static size_t find_markers(struct stream_stats *st, const float *w, size_t len,
+			   size_t scan, size_t fresh, uint64_t t_rx)
+{
+	float peak = 0, noise = INFINITY, thresh;
+	size_t i, k;
+
+	/* Blocks are mostly silence, so the quietest window is the noise */
+	for (i = fresh; i + NOISE_WINDOW <= len; i += NOISE_WINDOW) {
+		float e = 0;
+
+		for (k = i; k < i + NOISE_WINDOW; k++) {
+			float p = w[2 * k] * w[2 * k] + w[2 * k + 1] * w[2 * k + 1];
+
+			e += p;
+			if (p > peak)
+				peak = p;
+		}
+		if (e < noise)
+			noise = e;
+	}
+	noise /= NOISE_WINDOW;
+	thresh = fmaxf(fmaxf(peak / 8, noise * 20), 1);
+
+	for (i = scan; i + SEARCH + MARKER_LEN <= len; i++) {
+		float best = 0, c;
+		size_t off, best_off = 0;
+		uint16_t seq;
+		uint32_t ts;
+
+		if (w[2 * i] * w[2 * i] + w[2 * i + 1] * w[2 * i + 1] < thresh)
+			continue;
+
+		for (off = i > SEARCH ? i - SEARCH : 0; off <= i + SEARCH; off++) {
+			c = correlate(w, off);
+			if (c > best) {
+				best = c;
+				best_off = off;
+			}
+		}
+		if (best < MIN_CORR)
+			continue;
+
+		if (decode(w, best_off, &seq, &ts))
+			count_marker(st, seq, (uint32_t)(t_rx - ts));
+		else
+			st->corrupt++;
+		i = best_off + MARKER_LEN - 1;
+	}
+
+	return i < len ? i : len;
+}
+
+/* Interpolated within the histogram bin, so good to a fraction of a bin */
+static double percentile(const struct stream_stats *st, double p)
+{
+	double want = p * st->markers, n = 0, lo, hi;
+	int b;
+
+	for (b = 0; b < HIST_BINS; b++) {
+		if (st->hist[b] && n + st->hist[b] >= want) {
+			lo = fmax(hist_edge(b), st->lat_min);
+			hi = fmin(hist_edge(b + 1), st->lat_max);
+			return lo + (hi - lo) * (want - n) / st->hist[b];
+		}
+		n += st->hist[b];
+	}
+	return st->lat_max;
+}
+
+static void report(const struct stream_stats *st, size_t block_size,
+		   double fs, double secs)
+{
+	unsigned long long top = 0;
+	int b, first = -1, last = -1;
+
+	printf("* Loopback latency, %llu markers (submit to RX block, ms)\n",
+	       st->markers);
+	for (b = 0; b < HIST_BINS; b++) {
+		if (st->hist[b] && first < 0)
+			first = b;
+		if (st->hist[b])
+			last = b;
+		if (st->hist[b] > top)
+			top = st->hist[b];
+	}
+	for (b = first; first >= 0 && b <= last; b++)
+		printf("  %9.3f - %9.3f %8llu %.*s\n", hist_edge(b) / 1e3,
+		       hist_edge(b + 1) / 1e3, st->hist[b],
+		       (int)(st->hist[b] * HIST_BAR / top),
+		       "##################################################");
+
+	if (st->markers)
+		printf("  min %.3f, mean %.3f, p50 %.3f, p99 %.3f, max %.3f\n",
+		       st->lat_min / 1e3, st->lat_sum / st->markers / 1e3,
+		       percentile(st, 0.5) / 1e3, percentile(st, 0.99) / 1e3,
+		       st->lat_max / 1e3);
+	printf("* Sent %llu blocks, received %llu, dropped %llu, duplicated %llu, corrupt %llu\n",
+	       st->sent, st->markers, st->dropped, st->duplicated, st->corrupt);
+	printf("* RX %.3f MS/s, TX %.3f MS/s, nominal %.3f MS/s\n",
+	       st->rx_samples / secs / 1e6, st->tx_samples / secs / 1e6, fs / 1e6);
+
+	printf("summary: block_size=%zu%s%s fs=%.0f secs=%.2f rx_msps=%.3f tx_msps=%.3f "
+	       "sent=%llu received=%llu dropped=%llu duplicated=%llu corrupt=%llu "
+	       "lat_min_ms=%.3f lat_mean_ms=%.3f lat_p50_ms=%.3f lat_p99_ms=%.3f lat_max_ms=%.3f\n",
+	       block_size, *label ? " " : "", label, fs, secs,
+	       st->rx_samples / secs / 1e6, st->tx_samples / secs / 1e6,
+	       st->sent, st->markers, st->dropped, st->duplicated, st->corrupt,
+	       st->lat_min / 1e3, st->markers ? st->lat_sum / st->markers / 1e3 : 0,
+	       percentile(st, 0.5) / 1e3, percentile(st, 0.99) / 1e3,
+	       st->lat_max / 1e3);
+}
+
+/* Baseband rate, for comparing the throughput against */
+static double sample_rate(const struct iio_channel *chn)
+{
+	const struct iio_context *ctx = iio_device_get_context(iio_channel_get_device(chn));
+	const struct iio_device *phy = iio_context_find_device(ctx, "ad9361-phy");
+	const struct iio_attr *attr;
+	struct iio_channel *phy_chn;
+	long long fs;
+
+	phy_chn = phy ? iio_device_find_channel(phy, "voltage0", false) : NULL;
+	attr = phy_chn ? iio_channel_find_attr(phy_chn, "sampling_frequency") : NULL;
+	if (!attr || iio_attr_read_longlong(attr, &fs))
+		return 0;
+	return fs;
+}
+
+void stream(size_t rx_sample, size_t tx_sample, size_t block_size,
+	    struct iio_stream *rxstream, struct iio_stream *txstream,
+	    const struct iio_channel *rxchn, const struct iio_channel *txchn)
+{
+	const struct iio_device *rxdev = iio_channel_get_device(rxchn);
+	const struct iio_device *txdev = iio_channel_get_device(txchn);
+	size_t rx_stride = rx_sample / sizeof(int16_t);
+	size_t tx_stride = tx_sample / sizeof(int16_t);
+	const struct iio_block *rxblock, *txblock;
+	struct stream_stats st = { 0 };
+	uint64_t t0, t_rx, t_print;
+	double fs = sample_rate(rxchn);
+	size_t carry = 0, scan = 0, resume, i;
+	float *w;
+	int err;
+
+	if (block_size < STREAM_MIN_BLOCK_SIZE) {
+		fprintf(stderr, "Blocks of %zu samples are too small for the marker\n",
+			block_size);
+		return;
+	}
+
+	w = malloc((CARRY_MAX + block_size) * 2 * sizeof(*w));
+	if (!w) {
+		fprintf(stderr, "Unable to alloc the RX search buffer\n");
+		return;
+	}
+	pn_init();
+
+	txblock = iio_stream_get_next_block(txstream);
+	err = iio_err(txblock);
+	if (err) {
+		dev_perror(txdev, err, "Unable to get TX block");
+		free(w);
+		return;
+	}
+
+	t0 = t_print = now_us();
+	while (!stop) {
+		int16_t *p, *end;
+
+		/* Submit the TX block with the marker stamped just before */
+		p = iio_block_first(txblock, txchn);
+		memset(iio_block_start(txblock), 0, block_size * tx_sample);
+		put_marker(p, tx_stride, st.sent, now_us());
+		txblock = iio_stream_get_next_block(txstream);
+		err = iio_err(txblock);
+		if (err) {
+			dev_perror(txdev, err, "Unable to send block");
+			break;
+		}
+		st.sent++;
+		st.tx_samples += block_size;
+
+		rxblock = iio_stream_get_next_block(rxstream);
+		err = iio_err(rxblock);
+		if (err) {
+			dev_perror(rxdev, err, "Unable to receive block");
+			break;
+		}
+		t_rx = now_us();
+		st.rx_samples += block_size;
+
+		/* Search the carried over tail and the new block as one */
+		end = iio_block_end(rxblock);
+		for (p = iio_block_first(rxblock, rxchn), i = carry; p < end; p += rx_stride, i++) {
+			w[2 * i] = p[0];
+			w[2 * i + 1] = p[1];
+		}
+		resume = find_markers(&st, w, i, scan, carry, t_rx);
+
+		/* Keep enough in front of the resume point to refine a hit there */
+		scan = resume > SEARCH ? SEARCH : resume;
+		carry = i - (resume - scan);
+		memmove(w, w + 2 * (resume - scan), carry * 2 * sizeof(*w));
+
+		if (t_rx - t_print >= 1000000) {
+			double secs = (t_rx - t0) / 1e6;
+
+			printf("\tRX %8.3f MS/s, TX %8.3f MS/s, markers %llu, dropped %llu, latency %.3f ms\n",
+			       st.rx_samples / secs / 1e6, st.tx_samples / secs / 1e6,
+			       st.markers, st.dropped, st.lat_last / 1e3);
+			t_print = t_rx;
+		}
+	}
+
+	report(&st, block_size, fs, (now_us() - t0) / 1e6);
+	free(w);
+}
@@ -0,0 +1,33 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * libiio - AD9361 IIO streaming example, loopback measurement
+ *
+ * stream() sends a timestamped marker at the start of every TX block and
+ * looks for the markers in the RX blocks, with TX looped back to RX (a
+ * cable, or the iio-sim loopback ring). It reports the one-way latency,
+ * the throughput, and blocks that were dropped or duplicated on the way.
+ **/
+
+#ifndef IIOSTREAM_COMMON_H
+#define IIOSTREAM_COMMON_H
+
+#include <stddef.h>
+
+struct iio_channel;
+struct iio_stream;
+
+/* Stream until stop_stream() is called, then print the report */
+void stream(size_t rx_sample, size_t tx_sample, size_t block_size,
+	    struct iio_stream *rxstream, struct iio_stream *txstream,
+	    const struct iio_channel *rxchn, const struct iio_channel *txchn);
+
+/* Safe to call from a signal handler */
+void stop_stream(void);
+
+/* Extra key=value pairs for the summary line, e.g. "blocks=4" */
+void set_stream_label(const char *label);
+
+/* Smallest block that holds a marker and enough silence to find it */
+#define STREAM_MIN_BLOCK_SIZE	1024
+
+#endif /* IIOSTREAM_COMMON_H */
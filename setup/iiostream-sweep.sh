@@ -0,0 +1,19 @@
+#!/bin/sh
+# iiostream-sweep.sh : loopback latency and throughput over block sizes and counts
+#
+# Usage: iiostream-sweep.sh [seconds] [uri]
+# Prints one summary line per run, block sizes BLOCK_SIZES by block counts
+# NB_BLOCKS (both overridable from the environment).
+
+SECONDS_PER_RUN=${1:-5}
+URI=$2
+BLOCK_SIZES=${BLOCK_SIZES:-"4096 16384 65536 262144 1048576"}
+NB_BLOCKS=${NB_BLOCKS:-"2 4 8"}
+IIOSTREAM=${IIOSTREAM:-$(dirname "$0")/ad9361-iiostream}
+
+for bs in $BLOCK_SIZES; do
+	for nb in $NB_BLOCKS; do
+		"$IIOSTREAM" -b "$bs" -n "$nb" -t "$SECONDS_PER_RUN" $URI 2>/dev/null |
+			sed -n 's/^summary: //p'
+	done
+done
@@ -0,0 +1,990 @@
+/* sdr-bench.c : microbenchmarks of the DSP hot paths, as CSV
+ *
+ * Every kernel runs on one block of synthetic data, and on recorded data
+ * given with -a (16-bit deviation samples, as fed to tx-fm) or -q (16-bit
+ * I/Q from the ADC, as read by iio_fm_radio). Each is timed cache-warm,
+ * after an untimed run, and cache-cold, after evicting the caches. The
+ * output of every variant is compared with the reference variant of its
+ * stage, which is the original code of the tools:
+ *
+ *	mod	deviation to I/Q. reference is the modulate_sample() tx-fm.c
+ *		had (double, libm), scalar the same in float, fixed the
+ *		libsdr fm_mod lookup table tx-fm now runs.
+ *	demod	I/Q to audio. reference is the libsdr fm_demod discriminator
+ *		iio_fm_radio runs, scalar the same in float, parallel the
+ *		block split across a thread pool of one thread per CPU
+ *		(iio_fm_radio -j).
+ *	disc	I/Q to audio with the amplitude-independent discriminators
+ *		of iio_fm_radio -D, scaled to the deviation. reference is
+ *		the exact phase difference from atan2() in double; quadnorm,
+ *		cordic and lut are the libsdr ones.
+ *	mode	I/Q to audio in each mode of iio_fm_radio -m: wbfm, nbfm,
+ *		am, usb, lsb. The modes do not share a reference, each
+ *		is compared with itself, so only the time counts.
+ *	txmode	deviation samples to I/Q in each mode of tx-fm -m: fm, am,
+ *		usb, lsb. Like mode, each is compared with itself.
+ *	conv	I/Q through a low-pass of 16 to 2048 taps, in direct form
+ *		and by overlap-save FFT (libsdr conv), to find the tap
+ *		count from which the FFT is faster. Each FFT variant is
+ *		compared with the direct form of the same taps.
+ *	fill	reading a TX buffer worth of samples. reference is the
+ *		get_next_sample() loop of tx-fm.c, one read() per sample;
+ *		bulk reads the whole buffer at once.
+ *	ingest	a DMA block to audio. direct demodulates it in place,
+ *		copy first copies it into cached memory with ingest_copy(),
+ *		the two strategies of iio_fm_radio -I.
+ *
+ * The portable scalar and fixed kernels are also built for the SIMD
+ * extension of the machine (AVX2 on x86, NEON on 32-bit ARM) and run when
+ * the CPU has it, so hand-written SIMD kernels have a baseline to beat.
+ * The kernels that call into libsdr run the instruction set libsdr picked
+ * at startup, or the one given with -K, and report it as their isa.
+ *
+ * Cycles come from perf_event_open() and count user space only; the column
+ * is empty when the counter is not available (no PMU access, or in a VM).
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "conv.h"
+#include "demod.h"
+#include "dsp.h"
+#include "fir_design.h"
+#include "fm_demod.h"
+#include "ingest.h"
+#include "fm_mod.h"
+#include "mod.h"
+
+#if defined(__arm__) && !defined(__SOFTFP__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+#define DEFAULT_SAMPLES		65536	/* about one tx-fm buffer */
+#define DEFAULT_REPS		20
+#define EVICT_BYTES		(64 << 20)	/* well beyond the L2 of either target */
+#define MAX_DATASETS		8
+
+/* The modulator as tx-fm runs it, and the receiver as iio_fm_radio does */
+#define MAX_SAMPLE_VALUE	0x7FFF
+#define MOD_RATE		2500000.0
+#define MOD_DEVIATION		75000.0
+#define DEMOD_DECIMATION	48
+#define DEMOD_RATE		(48000.0 * DEMOD_DECIMATION)
+#define DEMOD_SUB		4	/* 576 kHz discriminator */
+#define DEMOD_AMPLITUDE		1500.0	/* 12-bit ADC */
+#define DEMOD_DEVIATION		50000.0
+#define CONV_CUTOFF		0.05	/* 115 kHz at 2.304 MS/s */
+#define CONV_BETA		6.0
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SIMD_ISA	"avx2"
+#define SIMD_TARGET	__attribute__((target("avx2,fma")))
+#elif defined(__arm__) && !defined(__SOFTFP__)
+#define SIMD_ISA	"neon"
+#define SIMD_TARGET	__attribute__((target("fpu=neon")))
+#endif
+
+enum stage { STAGE_MOD, STAGE_DEMOD, STAGE_DISC, STAGE_MODE, STAGE_TXMODE, STAGE_CONV,
+	     STAGE_FILL, STAGE_INGEST, NUM_STAGES };
+
+static const char * const stage_names[NUM_STAGES] = {
+	"mod", "demod", "disc", "mode", "txmode", "conv", "fill", "ingest"
+};
+
+/* Kernels turn n input samples (I/Q pairs for demod) into int16 output */
+typedef size_t (*kernel_fn)(const int16_t *in, size_t n, int16_t *out);
+
+struct kernel {
+	enum stage stage;
+	const char *variant;
+	const char *isa;	/* NULL when libsdr picks it, see -K */
+	kernel_fn run;
+	bool (*available)(void);
+	bool reference;		/* the kernels after it compare against it */
+};
+
+/**
+ * struct dataset - input of one run of all kernels
+ * @audio: deviation samples for mod and fill, NULL to skip those
+ * @iq: I/Q pairs for demod, NULL to skip it
+ * @fd: file holding @audio, which the fill kernels read
+ **/
+struct dataset {
+	char name[64];
+	int16_t *audio;
+	int16_t *iq;
+	int fd;
+};
+
+static size_t samples = DEFAULT_SAMPLES;
+static unsigned int reps = DEFAULT_REPS;
+static bool run_warm = true, run_cold = true;
+static int only_stage = -1;
+static unsigned int decimation = DEMOD_DECIMATION;
+static unsigned int sub = DEMOD_SUB;
+
+static struct fm_mod mod_state;
+static int demod_min, demod_max;	/* AGC range after the first block */
+static struct par_pool demod_pool;
+static int fill_fd = -1;
+static volatile double fill_power;
+static char *evict_buf;
+static int16_t *ingest_buf;	/* cached copy of the block */
+
+
+/* Kernels */
+
+/* modulate_sample() as tx-fm.c had it, with its globals as statics */
+static size_t mod_reference(const int16_t *in, size_t n, int16_t *iq)
+{
+	const double deviation_scale_factor = MOD_DEVIATION / MAX_SAMPLE_VALUE;
+	const double time_per_sample = 1.0 / MOD_RATE;
+	double signal = 0.0;
+	size_t k;
+
+	for (k = 0; k < n; k++) {
+		double deviation_in_hertz = in[k] * deviation_scale_factor;
+		double phase_increment_this_sample = 2 * M_PI * deviation_in_hertz * time_per_sample;
+
+		signal = fmod(signal + phase_increment_this_sample, 2 * M_PI);
+		iq[2 * k] = (int16_t)(cos(signal) * MAX_SAMPLE_VALUE);
+		iq[2 * k + 1] = (int16_t)(sin(signal) * MAX_SAMPLE_VALUE);
+	}
+	return 2 * n;
+}
+
+static inline __attribute__((always_inline))
+size_t mod_scalar_body(const int16_t *in, size_t n, int16_t *iq)
+{
+	const float k_rad = 2 * M_PI * MOD_DEVIATION / MAX_SAMPLE_VALUE / MOD_RATE;
+	float phase = 0;
+	size_t k;
+
+	for (k = 0; k < n; k++) {
+		phase += in[k] * k_rad;
+		if (phase > (float)M_PI)
+			phase -= 2 * (float)M_PI;
+		else if (phase < -(float)M_PI)
+			phase += 2 * (float)M_PI;
+		iq[2 * k] = (int16_t)(cosf(phase) * MAX_SAMPLE_VALUE);
+		iq[2 * k + 1] = (int16_t)(sinf(phase) * MAX_SAMPLE_VALUE);
+	}
+	return 2 * n;
+}
+
+/* fm_mod_block(), built here so that it can also be built for SIMD */
+static inline __attribute__((always_inline))
+size_t mod_fixed_body(const int16_t *in, size_t n, int16_t *iq)
+{
+	uint32_t phase = 0;
+	size_t k;
+
+	for (k = 0; k < n; k++) {
+		phase += fm_mod_increment(&mod_state, in[k]);
+		fm_mod_iq(phase, &iq[2 * k], &iq[2 * k + 1]);
+	}
+	return 2 * n;
+}
+
+static size_t demod_reference(const int16_t *iq, size_t n, int16_t *audio)
+{
+	struct fm_demod d;
+
+	fm_demod_init(&d, decimation, sub);
+	d.min = demod_min;
+	d.max = demod_max;
+	return fm_demod_block(&d, iq, n, audio);
+}
+
+static size_t demod_parallel(const int16_t *iq, size_t n, int16_t *audio)
+{
+	struct fm_demod d;
+
+	fm_demod_init(&d, decimation, sub);
+	d.min = demod_min;
+	d.max = demod_max;
+	return fm_demod_block_parallel(&d, iq, n, audio, &demod_pool);
+}
+
+/* Phase difference of successive discriminator inputs, averaged and scaled */
+static size_t disc_reference(const int16_t *iq, size_t n, int16_t *audio)
+{
+	const double step = 2 * M_PI * DEMOD_DEVIATION * sub / (decimation * 48000.0);
+	double i1 = iq[2], q1 = iq[3], acc = 0, s;
+	unsigned int x = 0;
+	size_t j, out = 0;
+
+	for (j = 2; j < 2 * n; j += 2 * sub) {
+		double i0 = iq[j], q0 = iq[j + 1];
+
+		acc += atan2(q0 * i1 - i0 * q1, i0 * i1 + q0 * q1);
+		i1 = i0;
+		q1 = q0;
+
+		x += sub;
+		if (x >= decimation) {
+			x = 0;
+			s = acc / (decimation / sub) / step * FM_DEMOD_AUDIO_MAX;
+			if (s > FM_DEMOD_AUDIO_MAX)
+				s = FM_DEMOD_AUDIO_MAX;
+			else if (s < -FM_DEMOD_AUDIO_MAX)
+				s = -FM_DEMOD_AUDIO_MAX;
+			audio[out++] = (int16_t)lrint(s);
+			acc = 0;
+		}
+	}
+	return out;
+}
+
+static size_t disc_libsdr(const char *name, const int16_t *iq, size_t n,
+			  int16_t *audio)
+{
+	struct fm_demod d;
+
+	fm_demod_init(&d, decimation, sub);
+	fm_demod_discriminator(&d, name, DEMOD_DEVIATION, decimation * 48000.0);
+	return fm_demod_block(&d, iq, n, audio);
+}
+
+static size_t disc_quadnorm(const int16_t *iq, size_t n, int16_t *audio)
+{
+	return disc_libsdr("quadnorm", iq, n, audio);
+}
+
+static size_t disc_cordic(const int16_t *iq, size_t n, int16_t *audio)
+{
+	return disc_libsdr("cordic", iq, n, audio);
+}
+
+static size_t disc_lut(const int16_t *iq, size_t n, int16_t *audio)
+{
+	return disc_libsdr("lut", iq, n, audio);
+}
+
+/* SSB at unity gain, rather than muted for the first block */
+static size_t mode_libsdr(const char *name, const int16_t *iq, size_t n,
+			  int16_t *audio)
+{
+	struct demod d;
+	size_t out;
+
+	demod_init(&d, name, decimation, sub, decimation * 48000.0);
+	d.fm.min = demod_min;
+	d.fm.max = demod_max;
+	if (d.mode == DEMOD_USB || d.mode == DEMOD_LSB)
+		d.gain = 1;
+	out = demod_block(&d, iq, n, audio, NULL);
+	demod_free(&d);
+	return out;
+}
+
+static size_t mode_wbfm(const int16_t *iq, size_t n, int16_t *audio)
+{
+	return mode_libsdr("wbfm", iq, n, audio);
+}
+
+static size_t mode_nbfm(const int16_t *iq, size_t n, int16_t *audio)
+{
+	return mode_libsdr("nbfm", iq, n, audio);
+}
+
+static size_t mode_am(const int16_t *iq, size_t n, int16_t *audio)
+{
+	return mode_libsdr("am", iq, n, audio);
+}
+
+static size_t mode_usb(const int16_t *iq, size_t n, int16_t *audio)
+{
+	return mode_libsdr("usb", iq, n, audio);
+}
+
+static size_t mode_lsb(const int16_t *iq, size_t n, int16_t *audio)
+{
+	return mode_libsdr("lsb", iq, n, audio);
+}
+
+static size_t txmode_libsdr(const char *name, const int16_t *in, size_t n,
+			    int16_t *iq)
+{
+	struct mod m;
+
+	mod_init(&m, name, MOD_DEVIATION / MAX_SAMPLE_VALUE, 0, MOD_RATE);
+	mod_block(&m, in, iq, n);
+	mod_free(&m);
+	return 2 * n;
+}
+
+static size_t txmode_fm(const int16_t *in, size_t n, int16_t *iq)
+{
+	return txmode_libsdr("fm", in, n, iq);
+}
+
+static size_t txmode_am(const int16_t *in, size_t n, int16_t *iq)
+{
+	return txmode_libsdr("am", in, n, iq);
+}
+
+static size_t txmode_usb(const int16_t *in, size_t n, int16_t *iq)
+{
+	return txmode_libsdr("usb", in, n, iq);
+}
+
+static size_t txmode_lsb(const int16_t *in, size_t n, int16_t *iq)
+{
+	return txmode_libsdr("lsb", in, n, iq);
+}
+
+/*
+ * The FFT output lags by conv.delay samples, so the block is followed by
+ * that many zeros and the output shifted back, to line up with the
+ * direct form.
+ */
+static size_t conv_run(unsigned int taps, enum conv_method method,
+		       const int16_t *iq, size_t n, int16_t *out)
+{
+	static float h[CONV_MAX_TAPS];
+	static unsigned int h_taps;
+	double hd[CONV_MAX_TAPS];
+	int16_t *tail;
+	struct conv c;
+	unsigned int k;
+
+	if (h_taps != taps) {
+		fir_lowpass(hd, taps, CONV_CUTOFF, CONV_BETA);
+		for (k = 0; k < taps; k++)
+			h[k] = hd[k];
+		h_taps = taps;
+	}
+	if (conv_init(&c, h, taps, method))
+		return 0;
+
+	conv_block_s16(&c, iq, out, n);
+	if (c.delay) {
+		tail = calloc(4, c.delay);
+		if (!tail) {
+			conv_free(&c);
+			return 0;
+		}
+		conv_block_s16(&c, tail, tail, c.delay);
+		if (c.delay < n) {
+			memmove(out, out + 2 * c.delay, 4 * (n - c.delay));
+			memcpy(out + 2 * (n - c.delay), tail, 4 * c.delay);
+		} else {
+			memcpy(out, tail + 2 * (c.delay - n), 4 * n);
+		}
+		free(tail);
+	}
+
+	conv_free(&c);
+	return 2 * n;
+}
+
+#define CONV_KERNELS(taps) \
+static size_t conv_direct_##taps(const int16_t *iq, size_t n, int16_t *out) \
+{ \
+	return conv_run(taps, CONV_DIRECT, iq, n, out); \
+} \
+static size_t conv_fft_##taps(const int16_t *iq, size_t n, int16_t *out) \
+{ \
+	return conv_run(taps, CONV_FFT, iq, n, out); \
+}
+
+CONV_KERNELS(16)
+CONV_KERNELS(32)
+CONV_KERNELS(64)
+CONV_KERNELS(128)
+CONV_KERNELS(256)
+CONV_KERNELS(512)
+CONV_KERNELS(1024)
+CONV_KERNELS(2048)
+
+static inline __attribute__((always_inline))
+size_t demod_scalar_body(const int16_t *iq, size_t n, int16_t *audio)
+{
+	const float range = demod_max - demod_min;
+	const float scale = FM_DEMOD_AUDIO_MAX / range / (decimation / sub);
+	const float centre = (int)range / 2 * (float)(decimation / sub);
+	float i1 = iq[2], q1 = iq[3], i2 = iq[0], q2 = iq[1];
+	float acc = 0, s;
+	unsigned int x = 0;
+	size_t j, out = 0;
+
+	for (j = 2; j < 2 * n; j += 2 * sub) {
+		float i0 = iq[j], q0 = iq[j + 1];
+
+		acc += i1 * (q0 - q2) - q1 * (i0 - i2);
+		i2 = i1;
+		q2 = q1;
+		i1 = i0;
+		q1 = q0;
+
+		x += sub;
+		if (x >= decimation) {
+			x = 0;
+			s = (acc - centre) * scale;
+			if (s > FM_DEMOD_AUDIO_MAX)
+				s = FM_DEMOD_AUDIO_MAX;
+			else if (s < -FM_DEMOD_AUDIO_MAX)
+				s = -FM_DEMOD_AUDIO_MAX;
+			audio[out++] = (int16_t)s;
+			acc = 0;
+		}
+	}
+	return out;
+}
+
+static size_t mod_scalar(const int16_t *in, size_t n, int16_t *out)
+{
+	return mod_scalar_body(in, n, out);
+}
+
+static size_t mod_fixed(const int16_t *in, size_t n, int16_t *out)
+{
+	return mod_fixed_body(in, n, out);
+}
+
+static size_t demod_scalar(const int16_t *in, size_t n, int16_t *out)
+{
+	return demod_scalar_body(in, n, out);
+}
+
+#ifdef SIMD_TARGET
+static SIMD_TARGET size_t mod_scalar_simd(const int16_t *in, size_t n, int16_t *out)
+{
+	return mod_scalar_body(in, n, out);
+}
+
+static SIMD_TARGET size_t mod_fixed_simd(const int16_t *in, size_t n, int16_t *out)
+{
+	return mod_fixed_body(in, n, out);
+}
+
+static SIMD_TARGET size_t demod_scalar_simd(const int16_t *in, size_t n, int16_t *out)
+{
+	return demod_scalar_body(in, n, out);
+}
+
+static bool simd_available(void)
+{
+#ifdef __arm__
+	return getauxval(AT_HWCAP) & HWCAP_NEON;
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#endif
+}
+#endif
+
+/* get_next_sample() from tx-fm.c, reading fill_fd instead of stdin */
+static int16_t get_next_sample(void)
+{
+	int16_t value;
+
+	if (read(fill_fd, (void *)&value, 2) != 2)
+		return 0;
+
+	return value;
+}
+
+static size_t fill_reference(const int16_t *in, size_t n, int16_t *out)
+{
+	double power = 0;
+	size_t k;
+
+	(void)in;
+	lseek(fill_fd, 0, SEEK_SET);
+	for (k = 0; k < n; k++) {
+		out[k] = get_next_sample();
+		power += (double)out[k] * out[k];
+	}
+	fill_power = power;
+	return n;
+}
+
+static size_t fill_bulk(const int16_t *in, size_t n, int16_t *out)
+{
+	size_t got = 0, k;
+	double power = 0;
+	ssize_t ret;
+
+	(void)in;
+	lseek(fill_fd, 0, SEEK_SET);
+	while (got < 2 * n) {
+		ret = read(fill_fd, (char *)out + got, 2 * n - got);
+		if (ret <= 0)
+			break;
+		got += ret;
+	}
+	memset((char *)out + got, 0, 2 * n - got);
+	for (k = 0; k < n; k++)
+		power += (double)out[k] * out[k];
+	fill_power = power;
+	return n;
+}
+
+static size_t ingest_direct(const int16_t *iq, size_t n, int16_t *audio)
+{
+	return demod_reference(iq, n, audio);
+}
+
+static size_t ingest_copy_first(const int16_t *iq, size_t n, int16_t *audio)
+{
+	ingest_copy(ingest_buf, iq, 4 * n);
+	return demod_reference(ingest_buf, n, audio);
+}
+
+/*
+ * The reference of each stage comes first. Kernels marked as references
+ * start a new comparison within their stage; in mode and txmode every
+ * kernel is its own.
+ */
+static const struct kernel kernels[] = {
+	{ STAGE_MOD, "reference", "generic", mod_reference, NULL, false },
+	{ STAGE_MOD, "scalar", "generic", mod_scalar, NULL, false },
+	{ STAGE_MOD, "fixed", "generic", mod_fixed, NULL, false },
+#ifdef SIMD_TARGET
+	{ STAGE_MOD, "scalar", SIMD_ISA, mod_scalar_simd, simd_available, false },
+	{ STAGE_MOD, "fixed", SIMD_ISA, mod_fixed_simd, simd_available, false },
+#endif
+	{ STAGE_DEMOD, "reference", NULL, demod_reference, NULL, false },
+	{ STAGE_DEMOD, "scalar", "generic", demod_scalar, NULL, false },
+	{ STAGE_DEMOD, "parallel", NULL, demod_parallel, NULL, false },
+#ifdef SIMD_TARGET
+	{ STAGE_DEMOD, "scalar", SIMD_ISA, demod_scalar_simd, simd_available, false },
+#endif
+	{ STAGE_DISC, "reference", "generic", disc_reference, NULL, false },
+	{ STAGE_DISC, "quadnorm", NULL, disc_quadnorm, NULL, false },
+	{ STAGE_DISC, "cordic", NULL, disc_cordic, NULL, false },
+	{ STAGE_DISC, "lut", NULL, disc_lut, NULL, false },
+	{ STAGE_MODE, "wbfm", NULL, mode_wbfm, NULL, true },
+	{ STAGE_MODE, "nbfm", NULL, mode_nbfm, NULL, true },
+	{ STAGE_MODE, "am", NULL, mode_am, NULL, true },
+	{ STAGE_MODE, "usb", NULL, mode_usb, NULL, true },
+	{ STAGE_MODE, "lsb", NULL, mode_lsb, NULL, true },
+	{ STAGE_TXMODE, "fm", NULL, txmode_fm, NULL, true },
+	{ STAGE_TXMODE, "am", NULL, txmode_am, NULL, true },
+	{ STAGE_TXMODE, "usb", NULL, txmode_usb, NULL, true },
+	{ STAGE_TXMODE, "lsb", NULL, txmode_lsb, NULL, true },
+	{ STAGE_CONV, "direct-16", NULL, conv_direct_16, NULL, true },
+	{ STAGE_CONV, "fft-16", NULL, conv_fft_16, NULL, false },
+	{ STAGE_CONV, "direct-32", NULL, conv_direct_32, NULL, true },
+	{ STAGE_CONV, "fft-32", NULL, conv_fft_32, NULL, false },
+	{ STAGE_CONV, "direct-64", NULL, conv_direct_64, NULL, true },
+	{ STAGE_CONV, "fft-64", NULL, conv_fft_64, NULL, false },
+	{ STAGE_CONV, "direct-128", NULL, conv_direct_128, NULL, true },
+	{ STAGE_CONV, "fft-128", NULL, conv_fft_128, NULL, false },
+	{ STAGE_CONV, "direct-256", NULL, conv_direct_256, NULL, true },
+	{ STAGE_CONV, "fft-256", NULL, conv_fft_256, NULL, false },
+	{ STAGE_CONV, "direct-512", NULL, conv_direct_512, NULL, true },
+	{ STAGE_CONV, "fft-512", NULL, conv_fft_512, NULL, false },
+	{ STAGE_CONV, "direct-1024", NULL, conv_direct_1024, NULL, true },
+	{ STAGE_CONV, "fft-1024", NULL, conv_fft_1024, NULL, false },
+	{ STAGE_CONV, "direct-2048", NULL, conv_direct_2048, NULL, true },
+	{ STAGE_CONV, "fft-2048", NULL, conv_fft_2048, NULL, false },
+	{ STAGE_FILL, "reference", "generic", fill_reference, NULL, false },
+	{ STAGE_FILL, "bulk", "generic", fill_bulk, NULL, false },
+	{ STAGE_INGEST, "direct", NULL, ingest_direct, NULL, false },
+	{ STAGE_INGEST, "copy", NULL, ingest_copy_first, NULL, false },
+};
+
+#define NUM_KERNELS	(sizeof(kernels) / sizeof(kernels[0]))
+
+
+/* Measurement */
+
+static uint64_t xorshift(uint64_t *s)
+{
+	*s ^= *s << 13;
+	*s ^= *s >> 7;
+	*s ^= *s << 17;
+	return *s;
+}
+
+static double noise(uint64_t *s)
+{
+	return (double)(xorshift(s) >> 11) / (1ULL << 53) - 0.5;
+}
+
+static double now_ns(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+static int cycles_open(void)
+{
+	struct perf_event_attr pe;
+
+	memset(&pe, 0, sizeof(pe));
+	pe.type = PERF_TYPE_HARDWARE;
+	pe.size = sizeof(pe);
+	pe.config = PERF_COUNT_HW_CPU_CYCLES;
+	pe.disabled = 1;
+	pe.exclude_kernel = 1;
+	pe.exclude_hv = 1;
+
+	return syscall(SYS_perf_event_open, &pe, 0, -1, -1, 0);
+}
+
+static void evict(void)
+{
+	size_t k;
+
+	for (k = 0; k < EVICT_BYTES; k += 64)
+		evict_buf[k]++;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* SNR of out against ref in dB, INFINITY when bit-exact */
+static double snr_db(const int16_t *ref, const int16_t *out, size_t n)
+{
+	double sig = 0, err = 0;
+	size_t k;
+
+	for (k = 0; k < n; k++) {
+		double e = (double)out[k] - ref[k];
+
+		sig += (double)ref[k] * ref[k];
+		err += e * e;
+	}
+	if (err == 0)
+		return INFINITY;
+	return 10 * log10(sig / err);
+}
+
+static void print_row(const struct kernel *k, const struct dataset *ds,
+		      bool cold, double ns, double cycles, double snr)
+{
+	printf("%s,%s,%s,%s,%s,%zu,%u,%.3f,%.3f,", stage_names[k->stage], k->variant,
+	       k->isa ? k->isa : dsp_isa_name(dsp_isa), ds->name, cold ? "cold" : "warm", samples, reps,
+	       ns / samples, samples / ns * 1e3);
+	if (cycles >= 0)
+		printf("%.3f", cycles / samples);
+	if (isinf(snr))
+		printf(",inf");
+	else
+		printf(",%.2f", snr);
+	printf(",%.1f\n", ns / 1e3);
+	fflush(stdout);
+}
+
+static void bench_kernel(const struct kernel *k, const struct dataset *ds,
+			 const int16_t *in, int16_t *out, const int16_t *ref,
+			 size_t ref_len, bool cold, int cycles_fd)
+{
+	double *ns = calloc(reps, sizeof(*ns));
+	double *cycles = calloc(reps, sizeof(*cycles));
+	size_t len = 0;
+	unsigned int r;
+
+	if (!ns || !cycles) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+
+	if (!cold)
+		k->run(in, samples, out);
+
+	for (r = 0; r < reps; r++) {
+		long long count = 0;
+		double t0;
+
+		if (cold)
+			evict();
+		if (cycles_fd >= 0) {
+			ioctl(cycles_fd, PERF_EVENT_IOC_RESET, 0);
+			ioctl(cycles_fd, PERF_EVENT_IOC_ENABLE, 0);
+		}
+		t0 = now_ns();
+		len = k->run(in, samples, out);
+		ns[r] = now_ns() - t0;
+		if (cycles_fd >= 0) {
+			ioctl(cycles_fd, PERF_EVENT_IOC_DISABLE, 0);
+			if (read(cycles_fd, &count, sizeof(count)) != sizeof(count))
+				count = -1;
+		}
+		cycles[r] = cycles_fd >= 0 ? count : -1;
+	}
+
+	qsort(ns, reps, sizeof(*ns), cmp_double);
+	qsort(cycles, reps, sizeof(*cycles), cmp_double);
+	print_row(k, ds, cold, ns[reps / 2], cycles[reps / 2],
+		  snr_db(ref, out, len < ref_len ? len : ref_len));
+
+	free(ns);
+	free(cycles);
+}
+
+static void bench_dataset(const struct dataset *ds, int cycles_fd)
+{
+	size_t out_len = 2 * samples + 16;
+	int16_t *out = malloc(out_len * sizeof(*out));
+	int16_t *ref = malloc(out_len * sizeof(*ref));
+	const struct kernel *k;
+	size_t ref_len = 0;
+	int stage = -1;
+
+	if (!out || !ref) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+
+	for (k = kernels; k < kernels + NUM_KERNELS; k++) {
+		bool iq = k->stage == STAGE_DEMOD || k->stage == STAGE_DISC ||
+			  k->stage == STAGE_MODE || k->stage == STAGE_CONV ||
+			  k->stage == STAGE_INGEST;
+		const int16_t *in = iq ? ds->iq : ds->audio;
+
+		if (!in || (only_stage >= 0 && (int)k->stage != only_stage))
+			continue;
+		if (k->available && !k->available())
+			continue;
+
+		if ((int)k->stage != stage) {
+			stage = k->stage;
+			fill_fd = ds->fd;
+			if (iq) {
+				struct fm_demod d;
+
+				fm_demod_init(&d, decimation, sub);
+				fm_demod_block(&d, ds->iq, samples, out);
+				demod_min = d.min;
+				demod_max = d.max;
+			}
+			ref_len = k->run(in, samples, ref);
+		} else if (k->reference) {
+			ref_len = k->run(in, samples, ref);
+		}
+
+		if (run_warm)
+			bench_kernel(k, ds, in, out, ref, ref_len, false, cycles_fd);
+		if (run_cold)
+			bench_kernel(k, ds, in, out, ref, ref_len, true, cycles_fd);
+	}
+
+	free(out);
+	free(ref);
+}
+
+
+/* Data */
+
+static int audio_file(const int16_t *audio)
+{
+	char path[] = "/tmp/sdr-bench-XXXXXX";
+	int fd = mkstemp(path);
+
+	if (fd < 0)
+		return -1;
+	unlink(path);
+	if (write(fd, audio, 2 * samples) != (ssize_t)(2 * samples)) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void synthetic(struct dataset *ds)
+{
+	uint64_t rng = 0x2545f4914f6cdd1dULL;
+	double phase = 0;
+	size_t k;
+
+	snprintf(ds->name, sizeof(ds->name), "synthetic");
+	ds->audio = malloc(2 * samples);
+	ds->iq = malloc(4 * samples);
+	if (!ds->audio || !ds->iq) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+
+	/* A 1 kHz tone with some noise, and that tone FM modulated on RX */
+	for (k = 0; k < samples; k++) {
+		double tone = sin(2 * M_PI * 1000 * k / MOD_RATE);
+
+		ds->audio[k] = (int16_t)lrint((0.7 * tone + 0.05 * noise(&rng))
+					      * MAX_SAMPLE_VALUE);
+
+		phase += 2 * M_PI * DEMOD_DEVIATION / DEMOD_RATE
+			 * sin(2 * M_PI * 1000 * k / DEMOD_RATE);
+		ds->iq[2 * k] = (int16_t)lrint(DEMOD_AMPLITUDE * cos(phase)
+					       + 20 * noise(&rng));
+		ds->iq[2 * k + 1] = (int16_t)lrint(DEMOD_AMPLITUDE * sin(phase)
+						   + 20 * noise(&rng));
+	}
+	ds->fd = audio_file(ds->audio);
+}
+
+/* Read a recording, repeated to one block of per_sample * samples int16 */
+static int16_t *recording(const char *path, size_t per_sample)
+{
+	size_t want = per_sample * samples, got = 0;
+	int16_t *buf = malloc(2 * want);
+	ssize_t ret;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || !buf) {
+		fprintf(stderr, "Cannot read %s: %s\n", path, strerror(errno));
+		exit(1);
+	}
+	while (got < 2 * want && (ret = read(fd, (char *)buf + got, 2 * want - got)) > 0)
+		got += ret;
+	close(fd);
+
+	got /= 2 * per_sample;
+	if (!got) {
+		fprintf(stderr, "%s is empty\n", path);
+		exit(1);
+	}
+	for (; got < samples; got *= 2) {
+		size_t n = got < samples - got ? got : samples - got;
+
+		memcpy(buf + per_sample * got, buf, 2 * per_sample * n);
+	}
+	return buf;
+}
+
+static const char *basename_of(const char *path)
+{
+	const char *slash = strrchr(path, '/');
+
+	return slash ? slash + 1 : path;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"sdr-bench, microbenchmarks of the DSP hot paths\n\n"
+		"Usage:\tsdr-bench [-options] > results.csv\n\n"
+		"\t-a file\t\tAlso run on recorded deviation samples (16-bit, as for tx-fm)\n"
+		"\t-q file\t\tAlso run on recorded I/Q (16-bit pairs from the 12-bit ADC)\n"
+		"\t-d decimation\tDemodulator decimation for -q data, default %d\n"
+		"\t-s stage\tOnly this stage: mod, demod, disc, fill or ingest\n"
+		"\t-n samples\tSamples per run, default %d\n"
+		"\t-r reps\t\tTimed runs per kernel, default %d; the median is reported\n"
+		"\t-c warm|cold\tOnly this cache mode, default both\n"
+		"\t-K isa\t\tRun the libsdr kernels built for scalar, neon, sse4.1, avx2\n"
+		"\t\t\tor avx512 instead of the best the CPU has\n",
+		DEMOD_DECIMATION, DEFAULT_SAMPLES, DEFAULT_REPS);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct dataset sets[MAX_DATASETS];
+	const char *audio_path[MAX_DATASETS], *iq_path[MAX_DATASETS];
+	unsigned int naudio = 0, niq = 0, nsets, k;
+	int opt, cycles_fd;
+
+	while ((opt = getopt(argc, argv, "a:q:d:s:n:r:c:K:h")) != -1) {
+		switch (opt) {
+		case 'a':
+			if (naudio + niq < MAX_DATASETS - 1)
+				audio_path[naudio++] = optarg;
+			break;
+		case 'q':
+			if (naudio + niq < MAX_DATASETS - 1)
+				iq_path[niq++] = optarg;
+			break;
+		case 'd': decimation = atoi(optarg); break;
+		case 's':
+			for (only_stage = NUM_STAGES - 1; only_stage >= 0; only_stage--)
+				if (!strcmp(optarg, stage_names[only_stage]))
+					break;
+			if (only_stage < 0)
+				usage();
+			break;
+		case 'n': samples = strtoul(optarg, NULL, 0); break;
+		case 'r': reps = atoi(optarg); break;
+		case 'c':
+			run_warm = !strcmp(optarg, "warm");
+			run_cold = !strcmp(optarg, "cold");
+			if (!run_warm && !run_cold)
+				usage();
+			break;
+		case 'K':
+			if (dsp_select(optarg)) {
+				fprintf(stderr, "DSP kernels %s are not available on this CPU\n", optarg);
+				exit(1);
+			}
+			break;
+		default: usage();
+		}
+	}
+	if (samples < 2 * decimation || !reps || !decimation)
+		usage();
+
+	/* Skip samples in the discriminator as iio_fm_radio does */
+	for (sub = decimation * 48000 / 576000; sub > 1; sub--)
+		if (decimation % sub == 0)
+			break;
+	if (!sub)
+		sub = 1;
+
+	fm_mod_init(&mod_state, MOD_DEVIATION / MAX_SAMPLE_VALUE, 0, MOD_RATE);
+	evict_buf = malloc(EVICT_BYTES);
+	if (!evict_buf) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	memset(evict_buf, 0, EVICT_BYTES);
+	if (par_pool_init(&demod_pool, 0)) {
+		fprintf(stderr, "Cannot start the demod threads\n");
+		exit(1);
+	}
+	ingest_buf = malloc(4 * samples);
+	if (!ingest_buf) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+
+	memset(sets, 0, sizeof(sets));
+	synthetic(&sets[0]);
+	nsets = 1;
+	for (k = 0; k < naudio; k++, nsets++) {
+		sets[nsets].audio = recording(audio_path[k], 1);
+		sets[nsets].fd = audio_file(sets[nsets].audio);
+		snprintf(sets[nsets].name, sizeof(sets[nsets].name), "%s", basename_of(audio_path[k]));
+	}
+	for (k = 0; k < niq; k++, nsets++) {
+		sets[nsets].iq = recording(iq_path[k], 2);
+		sets[nsets].fd = -1;
+		snprintf(sets[nsets].name, sizeof(sets[nsets].name), "%s", basename_of(iq_path[k]));
+	}
+
+	fprintf(stderr, "libsdr kernels: %s\n", dsp_isa_name(dsp_isa));
+	cycles_fd = cycles_open();
+	if (cycles_fd < 0)
+		fprintf(stderr, "No cycle counter (%s), cycles_per_sample left empty\n",
+			strerror(errno));
+
+	printf("stage,variant,isa,data,cache,samples,reps,ns_per_sample,msps,cycles_per_sample,snr_db,us_per_block\n");
+	for (k = 0; k < nsets; k++)
+		bench_dataset(&sets[k], cycles_fd);
+
+	return 0;
+}
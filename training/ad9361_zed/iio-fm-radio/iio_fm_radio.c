@@ -6,7 +6,9 @@
  **/
 
 #include <errno.h>
+#include <math.h>
 #include <signal.h>
+#include <string.h>
 #include <sys/mman.h>
 #include <fcntl.h>
 #include <unistd.h>
@@ -15,6 +17,16 @@
 #include <stdio.h>
 #include <sys/ioctl.h>
 #include "iio_utils.h"
+#include "ad9361_fir.h"
+#include "conv.h"
+#include "ctl.h"
+#include "dsp.h"
+#include "demod.h"
+#include "fm_demod.h"
+#include "ingest.h"
+#include "metrics.h"
+#include "recover.h"
+#include "trace.h"
 
 #define IIO_BLOCK_ALLOC_IOCTL   _IOWR('i', 0xa0, struct iio_buffer_block_alloc_req)
 #define IIO_BLOCK_FREE_IOCTL    _IO('i', 0xa1)
@@ -46,101 +58,75 @@ struct block {
 	short *addr;
 };
 
-static struct block blocks[5];
-
-/* Min and max are used for automatic gain control and DC offset control */
-static int min = 0xfffffff;
-static int max = -0xfffffff;
-
-#define DECIMATION_FACTOR 48
+#define DEFAULT_DECIMATION 48
 #define AUDIO_SAMPLE_RATE 48000
 
-static int demodulate(struct iio_buffer_block *block)
-{
-	int new_min, new_max;
-	long i[3], q[3], di, dq;
-	long long sample = 0;
-	unsigned int j;
-	unsigned int sub = 4;
-	unsigned int x = 0;
-	unsigned int n = 0;
-	short *sample_buffer;
-	size_t num_bytes, offset;
-	int ret;
-
-	new_min = 0xfffffff;
-	new_max = -0xfffffff;
-
-	sample_buffer = malloc(block->bytes_used / DECIMATION_FACTOR / 2);
-
-	i[2] = blocks[block->id].addr[0];
-	q[2] = blocks[block->id].addr[1];
-	i[1] = blocks[block->id].addr[2];
-	q[1] = blocks[block->id].addr[3];
-
-	x = 0;
-	for (j = 2; j < block->bytes_used / 2; j += 2 * sub) {
-
-		/* FM demodulation implemented as described in
-		 * http://www.embedded.com/design/embedded/4212086/DSP-Tricks--Frequency-demodulation-algorithms-
-		 */
-		i[0] = blocks[block->id].addr[j];
-		q[0] = blocks[block->id].addr[j + 1];
-
-		di = i[0] - i[2];
-		dq = q[0] - q[2];
+/* The discriminator runs at no less than this rate */
+#define DISCRIMINATOR_RATE 576000
 
-		sample += (i[1] * dq - q[1] * di);
+/* Broadcast FM deviation, full-scale audio with -D other than quad */
+#define FM_DEVIATION 75000.0
 
-		i[2] = i[1];
-		q[2] = q[1];
-		i[1] = i[0];
-		q[1] = q[0];
+/* -F channel filter: stop band from 1.25 times the cutoff, this far down */
+#define CHANNEL_TRANSITION 0.25
+#define CHANNEL_ATTEN_DB 60.0
 
-		x += sub;
-		if (x >= DECIMATION_FACTOR) {
-			x = 0;
-			sample /= (DECIMATION_FACTOR / sub);
+/* Mute the audio of blocks received below this level, in dBFS */
+static double squelch_level = -INFINITY;
 
-			if (sample < new_min)
-				new_min = sample;
-			if (sample > new_max)
-				new_max = sample;
+/* The ADC is 12 bits */
+#define FULL_SCALE 2048.0
 
-			if (min >= max)
-				continue;
+/* Exported with -M or -P, see setup_metrics() */
+static struct metric *m_blocks, *m_samples, *m_audio, *m_overflows, *m_squelched;
+static struct metric *m_queue, *m_dequeue, *m_ingest, *m_filter, *m_demod, *m_write;
+static struct metric *m_recoveries, *m_recovery;
 
-			sample -= (max - min) / 2;
-			sample = sample * 0x1fff / (max - min);
-			if (sample > 0x1fff)
-				sample = 0x1fff;
-			else if(sample < -0x1fff)
-				sample = -0x1fff;
+/* DMA error recovery, see recover_blocks() */
+static struct recover rec;
 
-			sample_buffer[n] = sample;	
-			n++;
-			sample = 0;
-		}
-	}
+/*
+ * Demodulate one block of I/Q to stdout, through @sample_buffer with room
+ * for @bytes / @demod->decimation / 2 bytes of audio. @demod keeps the min
+ * and max used for automatic gain control and DC offset control from block
+ * to block.
+ */
+static int demodulate(struct demod *demod, struct par_pool *pool,
+		      const short *iq, size_t bytes, short *sample_buffer)
+{
+	size_t n, num_bytes, offset;
+	long long t_ns;
+	int ret;
 
-	min = new_min;
-	max = new_max;
+	trace_begin("demod");
+	t_ns = ctl_now_ns();
+	n = demod_block(demod, iq, bytes / 4, sample_buffer, pool);
+	metric_observe(m_demod, (ctl_now_ns() - t_ns) / 1e9);
+	trace_end("demod");
 
 	if (n == 0)
 		return 0;
 
+	if (10 * log10(demod->power / (FULL_SCALE * FULL_SCALE) / demod->count + 1e-20) < squelch_level) {
+		memset(sample_buffer, 0, 2 * n);
+		metric_add(m_squelched, 1);
+	}
+
 	num_bytes = 2 * n;
 	offset = 0;
 
+	trace_begin("write");
+	t_ns = ctl_now_ns();
 	do {
-		ret = write(STDOUT_FILENO, sample_buffer + offset, num_bytes);
+		ret = write(STDOUT_FILENO, (char *)sample_buffer + offset, num_bytes);
 		if (ret <= 0)
 			break;
 		num_bytes -= ret;
 		offset += ret;
 	} while (num_bytes);
-		
-	free(sample_buffer);
+	metric_observe(m_write, (ctl_now_ns() - t_ns) / 1e9);
+	trace_end("write");
+	metric_add(m_audio, n);
 
 	if (ret == 0) {
 		fprintf(stderr, "Failed to write samples to stdout: EOF\n");
@@ -174,29 +160,426 @@ static void setup_sigterm_handler(void)
 	sigaction(SIGPIPE, &action, NULL);
 }
 
+static void dump_trace(int signal)
+{
+	trace_request_dump();
+}
+
+static int setup_metrics(const char *path, int port)
+{
+	static const char stage[] = "Time spent in a stage of the RX loop per block";
+
+	m_blocks = metrics_counter("sdr_rx_blocks_total", NULL,
+				   "DMA blocks dequeued");
+	m_samples = metrics_counter("sdr_rx_samples_total", NULL,
+				    "IQ samples dequeued");
+	m_audio = metrics_counter("sdr_rx_audio_samples_total", NULL,
+				  "Audio samples written to stdout");
+	m_overflows = metrics_counter("sdr_rx_overflows_total", NULL,
+		"Blocks handled after the DMA could have run out of free blocks");
+	m_squelched = metrics_counter("sdr_rx_squelched_blocks_total", NULL,
+				      "Blocks muted by the squelch");
+	m_recoveries = metrics_counter("sdr_rx_recoveries_total", NULL,
+		"Failed block ioctls retried, or followed by a rebuild of the blocks");
+	m_recovery = metrics_histogram("sdr_rx_recovery_seconds", NULL,
+		"Time from a block ioctl failing to a block being dequeued again",
+		NULL, 0);
+	m_queue = metrics_gauge("sdr_rx_queue_seconds", NULL,
+		"Signal the free DMA blocks could still hold when the last block was dequeued");
+	m_dequeue = metrics_histogram("sdr_rx_stage_seconds", "stage=\"dequeue\"",
+				      stage, NULL, 0);
+	m_ingest = metrics_histogram("sdr_rx_stage_seconds", "stage=\"ingest\"",
+				     stage, NULL, 0);
+	m_filter = metrics_histogram("sdr_rx_stage_seconds", "stage=\"filter\"",
+				     stage, NULL, 0);
+	m_demod = metrics_histogram("sdr_rx_stage_seconds", "stage=\"demod\"",
+				    stage, NULL, 0);
+	m_write = metrics_histogram("sdr_rx_stage_seconds", "stage=\"write\"",
+				    stage, NULL, 0);
+
+	return metrics_start(path, port);
+}
+
+static struct ctl ctl = { .fd = -1 };
+static long long rx_lo;
+static long long rx_gain;
+
+/* Switch to the phy for one attribute write, then back to the ADC core */
+static int write_phy_attr(const char *attr, long long val)
+{
+	int ret;
+
+	set_dev_paths("ad9361-phy");
+	ret = write_devattr_slonglong(attr, val);
+	set_dev_paths("cf-ad9361-lpc");
+
+	return ret;
+}
+
+/*
+ * Live control (-C). Applied between blocks; the LO and gain take effect
+ * once the attribute write returns. Deviation and offset have no meaning
+ * for this receiver.
+ */
+static void control_poll(void)
+{
+	struct ctl_cmd cmd;
+	double v;
+	int ret;
+
+	while (ctl_poll(&ctl, &cmd)) {
+		v = cmd.value;
+		ret = 0;
+
+		switch (cmd.param) {
+		case CTL_LO:
+			if (!cmd.has_value)
+				break;
+			if (v < 70e6 || v > 6e9) {
+				ret = -ERANGE;
+				break;
+			}
+			ret = write_phy_attr("out_altvoltage0_RX_LO_frequency", v);
+			if (!ret)
+				rx_lo = v;
+			break;
+		case CTL_GAIN:
+			if (!cmd.has_value)
+				break;
+			if (v < -3 || v > 71) {
+				ret = -ERANGE;
+				break;
+			}
+			set_dev_paths("ad9361-phy");
+			ret = write_devattr("in_voltage0_gain_control_mode", "manual");
+			set_dev_paths("cf-ad9361-lpc");
+			if (!ret)
+				ret = write_phy_attr("in_voltage0_hardwaregain", v);
+			if (!ret)
+				rx_gain = v;
+			break;
+		case CTL_SQUELCH:
+			if (cmd.has_value)
+				squelch_level = v;
+			break;
+		case CTL_GET:
+			cmd.param = CTL_LO;
+			ctl_reply(&ctl, &cmd, 0, rx_lo, 0);
+			cmd.param = CTL_GAIN;
+			ctl_reply(&ctl, &cmd, 0, rx_gain, 0);
+			cmd.param = CTL_SQUELCH;
+			ctl_reply(&ctl, &cmd, 0, squelch_level, 0);
+			continue;
+		default:
+			ret = -EOPNOTSUPP;
+			break;
+		}
+
+		v = cmd.param == CTL_LO ? rx_lo :
+			cmd.param == CTL_GAIN ? rx_gain : squelch_level;
+		ctl_reply(&ctl, &cmd, ret < 0 ? ret : 0, v,
+			  (ctl_now_ns() - cmd.recv_ns) / 1e9);
+	}
+}
+
 #define ALIGN(x, y) ((x) / (y)) * (y)
 
+/*
+ * Below 2.083 MHz the AD9361 needs its FIR to decimate by 4. Load a profile
+ * matching the rate and enable it before setting the rate, or disable it.
+ */
+static int setup_fir(const struct ad9361_rate_plan *plan, long long bw)
+{
+	static char config[AD9361_FIR_CONFIG_MAX];
+	struct ad9361_fir fir;
+	int ret;
+
+	if (!plan->fir_ratio)
+		return write_devattr_int("in_out_voltage_filter_fir_en", 0);
+
+	ret = ad9361_fir_design(&fir, plan->baseband, bw, plan->fir_ratio);
+	if (ret < 0)
+		return ret;
+	ret = ad9361_fir_config(&fir, config, sizeof(config));
+	if (ret < 0)
+		return ret;
+
+	fprintf(stderr, "Loading %u-tap FIR, decimation by %u\n", fir.taps, fir.ratio);
+	ret = write_devattr("filter_fir_config", config);
+	if (ret < 0)
+		return ret;
+
+	return write_devattr_int("in_out_voltage_filter_fir_en", 1);
+}
+
+/* Unmap the DMA blocks and free them */
+static void unmap_blocks(int fd, const struct iio_buffer_block_alloc_req *req,
+			 struct block *blocks)
+{
+	unsigned int i;
+
+	for (i = 0; i < req->count; i++) {
+		if (blocks[i].addr)
+			munmap(blocks[i].addr, blocks[i].block.size);
+		blocks[i].addr = NULL;
+	}
+	ioctl(fd, IIO_BLOCK_FREE_IOCTL, 0);
+}
+
+/* Allocate the DMA blocks, map them and hand them all to the DMA */
+static int map_blocks(int fd, struct iio_buffer_block_alloc_req *req,
+		      struct block *blocks)
+{
+	unsigned int i;
+	void *addr;
+
+	if (ioctl(fd, IIO_BLOCK_ALLOC_IOCTL, req) < 0)
+		return -errno;
+
+	for (i = 0; i < req->count; i++)
+		blocks[i].addr = NULL;
+	for (i = 0; i < req->count; i++) {
+		blocks[i].block.id = i;
+		if (ioctl(fd, IIO_BLOCK_QUERY_IOCTL, &blocks[i].block))
+			goto err;
+
+		addr = mmap(0, blocks[i].block.size, PROT_READ, MAP_SHARED, fd,
+			    blocks[i].block.data.offset);
+		if (addr == MAP_FAILED)
+			goto err;
+		blocks[i].addr = addr;
+
+		if (ioctl(fd, IIO_BLOCK_ENQUEUE_IOCTL, &blocks[i].block))
+			goto err;
+	}
+
+	return 0;
+
+err:
+	i = errno;
+	unmap_blocks(fd, req, blocks);
+	return -(int)i;
+}
+
+/*
+ * A block ioctl failed with @err. Interrupted calls are repeated; after a
+ * DMA error the buffer is disabled and the blocks freed, reallocated and
+ * enqueued again, which leaves the PHY setup alone. Returns 0 to repeat
+ * the call, 1 when the blocks were rebuilt (all of them enqueued), or a
+ * negative errno to give up with.
+ */
+static int recover_blocks(int fd, struct iio_buffer_block_alloc_req *req,
+			  struct block *blocks, const char *what, int err)
+{
+	enum recover_action action = recover_error(&rec, err);
+
+	fprintf(stderr, "Failed to %s block: %s, %s\n", what, strerror(-err),
+		recover_action_name(action));
+	trace_anomaly("rx block error", -err);
+	if (action == RECOVER_RETRY) {
+		metric_add(m_recoveries, 1);
+		return 0;
+	}
+
+	while (action == RECOVER_REBUILD) {
+		metric_add(m_recoveries, 1);
+		write_devattr_int("buffer/enable", 0);
+		unmap_blocks(fd, req, blocks);
+		err = map_blocks(fd, req, blocks);
+		if (!err) {
+			write_devattr_int("buffer/enable", 1);
+			return 1;
+		}
+		fprintf(stderr, "Failed to rebuild the blocks: %s\n", strerror(-err));
+		action = recover_error(&rec, err);
+	}
+
+	return err;
+}
+
 /**
- * Usage: `iio_fm_radio [frequency]`
+ * Usage: `iio_fm_radio [-C control_socket] [-T trace_prefix] [-M metrics_file]
+ *	[-P port] [-I auto|direct|copy] [-j threads] [-K isa]
+ *	[-m wbfm|nbfm|am|usb|lsb] [-D quad|quadnorm|cordic|lut] [-F cutoff]
+ *	[frequency [decimation]]`
+ *
+ * The sample rate is decimation * 48 kHz, 2.304 MHz by default. Down to
+ * 11 (528 kHz) works with the AD9361 FIR decimating.
+ *
+ * With -C, the LO ("lo <Hz>"), manual gain ("gain <dB>") and squelch
+ * ("squelch <dBFS>") can be changed while running, see libsdr/ctl.c.
+ *
+ * With -T, the last dequeue, demod and write events are dumped as Chrome
+ * trace JSON to <trace_prefix>-N.json on SIGUSR1, and when a block is
+ * handled too late for the DMA to have had a free one to fill.
+ *
+ * With -M and -P, counters of blocks, samples and overflows, the DMA
+ * headroom and the stage times are exported in Prometheus text format, to
+ * a file rewritten every second and over HTTP on 127.0.0.1:<port>.
+ *
+ * -I chooses how blocks reach the discriminator: read in place (direct),
+ * or copied into cached memory first (copy). The default, auto, copies
+ * when the block mapping reads much slower than cached memory, as the
+ * non-cacheable DMA mappings of the Zynq do.
+ *
+ * -j sets the threads each block is demodulated on, one per CPU by
+ * default; the audio is the same with any number.
+ *
+ * -K runs the discriminator built for another instruction set (scalar,
+ * neon, sse4.1, avx2 or avx512) than the best one the CPU has, which is
+ * printed at startup.
+ *
+ * -D chooses the discriminator. quad, the default, needs the block-delayed
+ * AGC and mutes the first block; the others measure the phase step and
+ * give full-scale audio at 75 kHz deviation whatever the signal level,
+ * see libsdr/fm_demod.h and the disc stage of sdr-bench.
+ *
+ * -m chooses the modulation, broadcast FM (wbfm) by default. The others
+ * filter a channel of their own width at 48 kHz: nbfm for 2.5 kHz
+ * deviation, am with the carrier level taken out, usb and lsb through a
+ * Weaver demodulator scaled to the previous block's peak. -D only
+ * applies to wbfm; see libsdr/demod.h.
+ *
+ * -F filters the I/Q to a channel of +-cutoff Hz before demodulating,
+ * 60 dB down from 1.25 times the cutoff. At the full sample rate that
+ * takes hundreds of taps, which run as overlap-save FFT convolution
+ * (libsdr/conv.h); the audio is one FFT step later.
  */
 int main(int argc, char *argv[])
 {
 	struct iio_buffer_block_alloc_req req;
 	struct iio_buffer_block block;
+	struct ad9361_rate_plan plan;
+	struct block blocks[5];
+	struct demod demod;
+	struct par_pool pool;
+	unsigned int decimation = DEFAULT_DECIMATION;
+	unsigned int sub;
 	unsigned int sample_rate;
+	const char *control_path = NULL;
+	const char *trace_path = NULL;
+	const char *metrics_path = NULL;
+	const char *ingest_mode = "auto";
+	const char *dsp_name = NULL;
+	const char *disc_name = "quad";
+	const char *mode_name = "wbfm";
+	struct conv channel = { 0 };
+	short *filtered = NULL;
+	double cutoff = 0;
+	short *work = NULL;
+	short *audio;
+	const short *iq;
+	int metrics_port = 0;
+	unsigned int nthreads = 0;
+	long long dequeued_ns = 0, late_ns, t_ns;
+	unsigned long nblocks = 0;
 	int fd, ret;
-	int i;
+	int i, opt;
+
+	while ((opt = getopt(argc, argv, "C:T:M:P:I:j:K:D:m:F:")) != -1) {
+		switch (opt) {
+		case 'C':
+			control_path = optarg;
+			break;
+		case 'T':
+			trace_path = optarg;
+			break;
+		case 'M':
+			metrics_path = optarg;
+			break;
+		case 'P':
+			metrics_port = atoi(optarg);
+			break;
+		case 'j':
+			nthreads = atoi(optarg);
+			break;
+		case 'K':
+			dsp_name = optarg;
+			break;
+		case 'D':
+			disc_name = optarg;
+			break;
+		case 'm':
+			mode_name = optarg;
+			break;
+		case 'F':
+			cutoff = atof(optarg);
+			break;
+		case 'I':
+			ingest_mode = optarg;
+			if (!strcmp(optarg, "auto") || !strcmp(optarg, "direct") ||
+			    !strcmp(optarg, "copy"))
+				break;
+			/* fall through */
+		default:
+			fprintf(stderr, "Usage: %s [-C control_socket] [-T trace_prefix] [-M metrics_file] [-P port] [-I auto|direct|copy] [-j threads] [-K isa] [-m wbfm|nbfm|am|usb|lsb] [-D quad|quadnorm|cordic|lut] [-F cutoff] [frequency [decimation]]\n",
+				argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	argc -= optind - 1;
+	argv += optind - 1;
 
-	sample_rate = DECIMATION_FACTOR * AUDIO_SAMPLE_RATE;
-	if (sample_rate <= 2083333) {
-		fprintf(stderr, "Sample rate of %u is to low\n", sample_rate);
+	if (argc > 2)
+		decimation = atoi(argv[2]);
+
+	if (!decimation || ad9361_rate_plan(&plan,
+			(long long)decimation * AUDIO_SAMPLE_RATE, 1)) {
+		fprintf(stderr, "Sample rate of %lld is out of range\n",
+			(long long)decimation * AUDIO_SAMPLE_RATE);
+		return EXIT_FAILURE;
+	}
+	sample_rate = decimation * AUDIO_SAMPLE_RATE;
+
+	/* Skip samples in the discriminator where the rate allows */
+	for (sub = decimation * AUDIO_SAMPLE_RATE / DISCRIMINATOR_RATE; sub > 1; sub--)
+		if (decimation % sub == 0)
+			break;
+	if (!sub)
+		sub = 1;
+	if (demod_init(&demod, mode_name, decimation, sub, sample_rate)) {
+		fprintf(stderr, "Unknown mode %s\n", mode_name);
+		return EXIT_FAILURE;
+	}
+	if (fm_demod_discriminator(&demod.fm, disc_name, FM_DEVIATION, sample_rate)) {
+		fprintf(stderr, "Unknown discriminator %s\n", disc_name);
+		return EXIT_FAILURE;
+	}
+	if (dsp_select(dsp_name)) {
+		fprintf(stderr, "DSP kernels %s are not available on this CPU\n", dsp_name);
+		return EXIT_FAILURE;
+	}
+	if (demod.mode == DEMOD_WBFM)
+		fprintf(stderr, "DSP kernels: %s, wbfm, %s discriminator\n",
+			dsp_isa_name(dsp_isa), fm_demod_disc_name(demod.fm.disc));
+	else
+		fprintf(stderr, "DSP kernels: %s, %s\n", dsp_isa_name(dsp_isa),
+			demod_mode_name(demod.mode));
+	if (cutoff > 0) {
+		ret = conv_lowpass(&channel, cutoff / sample_rate,
+				   CHANNEL_TRANSITION * cutoff / sample_rate, CHANNEL_ATTEN_DB, 1);
+		if (ret == -EINVAL) {
+			fprintf(stderr, "Channel cutoff %.0f Hz is out of range\n", cutoff);
+			return EXIT_FAILURE;
+		} else if (ret) {
+			fprintf(stderr, "Failed to set up the channel filter: %s\n", strerror(-ret));
+			return EXIT_FAILURE;
+		}
+		fprintf(stderr, "Channel filter: %u taps, %s\n", channel.taps,
+			conv_method_name(channel.method));
+	}
+	ret = par_pool_init(&pool, nthreads);
+	if (ret) {
+		fprintf(stderr, "Failed to start the demod threads: %s\n", strerror(-ret));
 		return EXIT_FAILURE;
 	}
 
 	setup_sigterm_handler();
 
 	req.type = 0x0;
-	req.size = ALIGN(0x100000, sizeof(uint16_t) * 2 * DECIMATION_FACTOR);
+	/* About 0.11 s per block, whatever the rate */
+	req.size = ALIGN(0x100000 / DEFAULT_DECIMATION * decimation,
+			 sizeof(uint16_t) * 2 * decimation);
 	req.count = 4;
 
 	ret = set_dev_paths("cf-ad9361-lpc");
@@ -219,7 +602,13 @@ int main(int argc, char *argv[])
 
 	/* Setup the phy */
 	set_dev_paths("ad9361-phy");
+	if (plan.fir_ratio && setup_fir(&plan, 300000) < 0) {
+		fprintf(stderr, "Failed to load the FIR profile\n");
+		exit(1);
+	}
 	write_devattr_int("in_voltage_sampling_frequency", sample_rate);
+	if (!plan.fir_ratio)
+		setup_fir(&plan, 300000);
 	/* Set bandwidth to 300 kHz */
 	write_devattr_int("in_voltage_rf_bandwidth", 300000);
 
@@ -230,68 +619,170 @@ int main(int argc, char *argv[])
 			freq *= 1000000;
 		write_devattr_int("out_altvoltage0_RX_LO_frequency", freq);
 	}
+	read_devattr_slonglong("out_altvoltage0_RX_LO_frequency", &rx_lo);
+	read_devattr_slonglong("in_voltage0_hardwaregain", &rx_gain);
+
+	/* Allocate, mmap and enqueue buffer blocks */
+	ret = map_blocks(fd, &req, blocks);
+	if (ret) {
+		fprintf(stderr, "Failed to set up the memory blocks: %s\n",
+			strerror(-ret));
+		exit(1);
+	}
+	for (i = 0; i < req.count; i++)
+		fprintf(stderr, "Sucessfully mapped block %d (offset %x, size %d) at %p\n",
+			i, blocks[i].block.data.offset, blocks[i].block.size,
+			blocks[i].addr);
 
-	/* Allocate and mmap buffer blocks */
-	ret = ioctl(fd, IIO_BLOCK_ALLOC_IOCTL, &req);
-	if (ret < 0) {
-		perror("Failed to allocate memory blocks");
+	/* Probed before streaming starts, while the DMA leaves the blocks alone */
+	if (!strcmp(ingest_mode, "auto")) {
+		double ratio = ingest_probe(blocks[0].addr, blocks[0].block.size);
+
+		fprintf(stderr, "Block mapping takes %.1fx as long to read as cached memory, %s\n",
+			ratio, ratio < INGEST_UNCACHED_RATIO ? "reading it directly" :
+			"copying blocks first");
+		if (ratio >= INGEST_UNCACHED_RATIO)
+			ingest_mode = "copy";
+	}
+	if (!strcmp(ingest_mode, "copy")) {
+		work = malloc(req.size);
+		if (!work) {
+			perror("Failed to allocate the working block");
+			exit(1);
+		}
+	}
+	audio = malloc(req.size / decimation / 2);
+	if (!audio) {
+		perror("Failed to allocate the audio buffer");
 		exit(1);
 	}
-	for (i = 0; i < req.count; i++) {
-		blocks[i].block.id = i;
-		ret = ioctl(fd, IIO_BLOCK_QUERY_IOCTL, &blocks[i].block);
-		if (ret) {
-			perror("Failed to query block");
+	if (channel.taps) {
+		filtered = malloc(req.size);
+		if (!filtered) {
+			perror("Failed to allocate the filtered block");
 			exit(1);
 		}
+	}
 
-		blocks[i].addr = mmap(0, blocks[i].block.size, PROT_READ,
-			MAP_SHARED, fd, blocks[i].block.data.offset);
-		if (blocks[i].addr == MAP_FAILED) {
-			perror("Failed to mmap block");
+	if (control_path) {
+		ret = ctl_open(&ctl, control_path);
+		if (ret) {
+			fprintf(stderr, "Failed to open control socket %s: %s\n",
+				control_path, strerror(-ret));
 			exit(1);
 		}
+	}
+
+	if (trace_path) {
+		struct sigaction action = {
+			.sa_handler = dump_trace,
+		};
 
-		ret = ioctl(fd, IIO_BLOCK_ENQUEUE_IOCTL, &blocks[i].block);
+		ret = trace_init(trace_path);
 		if (ret) {
-			perror("Failed to enqueue block");
+			fprintf(stderr, "Failed to start tracing to %s: %s\n",
+				trace_path, strerror(-ret));
+			exit(1);
+		}
+		trace_thread_name("rx");
+		sigaction(SIGUSR1, &action, NULL);
+	}
+	if (metrics_path || metrics_port) {
+		ret = setup_metrics(metrics_path, metrics_port);
+		if (ret) {
+			fprintf(stderr, "Failed to export metrics: %s\n",
+				strerror(-ret));
 			exit(1);
 		}
-
-		fprintf(stderr, "Sucessfully mapped block %d (offset %x, size %d) at %p\n",
-			i, blocks[i].block.data.offset, blocks[i].block.size,
-			blocks[i].addr);
 	}
 
+	/* With one block being handled, the DMA has the others to fill */
+	late_ns = (long long)(req.count - 1) * (req.size / 4) * 1000000000LL / sample_rate;
+
 	fprintf(stderr, "Starting FM modulation\n");
 
 	set_dev_paths("cf-ad9361-lpc");
 	write_devattr_int("buffer/enable", 1);
 
 	while (app_running) {
+		/* Handled slower than the DMA fills the free blocks */
+		t_ns = ctl_now_ns();
+		if (nblocks > req.count) {
+			long long gap = t_ns - dequeued_ns;
+
+			metric_set(m_queue, gap < late_ns ? (late_ns - gap) / 1e9 : 0);
+			if (gap > late_ns) {
+				metric_add(m_overflows, 1);
+				trace_anomaly("rx late", gap / 1000);
+			}
+		}
+
+		trace_begin("dequeue");
 		ret = ioctl(fd, IIO_BLOCK_DEQUEUE_IOCTL, &block);
+		trace_end("dequeue");
 		if (ret) {
-			perror("Failed to dequeue block");
-			break;
+			ret = recover_blocks(fd, &req, blocks, "dequeue", -errno);
+			if (ret < 0)
+				break;
+			continue;
 		}
-		ret = demodulate(&block);
+		dequeued_ns = ctl_now_ns();
+		if (recover_ok(&rec)) {
+			metric_observe(m_recovery, rec.last_ns / 1e9);
+			fprintf(stderr, "Receiving again after %.1f ms\n",
+				rec.last_ns / 1e6);
+		}
+		metric_observe(m_dequeue, (dequeued_ns - t_ns) / 1e9);
+		metric_add(m_blocks, 1);
+		metric_add(m_samples, block.bytes_used / 4);
+		nblocks++;
+		if (work) {
+			trace_begin("ingest");
+			t_ns = ctl_now_ns();
+			ingest_copy(work, blocks[block.id].addr, block.bytes_used);
+			metric_observe(m_ingest, (ctl_now_ns() - t_ns) / 1e9);
+			trace_end("ingest");
+		}
+		iq = work ? work : blocks[block.id].addr;
+		if (filtered) {
+			trace_begin("filter");
+			t_ns = ctl_now_ns();
+			conv_block_s16(&channel, iq, filtered, block.bytes_used / 4);
+			metric_observe(m_filter, (ctl_now_ns() - t_ns) / 1e9);
+			trace_end("filter");
+			iq = filtered;
+		}
+		ret = demodulate(&demod, &pool, iq, block.bytes_used, audio);
 		if (ret)
 			break;
-		ret = ioctl(fd, IIO_BLOCK_ENQUEUE_IOCTL, &block);
-		if (ret) {
-			perror("Failed to enqueue block");
-			break;
+		while (ioctl(fd, IIO_BLOCK_ENQUEUE_IOCTL, &block)) {
+			ret = recover_blocks(fd, &req, blocks, "enqueue", -errno);
+			if (ret)
+				break;
 		}
+		if (ret < 0)
+			break;
+		control_poll();
 	}
 
+	ctl_close(&ctl);
+	trace_close();
+	metrics_stop();
+	free(work);
+	free(filtered);
+	free(audio);
+	conv_free(&channel);
+	demod_free(&demod);
+	par_pool_free(&pool);
+
 	write_devattr_int("buffer/enable", 0);
 
 	fprintf(stderr, "Stopping FM modulation\n");
+	if (rec.retries || rec.rebuilds)
+		fprintf(stderr, "%lu DMA errors recovered (%lu retries, %lu block rebuilds), worst %.1f ms without blocks\n",
+			rec.outages, rec.retries, rec.rebuilds, rec.worst_ns / 1e6);
 
-	for (i = 0; i < req.count; i++)
-		munmap(blocks[i].addr, blocks[i].block.size);	
-
-	ioctl(fd, IIO_BLOCK_FREE_IOCTL, 0);
+	unmap_blocks(fd, &req, blocks);
 	close(fd);
 
 	return 0;
@@ -0,0 +1,802 @@
+/**
+ * Simulated AD9361 on FMCOMMS2 - libiio 0.x front-end
+ *
+ * Built as libiio.so.0, so tools linked against the real libiio run on
+ * the simulator with LD_LIBRARY_PATH pointing here. Every context sees
+ * the same three devices as the ZedBoard: ad9361-phy, the DDS core (TX)
+ * and the ADC core (RX). Samples are 16-bit, one slot per enabled
+ * channel, in scan index order.
+ *
+ * Licensed under the GPL-2.
+ *
+ **/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#include "iio.h"
+#include "sim.h"
+
+#define SIM_VERSION	"0.1"
+#define SIM_MAX_CHANS	8
+
+struct iio_channel {
+	struct iio_device *dev;
+	const struct sim_chan_desc *desc;
+	bool enabled;
+};
+
+struct iio_device {
+	struct iio_context *ctx;
+	int num;
+	char id[16];
+	struct iio_channel chans[SIM_MAX_CHANS];
+	unsigned int nchans;
+	unsigned int kernel_buffers;
+};
+
+struct iio_context {
+	char uri[64];
+	struct iio_device devs[SIM_NUM_DEVICES];
+};
+
+/**
+ * struct iio_buffer - a DMA buffer on the TX or RX streaming device
+ * @data: @samples samples of @sample_size bytes
+ * @stride: int16 slots per sample
+ * @cyclic: requested cyclic; the simulator transmits the data once
+ * @poll_fd: RX: @timer_fd; TX: the write end of a pipe that is full
+ *	until the next push would not block. -1 until
+ *	iio_buffer_get_poll_fd() asks for it
+ * @timer_fd: timerfd that expires when the next push or refill would not
+ *	block
+ * @pipe_rd: TX: the read end of the @poll_fd pipe
+ * @poll_thread: TX: empties the pipe when @timer_fd expires
+ * @poll_lock: TX: orders that against filling the pipe and rearming
+ * @poll_running: TX: @poll_thread was started
+ * @poll_quit: TX: tells @poll_thread to stop
+ **/
+struct iio_buffer {
+	const struct iio_device *dev;
+	void *data;
+	size_t samples;
+	size_t sample_size;
+	size_t stride;
+	bool output;
+	bool cyclic;
+	bool blocking;
+	bool cancelled;
+	int poll_fd;
+	int timer_fd;
+	int pipe_rd;
+	pthread_t poll_thread;
+	pthread_mutex_t poll_lock;
+	bool poll_running;
+	bool poll_quit;
+	struct sim_ring *ring;
+	struct sim_pacer pacer;
+	struct sim_rx rx;
+};
+
+static const char *const ctx_attrs[][2] = {
+	{ "uri", NULL },
+	{ "iio-sim,version", SIM_VERSION },
+};
+
+void iio_library_get_version(unsigned int *major, unsigned int *minor,
+			     char git_tag[8])
+{
+	if (major)
+		*major = 0;
+	if (minor)
+		*minor = 26;
+	if (git_tag)
+		strcpy(git_tag, "iiosim");
+}
+
+void iio_strerror(int err, char *dst, size_t len)
+{
+	snprintf(dst, len, "%s", strerror(err));
+}
+
+struct iio_context *iio_create_context_from_uri(const char *uri)
+{
+	struct iio_context *ctx;
+	int d, c, ret;
+
+	ret = sim_setup();
+	if (ret) {
+		errno = -ret;
+		return NULL;
+	}
+
+	ctx = calloc(1, sizeof(*ctx));
+	if (!ctx) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	snprintf(ctx->uri, sizeof(ctx->uri), "%s", uri ? uri : "local:");
+
+	for (d = 0; d < SIM_NUM_DEVICES; d++) {
+		struct iio_device *dev = &ctx->devs[d];
+
+		dev->ctx = ctx;
+		dev->num = d;
+		snprintf(dev->id, sizeof(dev->id), "iio:device%d", d);
+		dev->nchans = sim_devices[d].nchans;
+		for (c = 0; c < (int)dev->nchans; c++) {
+			dev->chans[c].dev = dev;
+			dev->chans[c].desc = &sim_devices[d].chans[c];
+		}
+	}
+
+	return ctx;
+}
+
+struct iio_context *iio_create_default_context(void)
+{
+	return iio_create_context_from_uri("local:");
+}
+
+struct iio_context *iio_create_local_context(void)
+{
+	return iio_create_context_from_uri("local:");
+}
+
+void iio_context_destroy(struct iio_context *ctx)
+{
+	free(ctx);
+}
+
+const char *iio_context_get_name(const struct iio_context *ctx)
+{
+	return "local";
+}
+
+const char *iio_context_get_description(const struct iio_context *ctx)
+{
+	return "iio-sim: simulated AD9361 on FMCOMMS2";
+}
+
+unsigned int iio_context_get_attrs_count(const struct iio_context *ctx)
+{
+	return sizeof(ctx_attrs) / sizeof(ctx_attrs[0]);
+}
+
+int iio_context_get_attr(const struct iio_context *ctx, unsigned int index,
+			 const char **name, const char **value)
+{
+	if (index >= iio_context_get_attrs_count(ctx))
+		return -EINVAL;
+
+	if (name)
+		*name = ctx_attrs[index][0];
+	if (value)
+		*value = index ? ctx_attrs[index][1] : ctx->uri;
+	return 0;
+}
+
+const char *iio_context_get_attr_value(const struct iio_context *ctx,
+				       const char *name)
+{
+	unsigned int k;
+
+	for (k = 0; k < iio_context_get_attrs_count(ctx); k++)
+		if (!strcmp(name, ctx_attrs[k][0]))
+			return k ? ctx_attrs[k][1] : ctx->uri;
+
+	return NULL;
+}
+
+unsigned int iio_context_get_devices_count(const struct iio_context *ctx)
+{
+	return SIM_NUM_DEVICES;
+}
+
+struct iio_device *iio_context_get_device(const struct iio_context *ctx,
+					  unsigned int index)
+{
+	if (index >= SIM_NUM_DEVICES)
+		return NULL;
+
+	return (struct iio_device *)&ctx->devs[index];
+}
+
+struct iio_device *iio_context_find_device(const struct iio_context *ctx,
+					   const char *name)
+{
+	int d;
+
+	for (d = 0; d < SIM_NUM_DEVICES; d++)
+		if (!strcmp(name, ctx->devs[d].id) ||
+		    !strcmp(name, sim_devices[d].name))
+			return (struct iio_device *)&ctx->devs[d];
+
+	return NULL;
+}
+
+int iio_context_set_timeout(struct iio_context *ctx, unsigned int timeout_ms)
+{
+	return 0;
+}
+
+const struct iio_context *iio_device_get_context(const struct iio_device *dev)
+{
+	return dev->ctx;
+}
+
+const char *iio_device_get_id(const struct iio_device *dev)
+{
+	return dev->id;
+}
+
+const char *iio_device_get_name(const struct iio_device *dev)
+{
+	return sim_devices[dev->num].name;
+}
+
+unsigned int iio_device_get_channels_count(const struct iio_device *dev)
+{
+	return dev->nchans;
+}
+
+struct iio_channel *iio_device_get_channel(const struct iio_device *dev,
+					   unsigned int index)
+{
+	if (index >= dev->nchans)
+		return NULL;
+
+	return (struct iio_channel *)&dev->chans[index];
+}
+
+struct iio_channel *iio_device_find_channel(const struct iio_device *dev,
+					    const char *name, bool output)
+{
+	unsigned int c;
+
+	for (c = 0; c < dev->nchans; c++) {
+		const struct sim_chan_desc *desc = dev->chans[c].desc;
+
+		if (desc->output == output &&
+		    (!strcmp(name, desc->id) ||
+		     (desc->ext && !strcmp(name, desc->ext))))
+			return (struct iio_channel *)&dev->chans[c];
+	}
+
+	return NULL;
+}
+
+ssize_t iio_device_attr_read(const struct iio_device *dev, const char *attr,
+			     char *dst, size_t len)
+{
+	return sim_attr_read(dev->num, attr, dst, len);
+}
+
+ssize_t iio_device_attr_write(const struct iio_device *dev, const char *attr,
+			      const char *src)
+{
+	return sim_attr_write(dev->num, attr, src, strlen(src));
+}
+
+static int parse_ll(const char *buf, ssize_t ret, long long *val)
+{
+	char *end;
+
+	if (ret < 0)
+		return (int)ret;
+
+	*val = strtoll(buf, &end, 0);
+	return end == buf ? -EINVAL : 0;
+}
+
+static int parse_double(const char *buf, ssize_t ret, double *val)
+{
+	char *end;
+
+	if (ret < 0)
+		return (int)ret;
+
+	*val = strtod(buf, &end);
+	return end == buf ? -EINVAL : 0;
+}
+
+static int write_ret(ssize_t ret)
+{
+	return ret < 0 ? (int)ret : 0;
+}
+
+int iio_device_attr_read_longlong(const struct iio_device *dev,
+				  const char *attr, long long *val)
+{
+	char buf[64];
+
+	return parse_ll(buf, iio_device_attr_read(dev, attr, buf, sizeof(buf)), val);
+}
+
+int iio_device_attr_read_double(const struct iio_device *dev,
+				const char *attr, double *val)
+{
+	char buf[64];
+
+	return parse_double(buf, iio_device_attr_read(dev, attr, buf, sizeof(buf)), val);
+}
+
+int iio_device_attr_write_longlong(const struct iio_device *dev,
+				   const char *attr, long long val)
+{
+	char buf[64];
+
+	snprintf(buf, sizeof(buf), "%lld", val);
+	return write_ret(iio_device_attr_write(dev, attr, buf));
+}
+
+int iio_device_attr_write_double(const struct iio_device *dev,
+				 const char *attr, double val)
+{
+	char buf[64];
+
+	snprintf(buf, sizeof(buf), "%f", val);
+	return write_ret(iio_device_attr_write(dev, attr, buf));
+}
+
+int iio_device_set_kernel_buffers_count(const struct iio_device *dev,
+					unsigned int nb_buffers)
+{
+	if (!nb_buffers)
+		return -EINVAL;
+
+	((struct iio_device *)dev)->kernel_buffers = nb_buffers;
+	return 0;
+}
+
+ssize_t iio_device_get_sample_size(const struct iio_device *dev)
+{
+	ssize_t size = 0;
+	unsigned int c;
+
+	for (c = 0; c < dev->nchans; c++)
+		if (dev->chans[c].enabled)
+			size += sizeof(int16_t);
+
+	return size ? size : -EINVAL;
+}
+
+const struct iio_device *iio_channel_get_device(const struct iio_channel *chn)
+{
+	return chn->dev;
+}
+
+const char *iio_channel_get_id(const struct iio_channel *chn)
+{
+	return chn->desc->id;
+}
+
+const char *iio_channel_get_name(const struct iio_channel *chn)
+{
+	return chn->desc->ext;
+}
+
+bool iio_channel_is_output(const struct iio_channel *chn)
+{
+	return chn->desc->output;
+}
+
+bool iio_channel_is_scan_element(const struct iio_channel *chn)
+{
+	return chn->desc->scan_index >= 0;
+}
+
+long iio_channel_get_index(const struct iio_channel *chn)
+{
+	return chn->desc->scan_index;
+}
+
+ssize_t iio_channel_attr_read(const struct iio_channel *chn, const char *attr,
+			      char *dst, size_t len)
+{
+	char file[SIM_PATH_MAX];
+	int ret;
+
+	ret = sim_chan_attr_file(file, sizeof(file), chn->desc, attr);
+	if (ret)
+		return ret;
+
+	return sim_attr_read(chn->dev->num, file, dst, len);
+}
+
+ssize_t iio_channel_attr_write(const struct iio_channel *chn, const char *attr,
+			       const char *src)
+{
+	char file[SIM_PATH_MAX];
+	int ret;
+
+	ret = sim_chan_attr_file(file, sizeof(file), chn->desc, attr);
+	if (ret)
+		return ret;
+
+	return sim_attr_write(chn->dev->num, file, src, strlen(src));
+}
+
+int iio_channel_attr_read_longlong(const struct iio_channel *chn,
+				   const char *attr, long long *val)
+{
+	char buf[64];
+
+	return parse_ll(buf, iio_channel_attr_read(chn, attr, buf, sizeof(buf)), val);
+}
+
+int iio_channel_attr_read_double(const struct iio_channel *chn,
+				 const char *attr, double *val)
+{
+	char buf[64];
+
+	return parse_double(buf, iio_channel_attr_read(chn, attr, buf, sizeof(buf)), val);
+}
+
+int iio_channel_attr_read_bool(const struct iio_channel *chn,
+			       const char *attr, bool *val)
+{
+	long long ll;
+	int ret;
+
+	ret = iio_channel_attr_read_longlong(chn, attr, &ll);
+	if (!ret)
+		*val = !!ll;
+	return ret;
+}
+
+int iio_channel_attr_write_longlong(const struct iio_channel *chn,
+				    const char *attr, long long val)
+{
+	char buf[64];
+
+	snprintf(buf, sizeof(buf), "%lld", val);
+	return write_ret(iio_channel_attr_write(chn, attr, buf));
+}
+
+int iio_channel_attr_write_double(const struct iio_channel *chn,
+				  const char *attr, double val)
+{
+	char buf[64];
+
+	snprintf(buf, sizeof(buf), "%f", val);
+	return write_ret(iio_channel_attr_write(chn, attr, buf));
+}
+
+int iio_channel_attr_write_bool(const struct iio_channel *chn,
+				const char *attr, bool val)
+{
+	return iio_channel_attr_write_longlong(chn, attr, val);
+}
+
+/* Mirror the scan element state in the device tree for the sysfs users */
+static void channel_set_enabled(struct iio_channel *chn, bool en)
+{
+	char file[SIM_PATH_MAX];
+
+	if (chn->desc->scan_index < 0)
+		return;
+
+	chn->enabled = en;
+	snprintf(file, sizeof(file), "scan_elements/%s_%s_en",
+		 chn->desc->output ? "out" : "in", chn->desc->id);
+	sim_attr_write(chn->dev->num, file, en ? "1" : "0", 1);
+}
+
+void iio_channel_enable(struct iio_channel *chn)
+{
+	channel_set_enabled(chn, true);
+}
+
+void iio_channel_disable(struct iio_channel *chn)
+{
+	channel_set_enabled(chn, false);
+}
+
+bool iio_channel_is_enabled(const struct iio_channel *chn)
+{
+	return chn->enabled;
+}
+
+const struct iio_device *iio_buffer_get_device(const struct iio_buffer *buf)
+{
+	return buf->dev;
+}
+
+struct iio_buffer *iio_device_create_buffer(const struct iio_device *dev,
+					    size_t samples_count, bool cyclic)
+{
+	ssize_t sample_size = iio_device_get_sample_size(dev);
+	struct iio_buffer *buf;
+	int err = ENOMEM;
+
+	/* Only the streaming cores have buffers, and I/Q comes in pairs */
+	if (dev->num == SIM_PHY || !samples_count || sample_size < 0 ||
+	    sample_size % (2 * sizeof(int16_t))) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	buf = calloc(1, sizeof(*buf));
+	if (!buf)
+		goto err;
+
+	buf->dev = dev;
+	buf->samples = samples_count;
+	buf->sample_size = sample_size;
+	buf->stride = sample_size / sizeof(int16_t);
+	buf->output = dev->num == SIM_TX;
+	buf->cyclic = cyclic;
+	buf->blocking = true;
+	buf->poll_fd = -1;
+	buf->timer_fd = -1;
+	buf->pipe_rd = -1;
+	buf->pacer.depth = dev->kernel_buffers;
+
+	buf->data = calloc(samples_count, sample_size);
+	if (!buf->data)
+		goto err_free;
+
+	buf->ring = sim_ring_map();
+	if (!buf->ring) {
+		err = errno;
+		goto err_free;
+	}
+
+	sim_attr_write(dev->num, "buffer/enable", "1", 1);
+	return buf;
+
+err_free:
+	free(buf->data);
+	free(buf);
+err:
+	errno = err;
+	return NULL;
+}
+
+/* Stop the TX poll thread and close the poll fds */
+static void buffer_close_poll(struct iio_buffer *buf)
+{
+	struct itimerspec now = { .it_value = { .tv_nsec = 1 } };
+
+	if (buf->poll_running) {
+		pthread_mutex_lock(&buf->poll_lock);
+		buf->poll_quit = true;
+		timerfd_settime(buf->timer_fd, 0, &now, NULL);
+		pthread_mutex_unlock(&buf->poll_lock);
+		pthread_join(buf->poll_thread, NULL);
+		pthread_mutex_destroy(&buf->poll_lock);
+		buf->poll_running = false;
+	}
+	if (buf->poll_fd >= 0 && buf->poll_fd != buf->timer_fd)
+		close(buf->poll_fd);
+	if (buf->pipe_rd >= 0)
+		close(buf->pipe_rd);
+	if (buf->timer_fd >= 0)
+		close(buf->timer_fd);
+	buf->poll_fd = buf->timer_fd = buf->pipe_rd = -1;
+}
+
+void iio_buffer_destroy(struct iio_buffer *buf)
+{
+	if (!buf)
+		return;
+
+	sim_attr_write(buf->dev->num, "buffer/enable", "0", 1);
+	if (buf->pacer.blocks)
+		fprintf(stderr, "iio-sim: %s: %llu blocks of %zu samples, %llu %s\n",
+			sim_devices[buf->dev->num].name, buf->pacer.blocks,
+			buf->samples, buf->pacer.xruns,
+			buf->output ? "underflows" : "overflows");
+	if (buf->pacer.faults)
+		fprintf(stderr, "iio-sim: %s: %llu faults injected\n",
+			sim_devices[buf->dev->num].name, buf->pacer.faults);
+
+	buffer_close_poll(buf);
+	free(buf->data);
+	free(buf);
+}
+
+/* TX: fill the pipe, so the poll fd is not writable */
+static void buffer_fill_pipe(struct iio_buffer *buf)
+{
+	static const char fill[4096];
+
+	while (write(buf->poll_fd, fill, sizeof(fill)) > 0)
+		;
+}
+
+/* TX: empty it again, so the poll fd is writable */
+static void buffer_drain_pipe(struct iio_buffer *buf)
+{
+	char drain[4096];
+
+	while (read(buf->pipe_rd, drain, sizeof(drain)) > 0)
+		;
+}
+
+/* Expire the poll fd when the next block can move */
+static void buffer_arm_poll(struct iio_buffer *buf, size_t samples)
+{
+	struct itimerspec t = { .it_value = { .tv_nsec = 1 } };
+	int64_t ready;
+
+	if (buf->poll_fd < 0)
+		return;
+
+	ready = sim_pace_ready(&buf->pacer, sim_sample_rate(buf->output ? SIM_TX : SIM_RX),
+			       buf->output, samples);
+	if (ready > 0) {
+		t.it_value.tv_sec = ready / 1000000000LL;
+		t.it_value.tv_nsec = ready % 1000000000LL;
+	}
+
+	/* Rearming drops an expiry the poll thread has not acted on yet */
+	if (buf->output) {
+		pthread_mutex_lock(&buf->poll_lock);
+		buffer_fill_pipe(buf);
+	}
+	timerfd_settime(buf->timer_fd, TFD_TIMER_ABSTIME, &t, NULL);
+	if (buf->output)
+		pthread_mutex_unlock(&buf->poll_lock);
+}
+
+/* TX: empty the pipe, so the poll fd is writable, once the timer expires */
+static void *buffer_poll_thread(void *arg)
+{
+	struct iio_buffer *buf = arg;
+	struct pollfd pfd = { .fd = buf->timer_fd, .events = POLLIN };
+	uint64_t expired;
+	bool quit = false;
+
+	while (!quit) {
+		if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+			break;
+		pthread_mutex_lock(&buf->poll_lock);
+		quit = buf->poll_quit;
+		if (!quit && read(buf->timer_fd, &expired, sizeof(expired)) == sizeof(expired))
+			buffer_drain_pipe(buf);
+		pthread_mutex_unlock(&buf->poll_lock);
+	}
+
+	return NULL;
+}
+
+/*
+ * The real poll fd is the device file. Here an RX buffer's is a timer,
+ * readable once the next refill would not block. A TX buffer's is the
+ * write end of a one page pipe, kept full and emptied by a thread once
+ * the next push would not block, so it is writable like the device file.
+ */
+int iio_buffer_get_poll_fd(struct iio_buffer *buf)
+{
+	int fds[2], ret;
+
+	if (buf->poll_fd >= 0)
+		return buf->poll_fd;
+
+	buf->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (buf->timer_fd < 0)
+		return -errno;
+	if (!buf->output) {
+		buf->poll_fd = buf->timer_fd;
+		buffer_arm_poll(buf, buf->samples);
+		return buf->poll_fd;
+	}
+
+	if (pipe2(fds, O_NONBLOCK | O_CLOEXEC)) {
+		ret = -errno;
+		buffer_close_poll(buf);
+		return ret;
+	}
+	buf->pipe_rd = fds[0];
+	buf->poll_fd = fds[1];
+	fcntl(buf->poll_fd, F_SETPIPE_SZ, 4096);
+	pthread_mutex_init(&buf->poll_lock, NULL);
+	buffer_arm_poll(buf, buf->samples);
+
+	ret = pthread_create(&buf->poll_thread, NULL, buffer_poll_thread, buf);
+	if (ret) {
+		pthread_mutex_destroy(&buf->poll_lock);
+		buffer_close_poll(buf);
+		return -ret;
+	}
+	buf->poll_running = true;
+
+	return buf->poll_fd;
+}
+
+int iio_buffer_set_blocking_mode(struct iio_buffer *buf, bool blocking)
+{
+	buf->blocking = blocking;
+	return 0;
+}
+
+void iio_buffer_cancel(struct iio_buffer *buf)
+{
+	buf->cancelled = true;
+}
+
+ssize_t iio_buffer_push_partial(struct iio_buffer *buf, size_t samples_count)
+{
+	double fs = sim_sample_rate(SIM_TX);
+	int64_t start;
+	int ret;
+
+	if (!buf->output || samples_count > buf->samples)
+		return -EINVAL;
+	if (buf->cancelled)
+		return -EBADF;
+
+	ret = sim_pace(&buf->pacer, fs, true, samples_count, buf->blocking, &start);
+	buffer_arm_poll(buf, samples_count);
+	if (ret)
+		return ret;
+
+	sim_tx_write(buf->ring, sim_ring_pos(buf->ring, start, fs), buf->data,
+		     buf->stride, samples_count);
+
+	return samples_count * buf->sample_size;
+}
+
+ssize_t iio_buffer_push(struct iio_buffer *buf)
+{
+	return iio_buffer_push_partial(buf, buf->samples);
+}
+
+ssize_t iio_buffer_refill(struct iio_buffer *buf)
+{
+	double fs = sim_sample_rate(SIM_RX);
+	int64_t start;
+	int ret;
+
+	if (buf->output)
+		return -EINVAL;
+	if (buf->cancelled)
+		return -EBADF;
+
+	ret = sim_pace(&buf->pacer, fs, false, buf->samples, buf->blocking, &start);
+	buffer_arm_poll(buf, buf->samples);
+	if (ret)
+		return ret;
+
+	sim_rx_fill(&buf->rx, buf->ring, sim_ring_pos(buf->ring, start, fs),
+		    buf->data, buf->stride, buf->samples);
+
+	return buf->samples * buf->sample_size;
+}
+
+void *iio_buffer_start(const struct iio_buffer *buf)
+{
+	return buf->data;
+}
+
+void *iio_buffer_first(const struct iio_buffer *buf, const struct iio_channel *chn)
+{
+	const struct iio_device *dev = buf->dev;
+	char *p = buf->data;
+	unsigned int c;
+
+	for (c = 0; c < dev->nchans && &dev->chans[c] != chn; c++)
+		if (dev->chans[c].enabled)
+			p += sizeof(int16_t);
+
+	return p;
+}
+
+ptrdiff_t iio_buffer_step(const struct iio_buffer *buf)
+{
+	return buf->sample_size;
+}
+
+void *iio_buffer_end(const struct iio_buffer *buf)
+{
+	return (char *)buf->data + buf->samples * buf->sample_size;
+}
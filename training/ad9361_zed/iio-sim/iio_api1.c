@@ -0,0 +1,652 @@
+/**
+ * Simulated AD9361 on FMCOMMS2 - libiio 1.x front-end
+ *
+ * Built as libiio.so.1 for the libiio 1.x tools (setup/ad9361-iiostream).
+ * The devices and channels are the same as in the 0.x front-end;
+ * attributes are looked up as objects, channels are enabled in masks, and
+ * samples move through streams of blocks. All blocks of a stream but the
+ * one the application holds are in flight in the kernel, so that is the
+ * pacing depth.
+ *
+ * Licensed under the GPL-2.
+ *
+ **/
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <iio/iio.h>
+#include "sim.h"
+
+#define SIM_MAX_CHANS	8
+#define SIM_ATTR_MAX	64
+
+struct iio_attr {
+	const struct iio_device *dev;
+	const struct iio_channel *chn;	/* NULL for device attributes */
+	char name[SIM_ATTR_MAX];
+	struct iio_attr *next;
+};
+
+struct iio_channel {
+	struct iio_device *dev;
+	const struct sim_chan_desc *desc;
+	unsigned int num;
+	struct iio_attr *attrs;
+};
+
+struct iio_device {
+	struct iio_context *ctx;
+	int num;
+	char id[16];
+	struct iio_channel chans[SIM_MAX_CHANS];
+	unsigned int nchans;
+	struct iio_attr *attrs;
+};
+
+struct iio_context {
+	struct iio_device devs[SIM_NUM_DEVICES];
+};
+
+struct iio_channels_mask {
+	unsigned int nb;
+	uint32_t bits;
+};
+
+struct iio_buffer {
+	const struct iio_device *dev;
+	struct iio_channels_mask mask;
+	size_t sample_size;
+	struct iio_stream *stream;
+	bool cancelled;
+};
+
+/**
+ * struct iio_block - one DMA block of a stream
+ * @data: @samples samples of the buffer's sample size
+ **/
+struct iio_block {
+	struct iio_stream *stream;
+	void *data;
+};
+
+/**
+ * struct iio_stream - blocks cycled through the DMA queue
+ * @curr: block handed to the application, -1 before the first one
+ *
+ * A TX block is queued when the next one is requested; an RX block is
+ * captured when it is requested.
+ **/
+struct iio_stream {
+	struct iio_buffer *buf;
+	struct iio_block *blocks;
+	size_t nb_blocks;
+	size_t samples;
+	long curr;
+	struct sim_ring *ring;
+	struct sim_pacer pacer;
+	struct sim_rx rx;
+};
+
+void iio_strerror(int err, char *dst, size_t len)
+{
+	snprintf(dst, len, "%s", strerror(err));
+}
+
+struct iio_context *iio_create_context(const struct iio_context_params *params,
+				       const char *uri)
+{
+	struct iio_context *ctx;
+	unsigned int d, c;
+	int ret;
+
+	if (uri && strncmp(uri, "local:", 6))
+		return iio_ptr(-ENOSYS);
+
+	ret = sim_setup();
+	if (ret)
+		return iio_ptr(ret);
+
+	ctx = calloc(1, sizeof(*ctx));
+	if (!ctx)
+		return iio_ptr(-ENOMEM);
+
+	for (d = 0; d < SIM_NUM_DEVICES; d++) {
+		struct iio_device *dev = &ctx->devs[d];
+
+		dev->ctx = ctx;
+		dev->num = d;
+		snprintf(dev->id, sizeof(dev->id), "iio:device%u", d);
+		dev->nchans = sim_devices[d].nchans;
+		for (c = 0; c < dev->nchans; c++) {
+			dev->chans[c].dev = dev;
+			dev->chans[c].desc = &sim_devices[d].chans[c];
+			dev->chans[c].num = c;
+		}
+	}
+
+	return ctx;
+}
+
+static void free_attrs(struct iio_attr *attr)
+{
+	while (attr) {
+		struct iio_attr *next = attr->next;
+
+		free(attr);
+		attr = next;
+	}
+}
+
+void iio_context_destroy(struct iio_context *ctx)
+{
+	unsigned int d, c;
+
+	if (!ctx)
+		return;
+
+	for (d = 0; d < SIM_NUM_DEVICES; d++) {
+		free_attrs(ctx->devs[d].attrs);
+		for (c = 0; c < ctx->devs[d].nchans; c++)
+			free_attrs(ctx->devs[d].chans[c].attrs);
+	}
+	free(ctx);
+}
+
+const char *iio_context_get_name(const struct iio_context *ctx)
+{
+	return "local";
+}
+
+unsigned int iio_context_get_devices_count(const struct iio_context *ctx)
+{
+	return SIM_NUM_DEVICES;
+}
+
+struct iio_device *iio_context_get_device(const struct iio_context *ctx,
+					  unsigned int index)
+{
+	if (index >= SIM_NUM_DEVICES)
+		return NULL;
+
+	return (struct iio_device *)&ctx->devs[index];
+}
+
+struct iio_device *iio_context_find_device(const struct iio_context *ctx,
+					   const char *name)
+{
+	int d;
+
+	for (d = 0; d < SIM_NUM_DEVICES; d++)
+		if (!strcmp(name, ctx->devs[d].id) ||
+		    !strcmp(name, sim_devices[d].name))
+			return (struct iio_device *)&ctx->devs[d];
+
+	return NULL;
+}
+
+const struct iio_context *iio_device_get_context(const struct iio_device *dev)
+{
+	return dev->ctx;
+}
+
+const char *iio_device_get_id(const struct iio_device *dev)
+{
+	return dev->id;
+}
+
+const char *iio_device_get_name(const struct iio_device *dev)
+{
+	return sim_devices[dev->num].name;
+}
+
+unsigned int iio_device_get_channels_count(const struct iio_device *dev)
+{
+	return dev->nchans;
+}
+
+struct iio_channel *iio_device_get_channel(const struct iio_device *dev,
+					   unsigned int index)
+{
+	if (index >= dev->nchans)
+		return NULL;
+
+	return (struct iio_channel *)&dev->chans[index];
+}
+
+struct iio_channel *iio_device_find_channel(const struct iio_device *dev,
+					    const char *name, bool output)
+{
+	unsigned int c;
+
+	for (c = 0; c < dev->nchans; c++) {
+		const struct sim_chan_desc *desc = dev->chans[c].desc;
+
+		if (desc->output == output &&
+		    (!strcmp(name, desc->id) ||
+		     (desc->ext && !strcmp(name, desc->ext))))
+			return (struct iio_channel *)&dev->chans[c];
+	}
+
+	return NULL;
+}
+
+/*
+ * Attribute objects are created on first lookup and live as long as the
+ * context. Any name is accepted, as the device tree only holds the
+ * attributes that have a value.
+ */
+static const struct iio_attr *find_attr(struct iio_attr **list,
+					const struct iio_device *dev,
+					const struct iio_channel *chn,
+					const char *name)
+{
+	struct iio_attr *attr;
+
+	if (!name || !*name || strlen(name) >= SIM_ATTR_MAX)
+		return NULL;
+
+	for (attr = *list; attr; attr = attr->next)
+		if (!strcmp(attr->name, name))
+			return attr;
+
+	attr = calloc(1, sizeof(*attr));
+	if (!attr)
+		return NULL;
+	attr->dev = dev;
+	attr->chn = chn;
+	strcpy(attr->name, name);
+	attr->next = *list;
+	*list = attr;
+
+	return attr;
+}
+
+const struct iio_attr *iio_device_find_attr(const struct iio_device *dev,
+					    const char *name)
+{
+	struct iio_device *d = (struct iio_device *)dev;
+
+	return find_attr(&d->attrs, dev, NULL, name);
+}
+
+const struct iio_attr *iio_channel_find_attr(const struct iio_channel *chn,
+					     const char *name)
+{
+	struct iio_channel *c = (struct iio_channel *)chn;
+
+	return find_attr(&c->attrs, chn->dev, chn, name);
+}
+
+const char *iio_attr_get_name(const struct iio_attr *attr)
+{
+	return attr->name;
+}
+
+static int attr_file(const struct iio_attr *attr, char *file, size_t len)
+{
+	if (!attr->chn) {
+		snprintf(file, len, "%s", attr->name);
+		return 0;
+	}
+
+	return sim_chan_attr_file(file, len, attr->chn->desc, attr->name);
+}
+
+ssize_t iio_attr_read_raw(const struct iio_attr *attr, char *dst, size_t len)
+{
+	char file[SIM_PATH_MAX];
+	int ret;
+
+	ret = attr_file(attr, file, sizeof(file));
+	if (ret)
+		return ret;
+
+	return sim_attr_read(attr->dev->num, file, dst, len);
+}
+
+ssize_t iio_attr_write_raw(const struct iio_attr *attr, const void *src,
+			   size_t len)
+{
+	char file[SIM_PATH_MAX];
+	int ret;
+
+	ret = attr_file(attr, file, sizeof(file));
+	if (ret)
+		return ret;
+
+	return sim_attr_write(attr->dev->num, file, src, len);
+}
+
+ssize_t iio_attr_write_string(const struct iio_attr *attr, const char *src)
+{
+	return iio_attr_write_raw(attr, src, strlen(src));
+}
+
+int iio_attr_read_longlong(const struct iio_attr *attr, long long *val)
+{
+	char buf[64], *end;
+	ssize_t ret = iio_attr_read_raw(attr, buf, sizeof(buf));
+
+	if (ret < 0)
+		return (int)ret;
+
+	*val = strtoll(buf, &end, 0);
+	return end == buf ? -EINVAL : 0;
+}
+
+int iio_attr_read_double(const struct iio_attr *attr, double *val)
+{
+	char buf[64], *end;
+	ssize_t ret = iio_attr_read_raw(attr, buf, sizeof(buf));
+
+	if (ret < 0)
+		return (int)ret;
+
+	*val = strtod(buf, &end);
+	return end == buf ? -EINVAL : 0;
+}
+
+int iio_attr_read_bool(const struct iio_attr *attr, bool *val)
+{
+	long long ll;
+	int ret = iio_attr_read_longlong(attr, &ll);
+
+	if (!ret)
+		*val = !!ll;
+	return ret;
+}
+
+int iio_attr_write_longlong(const struct iio_attr *attr, long long val)
+{
+	char buf[64];
+	ssize_t ret;
+
+	snprintf(buf, sizeof(buf), "%lld", val);
+	ret = iio_attr_write_string(attr, buf);
+	return ret < 0 ? (int)ret : 0;
+}
+
+int iio_attr_write_double(const struct iio_attr *attr, double val)
+{
+	char buf[64];
+	ssize_t ret;
+
+	snprintf(buf, sizeof(buf), "%f", val);
+	ret = iio_attr_write_string(attr, buf);
+	return ret < 0 ? (int)ret : 0;
+}
+
+int iio_attr_write_bool(const struct iio_attr *attr, bool val)
+{
+	return iio_attr_write_longlong(attr, val);
+}
+
+const struct iio_device *iio_channel_get_device(const struct iio_channel *chn)
+{
+	return chn->dev;
+}
+
+const char *iio_channel_get_id(const struct iio_channel *chn)
+{
+	return chn->desc->id;
+}
+
+bool iio_channel_is_output(const struct iio_channel *chn)
+{
+	return chn->desc->output;
+}
+
+long iio_channel_get_index(const struct iio_channel *chn)
+{
+	return chn->desc->scan_index;
+}
+
+struct iio_channels_mask *iio_create_channels_mask(unsigned int nb_channels)
+{
+	struct iio_channels_mask *mask;
+
+	if (nb_channels > 32)
+		return NULL;
+
+	mask = calloc(1, sizeof(*mask));
+	if (mask)
+		mask->nb = nb_channels;
+	return mask;
+}
+
+void iio_channels_mask_destroy(struct iio_channels_mask *mask)
+{
+	free(mask);
+}
+
+void iio_channel_enable(const struct iio_channel *chn,
+			struct iio_channels_mask *mask)
+{
+	if (chn->desc->scan_index >= 0 && chn->num < mask->nb)
+		mask->bits |= 1u << chn->num;
+}
+
+void iio_channel_disable(const struct iio_channel *chn,
+			 struct iio_channels_mask *mask)
+{
+	if (chn->num < mask->nb)
+		mask->bits &= ~(1u << chn->num);
+}
+
+bool iio_channel_is_enabled(const struct iio_channel *chn,
+			    const struct iio_channels_mask *mask)
+{
+	return chn->num < mask->nb && (mask->bits & (1u << chn->num));
+}
+
+ssize_t iio_device_get_sample_size(const struct iio_device *dev,
+				   const struct iio_channels_mask *mask)
+{
+	ssize_t size = 0;
+	unsigned int c;
+
+	for (c = 0; c < dev->nchans; c++)
+		if (iio_channel_is_enabled(&dev->chans[c], mask))
+			size += sizeof(int16_t);
+
+	return size ? size : -EINVAL;
+}
+
+/* Mirror the scan element state in the device tree for the sysfs users */
+static void write_scan_elements(const struct iio_device *dev,
+				const struct iio_channels_mask *mask)
+{
+	char file[SIM_PATH_MAX];
+	unsigned int c;
+
+	for (c = 0; c < dev->nchans; c++) {
+		const struct sim_chan_desc *desc = dev->chans[c].desc;
+		bool en = mask && iio_channel_is_enabled(&dev->chans[c], mask);
+
+		if (desc->scan_index < 0)
+			continue;
+		snprintf(file, sizeof(file), "scan_elements/%s_%s_en",
+			 desc->output ? "out" : "in", desc->id);
+		sim_attr_write(dev->num, file, en ? "1" : "0", 1);
+	}
+}
+
+struct iio_buffer *iio_device_create_buffer(const struct iio_device *dev,
+					    unsigned int idx,
+					    const struct iio_channels_mask *mask)
+{
+	ssize_t sample_size = iio_device_get_sample_size(dev, mask);
+	struct iio_buffer *buf;
+
+	/* Only the streaming cores have buffers, and I/Q comes in pairs */
+	if (dev->num == SIM_PHY || idx || sample_size < 0 ||
+	    sample_size % (2 * sizeof(int16_t)))
+		return iio_ptr(-EINVAL);
+
+	buf = calloc(1, sizeof(*buf));
+	if (!buf)
+		return iio_ptr(-ENOMEM);
+
+	buf->dev = dev;
+	buf->mask = *mask;
+	buf->sample_size = sample_size;
+	write_scan_elements(dev, mask);
+
+	return buf;
+}
+
+void iio_buffer_destroy(struct iio_buffer *buf)
+{
+	if (!buf)
+		return;
+
+	write_scan_elements(buf->dev, NULL);
+	free(buf);
+}
+
+void iio_buffer_cancel(struct iio_buffer *buf)
+{
+	buf->cancelled = true;
+}
+
+const struct iio_device *iio_buffer_get_device(const struct iio_buffer *buf)
+{
+	return buf->dev;
+}
+
+struct iio_stream *iio_buffer_create_stream(struct iio_buffer *buf,
+					    size_t nb_blocks,
+					    size_t samples_count)
+{
+	struct iio_stream *stream;
+	size_t k;
+
+	if (!nb_blocks || !samples_count || buf->stream)
+		return iio_ptr(-EINVAL);
+
+	stream = calloc(1, sizeof(*stream));
+	if (!stream)
+		return iio_ptr(-ENOMEM);
+
+	stream->buf = buf;
+	stream->nb_blocks = nb_blocks;
+	stream->samples = samples_count;
+	stream->curr = -1;
+	stream->pacer.depth = nb_blocks > 1 ? nb_blocks - 1 : 1;
+
+	stream->blocks = calloc(nb_blocks, sizeof(*stream->blocks));
+	if (!stream->blocks)
+		goto err_free;
+	for (k = 0; k < nb_blocks; k++) {
+		stream->blocks[k].stream = stream;
+		stream->blocks[k].data = calloc(samples_count, buf->sample_size);
+		if (!stream->blocks[k].data)
+			goto err_free;
+	}
+
+	stream->ring = sim_ring_map();
+	if (!stream->ring)
+		goto err_free;
+
+	buf->stream = stream;
+	sim_attr_write(buf->dev->num, "buffer/enable", "1", 1);
+	return stream;
+
+err_free:
+	for (k = 0; stream->blocks && k < nb_blocks; k++)
+		free(stream->blocks[k].data);
+	free(stream->blocks);
+	free(stream);
+	return iio_ptr(-ENOMEM);
+}
+
+void iio_stream_destroy(struct iio_stream *stream)
+{
+	struct iio_buffer *buf;
+	size_t k;
+
+	if (!stream)
+		return;
+
+	buf = stream->buf;
+	sim_attr_write(buf->dev->num, "buffer/enable", "0", 1);
+	if (stream->pacer.blocks)
+		fprintf(stderr, "iio-sim: %s: %llu blocks of %zu samples, %llu %s\n",
+			sim_devices[buf->dev->num].name, stream->pacer.blocks,
+			stream->samples, stream->pacer.xruns,
+			buf->dev->num == SIM_TX ? "underflows" : "overflows");
+	if (stream->pacer.faults)
+		fprintf(stderr, "iio-sim: %s: %llu faults injected\n",
+			sim_devices[buf->dev->num].name, stream->pacer.faults);
+
+	for (k = 0; k < stream->nb_blocks; k++)
+		free(stream->blocks[k].data);
+	free(stream->blocks);
+	buf->stream = NULL;
+	free(stream);
+}
+
+const struct iio_block *iio_stream_get_next_block(struct iio_stream *stream)
+{
+	struct iio_buffer *buf = stream->buf;
+	bool output = buf->dev->num == SIM_TX;
+	double fs = sim_sample_rate(buf->dev->num);
+	size_t stride = buf->sample_size / sizeof(int16_t);
+	struct iio_block *block;
+	int64_t start;
+	int ret;
+
+	if (buf->cancelled)
+		return iio_ptr(-EBADF);
+
+	if (output && stream->curr >= 0) {
+		block = &stream->blocks[stream->curr];
+		ret = sim_pace(&stream->pacer, fs, true, stream->samples, true, &start);
+		if (ret)
+			return iio_ptr(ret);
+		sim_tx_write(stream->ring, sim_ring_pos(stream->ring, start, fs),
+			     block->data, stride, stream->samples);
+	}
+
+	stream->curr = (stream->curr + 1) % (long)stream->nb_blocks;
+	block = &stream->blocks[stream->curr];
+
+	if (!output) {
+		ret = sim_pace(&stream->pacer, fs, false, stream->samples, true, &start);
+		if (ret)
+			return iio_ptr(ret);
+		sim_rx_fill(&stream->rx, stream->ring, sim_ring_pos(stream->ring, start, fs),
+			    block->data, stride, stream->samples);
+	}
+
+	return block;
+}
+
+void *iio_block_start(const struct iio_block *block)
+{
+	return block->data;
+}
+
+void *iio_block_first(const struct iio_block *block,
+		      const struct iio_channel *chn)
+{
+	const struct iio_buffer *buf = block->stream->buf;
+	char *p = block->data;
+	unsigned int c;
+
+	for (c = 0; c < chn->num; c++)
+		if (iio_channel_is_enabled(&buf->dev->chans[c], &buf->mask))
+			p += sizeof(int16_t);
+
+	return p;
+}
+
+void *iio_block_end(const struct iio_block *block)
+{
+	const struct iio_stream *stream = block->stream;
+
+	return (char *)block->data + stream->samples * stream->buf->sample_size;
+}
@@ -0,0 +1,143 @@
+/**
+ * Simulated AD9361 on FMCOMMS2 - libiio 0.x API
+ *
+ * The subset of the libiio 0.x interface that iio-sim implements, with the
+ * same prototypes as the real <iio.h>, so the tx-fm tools build against
+ * either one (make SIM=1) and run against either libiio.so.0.
+ *
+ * Licensed under the GPL-2.
+ *
+ **/
+
+#ifndef __IIO_H__
+#define __IIO_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define __api __attribute__((visibility("default")))
+#define __check_ret __attribute__((warn_unused_result))
+#define __pure __attribute__((pure))
+
+struct iio_context;
+struct iio_device;
+struct iio_channel;
+struct iio_buffer;
+
+/* Library */
+__api void iio_library_get_version(unsigned int *major,
+		unsigned int *minor, char git_tag[8]);
+__api void iio_strerror(int err, char *dst, size_t len);
+
+/* Context */
+__api __check_ret struct iio_context * iio_create_default_context(void);
+__api __check_ret struct iio_context * iio_create_local_context(void);
+__api __check_ret struct iio_context * iio_create_context_from_uri(const char *uri);
+__api void iio_context_destroy(struct iio_context *ctx);
+__api __check_ret __pure const char * iio_context_get_name(
+		const struct iio_context *ctx);
+__api __check_ret __pure const char * iio_context_get_description(
+		const struct iio_context *ctx);
+__api __check_ret __pure unsigned int iio_context_get_attrs_count(
+		const struct iio_context *ctx);
+__api __check_ret int iio_context_get_attr(
+		const struct iio_context *ctx, unsigned int index,
+		const char **name, const char **value);
+__api __check_ret const char * iio_context_get_attr_value(
+		const struct iio_context *ctx, const char *name);
+__api __check_ret __pure unsigned int iio_context_get_devices_count(
+		const struct iio_context *ctx);
+__api __check_ret __pure struct iio_device * iio_context_get_device(
+		const struct iio_context *ctx, unsigned int index);
+__api __check_ret __pure struct iio_device * iio_context_find_device(
+		const struct iio_context *ctx, const char *name);
+__api __check_ret int iio_context_set_timeout(
+		struct iio_context *ctx, unsigned int timeout_ms);
+
+/* Device */
+__api __check_ret __pure const struct iio_context * iio_device_get_context(
+		const struct iio_device *dev);
+__api __check_ret __pure const char * iio_device_get_id(const struct iio_device *dev);
+__api __check_ret __pure const char * iio_device_get_name(const struct iio_device *dev);
+__api __check_ret __pure unsigned int iio_device_get_channels_count(
+		const struct iio_device *dev);
+__api __check_ret __pure struct iio_channel * iio_device_get_channel(
+		const struct iio_device *dev, unsigned int index);
+__api __check_ret __pure struct iio_channel * iio_device_find_channel(
+		const struct iio_device *dev, const char *name, bool output);
+__api __check_ret ssize_t iio_device_attr_read(const struct iio_device *dev,
+		const char *attr, char *dst, size_t len);
+__api __check_ret int iio_device_attr_read_longlong(const struct iio_device *dev,
+		const char *attr, long long *val);
+__api __check_ret int iio_device_attr_read_double(const struct iio_device *dev,
+		const char *attr, double *val);
+__api __check_ret ssize_t iio_device_attr_write(const struct iio_device *dev,
+		const char *attr, const char *src);
+__api __check_ret int iio_device_attr_write_longlong(const struct iio_device *dev,
+		const char *attr, long long val);
+__api __check_ret int iio_device_attr_write_double(const struct iio_device *dev,
+		const char *attr, double val);
+__api __check_ret int iio_device_set_kernel_buffers_count(const struct iio_device *dev,
+		unsigned int nb_buffers);
+__api __check_ret ssize_t iio_device_get_sample_size(const struct iio_device *dev);
+
+/* Channel */
+__api __check_ret __pure const struct iio_device * iio_channel_get_device(
+		const struct iio_channel *chn);
+__api __check_ret __pure const char * iio_channel_get_id(const struct iio_channel *chn);
+__api __check_ret __pure const char * iio_channel_get_name(const struct iio_channel *chn);
+__api __check_ret __pure bool iio_channel_is_output(const struct iio_channel *chn);
+__api __check_ret __pure bool iio_channel_is_scan_element(const struct iio_channel *chn);
+__api __check_ret __pure long iio_channel_get_index(const struct iio_channel *chn);
+__api __check_ret ssize_t iio_channel_attr_read(const struct iio_channel *chn,
+		const char *attr, char *dst, size_t len);
+__api __check_ret int iio_channel_attr_read_bool(const struct iio_channel *chn,
+		const char *attr, bool *val);
+__api __check_ret int iio_channel_attr_read_longlong(const struct iio_channel *chn,
+		const char *attr, long long *val);
+__api __check_ret int iio_channel_attr_read_double(const struct iio_channel *chn,
+		const char *attr, double *val);
+__api __check_ret ssize_t iio_channel_attr_write(const struct iio_channel *chn,
+		const char *attr, const char *src);
+__api __check_ret int iio_channel_attr_write_bool(const struct iio_channel *chn,
+		const char *attr, bool val);
+__api __check_ret int iio_channel_attr_write_longlong(const struct iio_channel *chn,
+		const char *attr, long long val);
+__api __check_ret int iio_channel_attr_write_double(const struct iio_channel *chn,
+		const char *attr, double val);
+__api void iio_channel_enable(struct iio_channel *chn);
+__api void iio_channel_disable(struct iio_channel *chn);
+__api __check_ret bool iio_channel_is_enabled(const struct iio_channel *chn);
+
+/* Buffer */
+__api __check_ret __pure const struct iio_device * iio_buffer_get_device(
+		const struct iio_buffer *buf);
+__api __check_ret struct iio_buffer * iio_device_create_buffer(const struct iio_device *dev,
+		size_t samples_count, bool cyclic);
+__api void iio_buffer_destroy(struct iio_buffer *buf);
+__api __check_ret int iio_buffer_get_poll_fd(struct iio_buffer *buf);
+__api __check_ret int iio_buffer_set_blocking_mode(struct iio_buffer *buf, bool blocking);
+__api __check_ret ssize_t iio_buffer_refill(struct iio_buffer *buf);
+__api __check_ret ssize_t iio_buffer_push(struct iio_buffer *buf);
+__api __check_ret ssize_t iio_buffer_push_partial(struct iio_buffer *buf,
+		size_t samples_count);
+__api void iio_buffer_cancel(struct iio_buffer *buf);
+__api void * iio_buffer_start(const struct iio_buffer *buf);
+__api void * iio_buffer_first(const struct iio_buffer *buf,
+		const struct iio_channel *chn);
+__api __check_ret ptrdiff_t iio_buffer_step(const struct iio_buffer *buf);
+__api void * iio_buffer_end(const struct iio_buffer *buf);
+
+#ifdef __cplusplus
+}
+#endif
+
+#undef __api
+
+#endif /* __IIO_H__ */
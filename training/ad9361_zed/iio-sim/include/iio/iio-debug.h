@@ -0,0 +1,45 @@
+/**
+ * Simulated AD9361 on FMCOMMS2 - libiio 1.x error reporting macros
+ *
+ * The ctx_/dev_/chn_ err and perror helpers of <iio/iio-debug.h>, printing
+ * to stderr with the object name in front.
+ *
+ * Licensed under the GPL-2.
+ *
+ **/
+
+#ifndef __LIBIIO_DEBUG_H__
+#define __LIBIIO_DEBUG_H__
+
+#include <stdarg.h>
+#include <stdio.h>
+
+#include <iio/iio.h>
+
+static inline void iio_sim_perror(const char *who, int err, const char *fmt, ...)
+{
+	char buf[256];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+
+	if (err) {
+		char msg[128];
+
+		iio_strerror(err < 0 ? -err : err, msg, sizeof(msg));
+		fprintf(stderr, "%s: %s: %s\n", who, buf, msg);
+	} else {
+		fprintf(stderr, "%s: %s\n", who, buf);
+	}
+}
+
+#define ctx_err(ctx, ...)	iio_sim_perror(iio_context_get_name(ctx), 0, __VA_ARGS__)
+#define ctx_perror(ctx, err, ...) iio_sim_perror(iio_context_get_name(ctx), err, __VA_ARGS__)
+#define dev_err(dev, ...)	iio_sim_perror(iio_device_get_name(dev), 0, __VA_ARGS__)
+#define dev_perror(dev, err, ...) iio_sim_perror(iio_device_get_name(dev), err, __VA_ARGS__)
+#define chn_err(chn, ...)	iio_sim_perror(iio_channel_get_id(chn), 0, __VA_ARGS__)
+#define chn_perror(chn, err, ...) iio_sim_perror(iio_channel_get_id(chn), err, __VA_ARGS__)
+
+#endif /* __LIBIIO_DEBUG_H__ */
@@ -0,0 +1,144 @@
+/**
+ * Simulated AD9361 on FMCOMMS2 - libiio 1.x API
+ *
+ * The subset of the libiio 1.x interface that iio-sim implements, with the
+ * same prototypes as the real <iio/iio.h>: attributes as objects, channel
+ * masks, and buffers streamed as a ring of blocks. Errors are returned as
+ * negative errno encoded in the pointer, see iio_err().
+ *
+ * Licensed under the GPL-2.
+ *
+ **/
+
+#ifndef __LIBIIO_IIO_H__
+#define __LIBIIO_IIO_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define __api __attribute__((visibility("default")))
+#define __check_ret __attribute__((warn_unused_result))
+#define __pure __attribute__((pure))
+
+struct iio_attr;
+struct iio_block;
+struct iio_buffer;
+struct iio_channel;
+struct iio_channels_mask;
+struct iio_context;
+struct iio_context_params;
+struct iio_device;
+struct iio_stream;
+
+static inline void *iio_ptr(int err)
+{
+	return (void *)(intptr_t)err;
+}
+
+static inline int iio_err(const void *ptr)
+{
+	return (uintptr_t)ptr >= (uintptr_t)-4095 ? (int)(intptr_t)ptr : 0;
+}
+
+/* Library */
+__api void iio_strerror(int err, char *dst, size_t len);
+
+/* Context */
+__api __check_ret struct iio_context * iio_create_context(
+		const struct iio_context_params *params, const char *uri);
+__api void iio_context_destroy(struct iio_context *ctx);
+__api __check_ret __pure const char * iio_context_get_name(
+		const struct iio_context *ctx);
+__api __check_ret __pure unsigned int iio_context_get_devices_count(
+		const struct iio_context *ctx);
+__api __check_ret __pure struct iio_device * iio_context_get_device(
+		const struct iio_context *ctx, unsigned int index);
+__api __check_ret __pure struct iio_device * iio_context_find_device(
+		const struct iio_context *ctx, const char *name);
+
+/* Device */
+__api __check_ret __pure const struct iio_context * iio_device_get_context(
+		const struct iio_device *dev);
+__api __check_ret __pure const char * iio_device_get_id(const struct iio_device *dev);
+__api __check_ret __pure const char * iio_device_get_name(const struct iio_device *dev);
+__api __check_ret __pure unsigned int iio_device_get_channels_count(
+		const struct iio_device *dev);
+__api __check_ret __pure struct iio_channel * iio_device_get_channel(
+		const struct iio_device *dev, unsigned int index);
+__api __check_ret __pure struct iio_channel * iio_device_find_channel(
+		const struct iio_device *dev, const char *name, bool output);
+__api __check_ret const struct iio_attr * iio_device_find_attr(
+		const struct iio_device *dev, const char *name);
+__api __check_ret ssize_t iio_device_get_sample_size(const struct iio_device *dev,
+		const struct iio_channels_mask *mask);
+
+/* Channel */
+__api __check_ret __pure const struct iio_device * iio_channel_get_device(
+		const struct iio_channel *chn);
+__api __check_ret __pure const char * iio_channel_get_id(const struct iio_channel *chn);
+__api __check_ret __pure bool iio_channel_is_output(const struct iio_channel *chn);
+__api __check_ret __pure long iio_channel_get_index(const struct iio_channel *chn);
+__api __check_ret const struct iio_attr * iio_channel_find_attr(
+		const struct iio_channel *chn, const char *name);
+__api void iio_channel_enable(const struct iio_channel *chn,
+		struct iio_channels_mask *mask);
+__api void iio_channel_disable(const struct iio_channel *chn,
+		struct iio_channels_mask *mask);
+__api __check_ret bool iio_channel_is_enabled(const struct iio_channel *chn,
+		const struct iio_channels_mask *mask);
+
+/* Channels mask */
+__api __check_ret struct iio_channels_mask * iio_create_channels_mask(
+		unsigned int nb_channels);
+__api void iio_channels_mask_destroy(struct iio_channels_mask *mask);
+
+/* Attribute */
+__api __check_ret __pure const char * iio_attr_get_name(const struct iio_attr *attr);
+__api __check_ret ssize_t iio_attr_read_raw(const struct iio_attr *attr,
+		char *dst, size_t len);
+__api __check_ret ssize_t iio_attr_write_raw(const struct iio_attr *attr,
+		const void *src, size_t len);
+__api __check_ret ssize_t iio_attr_write_string(const struct iio_attr *attr,
+		const char *src);
+__api __check_ret int iio_attr_read_bool(const struct iio_attr *attr, bool *val);
+__api __check_ret int iio_attr_read_longlong(const struct iio_attr *attr, long long *val);
+__api __check_ret int iio_attr_read_double(const struct iio_attr *attr, double *val);
+__api __check_ret int iio_attr_write_bool(const struct iio_attr *attr, bool val);
+__api __check_ret int iio_attr_write_longlong(const struct iio_attr *attr, long long val);
+__api __check_ret int iio_attr_write_double(const struct iio_attr *attr, double val);
+
+/* Buffer */
+__api __check_ret struct iio_buffer * iio_device_create_buffer(
+		const struct iio_device *dev, unsigned int idx,
+		const struct iio_channels_mask *mask);
+__api void iio_buffer_destroy(struct iio_buffer *buf);
+__api void iio_buffer_cancel(struct iio_buffer *buf);
+__api __check_ret __pure const struct iio_device * iio_buffer_get_device(
+		const struct iio_buffer *buf);
+
+/* Stream */
+__api __check_ret struct iio_stream * iio_buffer_create_stream(
+		struct iio_buffer *buffer, size_t nb_blocks, size_t samples_count);
+__api void iio_stream_destroy(struct iio_stream *stream);
+__api __check_ret const struct iio_block * iio_stream_get_next_block(
+		struct iio_stream *stream);
+
+/* Block */
+__api void * iio_block_start(const struct iio_block *block);
+__api void * iio_block_first(const struct iio_block *block,
+		const struct iio_channel *chn);
+__api void * iio_block_end(const struct iio_block *block);
+
+#ifdef __cplusplus
+}
+#endif
+
+#undef __api
+
+#endif /* __LIBIIO_IIO_H__ */
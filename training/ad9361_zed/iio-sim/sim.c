@@ -0,0 +1,797 @@
+/**
+ * Simulated AD9361 on FMCOMMS2 - shared device model
+ *
+ * The device state is a sysfs-like directory tree under IIO_SIM_DIR
+ * (default /tmp/iio-sim), so the libiio front-end and the sysfs/ioctl
+ * front-end see the same attributes, even from different processes.
+ * Samples pushed on the TX device land in a shared ring that the RX
+ * device reads back with a frequency offset and noise applied.
+ *
+ * Licensed under the GPL-2.
+ *
+ **/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "sim.h"
+
+#define SIM_DEFAULT_DIR		"/tmp/iio-sim"
+#define SIM_SYSFS		"sys/bus/iio/devices"
+
+/* The AD9361 data path is 12 bits: TX is MSB aligned, RX sign extended */
+#define SIM_RX_FULL_SCALE	2047.0
+
+/* Limits enforced by the ad9361 driver */
+#define SIM_MAX_RATE		61440000LL
+#define SIM_MIN_RATE		2083334LL	/* without the FIR */
+#define SIM_MIN_RATE_FIR	520834LL
+#define SIM_MIN_LO		70000000LL
+#define SIM_MAX_LO		6000000000LL
+#define SIM_FASTLOCK_PROFILES	8
+
+static const struct sim_chan_desc phy_chans[] = {
+	{ "voltage0", NULL, false, -1 },
+	{ "voltage0", NULL, true, -1 },
+	{ "altvoltage0", "RX_LO", true, -1 },
+	{ "altvoltage1", "TX_LO", true, -1 },
+	{ "out", NULL, false, -1 },	/* in_out_voltage_filter_fir_en */
+};
+
+static const struct sim_chan_desc tx_chans[] = {
+	{ "voltage0", NULL, true, 0 },
+	{ "voltage1", NULL, true, 1 },
+	{ "voltage2", NULL, true, 2 },
+	{ "voltage3", NULL, true, 3 },
+};
+
+static const struct sim_chan_desc rx_chans[] = {
+	{ "voltage0", NULL, false, 0 },
+	{ "voltage1", NULL, false, 1 },
+	{ "voltage2", NULL, false, 2 },
+	{ "voltage3", NULL, false, 3 },
+};
+
+static const char *const phy_defaults[] = {
+	"in_voltage_sampling_frequency", "30720000",
+	"out_voltage_sampling_frequency", "30720000",
+	"in_voltage_rf_bandwidth", "18000000",
+	"out_voltage_rf_bandwidth", "18000000",
+	"in_voltage0_hardwaregain", "71",
+	"in_voltage0_gain_control_mode", "slow_attack",
+	"in_voltage0_rf_port_select", "A_BALANCED",
+	"out_voltage0_hardwaregain", "-10",
+	"out_voltage0_rf_port_select", "A",
+	"out_altvoltage0_RX_LO_frequency", "2400000000",
+	"out_altvoltage0_RX_LO_powerdown", "0",
+	"out_altvoltage0_RX_LO_fastlock_store", "0",
+	"out_altvoltage0_RX_LO_fastlock_recall", "0",
+	"out_altvoltage1_TX_LO_frequency", "2450000000",
+	"out_altvoltage1_TX_LO_powerdown", "0",
+	"out_altvoltage1_TX_LO_fastlock_store", "0",
+	"out_altvoltage1_TX_LO_fastlock_recall", "0",
+	"in_out_voltage_filter_fir_en", "0",
+	"xo_correction", "40000000",
+	"calib_mode", "auto",
+	"ensm_mode", "fdd",
+	NULL,
+};
+
+static const char *const tx_defaults[] = {
+	"out_voltage_sampling_frequency", "30720000",
+	"scan_elements/out_voltage0_en", "0",
+	"scan_elements/out_voltage1_en", "0",
+	"scan_elements/out_voltage2_en", "0",
+	"scan_elements/out_voltage3_en", "0",
+	"buffer/enable", "0",
+	NULL,
+};
+
+static const char *const rx_defaults[] = {
+	"in_voltage_sampling_frequency", "30720000",
+	"scan_elements/in_voltage0_en", "0",
+	"scan_elements/in_voltage1_en", "0",
+	"scan_elements/in_voltage2_en", "0",
+	"scan_elements/in_voltage3_en", "0",
+	"buffer/enable", "0",
+	NULL,
+};
+
+const struct sim_dev_desc sim_devices[SIM_NUM_DEVICES] = {
+	[SIM_PHY] = { "ad9361-phy", phy_chans, 5, phy_defaults },
+	[SIM_TX] = { "cf-ad9361-dds-core-lpc", tx_chans, 4, tx_defaults },
+	[SIM_RX] = { "cf-ad9361-lpc", rx_chans, 4, rx_defaults },
+};
+
+/* Attributes shared by all channels of a type, e.g. in_voltage_rf_bandwidth */
+static const char *const shared_attrs[] = {
+	"sampling_frequency", "sampling_frequency_available",
+	"rf_bandwidth", "rf_bandwidth_available", "filter_fir_en", NULL,
+};
+
+const char *sim_dir(void)
+{
+	const char *dir = getenv("IIO_SIM_DIR");
+
+	return dir && *dir ? dir : SIM_DEFAULT_DIR;
+}
+
+double sim_env(const char *name, double def)
+{
+	const char *val = getenv(name);
+
+	return val && *val ? atof(val) : def;
+}
+
+int sim_dev_path(char *dst, size_t len, int dev, const char *file)
+{
+	int ret = snprintf(dst, len, "%s/" SIM_SYSFS "/iio:device%d%s%s",
+			   sim_dir(), dev, file ? "/" : "", file ? file : "");
+
+	return ret < 0 || (size_t)ret >= len ? -ENAMETOOLONG : 0;
+}
+
+/* Map a libiio channel attribute to its sysfs file name */
+int sim_chan_attr_file(char *dst, size_t len, const struct sim_chan_desc *chn,
+		       const char *attr)
+{
+	const char *const *s;
+	size_t type_len = strcspn(chn->id, "0123456789");
+	bool shared = false;
+	int ret;
+
+	for (s = shared_attrs; *s; s++)
+		shared |= !strcmp(*s, attr);
+
+	ret = snprintf(dst, len, "%s_%.*s%s%s_%s", chn->output ? "out" : "in",
+		       (int)(shared ? type_len : strlen(chn->id)), chn->id,
+		       chn->ext && !shared ? "_" : "",
+		       chn->ext && !shared ? chn->ext : "", attr);
+
+	return ret < 0 || (size_t)ret >= len ? -ENAMETOOLONG : 0;
+}
+
+static int mkdir_p(const char *path)
+{
+	char tmp[SIM_PATH_MAX];
+	char *p;
+
+	snprintf(tmp, sizeof(tmp), "%s", path);
+	for (p = tmp + 1; *p; p++) {
+		if (*p != '/')
+			continue;
+		*p = '\0';
+		if (mkdir(tmp, 0755) && errno != EEXIST)
+			return -errno;
+		*p = '/';
+	}
+
+	return mkdir(tmp, 0755) && errno != EEXIST ? -errno : 0;
+}
+
+static int write_file(const char *path, const char *src, size_t len)
+{
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	ssize_t ret;
+
+	if (fd < 0)
+		return -errno;
+	ret = write(fd, src, len);
+	close(fd);
+
+	return ret < 0 ? -errno : (int)ret;
+}
+
+/**
+ * sim_setup() - create the device tree unless it already exists
+ *
+ * Values written by earlier runs are kept; remove IIO_SIM_DIR to start
+ * over from the power-on defaults.
+ **/
+int sim_setup(void)
+{
+	char path[SIM_PATH_MAX];
+	struct stat s;
+	int dev, ret;
+
+	for (dev = 0; dev < SIM_NUM_DEVICES; dev++) {
+		const struct sim_dev_desc *desc = &sim_devices[dev];
+		const char *const *d;
+
+		sim_dev_path(path, sizeof(path), dev, "name");
+		if (!stat(path, &s))
+			continue;
+
+		sim_dev_path(path, sizeof(path), dev, NULL);
+		ret = mkdir_p(path);
+		if (ret)
+			return ret;
+		if (desc->chans[0].scan_index >= 0) {
+			sim_dev_path(path, sizeof(path), dev, "scan_elements");
+			mkdir(path, 0755);
+			sim_dev_path(path, sizeof(path), dev, "buffer");
+			mkdir(path, 0755);
+		}
+
+		for (d = desc->defaults; *d; d += 2) {
+			sim_dev_path(path, sizeof(path), dev, d[0]);
+			write_file(path, d[1], strlen(d[1]));
+		}
+
+		/* Written last: its presence marks the device complete */
+		sim_dev_path(path, sizeof(path), dev, "name");
+		ret = write_file(path, desc->name, strlen(desc->name));
+		if (ret < 0)
+			return ret;
+	}
+
+	snprintf(path, sizeof(path), "%s/dev", sim_dir());
+	return mkdir_p(path);
+}
+
+/**
+ * rate_file() - resolve reads of the baseband rate
+ *
+ * Like in the ad9361 driver, the RX and TX baseband rates are one clock
+ * tree and the streaming cores run at that rate. Writes land in whichever
+ * phy file the tool picked (through libiio or sysfs), so reads of any of
+ * them return the most recently written phy rate.
+ **/
+static const char *rate_file(int *dev, const char *file)
+{
+	static const char *const names[] = {
+		"in_voltage_sampling_frequency", "out_voltage_sampling_frequency",
+	};
+	char path[SIM_PATH_MAX];
+	struct stat s[2];
+	int k;
+
+	if (strcmp(file, names[0]) && strcmp(file, names[1]))
+		return file;
+
+	for (k = 0; k < 2; k++) {
+		sim_dev_path(path, sizeof(path), SIM_PHY, names[k]);
+		if (stat(path, &s[k]))
+			return file;
+	}
+
+	*dev = SIM_PHY;
+	if (s[1].st_mtim.tv_sec > s[0].st_mtim.tv_sec ||
+	    (s[1].st_mtim.tv_sec == s[0].st_mtim.tv_sec &&
+	     s[1].st_mtim.tv_nsec > s[0].st_mtim.tv_nsec))
+		return names[1];
+	return names[0];
+}
+
+ssize_t sim_attr_read(int dev, const char *file, char *dst, size_t len)
+{
+	char path[SIM_PATH_MAX];
+	ssize_t ret;
+	int fd;
+
+	if (!len)
+		return -EINVAL;
+
+	file = rate_file(&dev, file);
+	sim_dev_path(path, sizeof(path), dev, file);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+
+	ret = read(fd, dst, len - 1);
+	close(fd);
+	if (ret < 0)
+		return -errno;
+
+	while (ret && (dst[ret - 1] == '\n' || dst[ret - 1] == ' '))
+		ret--;
+	dst[ret] = '\0';
+
+	return ret + 1;
+}
+
+/**
+ * attr_check() - reject values the ad9361 driver would reject
+ *
+ * Baseband rates below 2.083 MS/s need the programmable FIR loaded and
+ * enabled first; that takes them down to 520.833 kS/s.
+ **/
+static int attr_check(int dev, const char *file, const char *src)
+{
+	long long val = strtoll(src, NULL, 0);
+	struct stat s;
+	char path[SIM_PATH_MAX];
+
+	if (dev != SIM_PHY)
+		return 0;
+
+	if (!strcmp(file, "in_voltage_sampling_frequency") ||
+	    !strcmp(file, "out_voltage_sampling_frequency")) {
+		if (val > SIM_MAX_RATE || val < SIM_MIN_RATE_FIR)
+			return -EINVAL;
+		if (val < SIM_MIN_RATE &&
+		    !sim_attr_ll(SIM_PHY, "in_out_voltage_filter_fir_en", 0))
+			return -EINVAL;
+	} else if (!strcmp(file, "in_out_voltage_filter_fir_en")) {
+		sim_dev_path(path, sizeof(path), SIM_PHY, "filter_fir_config");
+		if (val && (stat(path, &s) || !s.st_size))
+			return -EINVAL;
+	} else if (strstr(file, "_LO_frequency")) {
+		if (val < SIM_MIN_LO || val > SIM_MAX_LO)
+			return -EINVAL;
+	}
+
+	return 0;
+}
+
+static void sleep_us(double us)
+{
+	struct timespec t = {
+		.tv_sec = (time_t)(us / 1e6),
+		.tv_nsec = (long)fmod(us * 1e3, 1e9),
+	};
+
+	if (us > 0)
+		clock_nanosleep(CLOCK_MONOTONIC, 0, &t, NULL);
+}
+
+/**
+ * lo_write() - model the synthesizer behind the LO attributes
+ *
+ * A frequency write runs the VCO calibration and a full lock, which takes
+ * IIO_SIM_LO_TUNE_US. fastlock_store saves the current frequency in one of
+ * 8 profiles (as hidden files next to the attributes) and fastlock_recall
+ * switches to a saved one in IIO_SIM_FASTLOCK_US, without calibrating.
+ **/
+static int lo_write(int dev, const char *file, const char *src)
+{
+	const char *attr = strstr(file, "_LO_");
+	long long val = strtoll(src, NULL, 0);
+	char name[SIM_PATH_MAX], freq[SIM_PATH_MAX], path[SIM_PATH_MAX];
+	char buf[32];
+	int prefix;
+	ssize_t ret;
+
+	if (dev != SIM_PHY || !attr)
+		return 0;
+	prefix = attr + 3 - file;
+	attr += 4;
+
+	if (!strcmp(attr, "frequency")) {
+		sleep_us(sim_env("IIO_SIM_LO_TUNE_US", 2000));
+		return 0;
+	}
+	if (strcmp(attr, "fastlock_store") && strcmp(attr, "fastlock_recall"))
+		return 0;
+	if (val < 0 || val >= SIM_FASTLOCK_PROFILES)
+		return -EINVAL;
+
+	snprintf(name, sizeof(name), ".%.*s_fastlock%lld", prefix, file, val);
+	snprintf(freq, sizeof(freq), "%.*s_frequency", prefix, file);
+	if (!strcmp(attr, "fastlock_store")) {
+		ret = sim_attr_read(dev, freq, buf, sizeof(buf));
+		if (ret < 0)
+			return ret;
+		sim_dev_path(path, sizeof(path), dev, name);
+	} else {
+		ret = sim_attr_read(dev, name, buf, sizeof(buf));
+		if (ret < 0)
+			return -EINVAL;	/* profile never stored */
+		sleep_us(sim_env("IIO_SIM_FASTLOCK_US", 25));
+		sim_dev_path(path, sizeof(path), dev, freq);
+	}
+	ret = write_file(path, buf, strlen(buf));
+
+	return ret < 0 ? ret : 0;
+}
+
+ssize_t sim_attr_write(int dev, const char *file, const char *src, size_t len)
+{
+	char path[SIM_PATH_MAX];
+	int ret;
+
+	ret = sim_dev_path(path, sizeof(path), dev, file);
+	if (ret)
+		return ret;
+
+	ret = attr_check(dev, file, src);
+	if (ret)
+		return ret;
+
+	ret = lo_write(dev, file, src);
+	if (ret)
+		return ret;
+
+	return write_file(path, src, len);
+}
+
+long long sim_attr_ll(int dev, const char *file, long long def)
+{
+	char buf[64];
+
+	if (sim_attr_read(dev, file, buf, sizeof(buf)) <= 0)
+		return def;
+
+	return strtoll(buf, NULL, 0);
+}
+
+double sim_sample_rate(int dev)
+{
+	return (double)sim_attr_ll(dev, dev == SIM_RX ?
+				   "in_voltage_sampling_frequency" :
+				   "out_voltage_sampling_frequency", 30720000);
+}
+
+static int64_t now_ns(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+struct sim_ring *sim_ring_map(void)
+{
+	size_t bytes = sizeof(struct sim_ring) + SIM_RING_SAMPLES * 4;
+	char path[SIM_PATH_MAX];
+	struct sim_ring *ring;
+	struct stat s;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/loopback", sim_dir());
+	fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &s) || ((size_t)s.st_size < bytes && ftruncate(fd, bytes))) {
+		close(fd);
+		return NULL;
+	}
+
+	ring = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (ring == MAP_FAILED)
+		return NULL;
+
+	/* A stale ring (other layout, or from before a reboot) starts over */
+	if (ring->magic != SIM_RING_MAGIC || ring->size != SIM_RING_SAMPLES ||
+	    ring->epoch_ns > now_ns()) {
+		ring->size = SIM_RING_SAMPLES;
+		ring->epoch_ns = now_ns();
+		ring->written = 0;
+		__atomic_store_n(&ring->magic, SIM_RING_MAGIC, __ATOMIC_RELEASE);
+	}
+
+	return ring;
+}
+
+/* Ring position of the sample on air at t_ns, or -1 when not paced */
+int64_t sim_ring_pos(const struct sim_ring *ring, int64_t t_ns, double fs)
+{
+	if (t_ns < 0)
+		return -1;
+
+	return llrint((t_ns - ring->epoch_ns) * fs / 1e9);
+}
+
+/**
+ * sim_tx_write() - put n I/Q pairs, taken stride int16 apart, on air
+ * @pos: ring position of the first one, -1 to append
+ *
+ * Anything between the previous end and @pos was silence (an underflow
+ * or the transmitter not running) and is zeroed.
+ **/
+void sim_tx_write(struct sim_ring *ring, int64_t pos, const int16_t *iq,
+		  size_t stride, size_t n)
+{
+	int64_t w = __atomic_load_n(&ring->written, __ATOMIC_RELAXED);
+	int64_t p;
+	size_t k;
+
+	if (pos < 0)
+		pos = w;
+
+	for (p = pos - w > ring->size ? pos - ring->size : w; p < pos; p++) {
+		ring->iq[2 * (p & (ring->size - 1))] = 0;
+		ring->iq[2 * (p & (ring->size - 1)) + 1] = 0;
+	}
+
+	for (k = 0; k < n; k++) {
+		size_t r = (pos + k) & (ring->size - 1);
+
+		ring->iq[2 * r] = iq[k * stride];
+		ring->iq[2 * r + 1] = iq[k * stride + 1];
+	}
+
+	if (pos + (int64_t)n > w)
+		__atomic_store_n(&ring->written, pos + n, __ATOMIC_RELEASE);
+}
+
+static uint64_t xorshift64(uint64_t *s)
+{
+	*s ^= *s << 13;
+	*s ^= *s >> 7;
+	*s ^= *s << 17;
+	return *s;
+}
+
+/* Roughly Gaussian, unit variance: sum of four uniforms */
+static double noise_sample(uint64_t *s)
+{
+	uint64_t r = xorshift64(s);
+	double sum = 0;
+	int k;
+
+	for (k = 0; k < 4; k++, r >>= 16)
+		sum += (double)(r & 0xffff) / 65536.0 - 0.5;
+
+	return sum * 1.7320508;
+}
+
+static int16_t adc_clip(double v)
+{
+	if (v > SIM_RX_FULL_SCALE)
+		return (int16_t)SIM_RX_FULL_SCALE;
+	if (v < -SIM_RX_FULL_SCALE - 1)
+		return (int16_t)(-SIM_RX_FULL_SCALE - 1);
+	return (int16_t)lrint(v);
+}
+
+/* IIO_SIM_RX_FILE, received instead of the loopback, or NULL */
+static const int16_t *rx_source(struct sim_rx *rx)
+{
+	const char *name = getenv("IIO_SIM_RX_FILE");
+	struct stat s;
+	void *p;
+	int fd;
+
+	if (rx->src_checked)
+		return rx->src;
+	rx->src_checked = true;
+	if (!name || !*name)
+		return NULL;
+
+	fd = open(name, O_RDONLY);
+	if (fd < 0 || fstat(fd, &s) || s.st_size < 4) {
+		fprintf(stderr, "iio-sim: cannot use IIO_SIM_RX_FILE %s\n", name);
+		if (fd >= 0)
+			close(fd);
+		return NULL;
+	}
+	p = mmap(NULL, s.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return NULL;
+
+	rx->src = p;
+	rx->src_len = s.st_size / 4;
+	return rx->src;
+}
+
+/**
+ * sim_rx_fill() - produce n received I/Q pairs
+ * @pos: ring position of the first one, -1 to read on sequentially
+ *
+ * The TX samples are scaled from the 16 bit DAC range to the 12 bit ADC
+ * range by the TX gain and IIO_SIM_PATH_GAIN_DB, shifted by the TX/RX LO
+ * difference plus IIO_SIM_FREQ_OFFSET and buried in IIO_SIM_NOISE_DB
+ * (dBFS) of noise. Positions nothing was written to read as silence.
+ * Slots after the first I/Q pair of each sample get a copy of it (the
+ * second RX channel).
+ *
+ * With IIO_SIM_RX_FILE set, that recording (16 bit I/Q at the RX rate,
+ * DAC scaled, repeated) is received instead, as a transmitter on the RX
+ * LO that started with the ring epoch. Only the path gain and
+ * IIO_SIM_FREQ_OFFSET apply to it.
+ **/
+void sim_rx_fill(struct sim_rx *rx, struct sim_ring *ring, int64_t pos,
+		 int16_t *iq, size_t stride, size_t n)
+{
+	const int16_t *src = rx_source(rx);
+	int64_t written = __atomic_load_n(&ring->written, __ATOMIC_ACQUIRE);
+	double fs = sim_sample_rate(SIM_RX);
+	double offset = sim_env("IIO_SIM_FREQ_OFFSET", 0) + (src ? 0 :
+		sim_attr_ll(SIM_PHY, "out_altvoltage1_TX_LO_frequency", 0)
+		- sim_attr_ll(SIM_PHY, "out_altvoltage0_RX_LO_frequency", 0));
+	double gain = pow(10, (sim_env("IIO_SIM_PATH_GAIN_DB", 0) + (src ? 0 :
+		sim_attr_ll(SIM_PHY, "out_voltage0_hardwaregain", 0))) / 20)
+		* SIM_RX_FULL_SCALE / 32768.0;
+	double sigma = SIM_RX_FULL_SCALE * pow(10, sim_env("IIO_SIM_NOISE_DB", -60) / 20);
+	double step_i = cos(2 * M_PI * offset / fs), step_q = sin(2 * M_PI * offset / fs);
+	bool on_air = fabs(offset) < fs / 2 && (src ||
+		!sim_attr_ll(SIM_PHY, "out_altvoltage1_TX_LO_powerdown", 0));
+	size_t k, c;
+	double mag;
+
+	if (src) {
+		if (pos < 0) {
+			pos = rx->read;
+			rx->read += n;
+		}
+		written = pos + n;
+	} else if (pos < 0) {
+		if (!rx->started || written - rx->read > ring->size)
+			rx->read = written;
+		pos = rx->read;
+		rx->read += written - pos < (int64_t)n ? written - pos : (int64_t)n;
+	}
+	rx->started = true;
+	if (!rx->rng)
+		rx->rng = 0x9e3779b97f4a7c15ull ^ (uintptr_t)rx;
+	if (rx->rot_i == 0 && rx->rot_q == 0)
+		rx->rot_i = 1;
+
+	for (k = 0; k < n; k++) {
+		int64_t p = pos + k;
+		double i = 0, q = 0, t;
+
+		if (on_air && p < written && (src || written - p <= ring->size)) {
+			size_t r = src ? p % rx->src_len : p & (ring->size - 1);
+			const int16_t *x = src ? &src[2 * r] : &ring->iq[2 * r];
+			double si = x[0] * gain;
+			double sq = x[1] * gain;
+
+			i = si * rx->rot_i - sq * rx->rot_q;
+			q = si * rx->rot_q + sq * rx->rot_i;
+		}
+
+		t = rx->rot_i * step_i - rx->rot_q * step_q;
+		rx->rot_q = rx->rot_i * step_q + rx->rot_q * step_i;
+		rx->rot_i = t;
+
+		iq[k * stride] = adc_clip(i + sigma * noise_sample(&rx->rng));
+		iq[k * stride + 1] = adc_clip(q + sigma * noise_sample(&rx->rng));
+		for (c = 2; c + 1 < stride; c += 2) {
+			iq[k * stride + c] = iq[k * stride];
+			iq[k * stride + c + 1] = iq[k * stride + 1];
+		}
+	}
+
+	/* Keep the rotator on the unit circle */
+	mag = sqrt(rx->rot_i * rx->rot_i + rx->rot_q * rx->rot_q);
+	rx->rot_i /= mag;
+	rx->rot_q /= mag;
+}
+
+static void ts_add(struct timespec *t, double s)
+{
+	long long ns = t->tv_nsec + (long long)(s * 1e9);
+
+	t->tv_sec += ns / 1000000000LL;
+	t->tv_nsec = ns % 1000000000LL;
+	if (t->tv_nsec < 0) {
+		t->tv_nsec += 1000000000L;
+		t->tv_sec--;
+	}
+}
+
+static double ts_diff(const struct timespec *a, const struct timespec *b)
+{
+	return (a->tv_sec - b->tv_sec) + (a->tv_nsec - b->tv_nsec) / 1e9;
+}
+
+/**
+ * sim_fault() - inject the DMA errors IIO_SIM_FAULT_EVERY asks for
+ *
+ * After every IIO_SIM_FAULT_EVERY blocks, the next call fails with
+ * IIO_SIM_FAULT_ERRNO. EINTR, EAGAIN and ETIMEDOUT fail just that call;
+ * any other error stays until the buffer is destroyed or its blocks are
+ * freed, like a DMA that stopped, so only a rebuild gets it going again.
+ *
+ * Returns 0 or the negative errno to fail with.
+ **/
+int sim_fault(struct sim_pacer *p)
+{
+	unsigned long long every = sim_env("IIO_SIM_FAULT_EVERY", 0);
+	int err;
+
+	if (p->failed)
+		return -p->failed;
+	if (!every || !p->blocks || p->blocks % every || p->fault_at == p->blocks)
+		return 0;
+
+	err = sim_env("IIO_SIM_FAULT_ERRNO", EIO);
+	p->fault_at = p->blocks;
+	p->faults++;
+	if (err != EINTR && err != EAGAIN && err != ETIMEDOUT)
+		p->failed = err;
+	return -err;
+}
+
+/**
+ * sim_pace_ready() - when the next sim_pace() would not wait
+ *
+ * Returns the CLOCK_MONOTONIC time in ns, 0 when it would not wait now:
+ * before the first block, without pacing, or with an injected error
+ * pending.
+ **/
+int64_t sim_pace_ready(const struct sim_pacer *p, double fs, bool output,
+		       size_t samples)
+{
+	double depth = p->depth ? p->depth : sim_env("IIO_SIM_KERNEL_BUFFERS", 4);
+	double dur = samples / fs;
+	struct timespec ready = p->hw;
+
+	if (!p->started || p->failed || !sim_env("IIO_SIM_PACE", 1))
+		return 0;
+
+	ts_add(&ready, output ? -(depth - 1) * dur : dur);
+	return ready.tv_sec * 1000000000LL + ready.tv_nsec;
+}
+
+/**
+ * sim_pace() - wait for the DMA like the real device would
+ * @p: pacer of the buffer
+ * @fs: sample rate of the device
+ * @output: TX (push) rather than RX (refill)
+ * @samples: samples in the block
+ * @block: wait rather than fail with -EAGAIN
+ * @start_ns: set to the time the block starts on air (TX) or started
+ *	being captured (RX), -1 without pacing
+ *
+ * The kernel keeps @p->depth blocks in flight. A TX push
+ * waits until one of them has been sent; a push arriving after the queue
+ * ran dry counts as an underflow. An RX refill waits until the next block
+ * has been captured; finding the whole queue full counts as an overflow
+ * and the oldest data is dropped. IIO_SIM_PACE=0 turns pacing off.
+ * Errors sim_fault() injects come first.
+ **/
+int sim_pace(struct sim_pacer *p, double fs, bool output, size_t samples,
+	     bool block, int64_t *start_ns)
+{
+	double depth = p->depth ? p->depth : sim_env("IIO_SIM_KERNEL_BUFFERS", 4);
+	double dur = samples / fs;
+	struct timespec now, ready;
+	int ret;
+
+	*start_ns = -1;
+	ret = sim_fault(p);
+	if (ret)
+		return ret;
+	if (!sim_env("IIO_SIM_PACE", 1)) {
+		p->blocks++;
+		return 0;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (!p->started) {
+		p->hw = now;
+		p->started = true;
+	}
+
+	ready = p->hw;
+	ts_add(&ready, output ? -(depth - 1) * dur : dur);
+
+	if (ts_diff(&ready, &now) > 0) {
+		if (!block)
+			return -EAGAIN;
+		/* A signal does not end the wait; the DMA is not done yet */
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ready, NULL) == EINTR)
+			;
+		now = ready;
+	}
+
+	if (output) {
+		if (ts_diff(&now, &p->hw) > 0) {
+			if (p->blocks)
+				p->xruns++;
+			p->hw = now;
+		}
+	} else if (ts_diff(&now, &ready) > depth * dur) {
+		p->xruns++;
+		p->hw = now;
+		ts_add(&p->hw, -dur);
+	}
+
+	*start_ns = p->hw.tv_sec * 1000000000LL + p->hw.tv_nsec;
+	ts_add(&p->hw, dur);
+	p->blocks++;
+	return 0;
+}
@@ -0,0 +1,128 @@
+/**
+ * Simulated AD9361 on FMCOMMS2 - shared device model
+ *
+ * Licensed under the GPL-2.
+ *
+ **/
+
+#ifndef SIM_H
+#define SIM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+
+#define SIM_PHY		0
+#define SIM_TX		1
+#define SIM_RX		2
+#define SIM_NUM_DEVICES	3
+
+#define SIM_PATH_MAX	512
+
+/* TX to RX loopback, shared by every process using the same IIO_SIM_DIR */
+#define SIM_RING_MAGIC		0x53494d53
+#define SIM_RING_SAMPLES	(1 << 24)
+
+/**
+ * struct sim_ring - on-air sample timeline
+ * @epoch_ns: CLOCK_MONOTONIC time of position 0
+ * @written: end of the data written so far, updated atomically
+ * @iq: the last @size I/Q pairs of the timeline
+ *
+ * With pacing on, position p is the sample on air at epoch + p / fs, so
+ * TX blocks land where the DMA sends them and RX blocks read what was on
+ * air while they were captured. Without pacing TX appends and RX reads
+ * sequentially.
+ **/
+struct sim_ring {
+	uint32_t magic;
+	uint32_t size;
+	int64_t epoch_ns;
+	uint64_t written;
+	int16_t iq[];
+};
+
+struct sim_chan_desc {
+	const char *id;
+	const char *ext;	/* extended name, as in out_altvoltage1_TX_LO_* */
+	bool output;
+	int scan_index;		/* -1 for channels that do not stream */
+};
+
+struct sim_dev_desc {
+	const char *name;
+	const struct sim_chan_desc *chans;
+	unsigned int nchans;
+	const char *const *defaults;	/* file, value, file, value, ..., NULL */
+};
+
+extern const struct sim_dev_desc sim_devices[SIM_NUM_DEVICES];
+
+/**
+ * struct sim_pacer - models the DMA consuming or producing samples
+ * @hw: time at which the hardware finishes the data queued so far (TX)
+ *	or finishes capturing the last block handed out (RX)
+ * @depth: blocks the kernel keeps in flight, 0 for IIO_SIM_KERNEL_BUFFERS
+ * @started: set once the first block went through
+ * @blocks: blocks moved so far
+ * @xruns: TX underflows or RX overflows seen
+ * @faults: errors injected with IIO_SIM_FAULT_EVERY
+ * @fault_at: @blocks when the last one was injected
+ * @failed: the injected error the buffer is stuck on, 0 for none
+ **/
+struct sim_pacer {
+	struct timespec hw;
+	unsigned int depth;
+	bool started;
+	unsigned long long blocks;
+	unsigned long long xruns;
+	unsigned long long faults;
+	unsigned long long fault_at;
+	int failed;
+};
+
+/**
+ * struct sim_rx - receive side of the loopback
+ * @read: ring position of the next sample when reading sequentially
+ * @rot_i, @rot_q: frequency offset rotator
+ * @rng: noise generator state
+ * @src, @src_len: IIO_SIM_RX_FILE mapping and its length in I/Q pairs
+ **/
+struct sim_rx {
+	int64_t read;
+	bool started;
+	double rot_i, rot_q;
+	uint64_t rng;
+	bool src_checked;
+	const int16_t *src;
+	size_t src_len;
+};
+
+const char *sim_dir(void);
+int sim_setup(void);
+int sim_dev_path(char *dst, size_t len, int dev, const char *file);
+int sim_chan_attr_file(char *dst, size_t len, const struct sim_chan_desc *chn,
+		       const char *attr);
+
+ssize_t sim_attr_read(int dev, const char *file, char *dst, size_t len);
+ssize_t sim_attr_write(int dev, const char *file, const char *src, size_t len);
+long long sim_attr_ll(int dev, const char *file, long long def);
+double sim_env(const char *name, double def);
+
+struct sim_ring *sim_ring_map(void);
+int64_t sim_ring_pos(const struct sim_ring *ring, int64_t t_ns, double fs);
+void sim_tx_write(struct sim_ring *ring, int64_t pos, const int16_t *iq,
+		  size_t stride, size_t n);
+void sim_rx_fill(struct sim_rx *rx, struct sim_ring *ring, int64_t pos,
+		 int16_t *iq, size_t stride, size_t n);
+
+double sim_sample_rate(int dev);
+int sim_fault(struct sim_pacer *p);
+int sim_pace(struct sim_pacer *p, double fs, bool output, size_t samples,
+	     bool block, int64_t *start_ns);
+int64_t sim_pace_ready(const struct sim_pacer *p, double fs, bool output,
+		       size_t samples);
+
+#endif /* SIM_H */
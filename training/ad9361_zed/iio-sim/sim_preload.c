@@ -0,0 +1,462 @@
+/**
+ * Simulated AD9361 on FMCOMMS2 - sysfs and block ioctl front-end
+ *
+ * LD_PRELOAD interposer for tools that drive the hardware through
+ * /sys/bus/iio/devices and the /dev/iio:deviceN block ioctls, like
+ * iio_fm_radio. Paths are redirected into IIO_SIM_DIR. The character
+ * device becomes a regular file holding the blocks, so mmap() of the
+ * block offsets works unchanged, and the ioctls move blocks between the
+ * application and the simulated DMA.
+ *
+ * Licensed under the GPL-2.
+ *
+ **/
+
+#include <dirent.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/ioctl.h>
+#include <linux/types.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "sim.h"
+
+/* Block API of the ADI kernel, as used by iio_fm_radio */
+#define IIO_BLOCK_ALLOC_IOCTL   _IOWR('i', 0xa0, struct iio_buffer_block_alloc_req)
+#define IIO_BLOCK_FREE_IOCTL    _IO('i', 0xa1)
+#define IIO_BLOCK_QUERY_IOCTL   _IOWR('i', 0xa2, struct iio_buffer_block)
+#define IIO_BLOCK_ENQUEUE_IOCTL _IOWR('i', 0xa3, struct iio_buffer_block)
+#define IIO_BLOCK_DEQUEUE_IOCTL _IOWR('i', 0xa4, struct iio_buffer_block)
+
+struct iio_buffer_block_alloc_req {
+	__u32 type;
+	__u32 size;
+	__u32 count;
+	__u32 id;
+};
+
+struct iio_buffer_block {
+	__u32 id;
+	__u32 size;
+	__u32 bytes_used;
+	__u32 type;
+	__u32 flags;
+	union {
+		__u32 offset;
+	} data;
+	__u64 timestamp;
+};
+
+#define SIM_MAX_BLOCKS	32
+#define SIM_MAX_FDS	8
+
+static const char *const sim_prefixes[] = {
+	"/sys/bus/iio/devices", "/sys/kernel/debug/iio", "/dev/iio:device", NULL,
+};
+
+/**
+ * struct sim_fd - an open /dev/iio:deviceN
+ * @blocks: block layout, offsets page aligned
+ * @map: our own mapping of all blocks
+ * @queue: ids of the enqueued blocks, oldest first
+ **/
+struct sim_fd {
+	int fd;
+	int dev;
+	struct iio_buffer_block blocks[SIM_MAX_BLOCKS];
+	unsigned int count;
+	char *map;
+	size_t map_size;
+	unsigned int queue[SIM_MAX_BLOCKS];
+	unsigned int queued;
+	struct sim_ring *ring;
+	struct sim_pacer pacer;
+	struct sim_rx rx;
+};
+
+static struct sim_fd sim_fds[SIM_MAX_FDS];
+static pthread_mutex_t sim_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define REAL(ret, name, ...)						\
+	static ret (*real_##name)(__VA_ARGS__);				\
+	if (!real_##name)						\
+		real_##name = (ret (*)(__VA_ARGS__))dlsym(RTLD_NEXT, #name)
+
+static __attribute__((constructor)) void sim_preload_init(void)
+{
+	int ret = sim_setup();
+
+	if (ret)
+		fprintf(stderr, "iio-sim: cannot create %s: %s\n", sim_dir(),
+			strerror(-ret));
+}
+
+/* Redirect device paths into IIO_SIM_DIR, leave everything else alone */
+static const char *sim_path(const char *path, char *buf, size_t len)
+{
+	const char *const *p;
+
+	if (!path)
+		return path;
+
+	for (p = sim_prefixes; *p; p++) {
+		if (!strncmp(path, *p, strlen(*p))) {
+			snprintf(buf, len, "%s%s", sim_dir(), path);
+			return buf;
+		}
+	}
+
+	return path;
+}
+
+/* /dev/iio:deviceN opened: remember the fd, return its device number */
+static void sim_track_fd(const char *path, int fd)
+{
+	static const char dev_prefix[] = "/dev/iio:device";
+	unsigned int k;
+
+	if (fd < 0 || strncmp(path, dev_prefix, sizeof(dev_prefix) - 1))
+		return;
+
+	pthread_mutex_lock(&sim_lock);
+	for (k = 0; k < SIM_MAX_FDS; k++) {
+		if (sim_fds[k].map || sim_fds[k].fd > 0)
+			continue;
+		memset(&sim_fds[k], 0, sizeof(sim_fds[k]));
+		sim_fds[k].fd = fd;
+		sim_fds[k].dev = atoi(path + sizeof(dev_prefix) - 1);
+		break;
+	}
+	pthread_mutex_unlock(&sim_lock);
+}
+
+static struct sim_fd *sim_find_fd(int fd)
+{
+	unsigned int k;
+
+	for (k = 0; k < SIM_MAX_FDS; k++)
+		if (sim_fds[k].fd == fd && fd > 0)
+			return &sim_fds[k];
+
+	return NULL;
+}
+
+/* Unmap the blocks, reporting what they moved */
+static void sim_free_blocks(struct sim_fd *s)
+{
+	if (s->pacer.blocks)
+		fprintf(stderr, "iio-sim: %s: %llu blocks, %llu %s\n",
+			sim_devices[s->dev].name, s->pacer.blocks,
+			s->pacer.xruns,
+			s->dev == SIM_TX ? "underflows" : "overflows");
+	if (s->pacer.faults)
+		fprintf(stderr, "iio-sim: %s: %llu faults injected\n",
+			sim_devices[s->dev].name, s->pacer.faults);
+	memset(&s->pacer, 0, sizeof(s->pacer));
+	if (s->map)
+		munmap(s->map, s->map_size);
+	s->map = NULL;
+	s->map_size = 0;
+	s->count = 0;
+	s->queued = 0;
+}
+
+/* Enabled channels of the device, each one int16 slot per sample */
+static size_t sim_stride(int dev)
+{
+	static const char *const dirs[] = { "in", "out" };
+	char file[64];
+	size_t n = 0;
+	int c;
+
+	for (c = 0; c < 4; c++) {
+		snprintf(file, sizeof(file), "scan_elements/%s_voltage%d_en",
+			 dirs[dev == SIM_TX], c);
+		n += sim_attr_ll(dev, file, 0) != 0;
+	}
+
+	return n;
+}
+
+static int sim_block_alloc(struct sim_fd *s, struct iio_buffer_block_alloc_req *req)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t span;
+	unsigned int k;
+
+	if (s->count)
+		return -EBUSY;
+	if (!req->size || !req->count)
+		return -EINVAL;
+	if (req->count > SIM_MAX_BLOCKS)
+		req->count = SIM_MAX_BLOCKS;
+
+	span = (req->size + page - 1) / page * page;
+	s->map_size = span * req->count;
+	if (ftruncate(s->fd, s->map_size))
+		return -errno;
+
+	s->map = mmap(NULL, s->map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		      s->fd, 0);
+	if (s->map == MAP_FAILED) {
+		s->map = NULL;
+		return -errno;
+	}
+
+	s->ring = sim_ring_map();
+	if (!s->ring) {
+		sim_free_blocks(s);
+		return -ENOMEM;
+	}
+
+	for (k = 0; k < req->count; k++) {
+		memset(&s->blocks[k], 0, sizeof(s->blocks[k]));
+		s->blocks[k].id = k;
+		s->blocks[k].size = req->size;
+		s->blocks[k].data.offset = k * span;
+	}
+	s->count = req->count;
+	memset(&s->pacer, 0, sizeof(s->pacer));
+	/* TX: the enqueued blocks are the queue, one is sent per dequeue */
+	if (s->dev == SIM_TX)
+		s->pacer.depth = 1;
+	memset(&s->rx, 0, sizeof(s->rx));
+
+	return 0;
+}
+
+/**
+ * sim_block_dequeue() - hand the oldest enqueued block back
+ *
+ * For RX the block is filled with what the simulated ADC captured while
+ * its turn came; for TX its contents go on air. Either way the call
+ * takes as long as the DMA would, or fails with -EAGAIN on a
+ * non-blocking fd.
+ **/
+static int sim_block_dequeue(struct sim_fd *s, struct iio_buffer_block *b,
+			     bool block)
+{
+	bool output = s->dev == SIM_TX;
+	double fs = sim_sample_rate(s->dev);
+	struct iio_buffer_block *blk;
+	size_t stride = sim_stride(s->dev);
+	size_t samples;
+	int64_t start;
+	int ret;
+
+	if (!s->queued)
+		return -EINVAL;
+	if (stride < 2)
+		return -EINVAL;
+
+	blk = &s->blocks[s->queue[0]];
+	samples = (output ? blk->bytes_used : blk->size) / (stride * sizeof(int16_t));
+
+	ret = sim_pace(&s->pacer, fs, output, samples, block, &start);
+	if (ret)
+		return ret;
+
+	if (output)
+		sim_tx_write(s->ring, sim_ring_pos(s->ring, start, fs),
+			     (int16_t *)(s->map + blk->data.offset), stride, samples);
+	else
+		sim_rx_fill(&s->rx, s->ring, sim_ring_pos(s->ring, start, fs),
+			    (int16_t *)(s->map + blk->data.offset), stride, samples);
+
+	blk->bytes_used = samples * stride * sizeof(int16_t);
+	blk->timestamp = start < 0 ? 0 : start;
+	*b = *blk;
+
+	s->queued--;
+	memmove(s->queue, s->queue + 1, s->queued * sizeof(s->queue[0]));
+	return 0;
+}
+
+static int sim_ioctl(struct sim_fd *s, unsigned long request, void *arg, int flags)
+{
+	struct iio_buffer_block *b = arg;
+
+	switch (request) {
+	case IIO_BLOCK_ALLOC_IOCTL:
+		return sim_block_alloc(s, arg);
+	case IIO_BLOCK_FREE_IOCTL:
+		sim_free_blocks(s);
+		return 0;
+	case IIO_BLOCK_QUERY_IOCTL:
+		if (b->id >= s->count)
+			return -EINVAL;
+		*b = s->blocks[b->id];
+		return 0;
+	case IIO_BLOCK_ENQUEUE_IOCTL:
+		if (b->id >= s->count || s->queued >= s->count)
+			return -EINVAL;
+		s->blocks[b->id].bytes_used = b->bytes_used ? b->bytes_used :
+			s->blocks[b->id].size;
+		s->queue[s->queued++] = b->id;
+		return 0;
+	case IIO_BLOCK_DEQUEUE_IOCTL:
+		return sim_block_dequeue(s, b, !(flags & O_NONBLOCK));
+	default:
+		return -ENOTTY;
+	}
+}
+
+int ioctl(int fd, unsigned long request, ...)
+{
+	REAL(int, ioctl, int, unsigned long, void *);
+	struct sim_fd *s;
+	va_list ap;
+	void *arg;
+	int ret;
+
+	va_start(ap, request);
+	arg = va_arg(ap, void *);
+	va_end(ap);
+
+	s = sim_find_fd(fd);
+	if (!s)
+		return real_ioctl(fd, request, arg);
+
+	ret = sim_ioctl(s, request, arg, fcntl(fd, F_GETFL));
+	if (ret < 0) {
+		errno = -ret;
+		return -1;
+	}
+
+	return ret;
+}
+
+int close(int fd)
+{
+	REAL(int, close, int);
+	struct sim_fd *s = sim_find_fd(fd);
+
+	if (s) {
+		sim_free_blocks(s);
+		s->fd = 0;
+	}
+
+	return real_close(fd);
+}
+
+static int sim_open(const char *name, const char *path, int flags, va_list ap)
+{
+	int (*real)(const char *, int, ...) =
+		(int (*)(const char *, int, ...))dlsym(RTLD_NEXT, name);
+	char buf[SIM_PATH_MAX];
+	mode_t mode = 0;
+	int fd;
+
+	if (flags & (O_CREAT | O_TMPFILE))
+		mode = va_arg(ap, mode_t);
+
+	/* The character device is a regular file here, create it on demand */
+	if (path && !strncmp(path, "/dev/iio:device", 15)) {
+		flags |= O_CREAT;
+		mode = 0644;
+	}
+
+	fd = real(sim_path(path, buf, sizeof(buf)), flags, mode);
+	if (path)
+		sim_track_fd(path, fd);
+
+	return fd;
+}
+
+int open(const char *path, int flags, ...)
+{
+	va_list ap;
+	int fd;
+
+	va_start(ap, flags);
+	fd = sim_open("open", path, flags, ap);
+	va_end(ap);
+
+	return fd;
+}
+
+int open64(const char *path, int flags, ...)
+{
+	va_list ap;
+	int fd;
+
+	va_start(ap, flags);
+	fd = sim_open("open64", path, flags, ap);
+	va_end(ap);
+
+	return fd;
+}
+
+FILE *fopen(const char *path, const char *mode)
+{
+	REAL(FILE *, fopen, const char *, const char *);
+	char buf[SIM_PATH_MAX];
+
+	return real_fopen(sim_path(path, buf, sizeof(buf)), mode);
+}
+
+FILE *fopen64(const char *path, const char *mode)
+{
+	REAL(FILE *, fopen64, const char *, const char *);
+	char buf[SIM_PATH_MAX];
+
+	return real_fopen64(sim_path(path, buf, sizeof(buf)), mode);
+}
+
+DIR *opendir(const char *path)
+{
+	REAL(DIR *, opendir, const char *);
+	char buf[SIM_PATH_MAX];
+
+	return real_opendir(sim_path(path, buf, sizeof(buf)));
+}
+
+int access(const char *path, int mode)
+{
+	REAL(int, access, const char *, int);
+	char buf[SIM_PATH_MAX];
+
+	return real_access(sim_path(path, buf, sizeof(buf)), mode);
+}
+
+int stat(const char *path, struct stat *st)
+{
+	REAL(int, stat, const char *, struct stat *);
+	char buf[SIM_PATH_MAX];
+
+	return real_stat(sim_path(path, buf, sizeof(buf)), st);
+}
+
+int stat64(const char *path, struct stat64 *st)
+{
+	REAL(int, stat64, const char *, struct stat64 *);
+	char buf[SIM_PATH_MAX];
+
+	return real_stat64(sim_path(path, buf, sizeof(buf)), st);
+}
+
+/* Binaries built against glibc before 2.33 call stat() through these */
+int __xstat(int ver, const char *path, struct stat *st)
+{
+	REAL(int, __xstat, int, const char *, struct stat *);
+	char buf[SIM_PATH_MAX];
+
+	return real___xstat(ver, sim_path(path, buf, sizeof(buf)), st);
+}
+
+int __xstat64(int ver, const char *path, struct stat64 *st)
+{
+	REAL(int, __xstat64, int, const char *, struct stat64 *);
+	char buf[SIM_PATH_MAX];
+
+	return real___xstat64(ver, sim_path(path, buf, sizeof(buf)), st);
+}
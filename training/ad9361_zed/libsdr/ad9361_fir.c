@@ -0,0 +1,139 @@
+/**
+ * AD9361 sample rate planning and programmable FIR profiles
+ *
+ * Below 2.083 MS/s the AD9361 half-band chain cannot decimate far enough
+ * on its own and the programmable FIR has to take the last factor of 4,
+ * which takes the floor down to 520.833 kS/s. Lower still needs the
+ * FPGA interpolator/decimator (8x on Pluto), when the HDL has one.
+ *
+ * Licensed under the GPL-2.
+ *
+ **/
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "ad9361_fir.h"
+#include "fir_design.h"
+
+#define AD9361_FIR_RATIO	4
+#define AD9361_FIR_BETA		6.0
+#define AD9361_FIR_MAX_BW	0.9	/* of the baseband rate */
+
+/**
+ * ad9361_rate_plan() - choose the FIR and FPGA ratios for a host rate
+ * @fpga_ratio: ratio of the FPGA interpolator/decimator, 1 if there is none
+ *
+ * The FIR is only used where the AD9361 needs it; the FPGA stage only
+ * where the FIR alone does not reach low enough. Returns -ERANGE for
+ * rates the hardware cannot do.
+ **/
+int ad9361_rate_plan(struct ad9361_rate_plan *p, long long rate,
+		     unsigned int fpga_ratio)
+{
+	memset(p, 0, sizeof(*p));
+	p->rate = rate;
+	p->baseband = rate;
+	p->fpga_ratio = 1;
+
+	if (rate > AD9361_MAX_RATE)
+		return -ERANGE;
+
+	if (rate < AD9361_MIN_RATE_FIR) {
+		if (fpga_ratio <= 1)
+			return -ERANGE;
+		p->fpga_ratio = fpga_ratio;
+		p->baseband = rate * fpga_ratio;
+		if (p->baseband < AD9361_MIN_RATE_FIR ||
+		    p->baseband > AD9361_MAX_RATE)
+			return -ERANGE;
+	}
+
+	if (p->baseband < AD9361_MIN_RATE)
+		p->fir_ratio = AD9361_FIR_RATIO;
+
+	return 0;
+}
+
+static void quantize(int16_t *dst, const double *h, unsigned int taps,
+		     double gain)
+{
+	double peak = 0;
+	unsigned int k;
+
+	for (k = 0; k < taps; k++)
+		peak = fmax(peak, fabs(h[k] * gain));
+
+	/* Give up a little gain rather than wrap the largest tap */
+	if (peak * 32768 > 32767)
+		gain *= 32767 / (peak * 32768);
+
+	for (k = 0; k < taps; k++)
+		dst[k] = (int16_t)lrint(h[k] * gain * 32768);
+}
+
+/**
+ * ad9361_fir_design() - low pass FIR pair for one baseband rate
+ * @baseband: sample rate at the AD9361 interface
+ * @bw: RF bandwidth to pass, clamped to 0.9 of @baseband
+ * @ratio: FIR interpolation/decimation, 1, 2 or 4
+ *
+ * The filters run at ratio * @baseband and cut off halfway between the
+ * pass band edge and the Nyquist frequency of @baseband. RX has unity
+ * gain; TX makes up for the zero stuffing of the interpolator.
+ **/
+int ad9361_fir_design(struct ad9361_fir *f, long long baseband, long long bw,
+		      unsigned int ratio)
+{
+	double h[AD9361_FIR_MAX_TAPS];
+	double fc;
+
+	if (ratio != 1 && ratio != 2 && ratio != 4)
+		return -EINVAL;
+	if (baseband <= 0)
+		return -EINVAL;
+	if (bw <= 0 || bw > AD9361_FIR_MAX_BW * baseband)
+		bw = AD9361_FIR_MAX_BW * baseband;
+
+	memset(f, 0, sizeof(*f));
+	f->ratio = ratio;
+	f->taps = ratio == 1 ? 64 : AD9361_FIR_MAX_TAPS;
+
+	fc = (bw / 2.0 + baseband / 2.0) / 2.0 / ((double)baseband * ratio);
+	fir_lowpass(h, f->taps, fc, AD9361_FIR_BETA);
+
+	quantize(f->rx, h, f->taps, 1.0);
+	quantize(f->tx, h, f->taps, ratio);
+
+	return 0;
+}
+
+/**
+ * ad9361_fir_config() - format a FIR pair for the filter_fir_config attribute
+ *
+ * Returns the length written, or -ENOSPC if @buf is too small
+ * (AD9361_FIR_CONFIG_MAX always suffices).
+ **/
+int ad9361_fir_config(const struct ad9361_fir *f, char *buf, size_t len)
+{
+	size_t pos;
+	unsigned int k;
+	int ret;
+
+	ret = snprintf(buf, len, "RX 3 GAIN %d DEC %u\nTX 3 GAIN %d INT %u\n",
+		       f->rx_gain, f->ratio, f->tx_gain, f->ratio);
+	if (ret < 0 || (size_t)ret >= len)
+		return -ENOSPC;
+	pos = ret;
+
+	for (k = 0; k < f->taps; k++) {
+		ret = snprintf(buf + pos, len - pos, "%d,%d\n", f->rx[k], f->tx[k]);
+		if (ret < 0 || (size_t)ret >= len - pos)
+			return -ENOSPC;
+		pos += ret;
+	}
+
+	return pos;
+}
@@ -0,0 +1,58 @@
+/**
+ * AD9361 sample rate planning and programmable FIR profiles
+ *
+ * Licensed under the GPL-2.
+ *
+ **/
+
+#ifndef AD9361_FIR_H
+#define AD9361_FIR_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Baseband rate limits of the AD9361, 25 MHz ADC clock / 12 and / 48 */
+#define AD9361_MAX_RATE		61440000LL
+#define AD9361_MIN_RATE		2083334LL	/* without the FIR */
+#define AD9361_MIN_RATE_FIR	520834LL	/* FIR decimating/interpolating by 4 */
+
+#define AD9361_FIR_MAX_TAPS	128
+#define AD9361_FIR_CONFIG_MAX	(64 + AD9361_FIR_MAX_TAPS * 16)
+
+/**
+ * struct ad9361_rate_plan - how a host sample rate is reached
+ * @rate: sample rate seen by the host
+ * @baseband: sample rate at the AD9361 digital interface
+ * @fpga_ratio: FPGA interpolation/decimation, 1 when bypassed
+ * @fir_ratio: AD9361 FIR interpolation/decimation, 0 with the FIR disabled
+ **/
+struct ad9361_rate_plan {
+	long long rate;
+	long long baseband;
+	unsigned int fpga_ratio;
+	unsigned int fir_ratio;
+};
+
+/**
+ * struct ad9361_fir - coefficients for filter_fir_config
+ * @ratio: FIR interpolation/decimation, 1, 2 or 4
+ * @taps: taps per filter, a multiple of 16
+ * @rx_gain, @tx_gain: FIR gain settings in dB
+ * @rx, @tx: Q15 coefficients
+ **/
+struct ad9361_fir {
+	unsigned int ratio;
+	unsigned int taps;
+	int rx_gain;
+	int tx_gain;
+	int16_t rx[AD9361_FIR_MAX_TAPS];
+	int16_t tx[AD9361_FIR_MAX_TAPS];
+};
+
+int ad9361_rate_plan(struct ad9361_rate_plan *p, long long rate,
+		     unsigned int fpga_ratio);
+int ad9361_fir_design(struct ad9361_fir *f, long long baseband, long long bw,
+		      unsigned int ratio);
+int ad9361_fir_config(const struct ad9361_fir *f, char *buf, size_t len);
+
+#endif /* AD9361_FIR_H */
@@ -0,0 +1,305 @@
+/**
+ * RX and TX of an AD9361 through one libiio context
+ *
+ * The setup the full-duplex tools share: the streaming channels of the ADC
+ * and DDS cores, and one sample rate for both directions, with an AD9361
+ * FIR profile decimating on RX and interpolating on TX by the same ratio
+ * below 2.083 MHz. Errors come back as negative errnos with @failed
+ * naming what failed, for the tool to report.
+ *
+ * This is the one module that needs libiio, so it is not in libsdr.a; the
+ * tools that use it build it in.
+ *
+ * Licensed under the GPL-2.
+ *
+ **/
+
+#include <errno.h>
+#include <string.h>
+
+#include "ad9361_trx.h"
+
+#define AD9361_TRX_MIN_BW	200000LL	/* analog filter range */
+#define AD9361_TRX_MAX_BW	56000000LL
+
+static struct iio_channel *stream_chan(struct ad9361_trx *t, struct iio_device *dev,
+				       const char *name, bool output)
+{
+	struct iio_channel *chn = iio_device_find_channel(dev, name, output);
+
+	if (!chn)
+		t->failed = name;
+	return chn;
+}
+
+/**
+ * ad9361_trx_open() - find the AD9361 and enable its I/Q channels
+ * @t: state, filled in
+ * @uri: libiio context URI
+ *
+ * Returns 0, -ENODEV or a negative errno from libiio. Call
+ * ad9361_trx_close() either way.
+ **/
+int ad9361_trx_open(struct ad9361_trx *t, const char *uri)
+{
+	memset(t, 0, sizeof(*t));
+
+	t->ctx = iio_create_context_from_uri(uri);
+	if (!t->ctx) {
+		t->failed = uri;
+		return errno ? -errno : -ENODEV;
+	}
+
+	t->rx_dev = iio_context_find_device(t->ctx, "cf-ad9361-lpc");
+	t->tx_dev = iio_context_find_device(t->ctx, "cf-ad9361-dds-core-lpc");
+	if (!t->rx_dev || !t->tx_dev) {
+		t->failed = !t->rx_dev ? "cf-ad9361-lpc" : "cf-ad9361-dds-core-lpc";
+		return -ENODEV;
+	}
+
+	t->rx0_i = stream_chan(t, t->rx_dev, "voltage0", false);
+	t->rx0_q = stream_chan(t, t->rx_dev, "voltage1", false);
+	t->tx0_i = stream_chan(t, t->tx_dev, "voltage0", true);
+	t->tx0_q = stream_chan(t, t->tx_dev, "voltage1", true);
+	if (!t->rx0_i || !t->rx0_q || !t->tx0_i || !t->tx0_q)
+		return -ENODEV;
+
+	iio_channel_enable(t->rx0_i);
+	iio_channel_enable(t->rx0_q);
+	iio_channel_enable(t->tx0_i);
+	iio_channel_enable(t->tx0_q);
+	return 0;
+}
+
+/**
+ * ad9361_trx_phy_chan() - a channel of ad9361-phy
+ * @t: state
+ * @name: channel, e.g. "voltage0" or "altvoltage1"
+ * @output: the TX side rather than the RX
+ *
+ * Returns the channel, or NULL with @t->failed set.
+ **/
+struct iio_channel *ad9361_trx_phy_chan(struct ad9361_trx *t, const char *name,
+					bool output)
+{
+	struct iio_device *phy = iio_context_find_device(t->ctx, "ad9361-phy");
+	struct iio_channel *chn;
+
+	if (!phy) {
+		t->failed = "ad9361-phy";
+		return NULL;
+	}
+	chn = iio_device_find_channel(phy, name, output);
+	if (!chn)
+		t->failed = name;
+	return chn;
+}
+
+/**
+ * ad9361_trx_write() - write an integer attribute of an ad9361-phy channel
+ * @t: state
+ * @chan: channel, see ad9361_trx_phy_chan()
+ * @output: the TX side rather than the RX
+ * @attr: attribute
+ * @val: value
+ *
+ * Returns 0, -ENODEV or the negative errno of the write, with
+ * @t->failed set.
+ **/
+int ad9361_trx_write(struct ad9361_trx *t, const char *chan, bool output,
+		     const char *attr, long long val)
+{
+	struct iio_channel *chn = ad9361_trx_phy_chan(t, chan, output);
+	int ret;
+
+	if (!chn)
+		return -ENODEV;
+	ret = iio_channel_attr_write_longlong(chn, attr, val);
+	if (ret < 0) {
+		t->failed = attr;
+		return ret;
+	}
+	return 0;
+}
+
+static int write_str(struct ad9361_trx *t, const char *chan, bool output,
+		     const char *attr, const char *str)
+{
+	struct iio_channel *chn = ad9361_trx_phy_chan(t, chan, output);
+	int ret;
+
+	if (!chn)
+		return -ENODEV;
+	ret = iio_channel_attr_write(chn, attr, str);
+	if (ret < 0) {
+		t->failed = attr;
+		return ret;
+	}
+	return 0;
+}
+
+static int write_fir_en(struct ad9361_trx *t, struct iio_channel *fir_chn, bool en)
+{
+	int ret = iio_channel_attr_write_bool(fir_chn, "voltage_filter_fir_en", en);
+
+	if (ret < 0) {
+		t->failed = "voltage_filter_fir_en";
+		return ret;
+	}
+	return 0;
+}
+
+/**
+ * ad9361_trx_set_sample_rate() - the common RX/TX sample rate
+ * @t: state
+ * @rate: sample rate in Hz
+ * @bw: bandwidth in Hz the FIR profile passes, where one is needed
+ *
+ * Below AD9361_MIN_RATE an AD9361 FIR profile is designed and loaded
+ * first, with an RX half decimating and a TX half interpolating by the
+ * same ratio, and is left in @t->fir. Returns 0, -ERANGE for a rate out
+ * of range, a negative errno from the FIR design or from libiio.
+ **/
+int ad9361_trx_set_sample_rate(struct ad9361_trx *t, long long rate, long long bw)
+{
+	struct iio_device *phy = iio_context_find_device(t->ctx, "ad9361-phy");
+	struct iio_channel *fir_chn = ad9361_trx_phy_chan(t, "out", false);
+	char config[AD9361_FIR_CONFIG_MAX];
+	struct ad9361_rate_plan plan;
+	int ret;
+
+	t->fir.taps = 0;
+	if (!phy || !fir_chn)
+		return -ENODEV;
+
+	ret = ad9361_rate_plan(&plan, rate, 1);
+	if (ret) {
+		t->failed = "sample rate";
+		return ret;
+	}
+
+	if (plan.fir_ratio) {
+		ret = ad9361_fir_design(&t->fir, plan.baseband, bw, plan.fir_ratio);
+		if (!ret)
+			ret = ad9361_fir_config(&t->fir, config, sizeof(config));
+		if (ret < 0) {
+			t->fir.taps = 0;
+			t->failed = "FIR profile design";
+			return ret;
+		}
+		ret = iio_device_attr_write(phy, "filter_fir_config", config);
+		if (ret < 0) {
+			t->fir.taps = 0;
+			t->failed = "filter_fir_config";
+			return ret;
+		}
+		ret = write_fir_en(t, fir_chn, true);
+		if (ret)
+			return ret;
+	}
+
+	ret = ad9361_trx_write(t, "voltage0", false, "sampling_frequency", plan.baseband);
+	if (ret)
+		return ret;
+	t->baseband = plan.baseband;
+
+	return plan.fir_ratio ? 0 : write_fir_en(t, fir_chn, false);
+}
+
+/**
+ * ad9361_trx_configure() - set up both directions
+ * @t: state
+ * @c: sample rate, frequencies and gains
+ *
+ * Sets the sample rate with ad9361_trx_set_sample_rate(), the analog
+ * filters to it, the RX to port A_BALANCED and the TX to port A, the
+ * gains, and both LOs, and powers the TX LO up. Returns 0 or a negative
+ * errno.
+ **/
+int ad9361_trx_configure(struct ad9361_trx *t, const struct ad9361_trx_config *c)
+{
+	long long bw = c->sample_rate < AD9361_TRX_MIN_BW ? AD9361_TRX_MIN_BW : c->sample_rate;
+	int ret;
+
+	if (bw > AD9361_TRX_MAX_BW)
+		bw = AD9361_TRX_MAX_BW;
+
+	ret = ad9361_trx_set_sample_rate(t, c->sample_rate, bw);
+	if (!ret)
+		ret = write_str(t, "voltage0", false, "rf_port_select", "A_BALANCED");
+	if (!ret)
+		ret = ad9361_trx_write(t, "voltage0", false, "rf_bandwidth", bw);
+	if (!ret)
+		ret = write_str(t, "voltage0", false, "gain_control_mode",
+				c->rx_gain < 0 ? "slow_attack" : "manual");
+	if (!ret && c->rx_gain >= 0)
+		ret = ad9361_trx_write(t, "voltage0", false, "hardwaregain", c->rx_gain);
+
+	if (!ret)
+		ret = write_str(t, "voltage0", true, "rf_port_select", "A");
+	if (!ret)
+		ret = ad9361_trx_write(t, "voltage0", true, "rf_bandwidth", bw);
+	if (!ret)
+		ret = ad9361_trx_write(t, "voltage0", true, "hardwaregain", -c->tx_attenuation);
+
+	if (!ret)
+		ret = ad9361_trx_write(t, "altvoltage0", true, "frequency", c->rx_frequency);
+	if (!ret)
+		ret = ad9361_trx_write(t, "altvoltage1", true, "frequency", c->tx_frequency);
+	if (!ret)
+		ret = ad9361_trx_write(t, "altvoltage1", true, "powerdown", 0);
+
+	return ret;
+}
+
+/**
+ * ad9361_trx_create_buffers() - create the RX and TX buffers
+ * @t: state
+ * @samples: samples per block
+ * @kernel_buffers: blocks the kernel keeps in flight
+ *
+ * Returns 0 or a negative errno.
+ **/
+int ad9361_trx_create_buffers(struct ad9361_trx *t, size_t samples,
+			      unsigned int kernel_buffers)
+{
+	int ret;
+
+	if ((ret = iio_device_set_kernel_buffers_count(t->rx_dev, kernel_buffers)) < 0 ||
+	    (ret = iio_device_set_kernel_buffers_count(t->tx_dev, kernel_buffers)) < 0) {
+		t->failed = "kernel buffer count";
+		return ret;
+	}
+
+	t->txbuf = iio_device_create_buffer(t->tx_dev, samples, false);
+	if (!t->txbuf) {
+		t->failed = "TX buffer";
+		return -errno;
+	}
+	t->rxbuf = iio_device_create_buffer(t->rx_dev, samples, false);
+	if (!t->rxbuf) {
+		t->failed = "RX buffer";
+		return -errno;
+	}
+	return 0;
+}
+
+/* Destroy the buffers, disable the channels and close the context */
+void ad9361_trx_close(struct ad9361_trx *t)
+{
+	if (t->rxbuf)
+		iio_buffer_destroy(t->rxbuf);
+	if (t->txbuf)
+		iio_buffer_destroy(t->txbuf);
+	if (t->rx0_i)
+		iio_channel_disable(t->rx0_i);
+	if (t->rx0_q)
+		iio_channel_disable(t->rx0_q);
+	if (t->tx0_i)
+		iio_channel_disable(t->tx0_i);
+	if (t->tx0_q)
+		iio_channel_disable(t->tx0_q);
+	if (t->ctx)
+		iio_context_destroy(t->ctx);
+	memset(t, 0, sizeof(*t));
+}
@@ -0,0 +1,65 @@
+/**
+ * RX and TX of an AD9361 through one libiio context
+ *
+ * Licensed under the GPL-2.
+ *
+ **/
+
+#ifndef AD9361_TRX_H
+#define AD9361_TRX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <iio.h>
+
+#include "ad9361_fir.h"
+
+/**
+ * struct ad9361_trx - the streaming devices of an AD9361, both directions
+ * @ctx: IIO context, NULL when closed
+ * @rx_dev, @tx_dev: the ADC core (RX) and the DDS core (TX)
+ * @rx0_i, @rx0_q, @tx0_i, @tx0_q: I/Q channels, enabled by ad9361_trx_open()
+ * @rxbuf, @txbuf: buffers of ad9361_trx_create_buffers(), or NULL
+ * @fir: the FIR profile ad9361_trx_configure() loaded, @fir.taps 0 for none
+ * @baseband: the AD9361 sample rate ad9361_trx_configure() set
+ * @failed: after an error, the device, attribute or step that failed
+ **/
+struct ad9361_trx {
+	struct iio_context *ctx;
+	struct iio_device *rx_dev, *tx_dev;
+	struct iio_channel *rx0_i, *rx0_q;
+	struct iio_channel *tx0_i, *tx0_q;
+	struct iio_buffer *rxbuf, *txbuf;
+	struct ad9361_fir fir;
+	long long baseband;
+	const char *failed;
+};
+
+/**
+ * struct ad9361_trx_config - one sample rate and band for both directions
+ * @sample_rate: RX and TX I/Q rate in Hz; below AD9361_MIN_RATE the
+ *	AD9361 FIR decimates and interpolates
+ * @rx_frequency, @tx_frequency: LO frequencies in Hz
+ * @rx_gain: manual RX gain in dB, negative for the AGC
+ * @tx_attenuation: TX attenuation in dB
+ **/
+struct ad9361_trx_config {
+	long long sample_rate;
+	long long rx_frequency;
+	long long tx_frequency;
+	int rx_gain;
+	int tx_attenuation;
+};
+
+int ad9361_trx_open(struct ad9361_trx *t, const char *uri);
+struct iio_channel *ad9361_trx_phy_chan(struct ad9361_trx *t, const char *name,
+					bool output);
+int ad9361_trx_write(struct ad9361_trx *t, const char *chan, bool output,
+		     const char *attr, long long val);
+int ad9361_trx_set_sample_rate(struct ad9361_trx *t, long long rate, long long bw);
+int ad9361_trx_configure(struct ad9361_trx *t, const struct ad9361_trx_config *c);
+int ad9361_trx_create_buffers(struct ad9361_trx *t, size_t samples,
+			      unsigned int kernel_buffers);
+void ad9361_trx_close(struct ad9361_trx *t);
+
+#endif /* AD9361_TRX_H */
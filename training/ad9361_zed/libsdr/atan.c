@@ -0,0 +1,36 @@
+/**
+ * Fixed-point angle of a complex sample, by CORDIC and by table
+ *
+ * Licensed under the GPL-2.
+ *
+ **/
+
+#include <math.h>
+#include <pthread.h>
+
+#include "atan.h"
+
+uint16_t atan_lut[ATAN_LUT_HALF << ATAN_LUT_BITS];
+int32_t atan_cordic_step[ATAN_CORDIC_STEPS];
+
+static pthread_once_t atan_once = PTHREAD_ONCE_INIT;
+
+static void atan_fill(void)
+{
+	unsigned int x, y, k;
+
+	for (x = 0; x < ATAN_LUT_HALF; x++)
+		for (y = 0; y < 1 << ATAN_LUT_BITS; y++)
+			atan_lut[x << ATAN_LUT_BITS | y] =
+				lrint(atan2(y + 0.5, ATAN_LUT_HALF + x + 0.5)
+				      / (2 * M_PI) * ATAN_TURN);
+
+	for (k = 0; k < ATAN_CORDIC_STEPS; k++)
+		atan_cordic_step[k] = lrint(atan(ldexp(1, -k)) / (2 * M_PI) * ATAN_TURN);
+}
+
+/* Fill the tables, once, before the first atan_cordic() or atan_table() */
+void atan_init(void)
+{
+	pthread_once(&atan_once, atan_fill);
+}
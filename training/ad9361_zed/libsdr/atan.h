@@ -0,0 +1,88 @@
+/**
+ * Fixed-point angle of a complex sample, by CORDIC and by table
+ *
+ * Licensed under the GPL-2.
+ *
+ **/
+
+#ifndef ATAN_H
+#define ATAN_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define ATAN_TURN		65536	/* angle units in one turn */
+#define ATAN_CORDIC_STEPS	12
+#define ATAN_LUT_BITS		7	/* per axis, 2^(2 * bits - 1) entries */
+#define ATAN_LUT_HALF		(1 << (ATAN_LUT_BITS - 1))
+
+/*
+ * atan_lut: angle of (x, y) at the cell centre for 0 <= y <= x, with x
+ * scaled into the top half of its range, ATAN_LUT_HALF <= x < 2^bits.
+ * atan_cordic_step: atan(2^-k).
+ */
+extern uint16_t atan_lut[ATAN_LUT_HALF << ATAN_LUT_BITS];
+extern int32_t atan_cordic_step[ATAN_CORDIC_STEPS];
+
+void atan_init(void);
+
+/* Angle of (x, y), |x|, |y| < 2^30 */
+static inline __attribute__((always_inline)) long atan_cordic(long x, long y)
+{
+	long angle = 0, t, m;
+	unsigned int k;
+
+	/* Rotate into the right half plane, where the steps converge */
+	if (x < 0) {
+		angle = y >= 0 ? ATAN_TURN / 2 : -ATAN_TURN / 2;
+		x = -x;
+		y = -y;
+	}
+
+	/* Rotate towards y = 0, negating with a mask rather than a branch */
+	for (k = 0; k < ATAN_CORDIC_STEPS; k++) {
+		m = -(long)(y <= 0);
+		t = x;
+		x += ((y >> k) ^ m) - m;
+		y -= ((t >> k) ^ m) - m;
+		angle += (atan_cordic_step[k] ^ m) - m;
+	}
+
+	return angle;
+}
+
+/* Angle of (x, y), |x|, |y| < 2^31, from the first octant table */
+static inline __attribute__((always_inline)) long atan_table(long x, long y)
+{
+	unsigned long ax = x < 0 ? -x : x, ay = y < 0 ? -y : y, t;
+	bool swap = ay > ax;
+	long angle;
+	int shift;
+
+	if (swap) {
+		t = ax;
+		ax = ay;
+		ay = t;
+	}
+	if (!ax)
+		return 0;
+
+	/* Scale the larger of the two into the top half of the table */
+	shift = 32 - __builtin_clz((unsigned int)ax) - ATAN_LUT_BITS;
+	if (shift > 0) {
+		ax >>= shift;
+		ay >>= shift;
+	} else {
+		ax <<= -shift;
+		ay <<= -shift;
+	}
+
+	angle = atan_lut[(ax - ATAN_LUT_HALF) << ATAN_LUT_BITS | ay];
+	if (swap)
+		angle = ATAN_TURN / 4 - angle;
+	if (x < 0)
+		angle = ATAN_TURN / 2 - angle;
+	return y < 0 ? -angle : angle;
+}
+
+#endif /* ATAN_H */
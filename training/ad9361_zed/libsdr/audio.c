@@ -0,0 +1,179 @@
+/**
+ * 16-bit PCM WAV and raw s16le audio input, down-mixed to mono
+ *
+ * A file that starts with a RIFF/WAVE header is read as WAV, from its
+ * data chunk to the chunk's end; anything else is raw audio at the rate
+ * and channel count the caller gives.
+ *
+ * Licensed under the GPL-2.
+ *
+ **/
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "audio.h"
+
+/* Frames down-mixed at once by audio_read() */
+#define AUDIO_CHUNK	4096
+
+static uint32_t le32(const unsigned char *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint16_t le16(const unsigned char *p)
+{
+	return p[0] | p[1] << 8;
+}
+
+/* Parse the WAV chunks up to the data chunk */
+static int audio_parse_wav(struct audio_in *in)
+{
+	unsigned char chunk[8], fmt[16];
+	bool have_fmt = false;
+	uint32_t size;
+
+	while (fread(chunk, 1, sizeof(chunk), in->fp) == sizeof(chunk)) {
+		size = le32(chunk + 4);
+
+		if (!memcmp(chunk, "fmt ", 4)) {
+			if (size < sizeof(fmt) ||
+			    fread(fmt, 1, sizeof(fmt), in->fp) != sizeof(fmt))
+				break;
+			if ((le16(fmt) != 1 && le16(fmt) != 0xFFFE) ||
+			    le16(fmt + 14) != 16)
+				return -ENOTSUP;
+			in->channels = le16(fmt + 2);
+			in->rate = le32(fmt + 4);
+			have_fmt = true;
+			size -= sizeof(fmt);
+		} else if (!memcmp(chunk, "data", 4)) {
+			if (!have_fmt)
+				break;
+			in->data_left = size;
+			return 0;
+		}
+
+		if (fseek(in->fp, size + (size & 1), SEEK_CUR))
+			break;
+	}
+
+	return -EINVAL;
+}
+
+/**
+ * audio_open() - open a WAV or raw audio file
+ * @in: audio file state
+ * @filename: file to open
+ * @raw_rate: sample rate of raw input
+ * @raw_channels: interleaved channels of raw input
+ *
+ * Returns 0, a negative errno from opening the file, -ENOTSUP for WAV that
+ * is not 16-bit PCM or a channel count outside 1 to AUDIO_MAX_CHANNELS,
+ * or -EINVAL for a malformed WAV file. Nothing is left open on error.
+ **/
+int audio_open(struct audio_in *in, const char *filename,
+	       unsigned int raw_rate, unsigned int raw_channels)
+{
+	unsigned char hdr[12];
+	int ret = 0;
+
+	in->fp = fopen(filename, "rb");
+	if (!in->fp)
+		return -errno;
+
+	in->data_left = 0;
+	in->rate = raw_rate;
+	in->channels = raw_channels;
+	in->wav = fread(hdr, 1, sizeof(hdr), in->fp) == sizeof(hdr) &&
+		!memcmp(hdr, "RIFF", 4) && !memcmp(hdr + 8, "WAVE", 4);
+	if (in->wav)
+		ret = audio_parse_wav(in);
+	else
+		rewind(in->fp);
+
+	if (!ret && (!in->channels || in->channels > AUDIO_MAX_CHANNELS || !in->rate))
+		ret = -ENOTSUP;
+	if (ret)
+		audio_close(in);
+	return ret;
+}
+
+/**
+ * audio_read() - read and down-mix up to n frames
+ * @in: audio file state
+ * @out: n mono samples, the average of the channels
+ * @n: frames wanted
+ *
+ * Returns the frames read, fewer than @n only at the end of the audio.
+ **/
+size_t audio_read(struct audio_in *in, int16_t *out, size_t n)
+{
+	int16_t raw[AUDIO_CHUNK * AUDIO_MAX_CHANNELS];
+	const size_t frame_bytes = 2 * in->channels;
+	size_t got, total = 0, run, k;
+	unsigned int ch;
+	int sum;
+
+	if (in->wav && n * frame_bytes > in->data_left)
+		n = in->data_left / frame_bytes;
+
+	if (in->channels == 1) {
+		total = fread(out, frame_bytes, n, in->fp);
+	} else {
+		while (total < n) {
+			run = n - total < AUDIO_CHUNK ? n - total : AUDIO_CHUNK;
+			got = fread(raw, frame_bytes, run, in->fp);
+			for (k = 0; k < got; k++) {
+				for (sum = 0, ch = 0; ch < in->channels; ch++)
+					sum += raw[k * in->channels + ch];
+				out[total + k] = (int16_t)(sum / (int)in->channels);
+			}
+			total += got;
+			if (got < run)
+				break;
+		}
+	}
+
+	if (in->wav)
+		in->data_left -= total * frame_bytes;
+	return total;
+}
+
+/**
+ * audio_read_fd() - read n raw samples from a descriptor
+ * @fd: descriptor of s16le mono audio, a pipe or a file
+ * @out: n samples, padded with silence past what was read
+ * @n: samples wanted
+ *
+ * Reads in as few calls as the descriptor allows, through short reads and
+ * signals. Returns the samples read, fewer than @n only at the end of the
+ * input or on a read error.
+ **/
+size_t audio_read_fd(int fd, int16_t *out, size_t n)
+{
+	const size_t bytes = n * sizeof(*out);
+	size_t got = 0;
+	ssize_t ret;
+
+	while (got < bytes) {
+		ret = read(fd, (char *)out + got, bytes - got);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			break;
+		got += ret;
+	}
+	memset((char *)out + got, 0, bytes - got);
+
+	return got / sizeof(*out);
+}
+
+void audio_close(struct audio_in *in)
+{
+	if (in->fp)
+		fclose(in->fp);
+	in->fp = NULL;
+}
@@ -0,0 +1,39 @@
+/**
+ * 16-bit PCM WAV and raw s16le audio input, down-mixed to mono
+ *
+ * Licensed under the GPL-2.
+ *
+ **/
+
+#ifndef AUDIO_H
+#define AUDIO_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define AUDIO_MAX_CHANNELS	8
+
+/**
+ * struct audio_in - an open audio file
+ * @rate: sample rate in Hz, from the WAV header or as given for raw input
+ * @channels: interleaved channels in the file
+ * @wav: the file is WAV, otherwise raw
+ * @data_left: WAV: bytes left in the data chunk
+ **/
+struct audio_in {
+	FILE *fp;
+	unsigned int rate;
+	unsigned int channels;
+	bool wav;
+	uint32_t data_left;
+};
+
+int audio_open(struct audio_in *in, const char *filename,
+	       unsigned int raw_rate, unsigned int raw_channels);
+size_t audio_read(struct audio_in *in, int16_t *out, size_t n);
+size_t audio_read_fd(int fd, int16_t *out, size_t n);
+void audio_close(struct audio_in *in);
+
+#endif /* AUDIO_H */
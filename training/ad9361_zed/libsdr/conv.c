@@ -0,0 +1,324 @@
+/**
+ * Long FIR filters over I/Q, direct or by overlap-save FFT convolution
+ *
+ * Direct form costs a multiply-add per tap per sample, overlap-save two
+ * transforms and a complex multiply per FFT step, which grows with the
+ * log of the taps instead. conv_init() with CONV_AUTO picks direct form
+ * below CONV_FFT_TAPS and the FFT from there on.
+ *
+ * Overlap-save transforms the last @taps - 1 samples of the previous step
+ * together with @step new ones, multiplies by the transform of the taps,
+ * computed once, and keeps the @step outputs the wrap-around of the
+ * circular convolution did not touch. The transform size is the power of
+ * two that costs least per output sample. A step only completes once all
+ * its samples are in, so the FFT filter returns each block's output one
+ * step late; @delay says by how much.
+ *
+ * Licensed under the GPL-2.
+ *
+ **/
+
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "conv.h"
+#include "dsp.h"
+#include "fir_design.h"
+
+/* Bigger transforms than this many times the taps only save memory traffic */
+#define CONV_MAX_RATIO_BITS	4
+
+/* Partial sums of the direct form, which it pads the taps to a multiple of */
+#define CONV_LANES		8
+
+static const char * const method_names[] = {
+	[CONV_AUTO] = "auto",
+	[CONV_DIRECT] = "direct",
+	[CONV_FFT] = "fft",
+};
+
+/* The transform size in bits with the fewest butterflies per output */
+static unsigned int conv_fft_bits(unsigned int taps)
+{
+	unsigned int bits, best = 0, min = 1;
+	double cost, best_cost = INFINITY;
+	size_t n;
+
+	while (((size_t)1 << min) < taps)
+		min++;
+
+	for (bits = min + 1; bits <= min + CONV_MAX_RATIO_BITS && bits <= FFT_MAX_BITS; bits++) {
+		n = (size_t)1 << bits;
+		cost = (double)n * bits / (n - taps + 1);
+		if (cost < best_cost) {
+			best_cost = cost;
+			best = bits;
+		}
+	}
+
+	return best;
+}
+
+static int conv_init_fft(struct conv *c, const float *h)
+{
+	unsigned int bits = conv_fft_bits(c->taps);
+	unsigned int k;
+	size_t n;
+
+	c->plan = bits ? fft_plan(bits) : NULL;
+	if (!c->plan)
+		return bits ? -ENOMEM : -EINVAL;
+
+	n = c->plan->n;
+	c->step = n - c->taps + 1;
+	c->delay = c->step;
+	c->H = calloc(2 * n, sizeof(*c->H));
+	c->buf = calloc(2 * n, sizeof(*c->buf));
+	c->work = malloc(2 * n * sizeof(*c->work));
+	c->out = calloc(2 * c->step, sizeof(*c->out));
+	if (!c->H || !c->buf || !c->work || !c->out)
+		return -ENOMEM;
+
+	for (k = 0; k < c->taps; k++)
+		c->H[2 * k] = h[k] / n;
+	fft_forward(c->plan, c->H);
+
+	return 0;
+}
+
+static int conv_init_direct(struct conv *c, const float *h)
+{
+	unsigned int k;
+
+	c->len = (c->taps + CONV_LANES - 1) / CONV_LANES * CONV_LANES;
+	c->h = calloc(c->len, sizeof(*c->h));
+	c->hist = calloc(4 * c->len, sizeof(*c->hist));
+	if (!c->h || !c->hist)
+		return -ENOMEM;
+
+	/* Leading zeros, the newest sample meets h[0] last */
+	for (k = 0; k < c->taps; k++)
+		c->h[c->len - 1 - k] = h[k];
+
+	return 0;
+}
+
+/**
+ * conv_init() - set up a filter with no history
+ * @c: filter state
+ * @h: taps, copied
+ * @taps: number of taps, at most CONV_MAX_TAPS
+ * @method: CONV_DIRECT, CONV_FFT, or CONV_AUTO to choose by @taps
+ *
+ * Returns 0, -EINVAL or -ENOMEM.
+ **/
+int conv_init(struct conv *c, const float *h, unsigned int taps,
+	      enum conv_method method)
+{
+	int ret;
+
+	if (!taps || taps > CONV_MAX_TAPS)
+		return -EINVAL;
+
+	memset(c, 0, sizeof(*c));
+	c->taps = taps;
+	if (method == CONV_AUTO)
+		method = taps < CONV_FFT_TAPS ? CONV_DIRECT : CONV_FFT;
+	c->method = method;
+
+	c->scratch = malloc(2 * CONV_CHUNK * sizeof(*c->scratch));
+	if (!c->scratch)
+		return -ENOMEM;
+
+	ret = method == CONV_FFT ? conv_init_fft(c, h) : conv_init_direct(c, h);
+	if (ret)
+		conv_free(c);
+	return ret;
+}
+
+/**
+ * conv_lowpass() - set up a Kaiser windowed low pass filter
+ * @c: filter state
+ * @fc: cutoff as a fraction of the sample rate, below 0.5
+ * @transition: transition band width as a fraction of the sample rate
+ * @atten_db: stop band attenuation in dB
+ * @gain: pass band gain, below 1 for headroom where the input is full
+ *	scale and the filter's ringing would clip
+ *
+ * The taps follow from @transition and @atten_db; @c->taps says how many.
+ * The method is CONV_AUTO. Returns 0, -EINVAL when @fc is out of range or
+ * the filter needs more than CONV_MAX_TAPS taps, or -ENOMEM.
+ **/
+int conv_lowpass(struct conv *c, double fc, double transition, double atten_db,
+		 double gain)
+{
+	size_t taps = kaiser_taps(transition, atten_db), k;
+	double *h;
+	float *hf;
+	int ret;
+
+	if (fc <= 0 || fc >= 0.5 || transition <= 0 || taps > CONV_MAX_TAPS)
+		return -EINVAL;
+
+	h = malloc(taps * sizeof(*h));
+	hf = malloc(taps * sizeof(*hf));
+	if (!h || !hf) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	fir_lowpass(h, taps, fc, kaiser_beta(atten_db));
+	for (k = 0; k < taps; k++)
+		hf[k] = gain * h[k];
+	ret = conv_init(c, hf, taps, CONV_AUTO);
+out:
+	free(h);
+	free(hf);
+	return ret;
+}
+
+/* The FFT plan is shared and stays */
+void conv_free(struct conv *c)
+{
+	free(c->h);
+	free(c->hist);
+	free(c->H);
+	free(c->buf);
+	free(c->work);
+	free(c->out);
+	free(c->scratch);
+	memset(c, 0, sizeof(*c));
+}
+
+const char *conv_method_name(enum conv_method method)
+{
+	return method <= CONV_FFT ? method_names[method] : "unknown";
+}
+
+static inline __attribute__((always_inline))
+void conv_direct_body(struct conv *c, float *iq, size_t n)
+{
+	const unsigned int len = c->len;
+	const float *h = c->h;
+	float *hist_i = c->hist, *hist_q = c->hist + 2 * len;
+	float si[CONV_LANES], sq[CONV_LANES];
+	unsigned int pos = c->pos, j, l;
+	const float *hi, *hq;
+	size_t k;
+
+	for (k = 0; k < n; k++) {
+		hist_i[pos] = hist_i[pos + len] = iq[2 * k];
+		hist_q[pos] = hist_q[pos + len] = iq[2 * k + 1];
+		if (++pos == len)
+			pos = 0;
+
+		/* Independent partial sums so the compiler can vectorise */
+		hi = hist_i + pos;
+		hq = hist_q + pos;
+		for (l = 0; l < CONV_LANES; l++)
+			si[l] = sq[l] = 0;
+		for (j = 0; j < len; j += CONV_LANES) {
+			for (l = 0; l < CONV_LANES; l++) {
+				si[l] += h[j + l] * hi[j + l];
+				sq[l] += h[j + l] * hq[j + l];
+			}
+		}
+		for (l = 1; l < CONV_LANES; l++) {
+			si[0] += si[l];
+			sq[0] += sq[l];
+		}
+		iq[2 * k] = si[0];
+		iq[2 * k + 1] = sq[0];
+	}
+	c->pos = pos;
+}
+
+DSP_KERNEL(conv_direct, void, (struct conv *c, float *iq, size_t n),
+	   (c, iq, n))
+
+/* x *= H, n complex points */
+static inline __attribute__((always_inline))
+void conv_mul_body(float *x, const float *H, size_t n)
+{
+	float xr, xi;
+	size_t k;
+
+	for (k = 0; k < n; k++) {
+		xr = x[2 * k];
+		xi = x[2 * k + 1];
+		x[2 * k] = xr * H[2 * k] - xi * H[2 * k + 1];
+		x[2 * k + 1] = xr * H[2 * k + 1] + xi * H[2 * k];
+	}
+}
+
+DSP_KERNEL(conv_mul, void, (float *x, const float *H, size_t n), (x, H, n))
+
+/* Filter the full buffer into out and keep its end as the next overlap */
+static void conv_step(struct conv *c)
+{
+	const size_t n = c->plan->n, overlap = c->taps - 1;
+
+	memcpy(c->work, c->buf, 2 * n * sizeof(*c->work));
+	fft_forward(c->plan, c->work);
+	DSP_CALL(conv_mul)(c->work, c->H, n);
+	fft_inverse(c->plan, c->work);
+
+	memcpy(c->out, c->work + 2 * overlap, 2 * c->step * sizeof(*c->out));
+	memmove(c->buf, c->buf + 2 * c->step, 2 * overlap * sizeof(*c->buf));
+}
+
+static void conv_fft(struct conv *c, float *iq, size_t n)
+{
+	const size_t overlap = c->taps - 1;
+	size_t k = 0, run;
+
+	while (k < n) {
+		run = c->step - c->fill;
+		if (run > n - k)
+			run = n - k;
+
+		memcpy(c->buf + 2 * (overlap + c->fill), iq + 2 * k,
+		       2 * run * sizeof(*iq));
+		memcpy(iq + 2 * k, c->out + 2 * c->fill, 2 * run * sizeof(*iq));
+		c->fill += run;
+		k += run;
+
+		if (c->fill == c->step) {
+			conv_step(c);
+			c->fill = 0;
+		}
+	}
+}
+
+/* Filter n interleaved I/Q pairs in place */
+void conv_block(struct conv *c, float *iq, size_t n)
+{
+	if (c->method == CONV_FFT)
+		conv_fft(c, iq, n);
+	else
+		DSP_CALL(conv_direct)(c, iq, n);
+}
+
+/* Filter n 16-bit I/Q pairs, rounding and clamping the output */
+void conv_block_s16(struct conv *c, const int16_t *in, int16_t *out, size_t n)
+{
+	size_t k, j, run;
+	float v;
+
+	for (k = 0; k < n; k += run) {
+		run = n - k < CONV_CHUNK ? n - k : CONV_CHUNK;
+		for (j = 0; j < 2 * run; j++)
+			c->scratch[j] = in[2 * k + j];
+
+		conv_block(c, c->scratch, run);
+
+		for (j = 0; j < 2 * run; j++) {
+			v = c->scratch[j];
+			v = v < 32767.0f ? v : 32767.0f;
+			v = v > -32768.0f ? v : -32768.0f;
+			out[2 * k + j] = (int16_t)(v + copysignf(0.5f, v));
+		}
+	}
+}
@@ -0,0 +1,84 @@
+/**
+ * Long FIR filters over I/Q, direct or by overlap-save FFT convolution
+ *
+ * Licensed under the GPL-2.
+ *
+ **/
+
+#ifndef CONV_H
+#define CONV_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "fft.h"
+
+#define CONV_MAX_TAPS	8192
+#define CONV_CHUNK	4096	/* I/Q pairs converted at once by conv_block_s16() */
+
+/*
+ * From this many taps on the FFT is faster, see the conv stage of
+ * sdr-bench. The x86 value is measured (AVX-512, the two cross between 8
+ * and 16 taps); the A9 value is an estimate until measured on the board.
+ */
+#if defined(__arm__)
+#define CONV_FFT_TAPS	32
+#else
+#define CONV_FFT_TAPS	16
+#endif
+
+enum conv_method {
+	CONV_AUTO,
+	CONV_DIRECT,
+	CONV_FFT,
+};
+
+/**
+ * struct conv - filter state
+ * @method: CONV_DIRECT or CONV_FFT, never CONV_AUTO after conv_init()
+ * @taps: number of taps
+ * @delay: samples the output lags a direct-form filter by, 0 for direct
+ *	and one FFT step for the FFT
+ * @len: direct: @taps rounded up to the partial sums of the dot product
+ * @h: direct: taps, reversed and padded with zeros to @len
+ * @hist: direct: I and Q history, each stored twice so that the last
+ *	@len samples are always contiguous
+ * @pos: direct: where the next sample goes in @hist
+ * @plan: FFT: transform of @taps - 1 samples of overlap and @step new ones
+ * @step: FFT: new samples per transform
+ * @fill: FFT: new samples in @buf so far
+ * @H: FFT: transform of the taps, divided by the size
+ * @buf: FFT: input, the overlap followed by the new samples
+ * @work: FFT: transform scratch
+ * @out: FFT: the last transform's @step output samples, returned while
+ *	@buf fills up again
+ * @scratch: CONV_CHUNK float I/Q pairs for conv_block_s16()
+ **/
+struct conv {
+	enum conv_method method;
+	unsigned int taps;
+	size_t delay;
+	unsigned int len;
+	float *h;
+	float *hist;
+	unsigned int pos;
+	const struct fft_plan *plan;
+	size_t step;
+	size_t fill;
+	float *H;
+	float *buf;
+	float *work;
+	float *out;
+	float *scratch;
+};
+
+int conv_init(struct conv *c, const float *h, unsigned int taps,
+	      enum conv_method method);
+int conv_lowpass(struct conv *c, double fc, double transition, double atten_db,
+		 double gain);
+void conv_free(struct conv *c);
+const char *conv_method_name(enum conv_method method);
+void conv_block(struct conv *c, float *iq, size_t n);
+void conv_block_s16(struct conv *c, const int16_t *in, int16_t *out, size_t n);
+
+#endif /* CONV_H */
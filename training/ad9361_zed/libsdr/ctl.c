@@ -0,0 +1,277 @@
+/**
+ * Live parameter control over a Unix socket
+ *
+ * A line based protocol on a SOCK_STREAM socket, so `socat - UNIX:path`
+ * or `nc -U path` work as clients:
+ *
+ *	<param> [value]		set (or with no value, query) a parameter
+ *	get			query all parameters
+ *
+ * Values take an optional k, M or G suffix. Every command is answered
+ * with one line per parameter, once the streaming loop has applied it:
+ *
+ *	ok <param> <value> <latency in ms>
+ *	err <param> <reason>
+ *
+ * The latency runs from reading the command to the change reaching RF.
+ * The socket is non-blocking and polled between blocks, so the
+ * streaming loop never waits on a client. An event loop can instead wait
+ * for ctl_poll_fd(), one fd for the socket and all its clients.
+ *
+ * Licensed under the GPL-2.
+ *
+ **/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ctl.h"
+
+const char *const ctl_param_names[CTL_NUM_PARAMS] = {
+	[CTL_LO] = "lo",
+	[CTL_GAIN] = "gain",
+	[CTL_DEV] = "dev",
+	[CTL_OFFSET] = "offset",
+	[CTL_SQUELCH] = "squelch",
+	[CTL_GET] = "get",
+};
+
+int64_t ctl_now_ns(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+int ctl_open(struct ctl *c, const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct epoll_event ev = { .events = EPOLLIN };
+	unsigned int k;
+	int err;
+
+	memset(c, 0, sizeof(*c));
+	c->epfd = -1;
+	for (k = 0; k < CTL_MAX_CLIENTS; k++)
+		c->clients[k].fd = -1;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		c->fd = -1;
+		return -ENAMETOOLONG;
+	}
+	strcpy(addr.sun_path, path);
+	strcpy(c->path, path);
+
+	c->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (c->fd < 0)
+		return -errno;
+
+	unlink(path);
+	if (bind(c->fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    listen(c->fd, CTL_MAX_CLIENTS))
+		goto err;
+
+	c->epfd = epoll_create1(EPOLL_CLOEXEC);
+	ev.data.fd = c->fd;
+	if (c->epfd < 0 || epoll_ctl(c->epfd, EPOLL_CTL_ADD, c->fd, &ev))
+		goto err;
+
+	return 0;
+
+err:
+	err = -errno;
+	if (c->epfd >= 0)
+		close(c->epfd);
+	c->epfd = -1;
+	close(c->fd);
+	c->fd = -1;
+	return err;
+}
+
+void ctl_close(struct ctl *c)
+{
+	unsigned int k;
+
+	if (c->fd < 0)
+		return;
+
+	for (k = 0; k < CTL_MAX_CLIENTS; k++)
+		if (c->clients[k].fd >= 0)
+			close(c->clients[k].fd);
+	close(c->fd);
+	close(c->epfd);
+	unlink(c->path);
+	c->fd = -1;
+	c->epfd = -1;
+}
+
+/**
+ * ctl_poll_fd() - one fd to wait on for the socket and its clients
+ * @c: control socket
+ *
+ * Readable when a client connects or sends, until ctl_poll() has been
+ * called until it returns 0. Returns -1 when the socket is closed.
+ **/
+int ctl_poll_fd(const struct ctl *c)
+{
+	return c->fd < 0 ? -1 : c->epfd;
+}
+
+static void ctl_send(struct ctl *c, int client, const char *msg)
+{
+	struct ctl_client *cl = &c->clients[client];
+
+	if (cl->fd >= 0 && send(cl->fd, msg, strlen(msg), MSG_NOSIGNAL) < 0 &&
+	    errno != EAGAIN) {
+		close(cl->fd);
+		cl->fd = -1;
+	}
+}
+
+void ctl_reply(struct ctl *c, const struct ctl_cmd *cmd, int err,
+	       double value, double latency_s)
+{
+	char msg[CTL_LINE_MAX];
+
+	if (err)
+		snprintf(msg, sizeof(msg), "err %s %s\n",
+			 ctl_param_names[cmd->param], strerror(-err));
+	else
+		snprintf(msg, sizeof(msg), "ok %s %.10g %.3f\n",
+			 ctl_param_names[cmd->param], value, latency_s * 1e3);
+
+	ctl_send(c, cmd->client, msg);
+}
+
+static int ctl_parse(char *line, struct ctl_cmd *cmd)
+{
+	char *name, *arg, *end;
+	unsigned int p;
+
+	name = strtok(line, " \t\r");
+	if (!name)
+		return -EINVAL;
+
+	for (p = 0; p < CTL_NUM_PARAMS; p++)
+		if (!strcmp(name, ctl_param_names[p]))
+			break;
+	if (p == CTL_NUM_PARAMS)
+		return -EINVAL;
+	cmd->param = p;
+
+	arg = strtok(NULL, " \t\r");
+	cmd->has_value = arg != NULL;
+	if (!arg)
+		return 0;
+	if (p == CTL_GET)
+		return -EINVAL;
+
+	cmd->value = strtod(arg, &end);
+	if (end == arg)
+		return -EINVAL;
+
+	switch (*end) {
+	case 'k': cmd->value *= 1e3; end++; break;
+	case 'M': cmd->value *= 1e6; end++; break;
+	case 'G': cmd->value *= 1e9; end++; break;
+	}
+
+	return *end ? -EINVAL : 0;
+}
+
+/* Take one complete line out of a client's buffer, if there is one */
+static bool ctl_take_line(struct ctl_client *cl, char *line)
+{
+	char *nl = memchr(cl->line, '\n', cl->len);
+	unsigned int n;
+
+	if (!nl)
+		return false;
+
+	n = nl - cl->line;
+	memcpy(line, cl->line, n);
+	line[n] = '\0';
+	cl->len -= n + 1;
+	memmove(cl->line, nl + 1, cl->len);
+
+	return true;
+}
+
+/**
+ * ctl_poll() - fetch the next pending command without blocking
+ *
+ * Returns 1 with @cmd filled in, or 0 when nothing is pending. Malformed
+ * commands are answered here and skipped.
+ **/
+int ctl_poll(struct ctl *c, struct ctl_cmd *cmd)
+{
+	struct epoll_event ev = { .events = EPOLLIN };
+	char line[CTL_LINE_MAX];
+	unsigned int k;
+	int fd;
+
+	if (c->fd < 0)
+		return 0;
+
+	while ((fd = accept4(c->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+		for (k = 0; k < CTL_MAX_CLIENTS && c->clients[k].fd >= 0; k++)
+			;
+		if (k == CTL_MAX_CLIENTS) {
+			close(fd);
+			continue;
+		}
+		c->clients[k].fd = fd;
+		c->clients[k].len = 0;
+
+		/* Closing a client takes it out of the set again */
+		ev.data.fd = fd;
+		epoll_ctl(c->epfd, EPOLL_CTL_ADD, fd, &ev);
+	}
+
+	for (k = 0; k < CTL_MAX_CLIENTS; k++) {
+		struct ctl_client *cl = &c->clients[k];
+
+		while (cl->fd >= 0) {
+			ssize_t n;
+
+			if (ctl_take_line(cl, line)) {
+				memset(cmd, 0, sizeof(*cmd));
+				cmd->client = k;
+				cmd->recv_ns = ctl_now_ns();
+				if (!line[0])
+					continue;
+				if (!ctl_parse(line, cmd))
+					return 1;
+				ctl_send(c, k, "err syntax\n");
+				continue;
+			}
+
+			if (cl->len == sizeof(cl->line)) {
+				cl->len = 0;
+				ctl_send(c, k, "err line too long\n");
+			}
+
+			n = read(cl->fd, cl->line + cl->len, sizeof(cl->line) - cl->len);
+			if (n > 0) {
+				cl->len += n;
+				continue;
+			}
+			if (n < 0 && errno == EAGAIN)
+				break;
+
+			close(cl->fd);
+			cl->fd = -1;
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,70 @@
+/**
+ * Live parameter control over a Unix socket
+ *
+ * Licensed under the GPL-2.
+ *
+ **/
+
+#ifndef CTL_H
+#define CTL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define CTL_MAX_CLIENTS	4
+#define CTL_LINE_MAX	128
+
+enum ctl_param {
+	CTL_LO,		/* LO frequency, Hz */
+	CTL_GAIN,	/* hardware gain, dB (negative attenuation on TX) */
+	CTL_DEV,	/* peak deviation, Hz */
+	CTL_OFFSET,	/* signal offset from the LO, Hz */
+	CTL_SQUELCH,	/* squelch level, dBFS */
+	CTL_GET,	/* report all values */
+	CTL_NUM_PARAMS,
+};
+
+/**
+ * struct ctl_cmd - one parsed command
+ * @client: index of the client to reply to
+ * @has_value: a value was given, otherwise the current value is queried
+ * @recv_ns: CLOCK_MONOTONIC time the command was read
+ **/
+struct ctl_cmd {
+	int client;
+	enum ctl_param param;
+	bool has_value;
+	double value;
+	int64_t recv_ns;
+};
+
+struct ctl_client {
+	int fd;
+	char line[CTL_LINE_MAX];
+	unsigned int len;
+};
+
+/**
+ * struct ctl - control socket
+ * @fd: listening socket, -1 when closed
+ * @epfd: epoll set of @fd and the clients, readable when ctl_poll() has
+ *	something to do, see ctl_poll_fd()
+ **/
+struct ctl {
+	int fd;
+	int epfd;
+	char path[108];
+	struct ctl_client clients[CTL_MAX_CLIENTS];
+};
+
+extern const char *const ctl_param_names[CTL_NUM_PARAMS];
+
+int ctl_open(struct ctl *c, const char *path);
+void ctl_close(struct ctl *c);
+int ctl_poll(struct ctl *c, struct ctl_cmd *cmd);
+int ctl_poll_fd(const struct ctl *c);
+void ctl_reply(struct ctl *c, const struct ctl_cmd *cmd, int err,
+	       double value, double latency_s);
+int64_t ctl_now_ns(void);
+
+#endif /* CTL_H */
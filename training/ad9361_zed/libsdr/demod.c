@@ -0,0 +1,342 @@
+/**
+ * Multi-mode demodulator: WBFM, NBFM, AM, USB and LSB
+ *
+ * WBFM is the fm_demod pipeline, with its choice of discriminators and
+ * its split across threads. The narrowband modes share one pipeline:
+ * the I/Q is decimated to the audio rate by a polyphase FIR, filtered to
+ * the channel, put through the detector of the mode and scaled to the
+ * audio range. The channel filter is as long as its transition band and
+ * DEMOD_CHANNEL_ATTEN_DB ask for, hundreds of taps for SSB, so it runs on
+ * chunks of the block through conv.
+ * The mode is a constant of each instance of that loop, built with
+ * DSP_KERNEL() like the other kernels, so the loops have no mode branches.
+ *
+ * USB and LSB are Weaver demodulators: the sideband is shifted down by the
+ * middle of the audio band, low-passed to half its width, shifted back and
+ * the real part taken.
+ *
+ * Licensed under the GPL-2.
+ *
+ **/
+
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "atan.h"
+#include "demod.h"
+#include "dsp.h"
+#include "fir_design.h"
+
+/* Time constant of the AM carrier level, in audio samples */
+#define DEMOD_AM_CARRIER	1024
+
+/* Middle of the SSB audio band */
+#define DEMOD_SSB_CENTRE	1500.0
+
+/* Stop band of the decimating filter, where signals fold into the channel */
+#define DEMOD_AA_ATTEN_DB	60.0
+
+/* Stop band of the channel filter: the opposite sideband, adjacent channels */
+#define DEMOD_CHANNEL_ATTEN_DB	60.0
+
+/*
+ * Its DC gain in integer taps. The sums stay integer so the loops
+ * vectorize, and in 32 bits: with the negative lobes the taps add up to
+ * under 1.3 times this in magnitude, times full-scale 16-bit samples.
+ */
+#define DEMOD_AA_ONE		32768
+
+/**
+ * struct demod_params - fixed parameters of a mode
+ * @bandwidth: channel filter pass band edge, half the channel width, in Hz
+ * @stop: where its stop band starts, in Hz. NBFM: the adjacent channel 12.5
+ *	kHz away, less its deviation and audio. AM: the adjacent carrier's
+ *	nearer sideband from 3 kHz on. SSB: the opposite sideband, 150 Hz
+ *	up, once shifted by DEMOD_SSB_CENTRE.
+ * @deviation: frequency deviation in Hz that gives full-scale audio (FM)
+ **/
+struct demod_params {
+	const char *name;
+	double bandwidth;
+	double stop;
+	double deviation;
+};
+
+static const struct demod_params params[DEMOD_NUM_MODES] = {
+	[DEMOD_WBFM] = { "wbfm", 100000, 0, 75000 },
+	[DEMOD_NBFM] = { "nbfm", 6250, 7000, 2500 },
+	[DEMOD_AM] = { "am", 5000, 6000, 0 },
+	[DEMOD_USB] = { "usb", 1350, 1650, 0 },
+	[DEMOD_LSB] = { "lsb", 1350, 1650, 0 },
+};
+
+/*
+ * Decimating low pass ahead of the channel filter. It passes the channel,
+ * up to @edge Hz, and stops everything that would fold onto it, from the
+ * audio rate less @edge on; the band between folds onto the part of the
+ * audio band the channel filter takes out.
+ */
+static int demod_aa_init(struct demod *d, double edge, double sample_rate)
+{
+	const unsigned int decimation = d->decimation;
+	const double rate = sample_rate / decimation;
+	size_t taps = kaiser_taps((rate - 2 * edge) / sample_rate, DEMOD_AA_ATTEN_DB);
+	unsigned int phases = (taps + decimation - 1) / decimation, p, j;
+	double *h;
+
+	if (phases > DEMOD_AA_MAX_PHASES)
+		phases = DEMOD_AA_MAX_PHASES;
+	if (phases * decimation > DEMOD_AA_MAX_TAPS)
+		phases = DEMOD_AA_MAX_TAPS / decimation;
+	if (!phases)
+		return -EINVAL;
+
+	h = malloc(phases * decimation * sizeof(*h));
+	if (!h)
+		return -ENOMEM;
+	fir_lowpass(h, phases * decimation, rate / 2 / sample_rate,
+		    kaiser_beta(DEMOD_AA_ATTEN_DB));
+	for (j = 0; j < decimation; j++)
+		for (p = 0; p < phases; p++)
+			d->aa[p * decimation + j] = (int16_t)lrint(DEMOD_AA_ONE *
+					h[p * decimation + decimation - 1 - j]);
+	free(h);
+
+	d->aa_phases = phases;
+	return 0;
+}
+
+/**
+ * demod_init() - set up a demodulator
+ * @d: demodulator state
+ * @mode: "wbfm", "nbfm", "am", "usb" or "lsb"
+ * @decimation: I/Q samples per audio sample
+ * @sub: WBFM discriminator input subsampling, see fm_demod_init()
+ * @sample_rate: I/Q sample rate in Hz
+ *
+ * WBFM starts with the quadricorrelator; fm_demod_discriminator() on @d->fm
+ * picks another. demod_free() frees the channel filter again. Returns 0,
+ * -EINVAL or -ENOMEM.
+ **/
+int demod_init(struct demod *d, const char *mode, unsigned int decimation,
+	       unsigned int sub, double sample_rate)
+{
+	double rate;
+	int m, ret;
+
+	for (m = 0; m < DEMOD_NUM_MODES; m++)
+		if (!strcmp(mode, params[m].name))
+			break;
+	if (m == DEMOD_NUM_MODES || !decimation || sample_rate <= 0)
+		return -EINVAL;
+
+	rate = sample_rate / decimation;
+	memset(d, 0, sizeof(*d));
+	d->mode = m;
+	d->decimation = decimation;
+	fm_demod_init(&d->fm, decimation, sub);
+	if (m == DEMOD_WBFM)
+		return 0;
+
+	ret = demod_aa_init(d, m == DEMOD_USB || m == DEMOD_LSB ?
+			   DEMOD_SSB_CENTRE + params[m].bandwidth : params[m].bandwidth,
+			   sample_rate);
+	if (ret)
+		return ret;
+	ret = conv_lowpass(&d->chan, (params[m].bandwidth + params[m].stop) / 2 / rate,
+			   (params[m].stop - params[m].bandwidth) / rate,
+			   DEMOD_CHANNEL_ATTEN_DB, 1.0);
+	if (ret)
+		return ret;
+
+	fm_mod_init(&d->bfo, 0, DEMOD_SSB_CENTRE, rate);
+	if (m == DEMOD_NBFM)
+		d->gain = FM_DEMOD_AUDIO_MAX / (params[m].deviation / rate * ATAN_TURN);
+
+	return 0;
+}
+
+void demod_free(struct demod *d)
+{
+	conv_free(&d->chan);
+}
+
+const char *demod_mode_name(enum demod_mode mode)
+{
+	return mode < DEMOD_NUM_MODES ? params[mode].name : "unknown";
+}
+
+/*
+ * n I/Q pairs to n / decimation audio samples, DEMOD_CHUNK at a time:
+ * decimated and shifted into @d->work, through the channel filter, and
+ * detected. The shift back of SSB replays the oscillator from the start
+ * of the chunk. mode is a constant.
+ */
+static inline __attribute__((always_inline))
+size_t demod_narrow_body(struct demod *d, const int16_t *iq, size_t n,
+			 int16_t *audio, const enum demod_mode mode)
+{
+	const unsigned int decimation = d->decimation;
+	const unsigned int phases = d->aa_phases;
+	float *const w = d->work;
+	long long power = 0;
+	size_t k = 0, j, m, run, out = 0;
+	long a, b;
+	float i, q, c, s, t, v, env;
+	const int16_t *h;
+	int16_t ci, cs;
+	unsigned int p;
+	uint32_t phase;
+
+	while (k + decimation <= n) {
+		run = (n - k) / decimation;
+		if (run > DEMOD_CHUNK)
+			run = DEMOD_CHUNK;
+		phase = d->bfo.phase;
+
+		for (m = 0; m < run; m++, k += decimation) {
+			const int16_t *x = iq + 2 * k;
+
+			for (j = 0; j < decimation; j++) {
+				a = x[2 * j];
+				b = x[2 * j + 1];
+				power += a * a + b * b;
+			}
+
+			/* The group adds to each of the next phases audio samples */
+			h = d->aa;
+			for (p = 0; p < phases; p++, h += decimation) {
+				int32_t si = 0, sq = 0;
+
+				for (j = 0; j < decimation; j++) {
+					si += h[j] * x[2 * j];
+					sq += h[j] * x[2 * j + 1];
+				}
+				d->aa_i[p] += si;
+				d->aa_q[p] += sq;
+			}
+			i = d->aa_i[0] * (1.0f / DEMOD_AA_ONE);
+			q = d->aa_q[0] * (1.0f / DEMOD_AA_ONE);
+			for (p = 1; p < phases; p++) {
+				d->aa_i[p - 1] = d->aa_i[p];
+				d->aa_q[p - 1] = d->aa_q[p];
+			}
+			d->aa_i[phases - 1] = 0;
+			d->aa_q[phases - 1] = 0;
+
+			if (mode == DEMOD_USB || mode == DEMOD_LSB) {
+				/* Shift the sideband's middle to 0 Hz */
+				fm_mod_iq(d->bfo.phase, &ci, &cs);
+				c = ci * (1.0f / FM_MOD_AMPLITUDE);
+				s = (mode == DEMOD_USB ? cs : -cs) * (1.0f / FM_MOD_AMPLITUDE);
+				d->bfo.phase += d->bfo.offset;
+				t = i * c + q * s;
+				q = q * c - i * s;
+				i = t;
+			}
+			w[2 * m] = i;
+			w[2 * m + 1] = q;
+		}
+
+		conv_block(&d->chan, w, run);
+
+		for (m = 0; m < run; m++) {
+			i = w[2 * m];
+			q = w[2 * m + 1];
+
+			switch (mode) {
+			case DEMOD_NBFM:
+				/*
+				 * In float: a weak carrier's product is a few units,
+				 * and at the audio rate atan2f() costs next to nothing
+				 */
+				v = atan2f(q * d->i1 - i * d->q1, i * d->i1 + q * d->q1) *
+				    (float)(ATAN_TURN / (2 * M_PI)) * d->gain;
+				d->i1 = i;
+				d->q1 = q;
+				break;
+			case DEMOD_AM:
+				env = sqrtf(i * i + q * q);
+				d->carrier += (env - d->carrier) * (1.0f / DEMOD_AM_CARRIER);
+				v = d->carrier > 1 ? (env - d->carrier) / d->carrier * FM_DEMOD_AUDIO_MAX : 0;
+				break;
+			default:
+				/* Shift back and take the real part */
+				fm_mod_iq(phase, &ci, &cs);
+				c = ci * (1.0f / FM_MOD_AMPLITUDE);
+				s = (mode == DEMOD_USB ? cs : -cs) * (1.0f / FM_MOD_AMPLITUDE);
+				phase += d->bfo.offset;
+				v = i * c - q * s;
+				if (fabsf(v) > d->peak)
+					d->peak = fabsf(v);
+				v *= d->gain;
+				break;
+			}
+
+			if (v > FM_DEMOD_AUDIO_MAX)
+				v = FM_DEMOD_AUDIO_MAX;
+			else if (v < -FM_DEMOD_AUDIO_MAX)
+				v = -FM_DEMOD_AUDIO_MAX;
+			audio[out++] = (int16_t)v;
+		}
+	}
+
+	/* SSB has no level reference, scale to the peak of the block */
+	if (mode == DEMOD_USB || mode == DEMOD_LSB) {
+		d->gain = d->peak > 0 ? FM_DEMOD_AUDIO_MAX / d->peak : 0;
+		d->peak = 0;
+	}
+	d->power = power;
+	d->count = k;
+
+	return out;
+}
+
+#define DEMOD_MODE(name, mode) \
+static inline __attribute__((always_inline)) \
+size_t name##_body(struct demod *d, const int16_t *iq, size_t n, int16_t *audio) \
+{ \
+	return demod_narrow_body(d, iq, n, audio, mode); \
+} \
+DSP_KERNEL(name, size_t, \
+	   (struct demod *d, const int16_t *iq, size_t n, int16_t *audio), \
+	   (d, iq, n, audio))
+
+DEMOD_MODE(demod_nbfm, DEMOD_NBFM)
+DEMOD_MODE(demod_am, DEMOD_AM)
+DEMOD_MODE(demod_usb, DEMOD_USB)
+DEMOD_MODE(demod_lsb, DEMOD_LSB)
+
+/**
+ * demod_block() - demodulate one block of I/Q
+ * @d: demodulator state
+ * @iq: n interleaved I/Q pairs
+ * @n: number of I/Q pairs, at least 2
+ * @audio: output, room for n / @d->decimation samples
+ * @pool: threads for WBFM, see fm_demod_block_parallel(), or NULL
+ *
+ * Returns the number of audio samples written.
+ **/
+size_t demod_block(struct demod *d, const int16_t *iq, size_t n,
+		   int16_t *audio, struct par_pool *pool)
+{
+	size_t out;
+
+	switch (d->mode) {
+	case DEMOD_NBFM:
+		return DSP_CALL(demod_nbfm)(d, iq, n, audio);
+	case DEMOD_AM:
+		return DSP_CALL(demod_am)(d, iq, n, audio);
+	case DEMOD_USB:
+		return DSP_CALL(demod_usb)(d, iq, n, audio);
+	case DEMOD_LSB:
+		return DSP_CALL(demod_lsb)(d, iq, n, audio);
+	default:
+		out = fm_demod_block_parallel(&d->fm, iq, n, audio, pool);
+		d->power = d->fm.power;
+		d->count = d->fm.count;
+		return out;
+	}
+}
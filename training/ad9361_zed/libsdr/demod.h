@@ -0,0 +1,80 @@
+/**
+ * Multi-mode demodulator: WBFM, NBFM, AM, USB and LSB
+ *
+ * Licensed under the GPL-2.
+ *
+ **/
+
+#ifndef DEMOD_H
+#define DEMOD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "conv.h"
+#include "fm_demod.h"
+#include "fm_mod.h"
+#include "par.h"
+
+#define DEMOD_CHUNK		1024	/* audio samples filtered at once */
+#define DEMOD_AA_MAX_PHASES	8	/* audio samples the decimating filter spans */
+#define DEMOD_AA_MAX_TAPS	4096
+
+enum demod_mode {
+	DEMOD_WBFM,
+	DEMOD_NBFM,
+	DEMOD_AM,
+	DEMOD_USB,
+	DEMOD_LSB,
+	DEMOD_NUM_MODES
+};
+
+/**
+ * struct demod - demodulator state
+ * @mode: modulation
+ * @decimation: I/Q samples per audio sample
+ * @fm: the WBFM pipeline, see fm_demod.h
+ * @aa_phases: audio samples the decimating filter of the other modes spans;
+ *	it has @aa_phases * @decimation taps
+ * @aa: its taps by phase, scaled to a DC gain of DEMOD_AA_ONE: what group sample j adds to the p-th audio
+ *	sample from now, tap p * @decimation + @decimation - 1 - j, is at
+ *	[p * @decimation + j]
+ * @aa_i, @aa_q: partial sums of the next @aa_phases audio samples
+ * @chan: channel filter of the other modes, at the audio rate
+ * @work: up to DEMOD_CHUNK I/Q pairs at the audio rate, on their way
+ *	through @chan
+ * @i1, @q1: previous channel sample (NBFM)
+ * @bfo: Weaver oscillator, an FM modulator with no deviation (SSB)
+ * @carrier: average envelope (AM)
+ * @peak: largest audio magnitude so far in this block (SSB)
+ * @gain: audio per detector unit; for SSB from the peak of the previous
+ *	block, 0 until there was one
+ * @power: sum of I^2 + Q^2 over the samples of the last block
+ * @count: number of samples in @power
+ **/
+struct demod {
+	enum demod_mode mode;
+	unsigned int decimation;
+	struct fm_demod fm;
+	unsigned int aa_phases;
+	int16_t aa[DEMOD_AA_MAX_TAPS];
+	int32_t aa_i[DEMOD_AA_MAX_PHASES], aa_q[DEMOD_AA_MAX_PHASES];
+	struct conv chan;
+	float work[2 * DEMOD_CHUNK];
+	float i1, q1;
+	struct fm_mod bfo;
+	float carrier;
+	float peak;
+	float gain;
+	long long power;
+	unsigned int count;
+};
+
+int demod_init(struct demod *d, const char *mode, unsigned int decimation,
+	       unsigned int sub, double sample_rate);
+void demod_free(struct demod *d);
+const char *demod_mode_name(enum demod_mode mode);
+size_t demod_block(struct demod *d, const int16_t *iq, size_t n,
+		   int16_t *audio, struct par_pool *pool);
+
+#endif /* DEMOD_H */
@@ -0,0 +1,142 @@
+/**
+ * Channel filter rejection of demod
+ *
+ * Each narrowband mode gets a wanted signal with a 1 kHz tone and an
+ * unwanted one of the same level where its channel filter has to take it
+ * out: for USB and LSB a 300 Hz tone on the opposite sideband, which once
+ * shifted lies just past the filter edge; for AM the carrier of the
+ * channel 9 kHz up, for NBFM that of the channel 12.5 kHz up. What of the
+ * unwanted signal reaches the audio, the 300 Hz tone or the beat with the
+ * adjacent carrier, is compared with the 1 kHz tone.
+ *
+ * Licensed under the GPL-2.
+ *
+ **/
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "demod.h"
+
+#define DECIMATION	48
+#define RATE		(48000.0 * DECIMATION)
+#define BLOCK		(DECIMATION * 2400)	/* 50 ms, whole cycles of every tone */
+#define BLOCKS		30
+#define MEASURE		10			/* the last blocks, once the filter is full */
+#define AMPLITUDE	1000.0
+#define REJECTION_DB	40.0
+
+/**
+ * struct signal - a test signal, the wanted one at 0 Hz
+ * @mode: demodulator
+ * @leak: audio frequency the unwanted signal shows up at
+ * @offset: frequency of the unwanted signal, negative for the opposite
+ *	sideband of SSB
+ **/
+struct signal {
+	const char *mode;
+	double leak;
+	double offset;
+};
+
+static const struct signal signals[] = {
+	{ "usb", 300, -300 },
+	{ "lsb", 300, 300 },
+	{ "am", 9000, 9000 },
+	{ "nbfm", 12500, 12500 },
+};
+
+/* Amplitude of the f Hz component of n audio samples */
+static double tone_level(const int16_t *audio, size_t n, double f)
+{
+	double c = 0, s = 0;
+	size_t k;
+
+	for (k = 0; k < n; k++) {
+		c += audio[k] * cos(2 * M_PI * f * k / 48000);
+		s += audio[k] * sin(2 * M_PI * f * k / 48000);
+	}
+
+	return 2 * sqrt(c * c + s * s) / n;
+}
+
+/* I/Q pair k of the wanted signal plus the unwanted one */
+static void sample(const struct signal *sig, size_t k, int16_t *iq)
+{
+	double t = k / RATE, tone = sin(2 * M_PI * 1000 * t);
+	double i, q, phase;
+
+	switch (sig->mode[0]) {
+	case 'u':
+		i = AMPLITUDE * cos(2 * M_PI * 1000 * t);
+		q = AMPLITUDE * sin(2 * M_PI * 1000 * t);
+		break;
+	case 'l':
+		i = AMPLITUDE * cos(2 * M_PI * 1000 * t);
+		q = -AMPLITUDE * sin(2 * M_PI * 1000 * t);
+		break;
+	case 'a':
+		i = AMPLITUDE * (1 + 0.5 * tone);
+		q = 0;
+		break;
+	default:
+		/* 2.5 kHz deviation, full-scale NBFM audio */
+		phase = 2500.0 / 1000 * -cos(2 * M_PI * 1000 * t);
+		i = AMPLITUDE * cos(phase);
+		q = AMPLITUDE * sin(phase);
+		break;
+	}
+	i += AMPLITUDE * cos(2 * M_PI * sig->offset * t);
+	q += AMPLITUDE * sin(2 * M_PI * sig->offset * t);
+
+	iq[0] = lrint(i);
+	iq[1] = lrint(q);
+}
+
+static int check(const struct signal *sig)
+{
+	static int16_t iq[2 * BLOCK], audio[BLOCK / DECIMATION * MEASURE];
+	double wanted, leak;
+	struct demod d;
+	size_t b, k, out = 0;
+	int ret;
+
+	ret = demod_init(&d, sig->mode, DECIMATION, 1, RATE);
+	if (ret) {
+		fprintf(stderr, "demod_init(%s): %d\n", sig->mode, ret);
+		return -1;
+	}
+
+	for (k = 0; k < BLOCK; k++)
+		sample(sig, k, &iq[2 * k]);
+	for (b = 0; b < BLOCKS; b++) {
+		if (b < BLOCKS - MEASURE)
+			demod_block(&d, iq, BLOCK, audio, NULL);
+		else
+			out += demod_block(&d, iq, BLOCK, audio + out, NULL);
+	}
+	demod_free(&d);
+
+	wanted = tone_level(audio, out, 1000);
+	leak = tone_level(audio, out, sig->leak);
+	printf("demod_test: %-4s 1 kHz at %.0f, %.0f Hz %.1f dB down\n",
+	       sig->mode, wanted, sig->leak, 20 * log10(wanted / leak));
+	if (wanted < 1000 || 20 * log10(wanted / leak) < REJECTION_DB) {
+		fprintf(stderr, "%s: want %.0f dB\n", sig->mode, REJECTION_DB);
+		return -1;
+	}
+
+	return 0;
+}
+
+int main(void)
+{
+	unsigned int s;
+
+	for (s = 0; s < sizeof(signals) / sizeof(signals[0]); s++)
+		if (check(&signals[s]))
+			return EXIT_FAILURE;
+
+	return EXIT_SUCCESS;
+}
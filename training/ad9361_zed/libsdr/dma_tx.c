@@ -0,0 +1,330 @@
+/**
+ * Zero-copy TX through the IIO block ioctls
+ *
+ * libiio 0.x hands a pushed buffer to the kernel by copying it, so a TX
+ * tool writes every sample twice: into its buffer, and again into the
+ * kernel's. The block API of the ADI kernel (the one iio_fm_radio uses
+ * for RX) instead maps the DMA blocks into the process. The modulator
+ * writes a block in place, enqueueing it hands it to the DMA, and
+ * dequeueing one waits until the DMA is done with it, so up to @count
+ * blocks are in flight and nothing is copied.
+ *
+ * The first @count blocks are filled before the buffer is enabled, so the
+ * DMA starts with a full queue.
+ *
+ * Licensed under the GPL-2.
+ *
+ **/
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/ioctl.h>
+#include <linux/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "dma_tx.h"
+
+#define IIO_BLOCK_ALLOC_IOCTL   _IOWR('i', 0xa0, struct iio_buffer_block_alloc_req)
+#define IIO_BLOCK_FREE_IOCTL    _IO('i', 0xa1)
+#define IIO_BLOCK_QUERY_IOCTL   _IOWR('i', 0xa2, struct iio_buffer_block)
+#define IIO_BLOCK_ENQUEUE_IOCTL _IOWR('i', 0xa3, struct iio_buffer_block)
+#define IIO_BLOCK_DEQUEUE_IOCTL _IOWR('i', 0xa4, struct iio_buffer_block)
+
+struct iio_buffer_block_alloc_req {
+	__u32 type;
+	__u32 size;
+	__u32 count;
+	__u32 id;
+};
+
+struct iio_buffer_block {
+	__u32 id;
+	__u32 size;
+	__u32 bytes_used;
+	__u32 type;
+	__u32 flags;
+	union {
+		__u32 offset;
+	} data;
+	__u64 timestamp;
+};
+
+#define IIO_SYSFS	"/sys/bus/iio/devices"
+
+/* Two I/Q channels of 16 bits per sample */
+#define DMA_TX_SAMPLE	(2 * sizeof(int16_t))
+
+static int dma_tx_attr(const struct dma_tx *t, const char *file, int val)
+{
+	char path[DMA_TX_PATH_MAX + 64], buf[16];
+	int fd, len, ret = 0;
+
+	snprintf(path, sizeof(path), "%s/%s", t->dir, file);
+	fd = open(path, O_WRONLY);
+	if (fd < 0)
+		return -errno;
+	len = snprintf(buf, sizeof(buf), "%d", val);
+	if (write(fd, buf, len) != len)
+		ret = -errno;
+	close(fd);
+
+	return ret;
+}
+
+/* Find the sysfs directory and device number of the device called @name */
+static int dma_tx_find(struct dma_tx *t, const char *name)
+{
+	char path[DMA_TX_PATH_MAX + 16], buf[64];
+	struct dirent *e;
+	int fd, num = -ENODEV;
+	ssize_t n;
+	DIR *d;
+
+	d = opendir(IIO_SYSFS);
+	if (!d)
+		return -errno;
+
+	while (num < 0 && (e = readdir(d))) {
+		if (strncmp(e->d_name, "iio:device", 10))
+			continue;
+		snprintf(path, sizeof(path), IIO_SYSFS "/%.20s/name", e->d_name);
+		fd = open(path, O_RDONLY);
+		if (fd < 0)
+			continue;
+		n = read(fd, buf, sizeof(buf) - 1);
+		close(fd);
+		if (n <= 0)
+			continue;
+		buf[n] = 0;
+		buf[strcspn(buf, "\n")] = 0;
+		if (strcmp(buf, name))
+			continue;
+		snprintf(t->dir, sizeof(t->dir), IIO_SYSFS "/%.20s", e->d_name);
+		num = atoi(e->d_name + 10);
+	}
+	closedir(d);
+
+	return num;
+}
+
+static void dma_tx_unmap(struct dma_tx *t)
+{
+	unsigned int i;
+
+	for (i = 0; i < t->count; i++) {
+		if (t->blocks[i].iq)
+			munmap(t->blocks[i].iq, t->blocks[i].size);
+		t->blocks[i].iq = NULL;
+	}
+	ioctl(t->fd, IIO_BLOCK_FREE_IOCTL, 0);
+	t->count = 0;
+	t->fresh = 0;
+	t->queued = 0;
+	t->filling = -1;
+}
+
+static int dma_tx_map(struct dma_tx *t, unsigned int count)
+{
+	struct iio_buffer_block_alloc_req req = {
+		.size = t->samples * DMA_TX_SAMPLE,
+		.count = count,
+	};
+	struct iio_buffer_block b;
+	unsigned int i;
+	void *addr;
+	int ret;
+
+	if (ioctl(t->fd, IIO_BLOCK_ALLOC_IOCTL, &req) < 0)
+		return -errno;
+	t->count = req.count < DMA_TX_MAX_BLOCKS ? req.count : DMA_TX_MAX_BLOCKS;
+
+	for (i = 0; i < t->count; i++) {
+		memset(&b, 0, sizeof(b));
+		b.id = i;
+		if (ioctl(t->fd, IIO_BLOCK_QUERY_IOCTL, &b))
+			goto err;
+		addr = mmap(NULL, b.size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			    t->fd, b.data.offset);
+		if (addr == MAP_FAILED)
+			goto err;
+		t->blocks[i].id = b.id;
+		t->blocks[i].size = b.size;
+		t->blocks[i].offset = b.data.offset;
+		t->blocks[i].iq = addr;
+	}
+	t->fresh = t->count;
+
+	return 0;
+
+err:
+	ret = -errno;
+	dma_tx_unmap(t);
+	return ret;
+}
+
+/**
+ * dma_tx_open() - set up a zero-copy TX stream
+ * @t: stream state
+ * @name: IIO device name, cf-ad9361-dds-core-lpc on the FMCOMMS2
+ * @samples: I/Q samples per block
+ * @count: blocks to keep in flight, at most DMA_TX_MAX_BLOCKS
+ *
+ * Enables the first I/Q channel pair only. Returns 0 or a negative errno.
+ **/
+int dma_tx_open(struct dma_tx *t, const char *name, size_t samples,
+		unsigned int count)
+{
+	char dev[32];
+	int num, ret;
+
+	memset(t, 0, sizeof(*t));
+	t->fd = -1;
+	t->filling = -1;
+	if (!samples || !count || count > DMA_TX_MAX_BLOCKS)
+		return -EINVAL;
+	t->samples = samples;
+	t->requested = count;
+
+	num = dma_tx_find(t, name);
+	if (num < 0)
+		return num;
+
+	dma_tx_attr(t, "buffer/enable", 0);
+	if ((ret = dma_tx_attr(t, "scan_elements/out_voltage0_en", 1)) ||
+	    (ret = dma_tx_attr(t, "scan_elements/out_voltage1_en", 1)))
+		return ret;
+	dma_tx_attr(t, "scan_elements/out_voltage2_en", 0);
+	dma_tx_attr(t, "scan_elements/out_voltage3_en", 0);
+
+	snprintf(dev, sizeof(dev), "/dev/iio:device%d", num);
+	t->fd = open(dev, O_RDWR);
+	if (t->fd < 0)
+		return -errno;
+
+	ret = dma_tx_map(t, count);
+	if (ret) {
+		close(t->fd);
+		t->fd = -1;
+	}
+
+	return ret;
+}
+
+/**
+ * dma_tx_get() - the next block to fill
+ * @t: stream state
+ * @iq: set to the block, @t->samples interleaved I/Q samples
+ *
+ * Once every block has been handed out, waits for the DMA to be done with
+ * the oldest one. Returns 0 or a negative errno.
+ **/
+int dma_tx_get(struct dma_tx *t, int16_t **iq)
+{
+	struct iio_buffer_block b;
+	int ret;
+
+	if (t->filling >= 0 || !t->count)
+		return -EINVAL;
+
+	if (t->fresh) {
+		t->filling = t->count - t->fresh--;
+		*iq = t->blocks[t->filling].iq;
+		return 0;
+	}
+
+	/* All blocks queued: start the DMA, then wait for one back */
+	if (!t->enabled) {
+		ret = dma_tx_attr(t, "buffer/enable", 1);
+		if (ret)
+			return ret;
+		t->enabled = true;
+	}
+
+	memset(&b, 0, sizeof(b));
+	if (ioctl(t->fd, IIO_BLOCK_DEQUEUE_IOCTL, &b))
+		return -errno;
+	if (b.id >= t->count)
+		return -EIO;
+
+	t->queued--;
+	t->filling = b.id;
+	*iq = t->blocks[b.id].iq;
+	return 0;
+}
+
+/**
+ * dma_tx_put() - hand the block from dma_tx_get() to the DMA
+ * @t: stream state
+ * @samples: I/Q samples written to it, at most @t->samples
+ *
+ * Returns 0 or a negative errno.
+ **/
+int dma_tx_put(struct dma_tx *t, size_t samples)
+{
+	struct iio_buffer_block b;
+
+	if (t->filling < 0 || samples > t->samples)
+		return -EINVAL;
+
+	memset(&b, 0, sizeof(b));
+	b.id = t->blocks[t->filling].id;
+	b.size = t->blocks[t->filling].size;
+	b.bytes_used = samples * DMA_TX_SAMPLE;
+	b.data.offset = t->blocks[t->filling].offset;
+	if (ioctl(t->fd, IIO_BLOCK_ENQUEUE_IOCTL, &b))
+		return -errno;
+
+	t->filling = -1;
+	t->queued++;
+	return 0;
+}
+
+/**
+ * dma_tx_rebuild() - start the stream over after a DMA error
+ * @t: stream state
+ *
+ * Disables the buffer and frees, reallocates and maps as many blocks as
+ * dma_tx_open() asked for, also after a failed rebuild left none; the data
+ * in them is lost. Returns 0 or a negative errno.
+ **/
+int dma_tx_rebuild(struct dma_tx *t)
+{
+	dma_tx_attr(t, "buffer/enable", 0);
+	t->enabled = false;
+	dma_tx_unmap(t);
+
+	return dma_tx_map(t, t->requested);
+}
+
+/**
+ * dma_tx_close() - send what is queued and free the stream
+ * @t: stream state
+ **/
+void dma_tx_close(struct dma_tx *t)
+{
+	struct iio_buffer_block b;
+
+	if (t->fd < 0)
+		return;
+
+	if (t->queued && !t->enabled && !dma_tx_attr(t, "buffer/enable", 1))
+		t->enabled = true;
+	while (t->enabled && t->queued) {
+		memset(&b, 0, sizeof(b));
+		if (!ioctl(t->fd, IIO_BLOCK_DEQUEUE_IOCTL, &b))
+			t->queued--;
+		else if (errno != EINTR)
+			break;
+	}
+
+	dma_tx_attr(t, "buffer/enable", 0);
+	dma_tx_unmap(t);
+	close(t->fd);
+	t->fd = -1;
+}
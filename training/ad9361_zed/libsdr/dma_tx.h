@@ -0,0 +1,64 @@
+/**
+ * Zero-copy TX through the IIO block ioctls
+ *
+ * Licensed under the GPL-2.
+ *
+ **/
+
+#ifndef DMA_TX_H
+#define DMA_TX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define DMA_TX_MAX_BLOCKS	16
+#define DMA_TX_PATH_MAX		64
+
+/**
+ * struct dma_tx_block - one DMA block, mapped writable
+ * @id: block id for the ioctls
+ * @size: block size in bytes
+ * @offset: mmap offset in the device file
+ * @iq: the mapping, interleaved I/Q
+ **/
+struct dma_tx_block {
+	uint32_t id;
+	uint32_t size;
+	uint32_t offset;
+	int16_t *iq;
+};
+
+/**
+ * struct dma_tx - TX stream of DMA blocks
+ * @fd: the /dev/iio:deviceN block device
+ * @dir: sysfs directory of the device
+ * @samples: I/Q samples per block
+ * @count: blocks allocated
+ * @requested: blocks asked for in dma_tx_open(), and again on a rebuild
+ * @fresh: blocks not enqueued since they were allocated
+ * @queued: blocks enqueued and not dequeued back
+ * @filling: block handed out by dma_tx_get(), -1 for none
+ * @enabled: the buffer is enabled, so the DMA runs
+ **/
+struct dma_tx {
+	int fd;
+	char dir[DMA_TX_PATH_MAX];
+	size_t samples;
+	unsigned int count;
+	unsigned int requested;
+	unsigned int fresh;
+	unsigned int queued;
+	int filling;
+	bool enabled;
+	struct dma_tx_block blocks[DMA_TX_MAX_BLOCKS];
+};
+
+int dma_tx_open(struct dma_tx *t, const char *name, size_t samples,
+		unsigned int count);
+int dma_tx_get(struct dma_tx *t, int16_t **iq);
+int dma_tx_put(struct dma_tx *t, size_t samples);
+int dma_tx_rebuild(struct dma_tx *t);
+void dma_tx_close(struct dma_tx *t);
+
+#endif /* DMA_TX_H */
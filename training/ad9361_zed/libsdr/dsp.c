@@ -0,0 +1,102 @@
+/**
+ * DSP kernels built for several instruction sets, picked at startup
+ *
+ * libsdr is built for the baseline of its target (no -mfpu=neon on the
+ * Zynq, no AVX on x86 hosts), and the kernels declared with DSP_KERNEL()
+ * are also built for the SIMD extensions of the architecture. The best one
+ * the CPU has is selected before main(); dsp_select() forces another, for
+ * comparing them, before any DSP thread has started.
+ *
+ * Licensed under the GPL-2.
+ *
+ **/
+
+#include <errno.h>
+#include <string.h>
+
+#include "dsp.h"
+
+#ifdef DSP_TARGET_NEON
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+enum dsp_isa dsp_isa;
+
+static const char * const isa_names[DSP_NUM_ISAS] = {
+	[DSP_SCALAR] = "scalar",
+	[DSP_NEON] = "neon",
+	[DSP_SSE41] = "sse4.1",
+	[DSP_AVX2] = "avx2",
+	[DSP_AVX512] = "avx512",
+};
+
+const char *dsp_isa_name(enum dsp_isa isa)
+{
+	return isa < DSP_NUM_ISAS ? isa_names[isa] : "unknown";
+}
+
+/* Built into libsdr and available on this CPU */
+bool dsp_isa_supported(enum dsp_isa isa)
+{
+	switch (isa) {
+	case DSP_SCALAR:
+		return true;
+#ifdef DSP_TARGET_NEON
+	case DSP_NEON:
+		return getauxval(AT_HWCAP) & HWCAP_NEON;
+#endif
+#ifdef DSP_TARGET_SSE41
+	case DSP_SSE41:
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("sse4.1");
+	case DSP_AVX2:
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+	case DSP_AVX512:
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("avx512f") &&
+		       __builtin_cpu_supports("avx512bw") &&
+		       __builtin_cpu_supports("avx512vl");
+#endif
+	default:
+		return false;
+	}
+}
+
+/**
+ * dsp_select() - choose the instruction set of the DSP kernels
+ * @name: "scalar", "neon", "sse4.1", "avx2" or "avx512", NULL or "auto"
+ *	for the best one the CPU has
+ *
+ * Returns 0, -EINVAL for an unknown name or -ENOTSUP when this build or
+ * this CPU does not have it.
+ **/
+int dsp_select(const char *name)
+{
+	int isa;
+
+	if (!name || !strcmp(name, "auto")) {
+		for (isa = DSP_NUM_ISAS - 1; isa > DSP_SCALAR; isa--)
+			if (dsp_isa_supported(isa))
+				break;
+		dsp_isa = isa;
+		return 0;
+	}
+
+	for (isa = 0; isa < DSP_NUM_ISAS; isa++)
+		if (!strcmp(name, isa_names[isa]))
+			break;
+	if (isa == DSP_NUM_ISAS)
+		return -EINVAL;
+	if (!dsp_isa_supported(isa))
+		return -ENOTSUP;
+
+	dsp_isa = isa;
+	return 0;
+}
+
+static void __attribute__((constructor)) dsp_init(void)
+{
+	dsp_select(NULL);
+}
@@ -0,0 +1,82 @@
+/**
+ * DSP kernels built for several instruction sets, picked at startup
+ *
+ * Licensed under the GPL-2.
+ *
+ **/
+
+#ifndef DSP_H
+#define DSP_H
+
+#include <stdbool.h>
+
+/* In order of preference; one build only ever has ARM or x86 ones */
+enum dsp_isa {
+	DSP_SCALAR,
+	DSP_NEON,
+	DSP_SSE41,
+	DSP_AVX2,
+	DSP_AVX512,
+	DSP_NUM_ISAS
+};
+
+#if defined(__arm__) && !defined(__SOFTFP__)
+#define DSP_TARGET_NEON		__attribute__((target("fpu=neon")))
+#elif defined(__x86_64__) || defined(__i386__)
+#define DSP_TARGET_SSE41	__attribute__((target("sse4.1")))
+#define DSP_TARGET_AVX2		__attribute__((target("avx2,fma")))
+#define DSP_TARGET_AVX512	__attribute__((target("avx512f,avx512bw,avx512vl")))
+#endif
+
+extern enum dsp_isa dsp_isa;
+
+const char *dsp_isa_name(enum dsp_isa isa);
+bool dsp_isa_supported(enum dsp_isa isa);
+int dsp_select(const char *name);
+
+/*
+ * DSP_KERNEL(name, ret, params, args) builds the always-inline name##_body,
+ * which takes params and is called with args, once for every instruction
+ * set of this build, along with the table DSP_CALL(name) picks from. The
+ * bodies are plain C that the compiler vectorizes for each target.
+ */
+#define DSP_VARIANT(name, isa, target, ret, params, args) \
+	static target ret name##_##isa params { return name##_body args; }
+
+#ifdef DSP_TARGET_NEON
+#define DSP_VARIANTS_ARM(name, ret, params, args) \
+	DSP_VARIANT(name, neon, DSP_TARGET_NEON, ret, params, args)
+#define DSP_ENTRIES_ARM(name) \
+	[DSP_NEON] = name##_neon,
+#else
+#define DSP_VARIANTS_ARM(name, ret, params, args)
+#define DSP_ENTRIES_ARM(name)
+#endif
+
+#ifdef DSP_TARGET_SSE41
+#define DSP_VARIANTS_X86(name, ret, params, args) \
+	DSP_VARIANT(name, sse41, DSP_TARGET_SSE41, ret, params, args) \
+	DSP_VARIANT(name, avx2, DSP_TARGET_AVX2, ret, params, args) \
+	DSP_VARIANT(name, avx512, DSP_TARGET_AVX512, ret, params, args)
+#define DSP_ENTRIES_X86(name) \
+	[DSP_SSE41] = name##_sse41, [DSP_AVX2] = name##_avx2, \
+	[DSP_AVX512] = name##_avx512,
+#else
+#define DSP_VARIANTS_X86(name, ret, params, args)
+#define DSP_ENTRIES_X86(name)
+#endif
+
+#define DSP_KERNEL(name, ret, params, args) \
+	DSP_VARIANT(name, scalar, , ret, params, args) \
+	DSP_VARIANTS_ARM(name, ret, params, args) \
+	DSP_VARIANTS_X86(name, ret, params, args) \
+	static ret (*const name##_isa[DSP_NUM_ISAS]) params = { \
+		[DSP_SCALAR] = name##_scalar, \
+		DSP_ENTRIES_ARM(name) \
+		DSP_ENTRIES_X86(name) \
+	};
+
+/* dsp_select() only picks instruction sets every table has an entry for */
+#define DSP_CALL(name)	(name##_isa[dsp_isa])
+
+#endif /* DSP_H */
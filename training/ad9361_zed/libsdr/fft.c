@@ -0,0 +1,151 @@
+/**
+ * Radix-2 complex FFT with cached plans
+ *
+ * An iterative decimation-in-time transform on interleaved float I/Q, in
+ * place. The plan of each size is built on first use and kept until
+ * exit, so filters of the same size share it and setting up a filter
+ * again costs nothing. The butterflies are built with DSP_KERNEL() for
+ * every instruction set.
+ *
+ * Licensed under the GPL-2.
+ *
+ **/
+
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "dsp.h"
+#include "fft.h"
+
+static struct fft_plan *plans[FFT_MAX_BITS + 1];
+static pthread_mutex_t plans_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct fft_plan *fft_plan_new(unsigned int bits)
+{
+	struct fft_plan *p = calloc(1, sizeof(*p));
+	size_t n = (size_t)1 << bits, h, j, k;
+	uint32_t r;
+	unsigned int b;
+
+	if (!p)
+		return NULL;
+	p->bits = bits;
+	p->n = n;
+	p->tw = malloc(2 * n * sizeof(*p->tw));
+	p->rev = malloc(n * sizeof(*p->rev));
+	if (!p->tw || !p->rev) {
+		free(p->tw);
+		free(p->rev);
+		free(p);
+		return NULL;
+	}
+
+	for (h = 1; h < n; h <<= 1) {
+		for (j = 0; j < h; j++) {
+			p->tw[2 * (h + j)] = (float)cos(M_PI * j / h);
+			p->tw[2 * (h + j) + 1] = (float)-sin(M_PI * j / h);
+		}
+	}
+	p->tw[0] = p->tw[1] = 0;
+
+	for (k = 0; k < n; k++) {
+		for (r = 0, b = 0; b < bits; b++)
+			r |= ((k >> b) & 1) << (bits - 1 - b);
+		p->rev[k] = r;
+	}
+
+	return p;
+}
+
+/**
+ * fft_plan() - get the plan of one transform size
+ * @bits: log2 of the number of points, at most FFT_MAX_BITS
+ *
+ * Returns the plan, shared by all callers, or NULL when @bits is out of
+ * range or memory runs out.
+ **/
+const struct fft_plan *fft_plan(unsigned int bits)
+{
+	struct fft_plan *p;
+
+	if (bits > FFT_MAX_BITS)
+		return NULL;
+
+	pthread_mutex_lock(&plans_lock);
+	p = plans[bits];
+	if (!p)
+		p = plans[bits] = fft_plan_new(bits);
+	pthread_mutex_unlock(&plans_lock);
+
+	return p;
+}
+
+/* sign is 1 for the forward transform and -1 for the inverse, a constant */
+static inline __attribute__((always_inline))
+void fft_body(const struct fft_plan *p, float *x, const float sign)
+{
+	const size_t n = p->n;
+	size_t h, j, k, r;
+	float t, ar, ai, br, bi, wr, wi;
+
+	for (k = 0; k < n; k++) {
+		r = p->rev[k];
+		if (r > k) {
+			t = x[2 * k];
+			x[2 * k] = x[2 * r];
+			x[2 * r] = t;
+			t = x[2 * k + 1];
+			x[2 * k + 1] = x[2 * r + 1];
+			x[2 * r + 1] = t;
+		}
+	}
+
+	for (h = 1; h < n; h <<= 1) {
+		const float *w = p->tw + 2 * h;
+
+		for (k = 0; k < n; k += 2 * h) {
+			float *a = x + 2 * k, *b = x + 2 * (k + h);
+
+			for (j = 0; j < h; j++) {
+				wr = w[2 * j];
+				wi = sign * w[2 * j + 1];
+				br = b[2 * j] * wr - b[2 * j + 1] * wi;
+				bi = b[2 * j] * wi + b[2 * j + 1] * wr;
+				ar = a[2 * j];
+				ai = a[2 * j + 1];
+				a[2 * j] = ar + br;
+				a[2 * j + 1] = ai + bi;
+				b[2 * j] = ar - br;
+				b[2 * j + 1] = ai - bi;
+			}
+		}
+	}
+}
+
+static inline __attribute__((always_inline))
+void fft_forward_body(const struct fft_plan *p, float *x)
+{
+	fft_body(p, x, 1.0f);
+}
+
+static inline __attribute__((always_inline))
+void fft_inverse_body(const struct fft_plan *p, float *x)
+{
+	fft_body(p, x, -1.0f);
+}
+
+DSP_KERNEL(fft_forward, void, (const struct fft_plan *p, float *x), (p, x))
+DSP_KERNEL(fft_inverse, void, (const struct fft_plan *p, float *x), (p, x))
+
+/* Transform p->n interleaved I/Q points in place */
+void fft_forward(const struct fft_plan *p, float *x)
+{
+	DSP_CALL(fft_forward)(p, x);
+}
+
+/* The inverse transform, not scaled: forward then inverse multiplies by n */
+void fft_inverse(const struct fft_plan *p, float *x)
+{
+	DSP_CALL(fft_inverse)(p, x);
+}
@@ -0,0 +1,35 @@
+/**
+ * Radix-2 complex FFT with cached plans
+ *
+ * Licensed under the GPL-2.
+ *
+ **/
+
+#ifndef FFT_H
+#define FFT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FFT_MAX_BITS	20	/* 1 Mi points */
+
+/**
+ * struct fft_plan - tables of one transform size
+ * @bits: log2 of the size
+ * @n: number of complex points
+ * @tw: twiddles e^(-2 pi i j / 2h) of the stage of half size h at
+ *	[h + j], interleaved re and im, so each stage reads them in order
+ * @rev: bit-reversed index of every point
+ **/
+struct fft_plan {
+	unsigned int bits;
+	size_t n;
+	float *tw;
+	uint32_t *rev;
+};
+
+const struct fft_plan *fft_plan(unsigned int bits);
+void fft_forward(const struct fft_plan *p, float *x);
+void fft_inverse(const struct fft_plan *p, float *x);
+
+#endif /* FFT_H */
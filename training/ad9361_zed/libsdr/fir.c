@@ -0,0 +1,47 @@
+/**
+ * FIR filters carrying their history from block to block
+ *
+ * Licensed under the GPL-2.
+ *
+ **/
+
+#include <errno.h>
+#include <string.h>
+
+#include "fir.h"
+#include "fir_design.h"
+
+/**
+ * fir_iq_init() - set up a Kaiser windowed-sinc low-pass with no history
+ * @f: filter state
+ * @taps: number of taps, at most FIR_MAX_TAPS
+ * @fc: cutoff as a fraction of the sample rate
+ * @beta: Kaiser window parameter
+ *
+ * Returns 0 or -EINVAL.
+ **/
+int fir_iq_init(struct fir_iq *f, unsigned int taps, double fc, double beta)
+{
+	double h[FIR_MAX_TAPS];
+	unsigned int k;
+
+	if (!taps || taps > FIR_MAX_TAPS)
+		return -EINVAL;
+
+	memset(f, 0, sizeof(*f));
+	f->taps = taps;
+	fir_lowpass(h, taps, fc, beta);
+	for (k = 0; k < taps; k++)
+		f->h[k] = (float)h[k];
+
+	return 0;
+}
+
+/* Filter n interleaved I/Q pairs in place */
+void fir_iq_block(struct fir_iq *f, float *iq, size_t n)
+{
+	size_t k;
+
+	for (k = 0; k < n; k++)
+		fir_iq_step(f, &iq[2 * k], &iq[2 * k + 1]);
+}
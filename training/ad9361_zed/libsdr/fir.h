@@ -0,0 +1,56 @@
+/**
+ * FIR filters carrying their history from block to block
+ *
+ * Licensed under the GPL-2.
+ *
+ **/
+
+#ifndef FIR_H
+#define FIR_H
+
+#include <stddef.h>
+
+#define FIR_MAX_TAPS	64
+
+/**
+ * struct fir_iq - real-tap FIR over complex samples
+ * @taps: number of taps in use
+ * @pos: where the next sample goes in @hist
+ * @h: taps
+ * @hist: I and Q history, each stored twice so that the last @taps
+ *	samples are always contiguous
+ **/
+struct fir_iq {
+	unsigned int taps;
+	unsigned int pos;
+	float h[FIR_MAX_TAPS];
+	float hist[2][2 * FIR_MAX_TAPS];
+};
+
+int fir_iq_init(struct fir_iq *f, unsigned int taps, double fc, double beta);
+void fir_iq_block(struct fir_iq *f, float *iq, size_t n);
+
+/* Filter one sample in place */
+static inline void fir_iq_step(struct fir_iq *f, float *i, float *q)
+{
+	const unsigned int taps = f->taps;
+	float si = 0, sq = 0;
+	const float *hi, *hq;
+	unsigned int k;
+
+	f->hist[0][f->pos] = f->hist[0][f->pos + taps] = *i;
+	f->hist[1][f->pos] = f->hist[1][f->pos + taps] = *q;
+	if (++f->pos == taps)
+		f->pos = 0;
+
+	hi = &f->hist[0][f->pos];
+	hq = &f->hist[1][f->pos];
+	for (k = 0; k < taps; k++) {
+		si += f->h[k] * hi[k];
+		sq += f->h[k] * hq[k];
+	}
+	*i = si;
+	*q = sq;
+}
+
+#endif /* FIR_H */
@@ -0,0 +1,80 @@
+/**
+ * Windowed-sinc FIR design
+ *
+ * Licensed under the GPL-2.
+ *
+ **/
+
+#include <math.h>
+
+#include "fir_design.h"
+
+static double bessel_i0(double x)
+{
+	double sum = 1, term = 1;
+	int k;
+
+	for (k = 1; k < 32; k++) {
+		term *= (x / (2 * k)) * (x / (2 * k));
+		sum += term;
+	}
+
+	return sum;
+}
+
+/**
+ * kaiser_window() - Kaiser window at r, from -1 to 1 across the window
+ **/
+double kaiser_window(double r, double beta)
+{
+	if (r * r >= 1)
+		return 0;
+
+	return bessel_i0(beta * sqrt(1 - r * r)) / bessel_i0(beta);
+}
+
+/**
+ * fir_lowpass() - linear phase low pass with unity DC gain
+ * @fc: cutoff as a fraction of the sample rate
+ *
+ * The window spans taps + 1 points so the outermost taps stay non-zero.
+ **/
+void fir_lowpass(double *h, size_t taps, double fc, double beta)
+{
+	double mid = (taps - 1) / 2.0, sum = 0;
+	size_t k;
+
+	for (k = 0; k < taps; k++) {
+		double x = k - mid;
+
+		h[k] = x == 0 ? 2 * fc : sin(2 * M_PI * fc * x) / (M_PI * x);
+		h[k] *= kaiser_window(x / (mid + 1), beta);
+		sum += h[k];
+	}
+
+	for (k = 0; k < taps; k++)
+		h[k] /= sum;
+}
+
+/**
+ * kaiser_beta() - window parameter for a stop band attenuation
+ * @atten_db: attenuation in dB, positive
+ **/
+double kaiser_beta(double atten_db)
+{
+	if (atten_db > 50)
+		return 0.1102 * (atten_db - 8.7);
+	if (atten_db >= 21)
+		return 0.5842 * pow(atten_db - 21, 0.4) + 0.07886 * (atten_db - 21);
+	return 0;
+}
+
+/**
+ * kaiser_taps() - taps a Kaiser windowed low pass needs
+ * @transition: transition band width as a fraction of the sample rate
+ * @atten_db: stop band attenuation in dB
+ **/
+size_t kaiser_taps(double transition, double atten_db)
+{
+	return (size_t)ceil((atten_db - 7.95) / (2.285 * 2 * M_PI * transition)) + 1;
+}
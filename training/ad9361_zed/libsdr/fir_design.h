@@ -0,0 +1,18 @@
+/**
+ * Windowed-sinc FIR design
+ *
+ * Licensed under the GPL-2.
+ *
+ **/
+
+#ifndef FIR_DESIGN_H
+#define FIR_DESIGN_H
+
+#include <stddef.h>
+
+double kaiser_window(double r, double beta);
+double kaiser_beta(double atten_db);
+size_t kaiser_taps(double transition, double atten_db);
+void fir_lowpass(double *h, size_t taps, double fc, double beta);
+
+#endif /* FIR_DESIGN_H */
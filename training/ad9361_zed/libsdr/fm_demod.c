@@ -0,0 +1,357 @@
+/**
+ * FM discriminator with decimation and automatic gain control
+ *
+ * Licensed under the GPL-2.
+ *
+ **/
+
+#include <errno.h>
+#include <math.h>
+#include <string.h>
+
+#include "atan.h"
+#include "dsp.h"
+#include "fm_demod.h"
+
+/* 2 sin(dphi), what the normalized quadricorrelator gives, in phase units */
+#define FM_DEMOD_QUADNORM_SCALE	((float)(FM_DEMOD_TURN / (4 * M_PI)))
+
+static const char * const disc_names[FM_DEMOD_NUM_DISCS] = {
+	[FM_DEMOD_QUAD] = "quad",
+	[FM_DEMOD_QUADNORM] = "quadnorm",
+	[FM_DEMOD_CORDIC] = "cordic",
+	[FM_DEMOD_LUT] = "lut",
+};
+
+/**
+ * fm_demod_init() - set up a discriminator with no gain history
+ * @d: discriminator state
+ * @decimation: I/Q samples per audio sample
+ * @sub: discriminator input subsampling, a divisor of @decimation
+ **/
+void fm_demod_init(struct fm_demod *d, unsigned int decimation,
+		   unsigned int sub)
+{
+	d->decimation = decimation;
+	d->sub = sub ? sub : 1;
+	d->min = 0xfffffff;
+	d->max = -0xfffffff;
+	d->power = 0;
+	d->count = 0;
+	d->disc = FM_DEMOD_QUAD;
+	d->gain = 0;
+}
+
+/**
+ * fm_demod_discriminator() - choose the discriminator
+ * @d: discriminator state
+ * @name: "quad", "quadnorm", "cordic" or "lut", see enum fm_demod_disc
+ * @deviation: frequency deviation in Hz that gives full-scale audio
+ * @sample_rate: I/Q sample rate in Hz
+ *
+ * Returns 0 or -EINVAL.
+ **/
+int fm_demod_discriminator(struct fm_demod *d, const char *name,
+			   double deviation, double sample_rate)
+{
+	double step;
+	int disc;
+
+	for (disc = 0; disc < FM_DEMOD_NUM_DISCS; disc++)
+		if (!strcmp(name, disc_names[disc]))
+			break;
+	if (disc == FM_DEMOD_NUM_DISCS || deviation <= 0 || sample_rate <= 0)
+		return -EINVAL;
+
+	atan_init();
+
+	/* Phase units per discriminator input at the full deviation */
+	step = deviation * d->sub / sample_rate * FM_DEMOD_TURN;
+	d->disc = disc;
+	d->gain = llrint(FM_DEMOD_AUDIO_MAX / step * 65536);
+	return 0;
+}
+
+const char *fm_demod_disc_name(enum fm_demod_disc disc)
+{
+	return disc < FM_DEMOD_NUM_DISCS ? disc_names[disc] : "unknown";
+}
+
+/* Partial results of one range of a block, combined in block order */
+struct fm_demod_part {
+	int min, max;
+	long long power;
+	unsigned int count;
+	size_t out;
+};
+
+/*
+ * Discriminator inputs t0 <= t < t1, where input t is I/Q pair 1 + t * sub,
+ * writing the audio samples of the groups that end in the range from
+ * audio[0]. t0 must start a group of decimation / sub inputs unless it is 0,
+ * and the two samples of history are re-read from the block the way a run
+ * over the whole block leaves them, so the ranges of a block can be run
+ * in any order. disc is a constant in every caller, so each discriminator
+ * gets a loop of its own.
+ */
+static inline __attribute__((always_inline))
+size_t fm_demod_range_body(const struct fm_demod *d, const int16_t *iq,
+			   size_t t0, size_t t1, int16_t *audio,
+			   struct fm_demod_part *part, const enum fm_demod_disc disc)
+{
+	const unsigned int decimation = d->decimation, sub = d->sub;
+	const int min = d->min, max = d->max;
+	int new_min = 0xfffffff, new_max = -0xfffffff;
+	long i[3], q[3], di, dq, norm;
+	long long sample = 0;
+	long long power = 0;
+	unsigned int count = 0;
+	unsigned int x = 0;
+	size_t j, h, out = 0;
+
+	if (t0 == 0) {
+		i[2] = iq[0];
+		q[2] = iq[1];
+		i[1] = iq[2];
+		q[1] = iq[3];
+	} else {
+		h = t0 >= 2 ? 2 + 2 * sub * (t0 - 2) : 2;
+		i[2] = iq[h];
+		q[2] = iq[h + 1];
+		h = 2 + 2 * sub * (t0 - 1);
+		i[1] = iq[h];
+		q[1] = iq[h + 1];
+	}
+
+	for (j = 2 + 2 * sub * t0; j < 2 + 2 * sub * t1; j += 2 * sub) {
+		i[0] = iq[j];
+		q[0] = iq[j + 1];
+		power += i[0] * i[0] + q[0] * q[0];
+		count++;
+
+		di = i[0] - i[2];
+		dq = q[0] - q[2];
+
+		switch (disc) {
+		case FM_DEMOD_QUAD:
+			sample += (i[1] * dq - q[1] * di);
+			break;
+		case FM_DEMOD_QUADNORM:
+			norm = i[1] * i[1] + q[1] * q[1];
+			if (norm)
+				sample += (long)((float)(i[1] * dq - q[1] * di)
+						 * FM_DEMOD_QUADNORM_SCALE / norm);
+			break;
+		case FM_DEMOD_CORDIC:
+			sample += atan_cordic(i[0] * i[1] + q[0] * q[1],
+					      q[0] * i[1] - i[0] * q[1]);
+			break;
+		default:
+			sample += atan_table(i[0] * i[1] + q[0] * q[1],
+					     q[0] * i[1] - i[0] * q[1]);
+			break;
+		}
+
+		i[2] = i[1];
+		q[2] = q[1];
+		i[1] = i[0];
+		q[1] = q[0];
+
+		x += sub;
+		if (x >= decimation) {
+			x = 0;
+			sample /= (decimation / sub);
+
+			if (sample < new_min)
+				new_min = sample;
+			if (sample > new_max)
+				new_max = sample;
+
+			if (disc != FM_DEMOD_QUAD) {
+				sample = sample * d->gain >> 16;
+			} else {
+				if (min >= max)
+					continue;
+
+				sample -= (max - min) / 2;
+				sample = sample * FM_DEMOD_AUDIO_MAX / (max - min);
+			}
+			if (sample > FM_DEMOD_AUDIO_MAX)
+				sample = FM_DEMOD_AUDIO_MAX;
+			else if (sample < -FM_DEMOD_AUDIO_MAX)
+				sample = -FM_DEMOD_AUDIO_MAX;
+
+			audio[out++] = sample;
+			sample = 0;
+		}
+	}
+
+	part->min = new_min;
+	part->max = new_max;
+	part->power = power;
+	part->count = count;
+	part->out = out;
+	return out;
+}
+
+#define FM_DEMOD_DISC(name, disc) \
+static inline __attribute__((always_inline)) \
+size_t name##_body(const struct fm_demod *d, const int16_t *iq, size_t t0, \
+		   size_t t1, int16_t *audio, struct fm_demod_part *part) \
+{ \
+	return fm_demod_range_body(d, iq, t0, t1, audio, part, disc); \
+} \
+DSP_KERNEL(name, size_t, \
+	   (const struct fm_demod *d, const int16_t *iq, size_t t0, size_t t1, \
+	    int16_t *audio, struct fm_demod_part *part), \
+	   (d, iq, t0, t1, audio, part))
+
+FM_DEMOD_DISC(fm_demod_quad, FM_DEMOD_QUAD)
+FM_DEMOD_DISC(fm_demod_quadnorm, FM_DEMOD_QUADNORM)
+FM_DEMOD_DISC(fm_demod_cordic, FM_DEMOD_CORDIC)
+FM_DEMOD_DISC(fm_demod_lut, FM_DEMOD_LUT)
+
+static void fm_demod_range(const struct fm_demod *d, const int16_t *iq,
+			   size_t t0, size_t t1, int16_t *audio,
+			   struct fm_demod_part *part)
+{
+	switch (d->disc) {
+	case FM_DEMOD_QUADNORM:
+		DSP_CALL(fm_demod_quadnorm)(d, iq, t0, t1, audio, part);
+		break;
+	case FM_DEMOD_CORDIC:
+		DSP_CALL(fm_demod_cordic)(d, iq, t0, t1, audio, part);
+		break;
+	case FM_DEMOD_LUT:
+		DSP_CALL(fm_demod_lut)(d, iq, t0, t1, audio, part);
+		break;
+	default:
+		DSP_CALL(fm_demod_quad)(d, iq, t0, t1, audio, part);
+		break;
+	}
+}
+
+/* Discriminator inputs in a block of n I/Q pairs */
+static size_t fm_demod_inputs(const struct fm_demod *d, size_t n)
+{
+	return n < 2 ? 0 : (n - 1 + d->sub - 1) / d->sub;
+}
+
+static void fm_demod_finish(struct fm_demod *d, const struct fm_demod_part *part)
+{
+	d->min = part->min;
+	d->max = part->max;
+	d->power = part->power;
+	d->count = part->count;
+}
+
+/**
+ * fm_demod_block() - demodulate one block of I/Q
+ * @d: discriminator state
+ * @iq: n interleaved I/Q pairs
+ * @n: number of I/Q pairs, at least 2
+ * @audio: output, room for n / @d->decimation samples
+ *
+ * FM demodulation implemented as described in
+ * http://www.embedded.com/design/embedded/4212086/DSP-Tricks--Frequency-demodulation-algorithms-
+ * averaged over @d->decimation samples. With the quadricorrelator the audio
+ * is centred and scaled to +-FM_DEMOD_AUDIO_MAX with the output range of
+ * the previous block, and the first block only measures that range and
+ * produces no audio. The other discriminators scale it to the deviation.
+ *
+ * Returns the number of audio samples written.
+ **/
+size_t fm_demod_block(struct fm_demod *d, const int16_t *iq, size_t n,
+		      int16_t *audio)
+{
+	struct fm_demod_part part;
+
+	fm_demod_range(d, iq, 0, fm_demod_inputs(d, n), audio, &part);
+	fm_demod_finish(d, &part);
+
+	return part.out;
+}
+
+struct fm_demod_job {
+	const struct fm_demod *d;
+	const int16_t *iq;
+	int16_t *audio;
+	size_t group;		/* discriminator inputs per audio sample */
+	size_t groups;
+	size_t inputs;
+	struct fm_demod_part part[PAR_MAX_CHUNKS];
+};
+
+static void fm_demod_chunk(void *ctx, unsigned int chunk, size_t begin,
+			   size_t end)
+{
+	struct fm_demod_job *job = ctx;
+	size_t t1 = end * job->group;
+
+	if (begin == end) {
+		job->part[chunk] = (struct fm_demod_part){
+			.min = 0xfffffff,
+			.max = -0xfffffff,
+		};
+		return;
+	}
+
+	/* The last chunk takes the inputs of the trailing partial group */
+	if (end == job->groups)
+		t1 = job->inputs;
+
+	fm_demod_range(job->d, job->iq, begin * job->group, t1,
+		       job->audio + begin, &job->part[chunk]);
+}
+
+/**
+ * fm_demod_block_parallel() - fm_demod_block() split across a pool
+ * @pool: threads to run on, NULL to run on the caller
+ *
+ * The block is cut on audio sample boundaries. Each chunk re-reads its
+ * two samples of discriminator history from the end of the previous one
+ * and writes its audio in place, and the level ranges and powers of the
+ * chunks are combined in block order, so the result is the same as that
+ * of fm_demod_block(). The first quadricorrelator block, which only
+ * measures the level range, runs on the caller.
+ **/
+size_t fm_demod_block_parallel(struct fm_demod *d, const int16_t *iq, size_t n,
+			       int16_t *audio, struct par_pool *pool)
+{
+	struct fm_demod_job job = {
+		.d = d,
+		.iq = iq,
+		.audio = audio,
+		.group = d->decimation / d->sub,
+		.inputs = fm_demod_inputs(d, n),
+	};
+	struct fm_demod_part total = {
+		.min = 0xfffffff,
+		.max = -0xfffffff,
+	};
+	unsigned int chunks, k;
+
+	job.groups = job.inputs / job.group;
+	if (!pool || pool->nthreads <= 1 || job.groups < 2 ||
+	    (d->disc == FM_DEMOD_QUAD && d->min >= d->max))
+		return fm_demod_block(d, iq, n, audio);
+
+	/* More chunks than threads, so a thread held up elsewhere is made up for */
+	chunks = par_chunks(job.groups, 2 * pool->nthreads, FM_DEMOD_MIN_CHUNK);
+	par_pool_for(pool, job.groups, chunks, fm_demod_chunk, &job);
+
+	for (k = 0; k < chunks; k++) {
+		const struct fm_demod_part *part = &job.part[k];
+
+		if (part->min < total.min)
+			total.min = part->min;
+		if (part->max > total.max)
+			total.max = part->max;
+		total.power += part->power;
+		total.count += part->count;
+		total.out += part->out;
+	}
+	fm_demod_finish(d, &total);
+
+	return total.out;
+}
@@ -0,0 +1,77 @@
+/**
+ * FM discriminator with decimation and automatic gain control
+ *
+ * Licensed under the GPL-2.
+ *
+ **/
+
+#ifndef FM_DEMOD_H
+#define FM_DEMOD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "atan.h"
+#include "par.h"
+
+#define FM_DEMOD_AUDIO_MAX	0x1fff
+#define FM_DEMOD_MIN_CHUNK	256	/* audio samples per chunk of a split block */
+#define FM_DEMOD_TURN		ATAN_TURN	/* phase units in one turn */
+
+/**
+ * enum fm_demod_disc - discriminators
+ * @FM_DEMOD_QUAD: quadricorrelator, I x dQ - Q x dI. Its output goes with
+ *	the square of the amplitude, which the min/max AGC takes out one
+ *	block late.
+ * @FM_DEMOD_QUADNORM: the same divided by I^2 + Q^2 at every sample. That
+ *	is the sine of the phase step, so the audio falls short of linear
+ *	towards full deviation, by 11% at 75 kHz and 576 kHz.
+ * @FM_DEMOD_CORDIC: phase difference of successive samples, by CORDIC
+ * @FM_DEMOD_LUT: phase difference from a 2-D arctangent table indexed by
+ *	the quantized product of successive samples
+ *
+ * All but @FM_DEMOD_QUAD are amplitude independent and scaled to the
+ * deviation given to fm_demod_discriminator().
+ **/
+enum fm_demod_disc {
+	FM_DEMOD_QUAD,
+	FM_DEMOD_QUADNORM,
+	FM_DEMOD_CORDIC,
+	FM_DEMOD_LUT,
+	FM_DEMOD_NUM_DISCS
+};
+
+/**
+ * struct fm_demod - discriminator state
+ * @decimation: I/Q samples per audio sample
+ * @sub: every sub-th I/Q sample goes through the discriminator, a
+ *	divisor of @decimation
+ * @min, @max: discriminator output range of the previous block, which
+ *	centres and scales the audio of the current one
+ * @power: sum of I^2 + Q^2 over the samples of the last block looked at
+ * @count: number of samples in @power
+ * @disc: discriminator
+ * @gain: audio per phase unit averaged over a sample, as a 16.16 fraction,
+ *	for all discriminators but @FM_DEMOD_QUAD
+ **/
+struct fm_demod {
+	unsigned int decimation;
+	unsigned int sub;
+	int min, max;
+	long long power;
+	unsigned int count;
+	enum fm_demod_disc disc;
+	long long gain;
+};
+
+void fm_demod_init(struct fm_demod *d, unsigned int decimation,
+		   unsigned int sub);
+int fm_demod_discriminator(struct fm_demod *d, const char *name,
+			   double deviation, double sample_rate);
+const char *fm_demod_disc_name(enum fm_demod_disc disc);
+size_t fm_demod_block(struct fm_demod *d, const int16_t *iq, size_t n,
+		      int16_t *audio);
+size_t fm_demod_block_parallel(struct fm_demod *d, const int16_t *iq, size_t n,
+			       int16_t *audio, struct par_pool *pool);
+
+#endif /* FM_DEMOD_H */
@@ -0,0 +1,234 @@
+/**
+ * fm_demod checks: split blocks and discriminator accuracy
+ *
+ * fm_demod_block_parallel() cuts a block on audio sample boundaries and
+ * runs the pieces on a pool; its audio and the level range and power it
+ * leaves for the next block must be those of fm_demod_block(). Checked for
+ * every discriminator and instruction set, over odd block sizes, several
+ * decimations and start phases, and two blocks in a row so the
+ * quadricorrelator AGC of the second comes from the first.
+ *
+ * The deviation-scaled discriminators are then fed constant tones of known
+ * deviation at a strong and a weak level. cordic and lut measure the phase
+ * step, so the audio goes linearly with the deviation; quadnorm measures
+ * its sine, and the audio follows that. quad is scaled by the level range
+ * of the previous block, not the deviation, and is left out.
+ *
+ * Licensed under the GPL-2.
+ *
+ **/
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dsp.h"
+#include "fm_demod.h"
+#include "par.h"
+
+#define DEVIATION	75000.0
+#define AMPLITUDE	2000.0	/* the ADC is 12 bits */
+#define MAX_SAMPLES	400009
+
+struct config {
+	unsigned int decimation, sub;
+	double sample_rate;
+};
+
+/* iio_fm_radio at its default rate, a 10x and 7x decimation, and 2.304 MHz without subsampling */
+static const struct config configs[] = {
+	{ 48, 4, 2304000 },
+	{ 10, 1, 480000 },
+	{ 14, 7, 672000 },
+	{ 48, 1, 2304000 },
+};
+static const size_t sizes[] = { 48 * 1100 + 1, 131071, 200003 };
+static const unsigned int threads[] = { 2, 3, 7 };
+static const double phases[] = { 0, M_PI - 1e-3, -M_PI / 2 };
+
+/* Audio tolerance of each discriminator at a constant deviation, in LSB */
+static const int tolerance[FM_DEMOD_NUM_DISCS] = {
+	[FM_DEMOD_QUADNORM] = 8,
+	[FM_DEMOD_CORDIC] = 8,
+	[FM_DEMOD_LUT] = 40,
+};
+
+/* FM of a deviation that wanders up to 1.2 times DEVIATION, from phase */
+static void fill_fm(int16_t *iq, size_t n, double phase, double sample_rate)
+{
+	uint32_t seed = 54321;
+	double f = 0;
+	size_t k;
+
+	for (k = 0; k < n; k++) {
+		seed = seed * 1103515245 + 12345;
+		f += ((double)(seed >> 16) / 65536 - 0.5) * DEVIATION / 20;
+		if (fabs(f) > 1.2 * DEVIATION)
+			f = 0;
+		iq[2 * k] = lrint(AMPLITUDE * cos(phase));
+		iq[2 * k + 1] = lrint(AMPLITUDE * sin(phase));
+		phase += 2 * M_PI * f / sample_rate;
+	}
+}
+
+static int same_state(const struct fm_demod *a, const struct fm_demod *b)
+{
+	return a->min == b->min && a->max == b->max &&
+	       a->power == b->power && a->count == b->count;
+}
+
+static int check_split(const int16_t *iq, int16_t *serial, int16_t *split,
+		       const struct config *c, enum fm_demod_disc disc,
+		       size_t n, struct par_pool *pool, double phase)
+{
+	struct fm_demod a, b;
+	size_t block, out_a, out_b, k;
+
+	fm_demod_init(&a, c->decimation, c->sub);
+	fm_demod_discriminator(&a, fm_demod_disc_name(disc), DEVIATION, c->sample_rate);
+	b = a;
+
+	for (block = 0; block < 2; block++) {
+		out_a = fm_demod_block(&a, iq + 2 * n * block, n, serial);
+		out_b = fm_demod_block_parallel(&b, iq + 2 * n * block, n, split, pool);
+
+		for (k = 0; k < out_a && serial[k] == split[k]; k++)
+			;
+		if (out_a != out_b || k < out_a || !same_state(&a, &b)) {
+			fprintf(stderr, "%s %s, decimation %u/%u, %zu samples, %u threads, phase %.3f, block %zu: ",
+				dsp_isa_name(dsp_isa), fm_demod_disc_name(disc),
+				c->decimation, c->sub, n, pool->nthreads, phase, block);
+			if (out_a != out_b)
+				fprintf(stderr, "%zu audio samples, not %zu\n", out_b, out_a);
+			else if (k < out_a)
+				fprintf(stderr, "audio sample %zu is %d, not %d\n",
+					k, split[k], serial[k]);
+			else
+				fprintf(stderr, "level range %d..%d power %lld, not %d..%d %lld\n",
+					b.min, b.max, b.power, a.min, a.max, a.power);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int check_splits(struct par_pool *pools)
+{
+	int16_t *iq = malloc(4 * MAX_SAMPLES * sizeof(*iq));
+	int16_t *serial = malloc(MAX_SAMPLES * sizeof(*serial));
+	int16_t *split = malloc(MAX_SAMPLES * sizeof(*split));
+	unsigned int c, d, s, t, p, runs = 0;
+	int isa, ret = -1;
+
+	if (!iq || !serial || !split)
+		goto out;
+
+	for (c = 0; c < sizeof(configs) / sizeof(configs[0]); c++) {
+		for (p = 0; p < sizeof(phases) / sizeof(phases[0]); p++) {
+			fill_fm(iq, 2 * MAX_SAMPLES, phases[p], configs[c].sample_rate);
+			for (isa = 0; isa < DSP_NUM_ISAS; isa++) {
+				if (!dsp_isa_supported(isa))
+					continue;
+				dsp_isa = isa;
+				for (d = 0; d < FM_DEMOD_NUM_DISCS; d++)
+					for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+						for (t = 0; t < sizeof(threads) / sizeof(threads[0]); t++, runs++)
+							if (check_split(iq, serial, split, &configs[c], d,
+									sizes[s], &pools[t], phases[p]))
+								goto out;
+			}
+		}
+	}
+
+	printf("fm_demod_test: %u split blocks bit-exact\n", runs);
+	ret = 0;
+out:
+	dsp_select(NULL);
+	free(iq);
+	free(serial);
+	free(split);
+	return ret;
+}
+
+/* Audio of a constant tone at fraction of DEVIATION, the ideal discriminator */
+static double expected(enum fm_demod_disc disc, const struct config *c, double fraction)
+{
+	double full = 2 * M_PI * DEVIATION * c->sub / c->sample_rate;
+
+	if (disc == FM_DEMOD_QUADNORM)
+		return FM_DEMOD_AUDIO_MAX * sin(fraction * full) / full;
+	return FM_DEMOD_AUDIO_MAX * fraction;
+}
+
+static int check_accuracy(void)
+{
+	static const double fractions[] = { 0.02, 0.25, 0.5, -0.5, 0.9, -1.0 };
+	static const double amplitudes[] = { AMPLITUDE, AMPLITUDE / 16 };
+	/* Rounding the weak tone to integer I/Q adds phase noise of its own */
+	static const int slack[] = { 0, 8 };
+	static int16_t iq[2 * 48 * 1000];
+	static int16_t audio[1000];
+	const struct config *c = &configs[0];
+	const size_t n = sizeof(audio) / sizeof(audio[0]) * c->decimation;
+	unsigned int f, a, runs = 0;
+	double want, phase;
+	struct fm_demod d;
+	size_t k, out, worst;
+	int disc;
+
+	for (disc = FM_DEMOD_QUADNORM; disc < FM_DEMOD_NUM_DISCS; disc++) {
+		for (f = 0; f < sizeof(fractions) / sizeof(fractions[0]); f++) {
+			for (a = 0; a < sizeof(amplitudes) / sizeof(amplitudes[0]); a++, runs++) {
+				phase = 0.3;
+				for (k = 0; k < n; k++) {
+					phase += 2 * M_PI * fractions[f] * DEVIATION / c->sample_rate;
+					iq[2 * k] = lrint(amplitudes[a] * cos(phase));
+					iq[2 * k + 1] = lrint(amplitudes[a] * sin(phase));
+				}
+
+				fm_demod_init(&d, c->decimation, c->sub);
+				fm_demod_discriminator(&d, fm_demod_disc_name(disc),
+						       DEVIATION, c->sample_rate);
+				out = fm_demod_block(&d, iq, n, audio);
+
+				want = expected(disc, c, fractions[f]);
+				worst = 1;
+				for (k = 1; k < out; k++)
+					if (fabs(audio[k] - want) > fabs(audio[worst] - want))
+						worst = k;
+				if (out < 2 || fabs(audio[worst] - want) > tolerance[disc] + slack[a]) {
+					fprintf(stderr, "%s at %.2f of the deviation, amplitude %.0f: audio %d, not %.1f\n",
+						fm_demod_disc_name(disc), fractions[f],
+						amplitudes[a], out < 2 ? 0 : audio[worst], want);
+					return -1;
+				}
+			}
+		}
+	}
+
+	printf("fm_demod_test: %u tones within tolerance\n", runs);
+	return 0;
+}
+
+int main(void)
+{
+	struct par_pool pools[sizeof(threads) / sizeof(threads[0])];
+	unsigned int t;
+	int ret;
+
+	for (t = 0; t < sizeof(threads) / sizeof(threads[0]); t++) {
+		if (par_pool_init(&pools[t], threads[t])) {
+			fprintf(stderr, "par_pool_init(%u) failed\n", threads[t]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	ret = check_splits(pools) || check_accuracy();
+
+	for (t = 0; t < sizeof(threads) / sizeof(threads[0]); t++)
+		par_pool_free(&pools[t]);
+
+	return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
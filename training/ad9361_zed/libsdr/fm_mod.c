@@ -0,0 +1,181 @@
+/**
+ * Fixed-point FM modulator
+ *
+ * Licensed under the GPL-2.
+ *
+ **/
+
+#include <math.h>
+#include <pthread.h>
+
+#include "dsp.h"
+#include "fm_mod.h"
+#include "par.h"
+
+/* Below this many samples per thread the thread start-up dominates */
+#define FM_MOD_MIN_CHUNK	16384
+
+int16_t fm_mod_lut[FM_MOD_LUT_SIZE];
+
+static pthread_once_t fm_mod_lut_once = PTHREAD_ONCE_INIT;
+
+static void fm_mod_lut_fill(void)
+{
+	unsigned int k;
+
+	for (k = 0; k < FM_MOD_LUT_SIZE; k++)
+		fm_mod_lut[k] = (int16_t)lrint(cos(2 * M_PI * k / FM_MOD_LUT_SIZE)
+					       * FM_MOD_AMPLITUDE);
+}
+
+/**
+ * fm_mod_init() - set up a modulator starting at phase zero
+ * @mod: modulator state
+ * @deviation_scale: deviation in Hz per unit of input sample
+ * @offset_hz: constant frequency offset in Hz (offset LO tuning)
+ * @sample_rate: output sample rate in Hz
+ **/
+void fm_mod_init(struct fm_mod *mod, double deviation_scale,
+		 double offset_hz, double sample_rate)
+{
+	pthread_once(&fm_mod_lut_once, fm_mod_lut_fill);
+
+	mod->phase = 0;
+	fm_mod_set(mod, deviation_scale, offset_hz, sample_rate);
+}
+
+/**
+ * fm_mod_set() - change the deviation and offset of a running modulator
+ * @mod: modulator state, set up by fm_mod_init()
+ * @deviation_scale: deviation in Hz per unit of input sample
+ * @offset_hz: constant frequency offset in Hz
+ * @sample_rate: output sample rate in Hz
+ *
+ * The phase carries on, so the change does not click.
+ **/
+void fm_mod_set(struct fm_mod *mod, double deviation_scale,
+		double offset_hz, double sample_rate)
+{
+	const double turn = 4294967296.0;
+
+	mod->gain = (int32_t)lrint(deviation_scale / sample_rate * turn);
+	mod->offset = (uint32_t)(int64_t)llrint(offset_hz / sample_rate * turn);
+}
+
+static inline __attribute__((always_inline))
+uint32_t fm_mod_sum_body(const struct fm_mod *mod, const int16_t *in, size_t n)
+{
+	uint32_t sum = 0;
+	size_t k;
+
+	for (k = 0; k < n; k++)
+		sum += fm_mod_increment(mod, in[k]);
+
+	return sum;
+}
+
+DSP_KERNEL(fm_mod_sum, uint32_t,
+	   (const struct fm_mod *mod, const int16_t *in, size_t n),
+	   (mod, in, n))
+
+/* Returns the phase after the block */
+static inline __attribute__((always_inline))
+uint32_t fm_mod_block_body(const struct fm_mod *mod, uint32_t phase,
+			   const int16_t *in, int16_t *iq, size_t n)
+{
+	size_t k;
+
+	for (k = 0; k < n; k++) {
+		phase += fm_mod_increment(mod, in[k]);
+		fm_mod_iq(phase, &iq[2 * k], &iq[2 * k + 1]);
+	}
+
+	return phase;
+}
+
+DSP_KERNEL(fm_mod_block, uint32_t,
+	   (const struct fm_mod *mod, uint32_t phase, const int16_t *in,
+	    int16_t *iq, size_t n),
+	   (mod, phase, in, iq, n))
+
+/* Sum of the phase increments of a block, modulo one turn */
+uint32_t fm_mod_sum(const struct fm_mod *mod, const int16_t *in, size_t n)
+{
+	return DSP_CALL(fm_mod_sum)(mod, in, n);
+}
+
+/* Modulate n input samples into n interleaved I/Q pairs */
+void fm_mod_block(struct fm_mod *mod, const int16_t *in, int16_t *iq, size_t n)
+{
+	mod->phase = DSP_CALL(fm_mod_block)(mod, mod->phase, in, iq, n);
+}
+
+struct fm_mod_scan {
+	const struct fm_mod *mod;
+	const int16_t *in;
+	int16_t *iq;
+	uint32_t sum[PAR_MAX_CHUNKS];
+	uint32_t start[PAR_MAX_CHUNKS];
+};
+
+static void fm_mod_sum_chunk(void *ctx, unsigned int chunk,
+			     size_t begin, size_t end)
+{
+	struct fm_mod_scan *scan = ctx;
+
+	scan->sum[chunk] = fm_mod_sum(scan->mod, scan->in + begin, end - begin);
+}
+
+static void fm_mod_block_chunk(void *ctx, unsigned int chunk,
+			       size_t begin, size_t end)
+{
+	struct fm_mod_scan *scan = ctx;
+	struct fm_mod mod = *scan->mod;
+
+	mod.phase = scan->start[chunk];
+	fm_mod_block(&mod, scan->in + begin, scan->iq + 2 * begin, end - begin);
+}
+
+/**
+ * fm_mod_block_parallel() - modulate a block on several threads
+ * @mod: modulator state, advanced past the block like fm_mod_block()
+ * @in: input samples
+ * @iq: output, n interleaved I/Q pairs
+ * @n: number of samples
+ * @nthreads: number of threads to use, 0 for one per online CPU
+ *
+ * The block is cut into one chunk per thread. Every chunk first sums its
+ * phase increments, an exclusive scan over those sums gives the phase each
+ * chunk starts at, and then all chunks generate I/Q independently. Since
+ * the phase arithmetic is modulo 2^32 the result is bit-identical to
+ * fm_mod_block().
+ *
+ * Returns the number of chunks the block was split into.
+ **/
+int fm_mod_block_parallel(struct fm_mod *mod, const int16_t *in, int16_t *iq,
+			  size_t n, unsigned int nthreads)
+{
+	struct fm_mod_scan scan = { .mod = mod, .in = in, .iq = iq };
+	unsigned int count, k;
+	uint32_t phase;
+
+	count = par_chunks(n, nthreads, FM_MOD_MIN_CHUNK);
+	if (count <= 1) {
+		fm_mod_block(mod, in, iq, n);
+		return 1;
+	}
+
+	par_for(n, count, fm_mod_sum_chunk, &scan);
+
+	/* Exclusive scan: each chunk starts where the previous one ended */
+	phase = mod->phase;
+	for (k = 0; k < count; k++) {
+		scan.start[k] = phase;
+		phase += scan.sum[k];
+	}
+
+	par_for(n, count, fm_mod_block_chunk, &scan);
+
+	mod->phase = phase;
+	return count;
+}
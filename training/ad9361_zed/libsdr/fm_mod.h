@@ -0,0 +1,61 @@
+/**
+ * Fixed-point FM modulator
+ *
+ * Licensed under the GPL-2.
+ *
+ **/
+
+#ifndef FM_MOD_H
+#define FM_MOD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FM_MOD_LUT_BITS		12
+#define FM_MOD_LUT_SIZE		(1 << FM_MOD_LUT_BITS)
+#define FM_MOD_AMPLITUDE	0x7FFF
+
+/**
+ * struct fm_mod - numerically controlled oscillator state
+ * @phase: current phase, 2^32 is one full turn
+ * @gain: phase increment per unit of input sample
+ * @offset: constant phase increment added to every sample (LO offset)
+ *
+ * Phase increments are plain 32-bit integers that wrap modulo one turn,
+ * so the phase after n samples is the start phase plus the sum of the
+ * increments, whatever order that sum is taken in.
+ **/
+struct fm_mod {
+	uint32_t phase;
+	int32_t gain;
+	uint32_t offset;
+};
+
+extern int16_t fm_mod_lut[FM_MOD_LUT_SIZE];
+
+void fm_mod_init(struct fm_mod *mod, double deviation_scale,
+		 double offset_hz, double sample_rate);
+void fm_mod_set(struct fm_mod *mod, double deviation_scale,
+		double offset_hz, double sample_rate);
+
+/* The low 32 bits of x * gain, in a 32-bit multiply that vectorizes */
+static inline uint32_t fm_mod_increment(const struct fm_mod *mod, int16_t x)
+{
+	return (uint32_t)x * (uint32_t)mod->gain + mod->offset;
+}
+
+static inline void fm_mod_iq(uint32_t phase, int16_t *i, int16_t *q)
+{
+	unsigned int idx = (phase + (1u << (31 - FM_MOD_LUT_BITS)))
+		>> (32 - FM_MOD_LUT_BITS);
+
+	*i = fm_mod_lut[idx & (FM_MOD_LUT_SIZE - 1)];
+	*q = fm_mod_lut[(idx - FM_MOD_LUT_SIZE / 4) & (FM_MOD_LUT_SIZE - 1)];
+}
+
+uint32_t fm_mod_sum(const struct fm_mod *mod, const int16_t *in, size_t n);
+void fm_mod_block(struct fm_mod *mod, const int16_t *in, int16_t *iq, size_t n);
+int fm_mod_block_parallel(struct fm_mod *mod, const int16_t *in, int16_t *iq,
+			  size_t n, unsigned int nthreads);
+
+#endif /* FM_MOD_H */
@@ -0,0 +1,103 @@
+/**
+ * fm_mod_block_parallel() against fm_mod_block()
+ *
+ * The parallel modulator cuts a block into chunks, scans their phase sums
+ * for the phase each chunk starts at and modulates the chunks apart, which
+ * is only right if the result is bit-identical to the serial modulator.
+ * Checked for every instruction set this CPU has, over odd block sizes
+ * that leave short last chunks, thread counts that do not divide them, and
+ * start phases on and next to the wrap of the 32-bit phase.
+ *
+ * Licensed under the GPL-2.
+ *
+ **/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dsp.h"
+#include "fm_mod.h"
+
+#define MAX_SAMPLES	262147
+
+static const size_t sizes[] = { 1, 2, 32767, 32769, 65537, 100003, MAX_SAMPLES };
+static const unsigned int threads[] = { 2, 3, 4, 7, 8 };
+static const uint32_t phases[] = { 0, 1, 0x7fffffff, 0x80000000, 0xfffffff0 };
+
+/* Deviation samples that wander over the whole int16 range and back */
+static void fill_input(int16_t *in, size_t n)
+{
+	uint32_t seed = 12345;
+	int level = 0;
+	size_t k;
+
+	for (k = 0; k < n; k++) {
+		seed = seed * 1103515245 + 12345;
+		level += (int)(seed >> 20) - 2048;
+		if (level > 32767 || level < -32768)
+			level = (int)(seed >> 16) - 32768;
+		in[k] = level;
+	}
+}
+
+static int check(const int16_t *in, int16_t *serial, int16_t *parallel,
+		 size_t n, unsigned int nthreads, uint32_t phase)
+{
+	struct fm_mod a, b;
+	size_t k;
+
+	fm_mod_init(&a, 75000.0 / 32767.0, 200000, 2304000);
+	a.phase = phase;
+	b = a;
+
+	fm_mod_block(&a, in, serial, n);
+	fm_mod_block_parallel(&b, in, parallel, n, nthreads);
+
+	if (a.phase != b.phase) {
+		fprintf(stderr, "%s, %zu samples, %u threads, phase %#x: ends at %#x, not %#x\n",
+			dsp_isa_name(dsp_isa), n, nthreads, phase, b.phase, a.phase);
+		return -1;
+	}
+	if (memcmp(serial, parallel, 2 * n * sizeof(*serial))) {
+		for (k = 0; k < 2 * n && serial[k] == parallel[k]; k++)
+			;
+		fprintf(stderr, "%s, %zu samples, %u threads, phase %#x: sample %zu is %d, not %d\n",
+			dsp_isa_name(dsp_isa), n, nthreads, phase, k / 2,
+			parallel[k], serial[k]);
+		return -1;
+	}
+
+	return 0;
+}
+
+int main(void)
+{
+	int16_t *in = malloc(MAX_SAMPLES * sizeof(*in));
+	int16_t *serial = malloc(2 * MAX_SAMPLES * sizeof(*serial));
+	int16_t *parallel = malloc(2 * MAX_SAMPLES * sizeof(*parallel));
+	unsigned int s, t, p, runs = 0;
+	int isa;
+
+	if (!in || !serial || !parallel)
+		return EXIT_FAILURE;
+	fill_input(in, MAX_SAMPLES);
+
+	for (isa = 0; isa < DSP_NUM_ISAS; isa++) {
+		if (!dsp_isa_supported(isa))
+			continue;
+		dsp_isa = isa;
+		for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+			for (t = 0; t < sizeof(threads) / sizeof(threads[0]); t++)
+				for (p = 0; p < sizeof(phases) / sizeof(phases[0]); p++, runs++)
+					if (check(in, serial, parallel, sizes[s],
+						  threads[t], phases[p]))
+						return EXIT_FAILURE;
+	}
+
+	printf("fm_mod_test: %u blocks bit-exact\n", runs);
+	free(in);
+	free(serial);
+	free(parallel);
+	return EXIT_SUCCESS;
+}
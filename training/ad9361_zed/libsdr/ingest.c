@@ -0,0 +1,126 @@
+/**
+ * Copying DMA blocks into cached memory before processing them
+ *
+ * On the Zynq the DMA blocks are often mapped non-cacheable, and then
+ * every 16-bit load of the discriminator is a separate bus read. Copying
+ * a block first with wide loads, prefetching a tile ahead, turns that
+ * into bursts, and the processing then runs from the cache.
+ *
+ * Whether that pays is a property of the mapping, which ingest_probe()
+ * measures by timing reads of it against reads of cached heap memory.
+ *
+ * Licensed under the GPL-2.
+ *
+ **/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
+#include "ingest.h"
+
+#ifdef __ARM_NEON
+/* 64 bytes per step in four quad registers, the next tile prefetched */
+static void copy_tile(uint8_t *dst, const uint8_t *src, size_t bytes)
+{
+	size_t k;
+
+	for (k = 0; k + 64 <= bytes; k += 64) {
+		uint8x16_t a, b, c, d;
+
+		__builtin_prefetch(src + k + INGEST_TILE);
+		a = vld1q_u8(src + k);
+		b = vld1q_u8(src + k + 16);
+		c = vld1q_u8(src + k + 32);
+		d = vld1q_u8(src + k + 48);
+		vst1q_u8(dst + k, a);
+		vst1q_u8(dst + k + 16, b);
+		vst1q_u8(dst + k + 32, c);
+		vst1q_u8(dst + k + 48, d);
+	}
+	memcpy(dst + k, src + k, bytes - k);
+}
+#else
+/* The C library copy already uses the widest loads the CPU has */
+static void copy_tile(uint8_t *dst, const uint8_t *src, size_t bytes)
+{
+	size_t k;
+
+	for (k = 0; k < bytes; k += 64)
+		__builtin_prefetch(src + k + INGEST_TILE);
+	memcpy(dst, src, bytes);
+}
+#endif
+
+/**
+ * ingest_copy() - copy a DMA block into cached memory
+ * @dst: destination, cached
+ * @src: the block mapping
+ * @bytes: bytes to copy
+ **/
+void ingest_copy(void *dst, const void *src, size_t bytes)
+{
+	uint8_t *d = dst;
+	const uint8_t *s = src;
+	size_t k, n;
+
+	for (k = 0; k < bytes; k += n) {
+		n = bytes - k < INGEST_TILE ? bytes - k : INGEST_TILE;
+		copy_tile(d + k, s + k, n);
+	}
+}
+
+static double read_ns(const void *p, size_t bytes)
+{
+	const volatile uint16_t *w = p;
+	struct timespec t0, t1;
+	uint32_t sum = 0;
+	size_t k;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (k = 0; k < bytes / 2; k++)
+		sum += w[k];
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	/* Keeps the loads, which is what is timed */
+	__asm__ volatile("" : : "r"(sum));
+	return (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+}
+
+/**
+ * ingest_probe() - how much slower a mapping reads than cached memory
+ * @map: the mapping, readable
+ * @bytes: its size; at most INGEST_PROBE_BYTES of it are read
+ *
+ * Reads with 16-bit loads, the way the discriminator does, each buffer
+ * once to fault it in and warm the cache, then again timed.
+ *
+ * Returns the ratio of the read times, about 1 for a cached mapping, or
+ * 0 when the heap buffer cannot be allocated.
+ **/
+double ingest_probe(const void *map, size_t bytes)
+{
+	double t_map, t_heap;
+	void *heap;
+
+	if (bytes > INGEST_PROBE_BYTES)
+		bytes = INGEST_PROBE_BYTES;
+
+	heap = malloc(bytes);
+	if (!heap)
+		return 0;
+	memset(heap, 0, bytes);
+
+	read_ns(map, bytes);
+	t_map = read_ns(map, bytes);
+	read_ns(heap, bytes);
+	t_heap = read_ns(heap, bytes);
+
+	free(heap);
+	return t_heap > 0 ? t_map / t_heap : 0;
+}
@@ -0,0 +1,27 @@
+/**
+ * Copying DMA blocks into cached memory before processing them
+ *
+ * Licensed under the GPL-2.
+ *
+ **/
+
+#ifndef INGEST_H
+#define INGEST_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define INGEST_TILE		4096	/* bytes copied per prefetch step */
+#define INGEST_PROBE_BYTES	65536	/* read by ingest_probe() */
+#define INGEST_UNCACHED_RATIO	4.0	/* slower than this is not cached */
+
+void ingest_copy(void *dst, const void *src, size_t bytes);
+double ingest_probe(const void *map, size_t bytes);
+
+/* Whether a mapping reads like cached memory */
+static inline bool ingest_cached(const void *map, size_t bytes)
+{
+	return ingest_probe(map, bytes) < INGEST_UNCACHED_RATIO;
+}
+
+#endif /* INGEST_H */
@@ -0,0 +1,440 @@
+/**
+ * Streaming counters, gauges and histograms in Prometheus text format
+ *
+ * Counter and histogram values live in one shard per thread, which only
+ * that thread writes, so an update is a plain add with no lock and no
+ * shared cache line. The exporter thread sums the shards when it renders
+ * the registry, every METRICS_INTERVAL into a textfile for the node
+ * exporter's textfile collector and on each request to an optional HTTP
+ * endpoint on 127.0.0.1. Neither touches the streaming threads.
+ *
+ * Gauges are a single value, the last one set by any thread.
+ *
+ * Licensed under the GPL-2.
+ *
+ **/
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "metrics.h"
+
+enum metric_type {
+	METRIC_COUNTER,
+	METRIC_GAUGE,
+	METRIC_HISTOGRAM,
+};
+
+/**
+ * struct metric - one registered metric
+ * @slot: first shard slot; a histogram has @nbounds + 1 bucket counts,
+ *	then the sum in nanounits
+ * @gauge: value of a gauge, as the bits of a double
+ **/
+struct metric {
+	enum metric_type type;
+	const char *name;
+	const char *labels;
+	const char *help;
+	const double *bounds;
+	unsigned int nbounds;
+	unsigned int slot;
+	uint64_t gauge;
+};
+
+struct metrics_shard {
+	struct metrics_shard *next;
+	uint64_t v[METRICS_SLOTS];
+};
+
+static const double time_bounds[] = {
+	10e-6, 25e-6, 50e-6, 100e-6, 250e-6, 500e-6,
+	1e-3, 2.5e-3, 5e-3, 10e-3, 25e-3, 50e-3, 100e-3, 250e-3, 500e-3, 1,
+};
+
+static struct metric registry[METRICS_MAX];
+static unsigned int nmetrics, nslots;
+
+static struct metrics_shard *shards;
+static __thread struct metrics_shard *self;
+
+static char textfile[256];
+static int listen_fd = -1;
+static int wake[2] = { -1, -1 };
+static pthread_t exporter;
+static bool running;
+
+static struct metric *metrics_register(enum metric_type type, const char *name,
+				       const char *labels, const char *help,
+				       unsigned int slots)
+{
+	struct metric *m;
+
+	if (nmetrics == METRICS_MAX || nslots + slots > METRICS_SLOTS) {
+		fprintf(stderr, "Too many metrics, %s not exported\n", name);
+		return NULL;
+	}
+
+	m = &registry[nmetrics++];
+	m->type = type;
+	m->name = name;
+	m->labels = labels ? labels : "";
+	m->help = help;
+	m->slot = nslots;
+	nslots += slots;
+	return m;
+}
+
+/* A monotonically increasing count, e.g. of samples */
+struct metric *metrics_counter(const char *name, const char *labels,
+			       const char *help)
+{
+	return metrics_register(METRIC_COUNTER, name, labels, help, 1);
+}
+
+/* A value that goes up and down, e.g. a queue depth */
+struct metric *metrics_gauge(const char *name, const char *labels,
+			     const char *help)
+{
+	return metrics_register(METRIC_GAUGE, name, labels, help, 0);
+}
+
+/* A distribution over the upper bucket bounds @bounds, e.g. of durations */
+struct metric *metrics_histogram(const char *name, const char *labels,
+				 const char *help, const double *bounds,
+				 unsigned int nbounds)
+{
+	struct metric *m;
+
+	if (!bounds) {
+		bounds = time_bounds;
+		nbounds = sizeof(time_bounds) / sizeof(time_bounds[0]);
+	}
+
+	m = metrics_register(METRIC_HISTOGRAM, name, labels, help, nbounds + 2);
+	if (m) {
+		m->bounds = bounds;
+		m->nbounds = nbounds;
+	}
+	return m;
+}
+
+static struct metrics_shard *shard_self(void)
+{
+	struct metrics_shard *s = self;
+
+	if (s)
+		return s;
+
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return NULL;
+
+	s->next = __atomic_load_n(&shards, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&shards, &s->next, s, true,
+					    __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+
+	self = s;
+	return s;
+}
+
+/* Only the owning thread writes a shard, the exporter reads it */
+static inline void shard_add(struct metrics_shard *s, unsigned int slot,
+			     uint64_t n)
+{
+	__atomic_store_n(&s->v[slot], s->v[slot] + n, __ATOMIC_RELAXED);
+}
+
+void metric_add(struct metric *m, uint64_t n)
+{
+	struct metrics_shard *s;
+
+	if (!m || !(s = shard_self()))
+		return;
+	shard_add(s, m->slot, n);
+}
+
+void metric_set(struct metric *m, double v)
+{
+	uint64_t bits;
+
+	if (!m)
+		return;
+	memcpy(&bits, &v, sizeof(bits));
+	__atomic_store_n(&m->gauge, bits, __ATOMIC_RELAXED);
+}
+
+void metric_observe(struct metric *m, double v)
+{
+	struct metrics_shard *s;
+	unsigned int b;
+
+	if (!m || !(s = shard_self()))
+		return;
+
+	for (b = 0; b < m->nbounds && v > m->bounds[b]; b++)
+		;
+	shard_add(s, m->slot + b, 1);
+	shard_add(s, m->slot + m->nbounds + 1, (uint64_t)(v * 1e9));
+}
+
+static uint64_t metrics_sum(unsigned int slot)
+{
+	const struct metrics_shard *s;
+	uint64_t sum = 0;
+
+	for (s = __atomic_load_n(&shards, __ATOMIC_ACQUIRE); s; s = s->next)
+		sum += __atomic_load_n(&s->v[slot], __ATOMIC_RELAXED);
+	return sum;
+}
+
+static void print_name(FILE *f, const struct metric *m, const char *suffix,
+		       const char *le)
+{
+	fprintf(f, "%s%s", m->name, suffix);
+	if (m->labels[0] || le) {
+		fprintf(f, "{%s", m->labels);
+		if (le)
+			fprintf(f, "%sle=\"%s\"", m->labels[0] ? "," : "", le);
+		fputc('}', f);
+	}
+	fputc(' ', f);
+}
+
+static void metrics_render(FILE *f)
+{
+	static const char *const types[] = { "counter", "gauge", "histogram" };
+	unsigned int i, b;
+
+	for (i = 0; i < nmetrics; i++) {
+		const struct metric *m = &registry[i];
+		uint64_t bits, count = 0;
+		char le[32];
+		double v;
+
+		if (!i || strcmp(m->name, registry[i - 1].name))
+			fprintf(f, "# HELP %s %s\n# TYPE %s %s\n",
+				m->name, m->help, m->name, types[m->type]);
+
+		switch (m->type) {
+		case METRIC_COUNTER:
+			print_name(f, m, "", NULL);
+			fprintf(f, "%llu\n", (unsigned long long)metrics_sum(m->slot));
+			break;
+
+		case METRIC_GAUGE:
+			bits = __atomic_load_n(&m->gauge, __ATOMIC_RELAXED);
+			memcpy(&v, &bits, sizeof(v));
+			print_name(f, m, "", NULL);
+			fprintf(f, "%.9g\n", v);
+			break;
+
+		case METRIC_HISTOGRAM:
+			for (b = 0; b <= m->nbounds; b++) {
+				count += metrics_sum(m->slot + b);
+				if (b < m->nbounds)
+					snprintf(le, sizeof(le), "%g", m->bounds[b]);
+				else
+					strcpy(le, "+Inf");
+				print_name(f, m, "_bucket", le);
+				fprintf(f, "%llu\n", (unsigned long long)count);
+			}
+			print_name(f, m, "_sum", NULL);
+			fprintf(f, "%.9g\n", metrics_sum(m->slot + m->nbounds + 1) / 1e9);
+			print_name(f, m, "_count", NULL);
+			fprintf(f, "%llu\n", (unsigned long long)count);
+			break;
+		}
+	}
+}
+
+/* Replace the textfile whole, so a collector never reads half of it */
+static void metrics_write_textfile(void)
+{
+	char tmp[sizeof(textfile) + 8];
+	FILE *f;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", textfile);
+	f = fopen(tmp, "w");
+	if (!f)
+		return;
+	metrics_render(f);
+	if (fclose(f) || rename(tmp, textfile))
+		unlink(tmp);
+}
+
+/* Any request gets the metrics, HTTP/1.0 style with the connection closed */
+static void metrics_serve(void)
+{
+	static const char header[] =
+		"HTTP/1.0 200 OK\r\n"
+		"Content-Type: text/plain; version=0.0.4\r\n"
+		"Content-Length: %zu\r\n\r\n";
+	struct timeval timeout = { .tv_usec = 100000 };
+	char request[1024], head[128];
+	char *body = NULL;
+	size_t len = 0;
+	FILE *f;
+	int fd;
+
+	fd = accept(listen_fd, NULL, NULL);
+	if (fd < 0)
+		return;
+
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	if (read(fd, request, sizeof(request)) <= 0)
+		goto out;
+
+	f = open_memstream(&body, &len);
+	if (!f)
+		goto out;
+	metrics_render(f);
+	if (fclose(f))
+		goto out;
+
+	snprintf(head, sizeof(head), header, len);
+	if (write(fd, head, strlen(head)) > 0 && write(fd, body, len) > 0)
+		shutdown(fd, SHUT_WR);
+out:
+	free(body);
+	close(fd);
+}
+
+static void *exporter_thread(void *arg)
+{
+	struct pollfd fds[2] = {
+		{ .fd = wake[0], .events = POLLIN },
+		{ .fd = listen_fd, .events = POLLIN },
+	};
+	struct timespec now, next;
+
+	(void)arg;
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	for (;;) {
+		int timeout;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (now.tv_sec > next.tv_sec ||
+		    (now.tv_sec == next.tv_sec && now.tv_nsec >= next.tv_nsec)) {
+			if (textfile[0])
+				metrics_write_textfile();
+			next.tv_sec += METRICS_INTERVAL;
+		}
+
+		timeout = (next.tv_sec - now.tv_sec) * 1000 +
+			  (next.tv_nsec - now.tv_nsec) / 1000000 + 1;
+		if (poll(fds, listen_fd >= 0 ? 2 : 1, timeout) < 0 && errno != EINTR)
+			break;
+		if (fds[0].revents)
+			break;
+		if (listen_fd >= 0 && fds[1].revents)
+			metrics_serve();
+	}
+
+	if (textfile[0])
+		metrics_write_textfile();
+	return NULL;
+}
+
+static int metrics_listen(int port)
+{
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_port = htons(port),
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+	int one = 1;
+	int fd;
+
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -errno;
+
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    listen(fd, 4)) {
+		int err = -errno;
+
+		close(fd);
+		return err;
+	}
+	return fd;
+}
+
+/**
+ * metrics_start() - start exporting the registry
+ * @path: textfile rewritten every METRICS_INTERVAL and at metrics_stop(),
+ *	or NULL
+ * @port: serve the registry over HTTP on 127.0.0.1:@port, or 0
+ *
+ * Returns 0 or a negative errno.
+ **/
+int metrics_start(const char *path, int port)
+{
+	int ret;
+
+	if (path) {
+		if (strlen(path) >= sizeof(textfile))
+			return -ENAMETOOLONG;
+		strcpy(textfile, path);
+	}
+
+	if (port) {
+		listen_fd = metrics_listen(port);
+		if (listen_fd < 0) {
+			ret = listen_fd;
+			listen_fd = -1;
+			return ret;
+		}
+	}
+
+	if (pipe(wake)) {
+		ret = -errno;
+		goto err_listen;
+	}
+
+	ret = pthread_create(&exporter, NULL, exporter_thread, NULL);
+	if (ret) {
+		ret = -ret;
+		close(wake[0]);
+		close(wake[1]);
+		goto err_listen;
+	}
+
+	running = true;
+	return 0;
+
+err_listen:
+	if (listen_fd >= 0)
+		close(listen_fd);
+	listen_fd = -1;
+	return ret;
+}
+
+/* Write the textfile a last time and stop the exporter */
+void metrics_stop(void)
+{
+	if (!running)
+		return;
+
+	running = false;
+	if (write(wake[1], "", 1) == 1)
+		pthread_join(exporter, NULL);
+	close(wake[0]);
+	close(wake[1]);
+	if (listen_fd >= 0)
+		close(listen_fd);
+	listen_fd = -1;
+}
@@ -0,0 +1,40 @@
+/**
+ * Streaming counters, gauges and histograms in Prometheus text format
+ *
+ * Licensed under the GPL-2.
+ *
+ **/
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+
+#define METRICS_MAX		64	/* registered metrics */
+#define METRICS_SLOTS		512	/* counter values, histogram buckets included */
+#define METRICS_INTERVAL	1	/* seconds between textfile rewrites */
+
+struct metric;
+
+/*
+ * Register before starting the threads that update the metric. @labels
+ * is empty or a Prometheus label list such as "stage=\"read\"", metrics
+ * of one name with different labels go next to each other. A histogram
+ * with no @bounds gets seconds from 10 us to 1 s.
+ */
+struct metric *metrics_counter(const char *name, const char *labels,
+			       const char *help);
+struct metric *metrics_gauge(const char *name, const char *labels,
+			     const char *help);
+struct metric *metrics_histogram(const char *name, const char *labels,
+				 const char *help, const double *bounds,
+				 unsigned int nbounds);
+
+void metric_add(struct metric *m, uint64_t n);
+void metric_set(struct metric *m, double v);
+void metric_observe(struct metric *m, double v);
+
+int metrics_start(const char *path, int port);
+void metrics_stop(void);
+
+#endif /* METRICS_H */
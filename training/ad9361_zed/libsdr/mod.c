@@ -0,0 +1,308 @@
+/**
+ * Multi-mode modulator: FM, AM, USB and LSB
+ *
+ * Input is the signed 16-bit audio tx-fm reads, at the TX rate. FM is the
+ * fm_mod phase accumulator; NBFM is FM at a small deviation. AM and SSB
+ * build a complex envelope and move it to the LO offset with an
+ * oscillator of no deviation, so every mode transmits on the same
+ * frequency. Each mode is its own loop, built with DSP_KERNEL() for
+ * every instruction set, so the loops have no mode branches.
+ *
+ * AM carries full-scale input at 100 % modulation.
+ *
+ * USB and LSB are Weaver modulators. The audio is averaged down to about
+ * 48 kHz, shifted down by the middle of the SSB band and low-passed to
+ * half its width, which leaves the one sideband; linear interpolation
+ * back to the TX rate and the shift back up, folded into the offset
+ * oscillator, make the complex SSB signal. LSB is the conjugate of USB.
+ * The sideband filter is as long as MOD_SSB_ATTEN_DB asks for across the
+ * 300 Hz between the sidebands, hundreds of taps, so it runs on chunks
+ * of the block through conv.
+ *
+ * Licensed under the GPL-2.
+ *
+ **/
+
+#include <errno.h>
+#include <math.h>
+#include <string.h>
+
+#include "dsp.h"
+#include "mod.h"
+
+/* Middle and half width of the SSB audio band, 150 Hz to 2850 Hz */
+#define MOD_SSB_CENTRE		1500.0
+#define MOD_SSB_BANDWIDTH	1350.0
+
+/* The opposite sideband once shifted, from 150 Hz up, and how far down */
+#define MOD_SSB_STOP		1650.0
+#define MOD_SSB_ATTEN_DB	60.0
+
+static const char * const mode_names[MOD_NUM_MODES] = {
+	[MOD_FM] = "fm",
+	[MOD_AM] = "am",
+	[MOD_USB] = "usb",
+	[MOD_LSB] = "lsb",
+};
+
+/**
+ * mod_init() - set up a modulator
+ * @m: modulator state
+ * @mode: "fm", "am", "usb" or "lsb"
+ * @deviation_scale: FM deviation in Hz per unit of input sample
+ * @offset_hz: frequency offset of the signal from the LO
+ * @sample_rate: input and output sample rate in Hz
+ *
+ * mod_free() frees the sideband filter again. Returns 0, -EINVAL or
+ * -ENOMEM.
+ **/
+int mod_init(struct mod *m, const char *mode, double deviation_scale,
+	     double offset_hz, double sample_rate)
+{
+	double rate;
+	int k, ret;
+
+	for (k = 0; k < MOD_NUM_MODES; k++)
+		if (!strcmp(mode, mode_names[k]))
+			break;
+	if (k == MOD_NUM_MODES || sample_rate <= 0)
+		return -EINVAL;
+
+	memset(m, 0, sizeof(*m));
+	m->mode = k;
+	fm_mod_init(&m->nco, 0, 0, sample_rate);
+	mod_set(m, deviation_scale, offset_hz, sample_rate);
+	if (m->mode != MOD_USB && m->mode != MOD_LSB)
+		return 0;
+
+	m->decimation = lrint(sample_rate / MOD_SSB_RATE);
+	if (!m->decimation)
+		m->decimation = 1;
+	rate = sample_rate / m->decimation;
+	ret = conv_lowpass(&m->chan, (MOD_SSB_BANDWIDTH + MOD_SSB_STOP) / 2 / rate,
+			   (MOD_SSB_STOP - MOD_SSB_BANDWIDTH) / rate, MOD_SSB_ATTEN_DB, 1.0);
+	if (ret)
+		return ret;
+	fm_mod_init(&m->bfo, 0, MOD_SSB_CENTRE, rate);
+
+	return 0;
+}
+
+void mod_free(struct mod *m)
+{
+	conv_free(&m->chan);
+}
+
+/**
+ * mod_set() - change the deviation and offset of a running modulator
+ * @m: modulator state, set up by mod_init()
+ * @deviation_scale: FM deviation in Hz per unit of input sample
+ * @offset_hz: frequency offset of the signal from the LO
+ * @sample_rate: input and output sample rate in Hz
+ *
+ * The deviation only applies to FM. The phase carries on.
+ **/
+void mod_set(struct mod *m, double deviation_scale, double offset_hz,
+	     double sample_rate)
+{
+	switch (m->mode) {
+	case MOD_FM:
+		fm_mod_set(&m->nco, deviation_scale, offset_hz, sample_rate);
+		break;
+	case MOD_USB:
+		fm_mod_set(&m->nco, 0, offset_hz + MOD_SSB_CENTRE, sample_rate);
+		break;
+	case MOD_LSB:
+		fm_mod_set(&m->nco, 0, offset_hz - MOD_SSB_CENTRE, sample_rate);
+		break;
+	default:
+		fm_mod_set(&m->nco, 0, offset_hz, sample_rate);
+		break;
+	}
+}
+
+const char *mod_mode_name(enum mod_mode mode)
+{
+	return mode < MOD_NUM_MODES ? mode_names[mode] : "unknown";
+}
+
+/* Returns the phase after the block */
+static inline __attribute__((always_inline))
+uint32_t mod_am_body(const struct mod *m, uint32_t phase, const int16_t *in,
+		     int16_t *iq, size_t n)
+{
+	const uint32_t offset = m->nco.offset;
+	int32_t e;
+	int16_t c, s;
+	size_t k;
+
+	for (k = 0; k < n; k++) {
+		e = (FM_MOD_AMPLITUDE + in[k]) >> 1;
+		fm_mod_iq(phase, &c, &s);
+		phase += offset;
+		iq[2 * k] = (int16_t)((e * c) >> 15);
+		iq[2 * k + 1] = (int16_t)((e * s) >> 15);
+	}
+
+	return phase;
+}
+
+DSP_KERNEL(mod_am, uint32_t,
+	   (const struct mod *m, uint32_t phase, const int16_t *in,
+	    int16_t *iq, size_t n),
+	   (m, phase, in, iq, n))
+
+/* In this form the compiler uses min and max rather than branches */
+static inline float mod_clamp(float v)
+{
+	v = v < FM_MOD_AMPLITUDE ? v : FM_MOD_AMPLITUDE;
+	return v > -FM_MOD_AMPLITUDE ? v : -FM_MOD_AMPLITUDE;
+}
+
+/*
+ * Average len input samples into filter samples in @m->work, shifted so
+ * the band's middle is at 0 Hz, which keeps the upper sideband. Returns
+ * how many.
+ */
+static inline __attribute__((always_inline))
+size_t mod_ssb_mix(struct mod *m, const int16_t *in, size_t len)
+{
+	const unsigned int decimation = m->decimation;
+	const float step = 1.0f / decimation;
+	const float unit = 1.0f / FM_MOD_AMPLITUDE;
+	unsigned int run, l;
+	size_t k = 0, f = 0;
+	int32_t acc;
+	int16_t c, s;
+	float x;
+
+	while (k < len) {
+		run = decimation - m->pos;
+		if (run > len - k)
+			run = len - k;
+		acc = m->acc;
+		for (l = 0; l < run; l++)
+			acc += in[k + l];
+		k += run;
+		m->acc = acc;
+		m->pos += run;
+		if (m->pos < decimation)
+			break;
+
+		x = m->acc * step;
+		fm_mod_iq(m->bfo.phase, &c, &s);
+		m->bfo.phase += m->bfo.offset;
+		m->work[2 * f] = x * c * unit;
+		m->work[2 * f + 1] = -x * s * unit;
+		f++;
+		m->acc = 0;
+		m->pos = 0;
+	}
+
+	return f;
+}
+
+/*
+ * n input samples to n I/Q pairs, MOD_CHUNK filter samples at a time:
+ * mixed down into @m->work, through the sideband filter, and interpolated
+ * back up to the TX rate. mode is a constant.
+ */
+static inline __attribute__((always_inline))
+void mod_ssb_body(struct mod *m, const int16_t *in, int16_t *iq, size_t n,
+		  const enum mod_mode mode)
+{
+	const unsigned int decimation = m->decimation;
+	const float step = 1.0f / decimation;
+	const float unit = 1.0f / FM_MOD_AMPLITUDE;
+	const uint32_t offset = m->nco.offset;
+	uint32_t phase = m->nco.phase;
+	float yi, yq, di, dq;
+	unsigned int pos, run, l;
+	size_t k = 0, len, end, f;
+	int16_t c, s;
+
+	while (k < n) {
+		len = n - k;
+		if (len > MOD_CHUNK * decimation - m->pos)
+			len = MOD_CHUNK * decimation - m->pos;
+		pos = m->pos;
+		conv_block(&m->chan, m->work, mod_ssb_mix(m, in + k, len));
+
+		for (end = k + len, f = 0; k < end; ) {
+			run = decimation - pos;
+			if (run > end - k)
+				run = end - k;
+
+			/* Between two filter samples, interpolate from i0, q0 */
+			di = (m->i1 - m->i0) * step;
+			dq = (m->q1 - m->q0) * step;
+			yi = m->i0 + di * pos;
+			yq = m->q0 + dq * pos;
+			for (l = 0; l < run; l++) {
+				fm_mod_iq(phase, &c, &s);
+				phase += offset;
+				if (mode == MOD_LSB) {
+					iq[2 * (k + l)] = (int16_t)mod_clamp((yi * c + yq * s) * unit);
+					iq[2 * (k + l) + 1] = (int16_t)mod_clamp((yi * s - yq * c) * unit);
+				} else {
+					iq[2 * (k + l)] = (int16_t)mod_clamp((yi * c - yq * s) * unit);
+					iq[2 * (k + l) + 1] = (int16_t)mod_clamp((yi * s + yq * c) * unit);
+				}
+				yi += di;
+				yq += dq;
+			}
+			k += run;
+			pos += run;
+			if (pos < decimation)
+				break;
+
+			/* The mixing halved the amplitude */
+			m->i0 = m->i1;
+			m->q0 = m->q1;
+			m->i1 = 2 * m->work[2 * f];
+			m->q1 = 2 * m->work[2 * f + 1];
+			f++;
+			pos = 0;
+		}
+	}
+
+	m->nco.phase = phase;
+}
+
+#define MOD_SSB(name, mode) \
+static inline __attribute__((always_inline)) \
+void name##_body(struct mod *m, const int16_t *in, int16_t *iq, size_t n) \
+{ \
+	mod_ssb_body(m, in, iq, n, mode); \
+} \
+DSP_KERNEL(name, void, \
+	   (struct mod *m, const int16_t *in, int16_t *iq, size_t n), \
+	   (m, in, iq, n))
+
+MOD_SSB(mod_usb, MOD_USB)
+MOD_SSB(mod_lsb, MOD_LSB)
+
+/**
+ * mod_block() - modulate one block
+ * @m: modulator state, carried over to the next block
+ * @in: n input samples
+ * @iq: output, n interleaved I/Q pairs
+ * @n: number of samples
+ **/
+void mod_block(struct mod *m, const int16_t *in, int16_t *iq, size_t n)
+{
+	switch (m->mode) {
+	case MOD_AM:
+		m->nco.phase = DSP_CALL(mod_am)(m, m->nco.phase, in, iq, n);
+		break;
+	case MOD_USB:
+		DSP_CALL(mod_usb)(m, in, iq, n);
+		break;
+	case MOD_LSB:
+		DSP_CALL(mod_lsb)(m, in, iq, n);
+		break;
+	default:
+		fm_mod_block(&m->nco, in, iq, n);
+		break;
+	}
+}
@@ -0,0 +1,62 @@
+/**
+ * Multi-mode modulator: FM, AM, USB and LSB
+ *
+ * Licensed under the GPL-2.
+ *
+ **/
+
+#ifndef MOD_H
+#define MOD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "conv.h"
+#include "fm_mod.h"
+
+#define MOD_CHUNK		1024	/* filter samples filtered at once (SSB) */
+#define MOD_SSB_RATE		48000.0	/* Weaver filter rate, roughly */
+
+enum mod_mode {
+	MOD_FM,
+	MOD_AM,
+	MOD_USB,
+	MOD_LSB,
+	MOD_NUM_MODES
+};
+
+/**
+ * struct mod - modulator state
+ * @mode: modulation
+ * @nco: FM modulator, or for AM and SSB the oscillator moving the signal
+ *	to the LO offset (no deviation)
+ * @bfo: Weaver oscillator at the filter rate (SSB)
+ * @chan: sideband filter at the filter rate (SSB)
+ * @work: up to MOD_CHUNK I/Q pairs at the filter rate, on their way
+ *	through @chan
+ * @decimation: input samples per filter sample (SSB)
+ * @pos: input samples so far towards the next filter sample
+ * @acc: sum of those samples
+ * @i0, @q0, @i1, @q1: last two filtered samples, interpolated between
+ **/
+struct mod {
+	enum mod_mode mode;
+	struct fm_mod nco;
+	struct fm_mod bfo;
+	struct conv chan;
+	float work[2 * MOD_CHUNK];
+	unsigned int decimation;
+	unsigned int pos;
+	int32_t acc;
+	float i0, q0, i1, q1;
+};
+
+int mod_init(struct mod *m, const char *mode, double deviation_scale,
+	     double offset_hz, double sample_rate);
+void mod_free(struct mod *m);
+void mod_set(struct mod *m, double deviation_scale, double offset_hz,
+	     double sample_rate);
+const char *mod_mode_name(enum mod_mode mode);
+void mod_block(struct mod *m, const int16_t *in, int16_t *iq, size_t n);
+
+#endif /* MOD_H */
@@ -0,0 +1,86 @@
+/**
+ * SSB opposite sideband rejection of mod
+ *
+ * Modulates an audio tone in USB and in LSB and compares what goes out
+ * on its sideband with what leaks onto the other. 300 Hz is the hard
+ * case: once shifted by the middle of the band, the leak lies just past
+ * the edge of the sideband filter.
+ *
+ * Licensed under the GPL-2.
+ *
+ **/
+
+#include <complex.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mod.h"
+
+#define RATE		2304000.0
+#define BLOCK		23040		/* 10 ms, whole cycles of every tone */
+#define BLOCKS		100
+#define MEASURE		10		/* the last blocks, once the filter is full */
+#define REJECTION_DB	40.0
+
+static const double tones[] = { 300, 1000, 2500 };
+
+/* Amplitude of the f Hz component of n I/Q pairs */
+static double tone_level(const int16_t *iq, size_t n, double f)
+{
+	double complex sum = 0, w = 1, step = cexp(-2 * M_PI * I * f / RATE);
+	size_t k;
+
+	for (k = 0; k < n; k++) {
+		sum += (iq[2 * k] + I * iq[2 * k + 1]) * w;
+		w *= step;
+	}
+
+	return cabs(sum) / n;
+}
+
+static int check(const char *mode, double f)
+{
+	static int16_t in[BLOCK], iq[2 * BLOCK * MEASURE];
+	double want = !strcmp(mode, "usb") ? f : -f;
+	double on, off;
+	struct mod m;
+	size_t b, k;
+	int ret;
+
+	ret = mod_init(&m, mode, 0, 0, RATE);
+	if (ret) {
+		fprintf(stderr, "mod_init(%s): %d\n", mode, ret);
+		return -1;
+	}
+
+	for (k = 0; k < BLOCK; k++)
+		in[k] = lrint(16000 * sin(2 * M_PI * f * k / RATE));
+	for (b = 0; b < BLOCKS; b++)
+		mod_block(&m, in, iq + 2 * BLOCK * (b < BLOCKS - MEASURE ? 0 : b - (BLOCKS - MEASURE)),
+			  BLOCK);
+	mod_free(&m);
+
+	on = tone_level(iq, BLOCK * MEASURE, want);
+	off = tone_level(iq, BLOCK * MEASURE, -want);
+	printf("mod_test: %s %4.0f Hz: %.0f on the sideband, %.1f dB down on the other\n",
+	       mode, f, on, 20 * log10(on / off));
+	if (on < 1000 || 20 * log10(on / off) < REJECTION_DB) {
+		fprintf(stderr, "%s %.0f Hz: want %.0f dB\n", mode, f, REJECTION_DB);
+		return -1;
+	}
+
+	return 0;
+}
+
+int main(void)
+{
+	unsigned int t;
+
+	for (t = 0; t < sizeof(tones) / sizeof(tones[0]); t++)
+		if (check("usb", tones[t]) || check("lsb", tones[t]))
+			return EXIT_FAILURE;
+
+	return EXIT_SUCCESS;
+}
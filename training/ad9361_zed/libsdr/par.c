@@ -0,0 +1,258 @@
+/**
+ * Fork/join helpers for splitting a block across threads
+ *
+ * par_for() starts a thread per chunk, which suits blocks that take far
+ * longer than a thread start-up. A par_pool keeps its threads between
+ * blocks for the streaming loops, where a block is a few milliseconds.
+ *
+ * Licensed under the GPL-2.
+ *
+ **/
+
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "par.h"
+
+struct par_job {
+	par_fn fn;
+	void *ctx;
+	unsigned int chunk;
+	size_t begin;
+	size_t end;
+	pthread_t thread;
+	int started;
+};
+
+static void *par_thread(void *arg)
+{
+	struct par_job *job = arg;
+
+	job->fn(job->ctx, job->chunk, job->begin, job->end);
+	return NULL;
+}
+
+unsigned int par_default_threads(void)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return cpus > 0 ? (unsigned int)cpus : 1;
+}
+
+/**
+ * par_chunks() - number of chunks worth splitting a block into
+ * @n: block length
+ * @nthreads: thread limit, 0 for one per online CPU
+ * @min_chunk: smallest chunk for which a thread start-up pays off
+ **/
+unsigned int par_chunks(size_t n, unsigned int nthreads, size_t min_chunk)
+{
+	size_t count = min_chunk ? n / min_chunk : n;
+
+	if (!nthreads)
+		nthreads = par_default_threads();
+	if (nthreads > PAR_MAX_CHUNKS)
+		nthreads = PAR_MAX_CHUNKS;
+	if (count > nthreads)
+		count = nthreads;
+
+	return count ? count : 1;
+}
+
+/* Sample range of chunk k of n cut into equal chunks */
+static void par_range(size_t n, unsigned int chunks, unsigned int k,
+		      size_t *begin, size_t *end)
+{
+	size_t per_chunk = (n + chunks - 1) / chunks;
+
+	*begin = k * per_chunk < n ? k * per_chunk : n;
+	*end = (k + 1) * per_chunk < n ? (k + 1) * per_chunk : n;
+}
+
+/**
+ * par_for() - run fn over [0, n) cut into equal chunks
+ *
+ * Chunk 0, and any chunk whose thread could not be started, runs on the
+ * calling thread. Returns once every chunk has finished.
+ **/
+void par_for(size_t n, unsigned int chunks, par_fn fn, void *ctx)
+{
+	struct par_job jobs[PAR_MAX_CHUNKS];
+	unsigned int k;
+
+	if (chunks > PAR_MAX_CHUNKS)
+		chunks = PAR_MAX_CHUNKS;
+	if (chunks <= 1) {
+		fn(ctx, 0, 0, n);
+		return;
+	}
+
+	for (k = 0; k < chunks; k++) {
+		jobs[k].fn = fn;
+		jobs[k].ctx = ctx;
+		jobs[k].chunk = k;
+		par_range(n, chunks, k, &jobs[k].begin, &jobs[k].end);
+	}
+
+	for (k = 1; k < chunks; k++)
+		jobs[k].started = !pthread_create(&jobs[k].thread, NULL,
+						  par_thread, &jobs[k]);
+
+	par_thread(&jobs[0]);
+
+	for (k = 1; k < chunks; k++) {
+		if (jobs[k].started)
+			pthread_join(jobs[k].thread, NULL);
+		else
+			par_thread(&jobs[k]);
+	}
+}
+
+/*
+ * Claim chunks of the current job until none are left. A thread that is
+ * done early takes the chunks a slower one has not started on.
+ */
+static void par_pool_work(struct par_pool *p)
+{
+	size_t begin, end;
+	unsigned int k;
+
+	while ((k = __atomic_fetch_add(&p->next, 1, __ATOMIC_RELAXED)) < p->chunks) {
+		par_range(p->n, p->chunks, k, &begin, &end);
+		p->fn(p->ctx, k, begin, end);
+	}
+}
+
+/*
+ * A worker starts from generation 0, the one par_pool_init() set, not from
+ * whatever it finds once it runs: par_pool_for() may already have handed
+ * out the first job by then.
+ */
+static void *par_pool_thread(void *arg)
+{
+	struct par_pool *p = arg;
+	unsigned long seen = 0;
+
+	pthread_mutex_lock(&p->lock);
+	for (;;) {
+		while (p->generation == seen && !p->quit)
+			pthread_cond_wait(&p->start, &p->lock);
+		if (p->quit)
+			break;
+		seen = p->generation;
+		pthread_mutex_unlock(&p->lock);
+
+		par_pool_work(p);
+
+		pthread_mutex_lock(&p->lock);
+		if (!--p->active)
+			pthread_cond_signal(&p->done);
+	}
+	pthread_mutex_unlock(&p->lock);
+	return NULL;
+}
+
+/**
+ * par_pool_init() - start the worker threads of a pool
+ * @p: pool
+ * @nthreads: threads to run jobs on, the caller included, 0 for one per
+ *	online CPU
+ *
+ * Returns 0 or a negative errno. A pool of one thread has no workers and
+ * runs every job on the caller.
+ **/
+int par_pool_init(struct par_pool *p, unsigned int nthreads)
+{
+	unsigned int k;
+	int ret;
+
+	if (!nthreads)
+		nthreads = par_default_threads();
+	if (nthreads > PAR_MAX_CHUNKS)
+		nthreads = PAR_MAX_CHUNKS;
+
+	p->nthreads = 1;
+	p->generation = 0;
+	p->active = 0;
+	p->quit = false;
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->start, NULL);
+	pthread_cond_init(&p->done, NULL);
+
+	for (k = 0; k + 1 < nthreads; k++) {
+		ret = pthread_create(&p->workers[k], NULL, par_pool_thread, p);
+		if (ret) {
+			par_pool_free(p);
+			return -ret;
+		}
+		p->nthreads++;
+	}
+
+	return 0;
+}
+
+/* Stop the workers */
+void par_pool_free(struct par_pool *p)
+{
+	unsigned int k;
+
+	pthread_mutex_lock(&p->lock);
+	p->quit = true;
+	pthread_cond_broadcast(&p->start);
+	pthread_mutex_unlock(&p->lock);
+
+	for (k = 0; k + 1 < p->nthreads; k++)
+		pthread_join(p->workers[k], NULL);
+	p->nthreads = 1;
+
+	pthread_cond_destroy(&p->start);
+	pthread_cond_destroy(&p->done);
+	pthread_mutex_destroy(&p->lock);
+}
+
+/**
+ * par_pool_for() - run fn over [0, n) cut into equal chunks on a pool
+ * @p: pool, or NULL to run on the caller alone
+ *
+ * Cut into more chunks than there are threads, the block balances across
+ * threads that are slowed down by other work. Returns once every chunk has
+ * finished and every worker is waiting for the next job again.
+ **/
+void par_pool_for(struct par_pool *p, size_t n, unsigned int chunks,
+		  par_fn fn, void *ctx)
+{
+	unsigned int k;
+
+	if (chunks > PAR_MAX_CHUNKS)
+		chunks = PAR_MAX_CHUNKS;
+	if (!p || p->nthreads <= 1 || chunks <= 1) {
+		size_t begin, end;
+
+		for (k = 0; k < chunks; k++) {
+			par_range(n, chunks, k, &begin, &end);
+			fn(ctx, k, begin, end);
+		}
+		if (!chunks)
+			fn(ctx, 0, 0, n);
+		return;
+	}
+
+	pthread_mutex_lock(&p->lock);
+	p->fn = fn;
+	p->ctx = ctx;
+	p->n = n;
+	p->chunks = chunks;
+	p->next = 0;
+	p->active = p->nthreads - 1;
+	p->generation++;
+	pthread_cond_broadcast(&p->start);
+	pthread_mutex_unlock(&p->lock);
+
+	par_pool_work(p);
+
+	pthread_mutex_lock(&p->lock);
+	while (p->active)
+		pthread_cond_wait(&p->done, &p->lock);
+	pthread_mutex_unlock(&p->lock);
+}
@@ -0,0 +1,53 @@
+/**
+ * Fork/join helpers for splitting a block across threads
+ *
+ * Licensed under the GPL-2.
+ *
+ **/
+
+#ifndef PAR_H
+#define PAR_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define PAR_MAX_CHUNKS	64
+
+/* Called once per chunk with the half-open sample range [begin, end) */
+typedef void (*par_fn)(void *ctx, unsigned int chunk, size_t begin, size_t end);
+
+/**
+ * struct par_pool - worker threads kept across blocks
+ * @nthreads: threads taking chunks, the caller of par_pool_for() included
+ * @workers: the other @nthreads - 1
+ * @generation: counts the jobs handed out, a worker waits for it to change
+ * @active: workers not done with the current job
+ * @next: next chunk of the current job to claim
+ **/
+struct par_pool {
+	unsigned int nthreads;
+	pthread_t workers[PAR_MAX_CHUNKS];
+	pthread_mutex_t lock;
+	pthread_cond_t start, done;
+	unsigned long generation;
+	unsigned int active;
+	bool quit;
+
+	par_fn fn;
+	void *ctx;
+	size_t n;
+	unsigned int chunks;
+	unsigned int next;
+};
+
+unsigned int par_default_threads(void);
+unsigned int par_chunks(size_t n, unsigned int nthreads, size_t min_chunk);
+void par_for(size_t n, unsigned int chunks, par_fn fn, void *ctx);
+
+int par_pool_init(struct par_pool *p, unsigned int nthreads);
+void par_pool_free(struct par_pool *p);
+void par_pool_for(struct par_pool *p, size_t n, unsigned int chunks,
+		  par_fn fn, void *ctx);
+
+#endif /* PAR_H */
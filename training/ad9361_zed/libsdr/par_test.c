@@ -0,0 +1,58 @@
+/**
+ * par_pool start-up and tear-down check
+ *
+ * Loops par_pool_init() -> par_pool_for() -> par_pool_free(), the way
+ * iio_fm_radio and sdr-bench use a pool, and checks every chunk ran. A
+ * job handed out before the workers are waiting must not be missed; if
+ * it is, this hangs.
+ *
+ * Licensed under the GPL-2.
+ *
+ **/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "par.h"
+
+#define ROUNDS	2000
+#define SAMPLES	1000
+
+static void count_chunk(void *ctx, unsigned int chunk, size_t begin, size_t end)
+{
+	unsigned int *hits = ctx;
+	size_t k;
+
+	(void)chunk;
+	for (k = begin; k < end; k++)
+		__atomic_fetch_add(&hits[k], 1, __ATOMIC_RELAXED);
+}
+
+int main(void)
+{
+	static unsigned int hits[SAMPLES];
+	struct par_pool pool;
+	unsigned int round, threads;
+	size_t k;
+
+	for (round = 0; round < ROUNDS; round++) {
+		threads = 2 + round % 7;
+		if (par_pool_init(&pool, threads)) {
+			fprintf(stderr, "par_pool_init(%u) failed\n", threads);
+			return EXIT_FAILURE;
+		}
+		par_pool_for(&pool, SAMPLES, 4 * threads, count_chunk, hits);
+		par_pool_free(&pool);
+
+		for (k = 0; k < SAMPLES; k++) {
+			if (hits[k] != round + 1) {
+				fprintf(stderr, "round %u: sample %zu ran %u times\n",
+					round, k, hits[k] - round);
+				return EXIT_FAILURE;
+			}
+		}
+	}
+
+	printf("par_test: %u pools OK\n", ROUNDS);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,597 @@
+/**
+ * Gapless playlist with background prefetch
+ *
+ * A prefetch thread opens each item in turn, 16-bit PCM WAV or raw s16le
+ * at the playlist's rate, and writes its samples into a ring that
+ * playlist_read() empties. The ring holds seconds of audio, so the next
+ * item is open and decoding long before the current one runs out, and the
+ * stream goes from one into the other with no gap: butt-joined, or with
+ * the last @fade samples of one item held back and crossfaded into the
+ * first of the next, over no more than half of either. The list starts
+ * over at its end, so a single item loops.
+ *
+ * The ring has one writer and one reader, each advancing its own counter
+ * with release stores, so playlist_read() takes no lock and never waits;
+ * what it cannot fill it leaves silent, and counts as an underrun unless
+ * the list ran out. Item changes travel alongside as marks at their
+ * stream position, for the caller to report when they go on air.
+ *
+ * The items come from playlist_add(), or from a directory or a list file
+ * of one path per line that inotify watches: a file closed after writing,
+ * moved in, moved out or deleted makes the prefetch thread read the list
+ * again. The item being prefetched carries on and the one after it in the
+ * new list is next, so an edit is heard once the audio already in the
+ * ring has played.
+ *
+ * Licensed under the GPL-2.
+ *
+ **/
+
+#include <dirent.h>
+#include <errno.h>
+#include <math.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "audio.h"
+#include "playlist.h"
+
+#define PLAYLIST_CHUNK		16384	/* samples read from an item at once */
+#define PLAYLIST_POLL_MS	10	/* wait for ring space, watching the list */
+#define PLAYLIST_IDLE_MS	100	/* wait for something to play */
+
+#define PLAYLIST_EVENTS	(IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE)
+
+/**
+ * playlist_init() - set up an empty playlist
+ * @pl: playlist state
+ * @rate: sample rate in Hz of the output and of every item
+ * @crossfade: seconds the end of an item overlaps the start of the next,
+ *	0 to butt-join them
+ * @prefetch: seconds of audio decoded ahead of playlist_read()
+ *
+ * Returns 0, -EINVAL or -ENOMEM.
+ **/
+int playlist_init(struct playlist *pl, unsigned int rate, double crossfade,
+		  double prefetch)
+{
+	size_t size = PLAYLIST_CHUNK;
+
+	memset(pl, 0, sizeof(*pl));
+	pl->inotify = -1;
+	pthread_mutex_init(&pl->lock, NULL);
+	if (!rate || crossfade < 0 || prefetch <= 0)
+		return -EINVAL;
+
+	pl->rate = rate;
+	pl->fade = (size_t)lrint(crossfade * rate);
+	while (size < prefetch * rate || size < 4 * pl->fade)
+		size <<= 1;
+	pl->mask = size - 1;
+
+	pl->ring = malloc(size * sizeof(*pl->ring));
+	pl->buf = malloc((PLAYLIST_CHUNK + 2 * pl->fade) * sizeof(*pl->buf));
+	pl->tail_buf = malloc((pl->fade + 1) * sizeof(*pl->tail_buf));
+	if (!pl->ring || !pl->buf || !pl->tail_buf) {
+		playlist_free(pl);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+/* dir/name, or name alone when it is absolute */
+static char *path_join(const char *dir, const char *name)
+{
+	size_t len;
+	char *path;
+
+	if (name[0] == '/' || !dir)
+		return strdup(name);
+	len = strlen(dir) + strlen(name) + 2;
+	path = malloc(len);
+	if (path)
+		snprintf(path, len, "%s/%s", dir, name);
+	return path;
+}
+
+static void items_free(char **items, size_t len)
+{
+	size_t k;
+
+	for (k = 0; k < len; k++)
+		free(items[k]);
+	free(items);
+}
+
+static int items_append(char ***items, size_t *len, char *path)
+{
+	char **grown;
+
+	if (!path)
+		return -ENOMEM;
+	grown = realloc(*items, (*len + 1) * sizeof(**items));
+	if (!grown) {
+		free(path);
+		return -ENOMEM;
+	}
+	grown[(*len)++] = path;
+	*items = grown;
+	return 0;
+}
+
+/**
+ * playlist_add() - append a file to the list
+ * @pl: playlist state
+ * @path: file to play, copied
+ *
+ * Safe while the playlist plays. A watched directory or list file
+ * replaces the whole list when it changes. Returns 0 or -ENOMEM.
+ **/
+int playlist_add(struct playlist *pl, const char *path)
+{
+	int ret;
+
+	pthread_mutex_lock(&pl->lock);
+	ret = items_append(&pl->items, &pl->len, strdup(path));
+	pthread_mutex_unlock(&pl->lock);
+	return ret;
+}
+
+static int name_cmp(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* The regular files of a directory, not hidden, in name order */
+static int read_dir(const char *dir, char ***items, size_t *len)
+{
+	struct dirent *d;
+	struct stat st;
+	char *path;
+	DIR *dp;
+	int ret = 0;
+
+	dp = opendir(dir);
+	if (!dp)
+		return -errno;
+
+	while (!ret && (d = readdir(dp))) {
+		if (d->d_name[0] == '.')
+			continue;
+		path = path_join(dir, d->d_name);
+		if (path && (stat(path, &st) || !S_ISREG(st.st_mode))) {
+			free(path);
+			continue;
+		}
+		ret = items_append(items, len, path);
+	}
+	closedir(dp);
+
+	if (!ret)
+		qsort(*items, *len, sizeof(**items), name_cmp);
+	return ret;
+}
+
+/* One path per line, relative to the list's directory; # starts a comment */
+static int read_list(const char *list, const char *dir, char ***items, size_t *len)
+{
+	char *line = NULL, *end;
+	size_t size = 0;
+	FILE *fp;
+	int ret = 0;
+
+	fp = fopen(list, "r");
+	if (!fp)
+		return -errno;
+
+	while (!ret && getline(&line, &size, fp) >= 0) {
+		end = line + strlen(line);
+		while (end > line && (end[-1] == '\n' || end[-1] == '\r' ||
+				      end[-1] == ' ' || end[-1] == '\t'))
+			*--end = 0;
+		if (!line[0] || line[0] == '#')
+			continue;
+		ret = items_append(items, len, path_join(dir, line));
+	}
+	free(line);
+	fclose(fp);
+
+	return ret;
+}
+
+/* Read the watched directory or list again; the old list stays on error */
+static int playlist_reload(struct playlist *pl)
+{
+	char **items = NULL, *dir, *slash;
+	size_t len = 0, k;
+	int ret;
+
+	if (!pl->watch_name) {
+		ret = read_dir(pl->watch, &items, &len);
+	} else {
+		dir = strdup(pl->watch);
+		if (!dir)
+			return -ENOMEM;
+		slash = strrchr(dir, '/');
+		if (slash)
+			*slash = 0;
+		ret = read_list(pl->watch, slash ? dir : NULL, &items, &len);
+		free(dir);
+	}
+	if (ret) {
+		items_free(items, len);
+		return ret;
+	}
+
+	/* Carry on after the current item where it still is */
+	pthread_mutex_lock(&pl->lock);
+	for (k = 0; pl->current && k < len; k++) {
+		if (!strcmp(items[k], pl->current)) {
+			pl->next = k + 1;
+			break;
+		}
+	}
+	items_free(pl->items, pl->len);
+	pl->items = items;
+	pl->len = len;
+	pthread_mutex_unlock(&pl->lock);
+
+	return 0;
+}
+
+/**
+ * playlist_watch() - take the list from a directory or list file
+ * @pl: playlist state, not started yet
+ * @path: directory, whose regular files play in name order, or a file
+ *	listing one path per line
+ *
+ * Replaces the list, and again whenever @path changes. Returns 0 or a
+ * negative errno.
+ **/
+int playlist_watch(struct playlist *pl, const char *path)
+{
+	char *dir, *slash;
+	struct stat st;
+	int ret;
+
+	if (stat(path, &st))
+		return -errno;
+
+	pl->watch = strdup(path);
+	dir = strdup(path);
+	if (!pl->watch || !dir) {
+		free(dir);
+		return -ENOMEM;
+	}
+
+	/* Editors replace a list file, so watch its directory for the name */
+	if (!S_ISDIR(st.st_mode)) {
+		slash = strrchr(dir, '/');
+		pl->watch_name = strdup(slash ? slash + 1 : dir);
+		if (slash == dir)
+			dir[1] = 0;
+		else if (slash)
+			*slash = 0;
+		else
+			strcpy(dir, ".");
+		if (!pl->watch_name) {
+			free(dir);
+			return -ENOMEM;
+		}
+	}
+
+	pl->inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (pl->inotify < 0 || inotify_add_watch(pl->inotify, dir, PLAYLIST_EVENTS) < 0)
+		ret = -errno;
+	else
+		ret = playlist_reload(pl);
+	free(dir);
+
+	return ret;
+}
+
+/* Read the list again if the watch saw it change */
+static void playlist_check_watch(struct playlist *pl)
+{
+	char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	bool changed = false;
+	ssize_t len;
+	char *p;
+
+	while ((len = read(pl->inotify, events, sizeof(events))) > 0) {
+		for (p = events; p < events + len; p += sizeof(*ev) + ev->len) {
+			ev = (const struct inotify_event *)p;
+			if (ev->mask & IN_Q_OVERFLOW)
+				changed = true;
+			else if (!ev->len)
+				continue;
+			else if (pl->watch_name ? !strcmp(ev->name, pl->watch_name) :
+				 ev->name[0] != '.')
+				changed = true;
+		}
+	}
+
+	if (changed)
+		playlist_reload(pl);
+}
+
+/* Sleep up to ms, waking early to follow changes to the list */
+static void playlist_wait(struct playlist *pl, int ms)
+{
+	struct pollfd pfd = { .fd = pl->inotify, .events = POLLIN };
+	struct timespec ts = { .tv_sec = ms / 1000, .tv_nsec = ms % 1000 * 1000000L };
+
+	if (pl->inotify < 0) {
+		nanosleep(&ts, NULL);
+		return;
+	}
+	if (poll(&pfd, 1, ms) > 0)
+		playlist_check_watch(pl);
+}
+
+/* Copy n samples into the ring, waiting for playlist_read() to make room */
+static void playlist_commit(struct playlist *pl, const int16_t *x, size_t n)
+{
+	const size_t size = pl->mask + 1;
+	size_t space, run, pos, first;
+
+	while (n && !__atomic_load_n(&pl->quit, __ATOMIC_RELAXED)) {
+		space = size - (pl->head - __atomic_load_n(&pl->tail, __ATOMIC_ACQUIRE));
+		if (!space) {
+			__atomic_store_n(&pl->primed, true, __ATOMIC_RELEASE);
+			playlist_wait(pl, PLAYLIST_POLL_MS);
+			continue;
+		}
+
+		run = n < space ? n : space;
+		pos = pl->head & pl->mask;
+		first = run < size - pos ? run : size - pos;
+		memcpy(pl->ring + pos, x, first * sizeof(*x));
+		memcpy(pl->ring, x + first, (run - first) * sizeof(*x));
+		__atomic_store_n(&pl->head, pl->head + run, __ATOMIC_RELEASE);
+		x += run;
+		n -= run;
+	}
+}
+
+/* Queue an item change at the current end of the stream, waiting for room */
+static void playlist_push_mark(struct playlist *pl, const char *path, int err)
+{
+	const char *slash = strrchr(path, '/');
+	struct playlist_mark *m;
+
+	while (pl->mark_head - __atomic_load_n(&pl->mark_tail, __ATOMIC_ACQUIRE) >= PLAYLIST_MARKS) {
+		if (__atomic_load_n(&pl->quit, __ATOMIC_RELAXED))
+			return;
+		__atomic_store_n(&pl->primed, true, __ATOMIC_RELEASE);
+		playlist_wait(pl, PLAYLIST_POLL_MS);
+	}
+
+	m = &pl->marks[pl->mark_head % PLAYLIST_MARKS];
+	m->at = pl->head;
+	m->err = err;
+	snprintf(m->name, sizeof(m->name), "%s", slash ? slash + 1 : path);
+	__atomic_store_n(&pl->mark_head, pl->mark_head + 1, __ATOMIC_RELEASE);
+}
+
+/* The next item to play, a copy, or NULL when the list is empty */
+static char *playlist_pick(struct playlist *pl, size_t *len)
+{
+	char *path = NULL;
+
+	pthread_mutex_lock(&pl->lock);
+	*len = pl->len;
+	if (pl->len) {
+		if (pl->next >= pl->len)
+			pl->next = 0;
+		path = strdup(pl->items[pl->next++]);
+		free(pl->current);
+		pl->current = path ? strdup(path) : NULL;
+	}
+	pthread_mutex_unlock(&pl->lock);
+
+	return path;
+}
+
+/*
+ * Stream one item into the ring, crossfading its start with the held tail.
+ * Each end of an item fades over at most half of it, so an item shorter
+ * than two fades still goes on air between its neighbours' fades.
+ */
+static void playlist_stream(struct playlist *pl, struct audio_in *in, const char *path)
+{
+	const size_t fade = pl->fade;
+	size_t pending, total, m, k, n;
+	float w;
+
+	/* Read what the tail fades into, fewer samples only at the item's end */
+	pending = total = audio_read(in, pl->buf, 2 * pl->tail_len);
+
+	/* What of the tail this item is too short for plays out unfaded */
+	n = pl->tail_len < total / 2 ? pl->tail_len : total / 2;
+	playlist_commit(pl, pl->tail_buf, pl->tail_len - n);
+	playlist_push_mark(pl, path, 0);
+	for (k = 0; k < n; k++) {
+		w = (k + 1) / (n + 1.0f);
+		pl->buf[k] = (int16_t)lrintf(pl->tail_buf[pl->tail_len - n + k] * (1 - w) +
+					     pl->buf[k] * w);
+	}
+	pl->tail_len = 0;
+
+	while (!__atomic_load_n(&pl->quit, __ATOMIC_RELAXED)) {
+		/* Hold back the last fade samples, they may be the item's end */
+		if (pending > fade) {
+			playlist_commit(pl, pl->buf, pending - fade);
+			memmove(pl->buf, pl->buf + pending - fade, fade * sizeof(*pl->buf));
+			pending = fade;
+		}
+
+		m = audio_read(in, pl->buf + pending, PLAYLIST_CHUNK);
+		if (!m)
+			break;
+		pending += m;
+		total += m;
+	}
+
+	/* pending holds at least this much: fade, or all of a short item */
+	n = fade < total / 2 ? fade : total / 2;
+	playlist_commit(pl, pl->buf, pending - n);
+	memcpy(pl->tail_buf, pl->buf + pending - n, n * sizeof(*pl->buf));
+	pl->tail_len = n;
+}
+
+static void *playlist_thread(void *arg)
+{
+	struct playlist *pl = arg;
+	struct audio_in in;
+	size_t len, failed = 0;
+	char *path;
+	int ret;
+
+	while (!__atomic_load_n(&pl->quit, __ATOMIC_RELAXED)) {
+		if (pl->inotify >= 0)
+			playlist_check_watch(pl);
+
+		path = playlist_pick(pl, &len);
+		if (!path) {
+			/* Play out what is held back, then nothing is coming */
+			playlist_commit(pl, pl->tail_buf, pl->tail_len);
+			pl->tail_len = 0;
+			__atomic_store_n(&pl->active, false, __ATOMIC_RELEASE);
+			__atomic_store_n(&pl->primed, true, __ATOMIC_RELEASE);
+			playlist_wait(pl, PLAYLIST_IDLE_MS);
+			continue;
+		}
+		__atomic_store_n(&pl->active, true, __ATOMIC_RELEASE);
+
+		ret = audio_open(&in, path, pl->rate, 1);
+		if (!ret && in.rate != pl->rate) {
+			audio_close(&in);
+			ret = -ERANGE;
+		}
+		if (ret) {
+			playlist_push_mark(pl, path, ret);
+			free(path);
+			/* Nothing in the list plays, wait for it to change */
+			if (++failed >= len) {
+				__atomic_store_n(&pl->primed, true, __ATOMIC_RELEASE);
+				playlist_wait(pl, PLAYLIST_IDLE_MS);
+				failed = 0;
+			}
+			continue;
+		}
+		failed = 0;
+
+		playlist_stream(pl, &in, path);
+		audio_close(&in);
+		free(path);
+	}
+
+	return NULL;
+}
+
+/**
+ * playlist_start() - start prefetching
+ * @pl: playlist state
+ *
+ * Returns once the ring is full or there is nothing to play, so the first
+ * playlist_read() does not underrun; 0 or a negative errno.
+ **/
+int playlist_start(struct playlist *pl)
+{
+	struct timespec ts = { .tv_nsec = PLAYLIST_POLL_MS * 1000000L };
+	int ret;
+
+	ret = pthread_create(&pl->thread, NULL, playlist_thread, pl);
+	if (ret)
+		return -ret;
+	pl->running = true;
+
+	while (!__atomic_load_n(&pl->primed, __ATOMIC_ACQUIRE))
+		nanosleep(&ts, NULL);
+
+	return 0;
+}
+
+/**
+ * playlist_read() - take the next n samples
+ * @pl: playlist state
+ * @out: n samples, silence past what was prefetched
+ * @n: samples wanted
+ *
+ * Never waits. Returns the samples that came from the list; fewer than @n
+ * while items are playing is an underrun, counted in @pl->underruns.
+ **/
+size_t playlist_read(struct playlist *pl, int16_t *out, size_t n)
+{
+	const size_t size = pl->mask + 1;
+	uint64_t head = __atomic_load_n(&pl->head, __ATOMIC_ACQUIRE);
+	size_t run, pos, first;
+
+	run = head - pl->tail < n ? head - pl->tail : n;
+	pos = pl->tail & pl->mask;
+	first = run < size - pos ? run : size - pos;
+	memcpy(out, pl->ring + pos, first * sizeof(*out));
+	memcpy(out + first, pl->ring, (run - first) * sizeof(*out));
+	__atomic_store_n(&pl->tail, pl->tail + run, __ATOMIC_RELEASE);
+
+	if (run < n) {
+		memset(out + run, 0, (n - run) * sizeof(*out));
+		if (__atomic_load_n(&pl->active, __ATOMIC_ACQUIRE))
+			pl->underruns++;
+	}
+
+	return run;
+}
+
+/**
+ * playlist_next_mark() - the next item change playlist_read() has reached
+ * @pl: playlist state
+ * @mark: filled with the change
+ *
+ * Call after playlist_read() until it returns false, from the same thread.
+ **/
+bool playlist_next_mark(struct playlist *pl, struct playlist_mark *mark)
+{
+	const struct playlist_mark *m;
+
+	if (pl->mark_tail == __atomic_load_n(&pl->mark_head, __ATOMIC_ACQUIRE))
+		return false;
+
+	m = &pl->marks[pl->mark_tail % PLAYLIST_MARKS];
+	if (m->at > pl->tail)
+		return false;
+
+	*mark = *m;
+	__atomic_store_n(&pl->mark_tail, pl->mark_tail + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+/* Stop the prefetch thread and free everything */
+void playlist_free(struct playlist *pl)
+{
+	if (pl->running) {
+		__atomic_store_n(&pl->quit, true, __ATOMIC_RELAXED);
+		pthread_join(pl->thread, NULL);
+	}
+	if (pl->inotify >= 0)
+		close(pl->inotify);
+	items_free(pl->items, pl->len);
+	free(pl->current);
+	free(pl->watch);
+	free(pl->watch_name);
+	free(pl->ring);
+	free(pl->buf);
+	free(pl->tail_buf);
+	pthread_mutex_destroy(&pl->lock);
+	memset(pl, 0, sizeof(*pl));
+	pl->inotify = -1;
+}
@@ -0,0 +1,101 @@
+/**
+ * Gapless playlist with background prefetch
+ *
+ * Licensed under the GPL-2.
+ *
+ **/
+
+#ifndef PLAYLIST_H
+#define PLAYLIST_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define PLAYLIST_MARKS		16	/* item changes queued ahead of playback, at most */
+#define PLAYLIST_NAME_MAX	256
+
+/**
+ * struct playlist_mark - an item change in the sample stream
+ * @at: stream position of the item's first sample
+ * @err: 0 when the item plays, or why it was skipped, a negative errno
+ * @name: the item's file name, without its directory
+ **/
+struct playlist_mark {
+	uint64_t at;
+	int err;
+	char name[PLAYLIST_NAME_MAX];
+};
+
+/**
+ * struct playlist - a list of audio files played back to back
+ * @rate: sample rate of the output, and of every item
+ * @fade: crossfade between items in samples, 0 to butt-join them
+ * @lock: protects the list, @items to @current, against the prefetch thread
+ * @items: file paths, played in order and from the start again at the end
+ * @len: number of @items
+ * @next: the item to play after @current
+ * @current: path of the item being prefetched, or NULL
+ * @watch: directory or list file the items come from, or NULL
+ * @watch_name: for a list file, its name within the watched directory
+ * @inotify: inotify descriptor watching @watch, or -1
+ * @ring: prefetched samples, a power of two of them
+ * @mask: size of @ring minus one
+ * @head: samples the prefetch thread wrote, only it advances this
+ * @tail: samples playlist_read() took, only it advances this
+ * @marks: item changes from @mark_tail up to @mark_head, in stream order
+ * @active: the prefetch thread has audio coming, so an empty @ring is an
+ *	underrun rather than the end of the list
+ * @underruns: playlist_read() calls that ran out of samples while @active
+ * @thread: the prefetch thread
+ * @running: @thread was started
+ * @primed: @thread filled @ring or found nothing to play
+ * @quit: tells @thread to stop
+ * @buf: prefetch: samples read but not in @ring yet
+ * @tail_buf: prefetch: the last @fade samples of the previous item, or
+ *	half of a shorter one, held back to be mixed with the start of the next
+ * @tail_len: prefetch: samples in @tail_buf
+ **/
+struct playlist {
+	unsigned int rate;
+	size_t fade;
+
+	pthread_mutex_t lock;
+	char **items;
+	size_t len;
+	size_t next;
+	char *current;
+	char *watch;
+	char *watch_name;
+	int inotify;
+
+	int16_t *ring;
+	size_t mask;
+	uint64_t head;
+	uint64_t tail;
+	struct playlist_mark marks[PLAYLIST_MARKS];
+	uint64_t mark_head;
+	uint64_t mark_tail;
+	bool active;
+	unsigned long underruns;
+
+	pthread_t thread;
+	bool running;
+	bool primed;
+	bool quit;
+	int16_t *buf;
+	int16_t *tail_buf;
+	size_t tail_len;
+};
+
+int playlist_init(struct playlist *pl, unsigned int rate, double crossfade,
+		  double prefetch);
+int playlist_add(struct playlist *pl, const char *path);
+int playlist_watch(struct playlist *pl, const char *path);
+int playlist_start(struct playlist *pl);
+size_t playlist_read(struct playlist *pl, int16_t *out, size_t n);
+bool playlist_next_mark(struct playlist *pl, struct playlist_mark *mark);
+void playlist_free(struct playlist *pl);
+
+#endif /* PLAYLIST_H */
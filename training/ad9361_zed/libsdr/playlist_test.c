@@ -0,0 +1,191 @@
+/**
+ * Gapless transitions of playlist
+ *
+ * Plays a list of three raw items at constant levels, the middle one
+ * shorter than the crossfade and the last one shorter than two, butt-joined
+ * and crossfaded. Butt-joined, every item must start exactly where the one
+ * before ends. Crossfaded, the stream must go from level to level without
+ * a step or a dip towards silence, and every item must get its own mark
+ * and be heard at its level after it.
+ *
+ * Licensed under the GPL-2.
+ *
+ **/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "playlist.h"
+
+#define RATE		8000
+#define CROSSFADE	0.1				/* 800 samples */
+#define PREFETCH	4.0				/* the whole test in the ring */
+#define OUT		8000
+#define MAX_STEP	40				/* b fades in and out over 120 samples each */
+
+/**
+ * struct item - a test item
+ * @name: file name
+ * @level: the constant sample value it holds
+ * @len: its length in samples
+ **/
+struct item {
+	const char *name;
+	int16_t level;
+	size_t len;
+};
+
+static const struct item items[] = {
+	{ "a.raw", 8000, 4000 },
+	{ "b.raw", 6000, 240 },		/* shorter than the crossfade */
+	{ "c.raw", 4000, 1200 },	/* shorter than two crossfades */
+};
+
+#define NUM_ITEMS	(sizeof(items) / sizeof(items[0]))
+
+static char dir[] = "/tmp/playlist_test.XXXXXX";
+
+static int write_items(void)
+{
+	int16_t x[4000];
+	char path[64];
+	unsigned int i;
+	size_t k;
+	FILE *fp;
+
+	if (!mkdtemp(dir))
+		return -1;
+	for (i = 0; i < NUM_ITEMS; i++) {
+		for (k = 0; k < items[i].len; k++)
+			x[k] = items[i].level;
+		snprintf(path, sizeof(path), "%s/%s", dir, items[i].name);
+		fp = fopen(path, "wb");
+		if (!fp)
+			return -1;
+		if (fwrite(x, sizeof(*x), items[i].len, fp) != items[i].len) {
+			fclose(fp);
+			return -1;
+		}
+		fclose(fp);
+	}
+
+	return 0;
+}
+
+static void remove_items(void)
+{
+	char path[64];
+	unsigned int i;
+
+	for (i = 0; i < NUM_ITEMS; i++) {
+		snprintf(path, sizeof(path), "%s/%s", dir, items[i].name);
+		unlink(path);
+	}
+	rmdir(dir);
+}
+
+/* Some sample from 'from' up to 'to' within MAX_STEP of level */
+static int heard(const int16_t *out, size_t from, size_t to, int level)
+{
+	size_t k;
+
+	for (k = from; k < to && k < OUT; k++)
+		if (abs(out[k] - level) <= MAX_STEP)
+			return 1;
+	return 0;
+}
+
+static int check(double crossfade)
+{
+	static int16_t out[OUT];
+	struct playlist_mark marks[PLAYLIST_MARKS];
+	const size_t fade = crossfade * RATE;
+	unsigned int i, n = 0;
+	struct playlist pl;
+	char path[64];
+	size_t k, at = 0;
+	int ret;
+
+	ret = playlist_init(&pl, RATE, crossfade, PREFETCH);
+	for (i = 0; !ret && i < NUM_ITEMS; i++) {
+		snprintf(path, sizeof(path), "%s/%s", dir, items[i].name);
+		ret = playlist_add(&pl, path);
+	}
+	if (!ret)
+		ret = playlist_start(&pl);
+	if (ret) {
+		fprintf(stderr, "playlist: %d\n", ret);
+		playlist_free(&pl);
+		return -1;
+	}
+
+	k = playlist_read(&pl, out, OUT);
+	while (n < PLAYLIST_MARKS && playlist_next_mark(&pl, &marks[n]))
+		n++;
+	playlist_free(&pl);
+	if (k < OUT) {
+		fprintf(stderr, "crossfade %.2f s: %zu samples, not %d\n", crossfade, k, OUT);
+		return -1;
+	}
+
+	/* a, b, c and a again, each after the last */
+	for (i = 0; i < n && i <= NUM_ITEMS; i++) {
+		if (marks[i].err || strcmp(marks[i].name, items[i % NUM_ITEMS].name) ||
+		    (i && marks[i].at <= marks[i - 1].at)) {
+			fprintf(stderr, "crossfade %.2f s: mark %u is %s at %llu\n",
+				crossfade, i, marks[i].name, (unsigned long long)marks[i].at);
+			return -1;
+		}
+		if (!fade && marks[i].at != at) {
+			fprintf(stderr, "butt-joined: %s starts at %llu, not %zu\n",
+				marks[i].name, (unsigned long long)marks[i].at, at);
+			return -1;
+		}
+		at += items[i % NUM_ITEMS].len;
+	}
+	if (i <= NUM_ITEMS) {
+		fprintf(stderr, "crossfade %.2f s: %u marks\n", crossfade, n);
+		return -1;
+	}
+
+	for (i = 0; i < NUM_ITEMS; i++) {
+		if (!heard(out, marks[i].at, marks[i + 1].at + fade, items[i].level)) {
+			fprintf(stderr, "crossfade %.2f s: %s never reaches %d\n",
+				crossfade, items[i].name, items[i].level);
+			return -1;
+		}
+	}
+
+	for (k = 0; k < OUT; k++) {
+		if (out[k] < 4000 || out[k] > 8000 ||
+		    (fade && k && abs(out[k] - out[k - 1]) > MAX_STEP)) {
+			fprintf(stderr, "crossfade %.2f s: sample %zu is %d after %d\n",
+				crossfade, k, out[k], k ? out[k - 1] : 0);
+			return -1;
+		}
+	}
+
+	printf("playlist_test: crossfade %.2f s, %s at %llu, %s at %llu, %s at %llu, gapless\n",
+	       crossfade, marks[0].name, (unsigned long long)marks[0].at,
+	       marks[1].name, (unsigned long long)marks[1].at,
+	       marks[2].name, (unsigned long long)marks[2].at);
+	return 0;
+}
+
+int main(void)
+{
+	int ret;
+
+	if (write_items()) {
+		perror("playlist_test");
+		remove_items();
+		return EXIT_FAILURE;
+	}
+
+	ret = check(0) || check(CROSSFADE);
+
+	remove_items();
+	return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
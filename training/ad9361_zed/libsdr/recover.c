@@ -0,0 +1,122 @@
+/**
+ * Recovery from DMA buffer errors
+ *
+ * A failed push, refill or block dequeue is classified by its errno. An
+ * interrupted or would-block call is repeated. A DMA that timed out or
+ * stopped with an error is brought back by destroying and recreating the
+ * buffer (or freeing and reallocating the blocks), which leaves the PHY
+ * setup and the IIO context alone, so the stream resumes within a few
+ * buffer periods. A device that disappeared, or an error that says the
+ * call itself was wrong, is left to the caller to give up on.
+ *
+ * Repeated failures escalate: retries to a rebuild, rebuilds to fatal.
+ *
+ * Licensed under the GPL-2.
+ *
+ **/
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include "recover.h"
+
+static int64_t recover_now_ns(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+void recover_init(struct recover *r)
+{
+	memset(r, 0, sizeof(*r));
+}
+
+/**
+ * recover_classify() - what a buffer error calls for
+ * @err: negative errno from a push, refill or block ioctl
+ **/
+enum recover_action recover_classify(int err)
+{
+	switch (-err) {
+	case EINTR:
+	case EAGAIN:
+		return RECOVER_RETRY;
+	case ENODEV:
+	case ENXIO:
+	case ENOENT:
+	case ESHUTDOWN:
+	case EINVAL:
+	case EFAULT:
+	case ENOSYS:
+	case ENOTTY:
+		return RECOVER_FATAL;
+	default:
+		/* EIO, ETIMEDOUT, EPIPE, EBADF, ENOMEM, EBUSY, ... */
+		return RECOVER_REBUILD;
+	}
+}
+
+/**
+ * recover_error() - account for a failed call
+ * @r: recovery state
+ * @err: negative errno the call, or a rebuild, failed with
+ *
+ * Returns what to do next, escalated when the same outage keeps failing.
+ **/
+enum recover_action recover_error(struct recover *r, int err)
+{
+	enum recover_action action = recover_classify(err);
+
+	r->last_err = err;
+	if (!r->since_ns)
+		r->since_ns = recover_now_ns();
+	r->in_row++;
+
+	if (action == RECOVER_RETRY && r->in_row > RECOVER_MAX_RETRIES)
+		action = RECOVER_REBUILD;
+	if (action == RECOVER_REBUILD && r->rebuilds_in_row >= RECOVER_MAX_REBUILDS)
+		action = RECOVER_FATAL;
+
+	if (action == RECOVER_RETRY)
+		r->retries++;
+	else if (action == RECOVER_REBUILD) {
+		r->rebuilds++;
+		r->rebuilds_in_row++;
+	}
+
+	return action;
+}
+
+/**
+ * recover_ok() - account for a call that moved data
+ * @r: recovery state
+ *
+ * Returns true when this ended an outage; @r->last_ns then holds how long
+ * it took.
+ **/
+bool recover_ok(struct recover *r)
+{
+	if (!r->since_ns)
+		return false;
+
+	r->last_ns = recover_now_ns() - r->since_ns;
+	if (r->last_ns > r->worst_ns)
+		r->worst_ns = r->last_ns;
+	r->total_ns += r->last_ns;
+	r->outages++;
+	r->since_ns = 0;
+	r->in_row = 0;
+	r->rebuilds_in_row = 0;
+
+	return true;
+}
+
+const char *recover_action_name(enum recover_action action)
+{
+	static const char *const names[] = { "retry", "rebuild", "fatal" };
+
+	return names[action];
+}
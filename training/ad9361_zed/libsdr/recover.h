@@ -0,0 +1,56 @@
+/**
+ * Recovery from DMA buffer errors
+ *
+ * Licensed under the GPL-2.
+ *
+ **/
+
+#ifndef RECOVER_H
+#define RECOVER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define RECOVER_MAX_RETRIES	3	/* retries in a row before rebuilding */
+#define RECOVER_MAX_REBUILDS	5	/* rebuilds in a row before giving up */
+
+enum recover_action {
+	RECOVER_RETRY,		/* transient, repeat the call */
+	RECOVER_REBUILD,	/* recreate the buffer or stream, keep the PHY setup */
+	RECOVER_FATAL,		/* the device is gone, or a rebuild cannot help */
+};
+
+/**
+ * struct recover - error recovery state of one buffer or stream
+ * @retries: calls repeated
+ * @rebuilds: buffers or streams recreated
+ * @outages: errors that needed a recovery before data moved again
+ * @last_err: the last error seen, negative errno
+ * @in_row: errors since data last moved
+ * @rebuilds_in_row: rebuilds since data last moved
+ * @since_ns: CLOCK_MONOTONIC time of the first error of the current outage,
+ *	0 when data is moving
+ * @last_ns, @worst_ns, @total_ns: time from the first error of an outage
+ *	to data moving again
+ **/
+struct recover {
+	unsigned long retries;
+	unsigned long rebuilds;
+	unsigned long outages;
+	int last_err;
+
+	unsigned int in_row;
+	unsigned int rebuilds_in_row;
+	int64_t since_ns;
+	int64_t last_ns;
+	int64_t worst_ns;
+	int64_t total_ns;
+};
+
+void recover_init(struct recover *r);
+enum recover_action recover_classify(int err);
+enum recover_action recover_error(struct recover *r, int err);
+bool recover_ok(struct recover *r);
+const char *recover_action_name(enum recover_action action);
+
+#endif /* RECOVER_H */
@@ -0,0 +1,314 @@
+/**
+ * Hot-loop event tracing into per-thread rings
+ *
+ * Every thread that emits an event gets its own ring of the last
+ * TRACE_RING_EVENTS events, which only that thread writes, so emitting
+ * is a clock read and a few stores with no lock and no system call. The
+ * rings are linked into a list once, with a compare-and-swap.
+ *
+ * A dump writes all rings as Chrome trace JSON, which chrome://tracing
+ * and ui.perfetto.dev open, to <prefix>-<n>.json. Dumps run on their own
+ * thread, woken through a semaphore, so trace_request_dump() can be
+ * called from a signal handler and the streaming threads never wait for
+ * the file. The dumper copies a ring while its thread keeps writing and
+ * drops the entries that may have been overwritten during the copy.
+ *
+ * Licensed under the GPL-2.
+ *
+ **/
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+#define TRACE_NAME_MAX	16
+
+/**
+ * struct trace_ring - events of one thread
+ * @head: number of events written so far, stored with release semantics
+ *	after the event itself
+ **/
+struct trace_ring {
+	struct trace_ring *next;
+	pid_t tid;
+	char name[TRACE_NAME_MAX];
+	uint64_t head;
+	struct trace_event ev[TRACE_RING_EVENTS];
+};
+
+bool trace_enabled;
+
+static struct trace_ring *rings;
+static __thread struct trace_ring *self;
+
+static char trace_prefix[256];
+static pthread_t dumper;
+static sem_t dump_sem;
+static volatile bool dumper_stop;
+static const char *volatile dump_reason;
+static uint64_t last_anomaly_ns;
+static unsigned int ndumps;
+
+static uint64_t now_ns(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+static struct trace_ring *ring_self(void)
+{
+	struct trace_ring *r = self;
+
+	if (r)
+		return r;
+
+	r = calloc(1, sizeof(*r));
+	if (!r)
+		return NULL;
+	r->tid = syscall(SYS_gettid);
+	snprintf(r->name, sizeof(r->name), "thread %d", (int)r->tid);
+
+	r->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&rings, &r->next, r, true,
+					    __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+
+	self = r;
+	return r;
+}
+
+/* Append one event to the calling thread's ring */
+void trace_emit(const char *name, char ph, uint32_t arg)
+{
+	struct trace_ring *r = ring_self();
+	struct trace_event *e;
+
+	if (!r)
+		return;
+
+	e = &r->ev[r->head & (TRACE_RING_EVENTS - 1)];
+	e->ts_ns = now_ns();
+	e->name = name;
+	e->arg = arg;
+	e->ph = ph;
+	__atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+/* Name the calling thread in the trace, e.g. "tx" or "demod" */
+void trace_thread_name(const char *name)
+{
+	struct trace_ring *r;
+
+	if (!trace_enabled)
+		return;
+
+	r = ring_self();
+	if (r)
+		snprintf(r->name, sizeof(r->name), "%s", name);
+}
+
+/* Async-signal-safe: only posts the semaphore */
+void trace_request_dump(void)
+{
+	if (!trace_enabled)
+		return;
+
+	if (!dump_reason)
+		dump_reason = "signal";
+	sem_post(&dump_sem);
+}
+
+/**
+ * trace_anomaly() - record an anomaly and dump the rings
+ * @what: static string naming it, e.g. "tx late"
+ * @arg: value shown with the event
+ *
+ * The event goes into the calling thread's ring first, so the dump ends
+ * with it. Anomalies closer than TRACE_DUMP_INTERVAL to the last dumped
+ * one are only recorded.
+ **/
+void trace_anomaly(const char *what, uint32_t arg)
+{
+	uint64_t now;
+
+	if (!trace_enabled)
+		return;
+
+	trace_emit(what, 'i', arg);
+	now = now_ns();
+	if (last_anomaly_ns && now - last_anomaly_ns < TRACE_DUMP_INTERVAL * 1e9)
+		return;
+	last_anomaly_ns = now;
+	dump_reason = what;
+	sem_post(&dump_sem);
+}
+
+static void json_string(FILE *f, const char *s)
+{
+	fputc('"', f);
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			fputc('\\', f);
+		if ((unsigned char)*s >= 0x20)
+			fputc(*s, f);
+	}
+	fputc('"', f);
+}
+
+/* Copy the consistent part of a ring; returns the first valid index */
+static uint64_t ring_snapshot(const struct trace_ring *r, struct trace_event *ev,
+			      uint64_t *end)
+{
+	uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	uint64_t start = head > TRACE_RING_EVENTS ? head - TRACE_RING_EVENTS : 0;
+	uint64_t k, after;
+
+	for (k = start; k < head; k++)
+		ev[k & (TRACE_RING_EVENTS - 1)] = r->ev[k & (TRACE_RING_EVENTS - 1)];
+
+	/*
+	 * Entries the writer lapped while they were copied are torn, and so
+	 * may be the one in the slot it is filling now
+	 */
+	after = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) + 1;
+	if (after > TRACE_RING_EVENTS && after - TRACE_RING_EVENTS > start)
+		start = after - TRACE_RING_EVENTS;
+
+	*end = head;
+	return start;
+}
+
+static int trace_dump(const char *reason)
+{
+	struct trace_event *ev = malloc(sizeof(*ev) * TRACE_RING_EVENTS);
+	const struct trace_ring *r;
+	char path[300];
+	bool first = true;
+	pid_t pid = getpid();
+	FILE *f;
+
+	if (!ev)
+		return -ENOMEM;
+
+	snprintf(path, sizeof(path), "%s-%u.json", trace_prefix, ndumps++);
+	f = fopen(path, "w");
+	if (!f) {
+		int err = -errno;
+
+		free(ev);
+		return err;
+	}
+
+	fprintf(f, "{\"displayTimeUnit\":\"ms\",\"otherData\":{\"reason\":");
+	json_string(f, reason);
+	fprintf(f, "},\"traceEvents\":[\n");
+
+	for (r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+		uint64_t k, end, start = ring_snapshot(r, ev, &end);
+		unsigned int depth = 0;
+
+		fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":",
+			first ? "" : ",\n", (int)pid, (int)r->tid);
+		json_string(f, r->name);
+		fprintf(f, "}}");
+		first = false;
+
+		for (k = start; k < end; k++) {
+			const struct trace_event *e = &ev[k & (TRACE_RING_EVENTS - 1)];
+
+			/* The ring may start in the middle of a stage */
+			if (e->ph == 'E' && !depth)
+				continue;
+			depth += e->ph == 'B';
+			depth -= e->ph == 'E';
+
+			fprintf(f, ",\n{\"name\":");
+			json_string(f, e->name);
+			fprintf(f, ",\"ph\":\"%c\",\"ts\":%" PRIu64 ".%03u,\"pid\":%d,\"tid\":%d",
+				e->ph, e->ts_ns / 1000, (unsigned int)(e->ts_ns % 1000),
+				(int)pid, (int)r->tid);
+			if (e->ph == 'i')
+				fprintf(f, ",\"s\":\"t\",\"args\":{\"arg\":%u}", e->arg);
+			fprintf(f, "}");
+		}
+	}
+	fprintf(f, "\n]}\n");
+
+	free(ev);
+	if (fclose(f))
+		return -errno;
+
+	fprintf(stderr, "Trace dumped to %s (%s)\n", path, reason);
+	return 0;
+}
+
+static void *dumper_thread(void *arg)
+{
+	const char *reason;
+	int ret;
+
+	(void)arg;
+	for (;;) {
+		while (sem_wait(&dump_sem) && errno == EINTR)
+			;
+		if (dumper_stop)
+			break;
+
+		reason = dump_reason;
+		dump_reason = NULL;
+		ret = trace_dump(reason ? reason : "signal");
+		if (ret)
+			fprintf(stderr, "Trace dump failed: %s\n", strerror(-ret));
+	}
+	return NULL;
+}
+
+/**
+ * trace_init() - enable tracing
+ * @prefix: dumps go to <prefix>-<n>.json
+ *
+ * Returns 0 or a negative errno.
+ **/
+int trace_init(const char *prefix)
+{
+	int ret;
+
+	if (strlen(prefix) >= sizeof(trace_prefix))
+		return -ENAMETOOLONG;
+	strcpy(trace_prefix, prefix);
+
+	if (sem_init(&dump_sem, 0, 0))
+		return -errno;
+	ret = pthread_create(&dumper, NULL, dumper_thread, NULL);
+	if (ret) {
+		sem_destroy(&dump_sem);
+		return -ret;
+	}
+
+	trace_enabled = true;
+	return 0;
+}
+
+/* Stop the dumper; the rings stay allocated until exit */
+void trace_close(void)
+{
+	if (!trace_enabled)
+		return;
+
+	trace_enabled = false;
+	dumper_stop = true;
+	sem_post(&dump_sem);
+	pthread_join(dumper, NULL);
+	sem_destroy(&dump_sem);
+}
@@ -0,0 +1,59 @@
+/**
+ * Hot-loop event tracing into per-thread rings
+ *
+ * Licensed under the GPL-2.
+ *
+ **/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define TRACE_RING_EVENTS	4096	/* per thread, a power of two */
+#define TRACE_DUMP_INTERVAL	1.0	/* seconds between anomaly dumps */
+
+/**
+ * struct trace_event - one fixed-size ring entry
+ * @ts_ns: CLOCK_MONOTONIC time
+ * @name: static string naming the stage or the anomaly
+ * @arg: free-form value shown with instant events
+ * @ph: Chrome trace phase, 'B' begin, 'E' end or 'i' instant
+ **/
+struct trace_event {
+	uint64_t ts_ns;
+	const char *name;
+	uint32_t arg;
+	char ph;
+};
+
+extern bool trace_enabled;
+
+int trace_init(const char *prefix);
+void trace_close(void);
+void trace_thread_name(const char *name);
+void trace_emit(const char *name, char ph, uint32_t arg);
+void trace_anomaly(const char *what, uint32_t arg);
+void trace_request_dump(void);
+
+/* One predictable branch when tracing is off */
+static inline void trace_begin(const char *name)
+{
+	if (trace_enabled)
+		trace_emit(name, 'B', 0);
+}
+
+static inline void trace_end(const char *name)
+{
+	if (trace_enabled)
+		trace_emit(name, 'E', 0);
+}
+
+static inline void trace_instant(const char *name, uint32_t arg)
+{
+	if (trace_enabled)
+		trace_emit(name, 'i', arg);
+}
+
+#endif /* TRACE_H */
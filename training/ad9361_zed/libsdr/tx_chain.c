@@ -0,0 +1,302 @@
+/**
+ * Audio to FM I/Q transmit chain
+ *
+ * Licensed under the GPL-2.
+ *
+ **/
+
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fir_design.h"
+#include "par.h"
+#include "tx_chain.h"
+
+#define RESAMPLER_HALF		(RESAMPLER_TAPS / 2)
+#define RESAMPLER_PHASE_BITS	7	/* log2(RESAMPLER_PHASES) */
+#define RESAMPLER_KAISER_BETA	8.0
+#define RESAMPLER_MIN_CHUNK	4096
+
+/* Upper corner of the pre-emphasis shelf, keeps the HF boost finite */
+#define PREEMPH_HF_CORNER	21000.0
+
+void preemph_init(struct preemph *p, double tau, double sample_rate)
+{
+	double corner = PREEMPH_HF_CORNER;
+	double k1, k2;
+
+	memset(p, 0, sizeof(*p));
+	if (tau <= 0) {
+		p->b0 = 1;
+		return;
+	}
+
+	if (corner > 0.45 * sample_rate)
+		corner = 0.45 * sample_rate;
+
+	k1 = 2 * tau * sample_rate;
+	k2 = 2 * sample_rate / (2 * M_PI * corner);
+	p->b0 = (1 + k1) / (1 + k2);
+	p->b1 = (1 - k1) / (1 + k2);
+	p->a1 = (1 - k2) / (1 + k2);
+}
+
+void preemph_block(struct preemph *p, float *x, size_t n)
+{
+	float x1 = p->x1, y1 = p->y1;
+	size_t k;
+
+	for (k = 0; k < n; k++) {
+		float y = p->b0 * x[k] + p->b1 * x1 - p->a1 * y1;
+
+		x1 = x[k];
+		y1 = y;
+		x[k] = y;
+	}
+
+	p->x1 = x1;
+	p->y1 = y1;
+}
+
+/**
+ * resampler_init() - set up a converter from rate_in to rate_out
+ * @cutoff_hz: pass band edge, clamped to 0.45 of the lower of both rates
+ *
+ * Each output sample is a RESAMPLER_TAPS point dot product, with the
+ * filter phase linearly interpolated between the two nearest of
+ * RESAMPLER_PHASES precomputed phases.
+ **/
+int resampler_init(struct resampler *rs, double rate_in, double rate_out,
+		   double cutoff_hz)
+{
+	double fc, limit = 0.45 * (rate_in < rate_out ? rate_in : rate_out);
+	unsigned int p, j;
+
+	memset(rs, 0, sizeof(*rs));
+	if (cutoff_hz <= 0 || cutoff_hz > limit)
+		cutoff_hz = limit;
+	fc = cutoff_hz / rate_in;
+
+	rs->step = (uint64_t)llrint(rate_in / rate_out * 4294967296.0);
+	rs->coeffs = malloc((RESAMPLER_PHASES + 1) * RESAMPLER_TAPS *
+			    sizeof(*rs->coeffs));
+	if (!rs->coeffs)
+		return -ENOMEM;
+
+	for (p = 0; p <= RESAMPLER_PHASES; p++) {
+		float *row = rs->coeffs + p * RESAMPLER_TAPS;
+		double frac = (double)p / RESAMPLER_PHASES;
+		double sum = 0;
+
+		for (j = 0; j < RESAMPLER_TAPS; j++) {
+			double x = (double)j - (RESAMPLER_HALF - 1) - frac;
+			double h = 2 * fc;
+
+			if (x != 0)
+				h = sin(2 * M_PI * fc * x) / (M_PI * x);
+			h *= kaiser_window(x / RESAMPLER_HALF, RESAMPLER_KAISER_BETA);
+			row[j] = h;
+			sum += h;
+		}
+		for (j = 0; j < RESAMPLER_TAPS; j++)
+			row[j] /= sum;
+	}
+
+	/* Zero history so the first output lines up with the first input */
+	rs->size = 4096;
+	rs->buf = calloc(rs->size, sizeof(*rs->buf));
+	if (!rs->buf) {
+		resampler_free(rs);
+		return -ENOMEM;
+	}
+	rs->len = RESAMPLER_HALF - 1;
+	rs->pos = (uint64_t)(RESAMPLER_HALF - 1) << 32;
+
+	return 0;
+}
+
+void resampler_free(struct resampler *rs)
+{
+	free(rs->coeffs);
+	free(rs->buf);
+	rs->coeffs = NULL;
+	rs->buf = NULL;
+}
+
+int resampler_push(struct resampler *rs, const float *x, size_t n)
+{
+	if (rs->len + n > rs->size) {
+		size_t size = 2 * (rs->len + n);
+		float *buf = realloc(rs->buf, size * sizeof(*buf));
+
+		if (!buf)
+			return -ENOMEM;
+		rs->buf = buf;
+		rs->size = size;
+	}
+
+	memcpy(rs->buf + rs->len, x, n * sizeof(*x));
+	rs->len += n;
+	return 0;
+}
+
+/* Number of outputs that can be computed from the input pushed so far */
+size_t resampler_avail(const struct resampler *rs)
+{
+	uint64_t limit;
+
+	if (rs->len <= RESAMPLER_HALF)
+		return 0;
+
+	limit = (uint64_t)(rs->len - RESAMPLER_HALF) << 32;
+	if (rs->pos >= limit)
+		return 0;
+
+	return (limit - rs->pos - 1) / rs->step + 1;
+}
+
+/* Output k, counted from the next unconsumed one; k < resampler_avail() */
+float resampler_output(const struct resampler *rs, size_t k)
+{
+	uint64_t t = rs->pos + k * rs->step;
+	uint32_t frac = (uint32_t)t;
+	unsigned int p = frac >> (32 - RESAMPLER_PHASE_BITS);
+	float mu = (float)(frac << RESAMPLER_PHASE_BITS) / 4294967296.0f;
+	const float *x = rs->buf + (t >> 32) - (RESAMPLER_HALF - 1);
+	const float *c0 = rs->coeffs + p * RESAMPLER_TAPS;
+	const float *c1 = c0 + RESAMPLER_TAPS;
+	float y0[4] = { 0 }, y1[4] = { 0 };
+	unsigned int j, l;
+
+	/* Four independent partial sums so the compiler can vectorise */
+	for (j = 0; j < RESAMPLER_TAPS; j += 4) {
+		for (l = 0; l < 4; l++) {
+			y0[l] += x[j + l] * c0[j + l];
+			y1[l] += x[j + l] * c1[j + l];
+		}
+	}
+
+	y0[0] += y0[1] + y0[2] + y0[3];
+	y1[0] += y1[1] + y1[2] + y1[3];
+	return y0[0] + mu * (y1[0] - y0[0]);
+}
+
+/* Advance past n outputs and drop the input no longer needed */
+void resampler_consume(struct resampler *rs, size_t n)
+{
+	size_t drop;
+
+	rs->pos += n * rs->step;
+	drop = rs->pos >> 32;
+	if (drop <= RESAMPLER_HALF - 1)
+		return;
+
+	drop -= RESAMPLER_HALF - 1;
+	memmove(rs->buf, rs->buf + drop, (rs->len - drop) * sizeof(*rs->buf));
+	rs->len -= drop;
+	rs->pos -= (uint64_t)drop << 32;
+}
+
+/**
+ * tx_chain_init() - set up the full transmit chain
+ * @audio_rate: input audio sample rate in Hz
+ * @tx_rate: output I/Q sample rate in Hz
+ * @tau: pre-emphasis time constant in seconds (50e-6 or 75e-6), 0 for none
+ * @audio_bw: audio bandwidth in Hz, the resampler pass band
+ * @deviation: peak deviation in Hz, reached at the limiter threshold
+ * @gain_db: gain applied ahead of the limiter
+ **/
+int tx_chain_init(struct tx_chain *c, double audio_rate, double tx_rate,
+		  double tau, double audio_bw, double deviation, double gain_db)
+{
+	int ret;
+
+	memset(c, 0, sizeof(*c));
+	preemph_init(&c->pre, tau, audio_rate);
+	ret = resampler_init(&c->rs, audio_rate, tx_rate, audio_bw);
+	if (ret)
+		return ret;
+
+	fm_mod_init(&c->mod, deviation / FM_MOD_AMPLITUDE, 0, tx_rate);
+	c->gain = pow(10, gain_db / 20);
+	return 0;
+}
+
+void tx_chain_free(struct tx_chain *c)
+{
+	resampler_free(&c->rs);
+	free(c->dev);
+	c->dev = NULL;
+}
+
+/* Upper bound on the I/Q samples one tx_chain_process() call can produce */
+size_t tx_chain_max_output(const struct tx_chain *c, size_t frames)
+{
+	return (((uint64_t)(c->rs.len + frames) << 32) / c->rs.step) + 1;
+}
+
+static void tx_chain_limit_chunk(void *ctx, unsigned int chunk,
+				 size_t begin, size_t end)
+{
+	struct tx_chain *c = ctx;
+	size_t k;
+
+	(void)chunk;
+
+	for (k = begin; k < end; k++) {
+		float y = c->gain * resampler_output(&c->rs, k);
+
+		if (y > 1.0f)
+			y = 1.0f;
+		else if (y < -1.0f)
+			y = -1.0f;
+		c->dev[k] = (int16_t)lrintf(y * FM_MOD_AMPLITUDE);
+	}
+}
+
+/**
+ * tx_chain_process() - turn a block of mono audio into FM I/Q
+ * @audio: mono samples in [-1, 1], pre-emphasised in place
+ * @frames: number of audio samples
+ * @iq: output, interleaved I/Q pairs
+ * @max_out: capacity of @iq in I/Q pairs
+ *
+ * Pre-emphasis runs serially at the audio rate. Resampling with the
+ * limiter and the modulator run at the TX rate split across threads;
+ * the modulator phase carries over from call to call.
+ *
+ * Returns the number of I/Q pairs written or a negative error code.
+ **/
+ssize_t tx_chain_process(struct tx_chain *c, float *audio, size_t frames,
+			 int16_t *iq, size_t max_out)
+{
+	size_t n;
+	int ret;
+
+	preemph_block(&c->pre, audio, frames);
+	ret = resampler_push(&c->rs, audio, frames);
+	if (ret)
+		return ret;
+
+	n = resampler_avail(&c->rs);
+	if (n > max_out)
+		n = max_out;
+
+	if (n > c->dev_size) {
+		int16_t *dev = realloc(c->dev, n * sizeof(*dev));
+
+		if (!dev)
+			return -ENOMEM;
+		c->dev = dev;
+		c->dev_size = n;
+	}
+
+	par_for(n, par_chunks(n, c->nthreads, RESAMPLER_MIN_CHUNK),
+		tx_chain_limit_chunk, c);
+	fm_mod_block_parallel(&c->mod, c->dev, iq, n, c->nthreads);
+	resampler_consume(&c->rs, n);
+
+	return n;
+}
@@ -0,0 +1,83 @@
+/**
+ * Audio to FM I/Q transmit chain
+ *
+ * Licensed under the GPL-2.
+ *
+ **/
+
+#ifndef TX_CHAIN_H
+#define TX_CHAIN_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "fm_mod.h"
+
+#define RESAMPLER_TAPS		32
+#define RESAMPLER_PHASES	128
+
+/**
+ * struct preemph - first order FM pre-emphasis shelf
+ * @b0, @b1, @a1: bilinear transform of (1 + s*tau) / (1 + s*tau_hf)
+ * @x1, @y1: previous input and output
+ **/
+struct preemph {
+	float b0, b1, a1;
+	float x1, y1;
+};
+
+/**
+ * struct resampler - polyphase windowed-sinc sample rate converter
+ * @step: input samples per output sample, 32.32 fixed point
+ * @pos: position of the next output in @buf, 32.32 fixed point
+ * @coeffs: RESAMPLER_PHASES + 1 rows of RESAMPLER_TAPS taps
+ * @buf: input history followed by not yet consumed input
+ * @len: valid samples in @buf
+ * @size: allocated samples in @buf
+ **/
+struct resampler {
+	uint64_t step;
+	uint64_t pos;
+	float *coeffs;
+	float *buf;
+	size_t len;
+	size_t size;
+};
+
+/**
+ * struct tx_chain - pre-emphasis, resampling, limiter and modulator
+ * @gain: linear gain applied before the limiter, 1.0 is full deviation
+ * @dev: deviation samples, scratch for one call of tx_chain_process()
+ * @dev_size: allocated samples in @dev
+ * @nthreads: threads for resampling and modulation, 0 for one per CPU
+ **/
+struct tx_chain {
+	struct preemph pre;
+	struct resampler rs;
+	struct fm_mod mod;
+	float gain;
+	int16_t *dev;
+	size_t dev_size;
+	unsigned int nthreads;
+};
+
+void preemph_init(struct preemph *p, double tau, double sample_rate);
+void preemph_block(struct preemph *p, float *x, size_t n);
+
+int resampler_init(struct resampler *rs, double rate_in, double rate_out,
+		   double cutoff_hz);
+void resampler_free(struct resampler *rs);
+int resampler_push(struct resampler *rs, const float *x, size_t n);
+size_t resampler_avail(const struct resampler *rs);
+float resampler_output(const struct resampler *rs, size_t k);
+void resampler_consume(struct resampler *rs, size_t n);
+
+int tx_chain_init(struct tx_chain *c, double audio_rate, double tx_rate,
+		  double tau, double audio_bw, double deviation, double gain_db);
+void tx_chain_free(struct tx_chain *c);
+size_t tx_chain_max_output(const struct tx_chain *c, size_t frames);
+ssize_t tx_chain_process(struct tx_chain *c, float *audio, size_t frames,
+			 int16_t *iq, size_t max_out);
+
+#endif /* TX_CHAIN_H */
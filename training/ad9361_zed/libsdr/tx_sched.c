@@ -0,0 +1,198 @@
+/**
+ * Timestamp-scheduled TX windows on the DMA sample clock
+ *
+ * Once the stream runs, sample k goes out at t0 + k / fs, so a window
+ * that opens at a given CLOCK_REALTIME or CLOCK_TAI instant starts at a
+ * known sample, and the caller leaves the samples outside the windows
+ * silent. The stream runs from tx_sched_lead_ns() before the first window,
+ * long enough for t0 to be measured before the window's buffer is filled.
+ *
+ * t0 comes from the push times. The first push starts the DMA, which puts
+ * sample 0 on air as it returns. Once the kernel queue is full, a push
+ * returns when the DMA is done with a buffer, @depth - 1 buffers before
+ * the pushed one goes out. Scheduling delays only ever make a push return
+ * late, so the earliest of the last TX_SCHED_WINDOW such estimates is the
+ * best; looking back no further follows the clock when an underflow
+ * restarts the DMA.
+ *
+ * The requested clock is read against CLOCK_MONOTONIC at every push, so
+ * NTP slewing and steps apply to the windows not yet filled.
+ *
+ * Licensed under the GPL-2.
+ *
+ **/
+
+#include <errno.h>
+#include <math.h>
+#include <string.h>
+
+#include "tx_sched.h"
+
+int64_t tx_sched_now(clockid_t clock)
+{
+	struct timespec t;
+
+	clock_gettime(clock, &t);
+	return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+/**
+ * tx_sched_init() - set up a schedule
+ * @s: schedule state
+ * @clock: CLOCK_REALTIME or CLOCK_TAI, the clock of the times
+ * @start_ns: start of the first window
+ * @stop_ns: end of transmission, or TX_SCHED_NEVER
+ * @period_ns: a window opens every @period_ns from @start_ns, 0 for one
+ * @length_ns: length of each window, 0 for open until @stop_ns; at most
+ *	@period_ns, and not 0 when @period_ns is set
+ * @fs: sample rate of the stream in Hz
+ * @block: samples per pushed buffer
+ * @depth: buffers the kernel queues ahead of the DMA
+ *
+ * Returns 0 or -EINVAL.
+ **/
+int tx_sched_init(struct tx_sched *s, clockid_t clock, int64_t start_ns,
+		  int64_t stop_ns, int64_t period_ns, int64_t length_ns,
+		  double fs, size_t block, unsigned int depth)
+{
+	if ((clock != CLOCK_REALTIME && clock != CLOCK_TAI) || fs <= 0 ||
+	    !block || !depth || stop_ns <= start_ns || period_ns < 0 ||
+	    length_ns < 0 || (period_ns && (!length_ns || length_ns > period_ns)))
+		return -EINVAL;
+
+	memset(s, 0, sizeof(*s));
+	s->clock = clock;
+	s->start_ns = start_ns;
+	s->stop_ns = stop_ns;
+	s->period_ns = period_ns;
+	s->length_ns = length_ns;
+	s->fs = fs;
+	s->block = block;
+	s->depth = depth;
+	s->t0_ns = TX_SCHED_NEVER;
+	s->offset_ns = tx_sched_now(clock) - tx_sched_now(CLOCK_MONOTONIC);
+
+	return 0;
+}
+
+/* Stream time of a buffer in ns */
+static double tx_sched_block_ns(const struct tx_sched *s)
+{
+	return s->block * 1e9 / s->fs;
+}
+
+/* How long the stream runs silent before the first window */
+int64_t tx_sched_lead_ns(const struct tx_sched *s)
+{
+	return (int64_t)((2 * s->depth + TX_SCHED_WINDOW) * tx_sched_block_ns(s));
+}
+
+/**
+ * tx_sched_pushed() - account for a pushed buffer
+ * @s: schedule state
+ * @returned_ns: CLOCK_MONOTONIC time the push returned
+ **/
+void tx_sched_pushed(struct tx_sched *s, int64_t returned_ns)
+{
+	const uint64_t n = s->pushes++;
+	const double dur = tx_sched_block_ns(s);
+	int64_t mono, clk, t0;
+	uint64_t k, filled;
+
+	/* Bracket the clock read, for an offset good to a fraction of a us */
+	mono = tx_sched_now(CLOCK_MONOTONIC);
+	clk = tx_sched_now(s->clock);
+	s->offset_ns = clk - (mono + tx_sched_now(CLOCK_MONOTONIC)) / 2;
+
+	if (!n) {
+		s->t0_ns = returned_ns;
+		return;
+	}
+	if (n < s->depth)
+		return;
+
+	s->est[n % TX_SCHED_WINDOW] = returned_ns + (int64_t)((s->depth - 1.0 - n) * dur);
+	filled = n - s->depth + 1 < TX_SCHED_WINDOW ? n - s->depth + 1 : TX_SCHED_WINDOW;
+	t0 = s->est[n % TX_SCHED_WINDOW];
+	for (k = 1; k < filled; k++)
+		if (s->est[(n - k) % TX_SCHED_WINDOW] < t0)
+			t0 = s->est[(n - k) % TX_SCHED_WINDOW];
+	s->t0_ns = t0;
+}
+
+/* Time on @clock a stream sample goes out, TX_SCHED_NEVER before a push */
+int64_t tx_sched_time(const struct tx_sched *s, uint64_t sample)
+{
+	if (s->t0_ns == TX_SCHED_NEVER)
+		return TX_SCHED_NEVER;
+	return s->t0_ns + (int64_t)(sample * 1e9 / s->fs) + s->offset_ns;
+}
+
+/* The first sample at or after t_ns, and after sample */
+static uint64_t tx_sched_edge(const struct tx_sched *s, uint64_t sample,
+			      int64_t t_ns)
+{
+	double x;
+
+	if (t_ns == TX_SCHED_NEVER)
+		return UINT64_MAX;
+	x = ceil((double)(t_ns - s->offset_ns - s->t0_ns) * s->fs / 1e9);
+	return x > sample ? (uint64_t)x : sample + 1;
+}
+
+/**
+ * tx_sched_run() - whether a sample is in a window, and for how long
+ * @s: schedule state, pushed at least once
+ * @sample: stream sample
+ * @on: set when @sample goes out
+ * @window_ns: set to the start of @sample's window when @on, else of the
+ *	next window, TX_SCHED_NEVER when there is none
+ *
+ * Returns the first sample after @sample where @on changes, UINT64_MAX
+ * when it never does. Before the first push no sample has a time yet:
+ * @sample is off, with no window, up to UINT64_MAX.
+ **/
+uint64_t tx_sched_run(const struct tx_sched *s, uint64_t sample, bool *on,
+		      int64_t *window_ns)
+{
+	int64_t t = tx_sched_time(s, sample), w, end;
+
+	*on = false;
+	*window_ns = TX_SCHED_NEVER;
+	if (t == TX_SCHED_NEVER)
+		return UINT64_MAX;
+	if (t >= s->stop_ns)
+		return UINT64_MAX;
+	if (t < s->start_ns) {
+		*window_ns = s->start_ns;
+		return tx_sched_edge(s, sample, s->start_ns);
+	}
+
+	w = s->start_ns;
+	if (s->period_ns)
+		w += (t - s->start_ns) / s->period_ns * s->period_ns;
+	end = s->length_ns ? w + s->length_ns : TX_SCHED_NEVER;
+	if (end > s->stop_ns)
+		end = s->stop_ns;
+
+	if (t < end) {
+		*on = true;
+		*window_ns = w;
+		return tx_sched_edge(s, sample, end);
+	}
+	if (!s->period_ns || w + s->period_ns >= s->stop_ns)
+		return UINT64_MAX;
+	*window_ns = w + s->period_ns;
+	return tx_sched_edge(s, sample, w + s->period_ns);
+}
+
+/* Nothing from this sample on goes out; never before the first push */
+bool tx_sched_done(const struct tx_sched *s, uint64_t sample)
+{
+	int64_t window_ns;
+	bool on;
+
+	if (s->t0_ns == TX_SCHED_NEVER)
+		return false;
+	return tx_sched_run(s, sample, &on, &window_ns) == UINT64_MAX && !on;
+}
@@ -0,0 +1,63 @@
+/**
+ * Timestamp-scheduled TX windows on the DMA sample clock
+ *
+ * Licensed under the GPL-2.
+ *
+ **/
+
+#ifndef TX_SCHED_H
+#define TX_SCHED_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#define TX_SCHED_NEVER		INT64_MAX
+#define TX_SCHED_WINDOW		8	/* pushes the on-air estimate looks back over */
+
+/**
+ * struct tx_sched - when to transmit, and when each stream sample goes out
+ * @clock: CLOCK_REALTIME or CLOCK_TAI, the clock of the times below
+ * @start_ns: start of the first window
+ * @stop_ns: nothing goes out from here on, or TX_SCHED_NEVER
+ * @period_ns: a window opens every @period_ns from @start_ns, 0 for one
+ * @length_ns: length of each window, 0 for open until @stop_ns
+ * @fs: sample rate of the stream in Hz
+ * @block: samples per pushed buffer
+ * @depth: buffers the kernel queues ahead of the DMA
+ * @t0_ns: CLOCK_MONOTONIC time stream sample 0 went out, estimated from
+ *	the push times, or TX_SCHED_NEVER before the first push
+ * @offset_ns: @clock minus CLOCK_MONOTONIC, read at the last push
+ * @pushes: buffers pushed
+ * @est: on-air estimates of sample 0 from the last TX_SCHED_WINDOW pushes
+ *	that waited for the DMA
+ **/
+struct tx_sched {
+	clockid_t clock;
+	int64_t start_ns;
+	int64_t stop_ns;
+	int64_t period_ns;
+	int64_t length_ns;
+	double fs;
+	size_t block;
+	unsigned int depth;
+
+	int64_t t0_ns;
+	int64_t offset_ns;
+	uint64_t pushes;
+	int64_t est[TX_SCHED_WINDOW];
+};
+
+int64_t tx_sched_now(clockid_t clock);
+int tx_sched_init(struct tx_sched *s, clockid_t clock, int64_t start_ns,
+		  int64_t stop_ns, int64_t period_ns, int64_t length_ns,
+		  double fs, size_t block, unsigned int depth);
+int64_t tx_sched_lead_ns(const struct tx_sched *s);
+void tx_sched_pushed(struct tx_sched *s, int64_t returned_ns);
+int64_t tx_sched_time(const struct tx_sched *s, uint64_t sample);
+uint64_t tx_sched_run(const struct tx_sched *s, uint64_t sample, bool *on,
+		      int64_t *window_ns);
+bool tx_sched_done(const struct tx_sched *s, uint64_t sample);
+
+#endif /* TX_SCHED_H */
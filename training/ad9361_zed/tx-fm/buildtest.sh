@@ -1,2 +1,3 @@
 #!/bin/sh
-$CC -I$SDKTARGETSYSROOT/usr/include -L$SDKTARGETSYSROOT/usr/lib -Wall -Wextra -pedantic -Wstrict-prototypes -o $1 $1.c -liio -lm 
+# Cross-build one TX tool (or all of them with no argument) with the SDK
+make CPPFLAGS="-I$SDKTARGETSYSROOT/usr/include" LDFLAGS="-L$SDKTARGETSYSROOT/usr/lib" $1
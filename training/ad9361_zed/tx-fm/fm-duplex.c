@@ -0,0 +1,719 @@
+/* fm-duplex.c : FM receiver and transmitter in one event loop
+ *
+ * Receives FM on one frequency, writing 48 kHz audio to stdout like
+ * iio_fm_radio, and transmits FM on another from deviation samples at
+ * the I/Q rate on stdin like tx-fm, all from one thread.
+ *
+ * Both IIO buffers are non-blocking. Their poll fds, stdin, stdout and the
+ * control socket (-C) are in one epoll set, and the loop sleeps in
+ * epoll_wait() until one of them is ready, so it wakes about twice per
+ * block and never spins. Whatever was ready is then handled in a fixed
+ * order: RX refill and demodulation, audio out, deviation in, TX
+ * modulation and push, control commands. A run with the same input and
+ * the same readiness does the same thing in the same order.
+ *
+ * stdin and stdout go through small rings so that neither side blocks the
+ * other: audio that does not fit is dropped, and a TX block that finds too
+ * few deviation samples is padded with carrier. Regular files cannot be
+ * polled and are read and written on every wake-up instead.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <iio.h>
+
+#include "ad9361_trx.h"
+#include "ctl.h"
+#include "demod.h"
+#include "fm_mod.h"
+
+#define MAX_CONTEXT_URL_LEN	80
+#define KERNEL_BUFFERS		4
+#define AUDIO_SAMPLE_RATE	48000
+#define DISCRIMINATOR_RATE	576000
+#define FM_DEVIATION		75000.0	/* RX discriminator full scale */
+#define FULL_SCALE		2048.0	/* 12-bit ADC */
+#define IN_RING_BLOCKS		4	/* TX blocks of deviation samples read ahead */
+#define OUT_RING_BLOCKS		8	/* RX blocks of audio waiting for stdout */
+#define STATUS_INTERVAL		1.0	/* seconds */
+
+static char iio_context_url[MAX_CONTEXT_URL_LEN + 1] = "local:";
+static long long rx_frequency = -1;
+static long long tx_frequency = -1;
+static long long sample_rate = 2304000;
+static double block_ms = 20;
+static const char *mode_name = "wbfm";
+static double deviation = 75000;	// TX deviation at sample value 0x7FFF
+static double offset_hz = 0;		// TX signal offset from the LO
+static double squelch_level = -INFINITY;
+static int rx_gain = -1;		// manual RX gain in dB, -1 for the AGC
+static int transmit_attenuation = 10;
+static const char *control_path;
+static bool status_display = true;
+
+static struct ad9361_trx trx;
+static struct ctl ctl = { .fd = -1 };
+static int epfd = -1;
+static int stdin_flags = -1, stdout_flags = -1;
+
+static volatile bool stop;
+
+/* What epoll_wait() found ready, in the order it is handled */
+enum source {
+	SRC_RX,
+	SRC_STDOUT,
+	SRC_STDIN,
+	SRC_TX,
+	SRC_CTL,
+	NUM_SOURCES,
+};
+
+/**
+ * struct ring - byte FIFO between a file descriptor and the DSP
+ * @rd, @wr: bytes taken out and put in so far; the fill is @wr - @rd
+ **/
+struct ring {
+	char *buf;
+	size_t size;
+	size_t rd, wr;
+};
+
+/**
+ * struct watch - one file descriptor in the epoll set
+ * @events: the events asked for now, 0 when out of the set
+ * @always: a regular file, which epoll refuses; it is always ready
+ **/
+struct watch {
+	int fd;
+	uint32_t events;
+	bool always;
+};
+
+/**
+ * struct loop_stats - what the loop did, for the status line
+ * @wakeups: epoll_wait() returns, timeouts for the status line included
+ * @events: ready file descriptors over all wake-ups
+ * @spurious: RX or TX wake-ups that still found the buffer busy
+ * @idle: seconds spent in epoll_wait()
+ * @starved: TX samples padded with carrier for want of input
+ * @dropped: audio samples stdout was too slow for
+ **/
+struct loop_stats {
+	unsigned long wakeups;
+	unsigned long events;
+	unsigned long spurious;
+	unsigned long rx_blocks;
+	unsigned long tx_blocks;
+	unsigned long long starved;
+	unsigned long long dropped;
+	double idle;
+	double wall;
+	double cpu;
+};
+
+static double now_s(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static double cpu_s(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static void shutdown(int status)
+{
+	if (stdin_flags >= 0) { fcntl(STDIN_FILENO, F_SETFL, stdin_flags); }
+	if (stdout_flags >= 0) { fcntl(STDOUT_FILENO, F_SETFL, stdout_flags); }
+	if (epfd >= 0) { close(epfd); }
+	ctl_close(&ctl);
+	ad9361_trx_close(&trx);
+	exit(status);
+}
+
+static void handle_sig(int sig)
+{
+	(void)sig;
+	stop = true;
+}
+
+/* sets up both directions at sample_rate, see ad9361_trx_configure() */
+static void cfg_ad9361(void)
+{
+	struct ad9361_trx_config cfg = {
+		.sample_rate = sample_rate,
+		.rx_frequency = rx_frequency,
+		.tx_frequency = tx_frequency,
+		.rx_gain = rx_gain,
+		.tx_attenuation = transmit_attenuation,
+	};
+	int ret = ad9361_trx_configure(&trx, &cfg);
+
+	if (ret == -ERANGE && !trx.baseband) {
+		fprintf(stderr, "Sample rate %lld is out of range (%lld to %lld Hz)\n",
+			sample_rate, AD9361_MIN_RATE_FIR, AD9361_MAX_RATE);
+		shutdown(1);
+	}
+	if (ret) {
+		fprintf(stderr, "Could not configure the AD9361, %s: %s\n", trx.failed, strerror(-ret));
+		shutdown(1);
+	}
+	if (status_display && trx.fir.taps) fprintf(stderr, "* Loaded %u-tap FIR profile, %ux decimation/interpolation\n", trx.fir.taps, trx.fir.ratio);
+	if (status_display) fprintf(stderr, "* AD9361 sample rate %lld Hz, RX %lld Hz, TX %lld Hz\n", trx.baseband, rx_frequency, tx_frequency);
+}
+
+static void ring_init(struct ring *r, size_t size)
+{
+	r->buf = malloc(size);
+	r->size = size;
+	r->rd = r->wr = 0;
+	if (!r->buf) {
+		perror("Could not allocate a ring");
+		shutdown(1);
+	}
+}
+
+static size_t ring_fill(const struct ring *r)
+{
+	return r->wr - r->rd;
+}
+
+static size_t ring_space(const struct ring *r)
+{
+	return r->size - ring_fill(r);
+}
+
+static void ring_put(struct ring *r, const void *src, size_t len)
+{
+	size_t pos = r->wr % r->size;
+	size_t n = len < r->size - pos ? len : r->size - pos;
+
+	memcpy(r->buf + pos, src, n);
+	memcpy(r->buf, (const char *)src + n, len - n);
+	r->wr += len;
+}
+
+static void ring_get(struct ring *r, void *dst, size_t len)
+{
+	size_t pos = r->rd % r->size;
+	size_t n = len < r->size - pos ? len : r->size - pos;
+
+	memcpy(dst, r->buf + pos, n);
+	memcpy((char *)dst + n, r->buf, len - n);
+	r->rd += len;
+}
+
+/* reads into the free space up to the wrap, like read() */
+static ssize_t ring_read_fd(struct ring *r, int fd)
+{
+	size_t pos = r->wr % r->size;
+	size_t space = ring_space(r);
+	ssize_t n = read(fd, r->buf + pos, space < r->size - pos ? space : r->size - pos);
+
+	if (n > 0) { r->wr += n; }
+	return n;
+}
+
+/* writes out the fill up to the wrap, like write() */
+static ssize_t ring_write_fd(struct ring *r, int fd)
+{
+	size_t pos = r->rd % r->size;
+	size_t fill = ring_fill(r);
+	ssize_t n = write(fd, r->buf + pos, fill < r->size - pos ? fill : r->size - pos);
+
+	if (n > 0) { r->rd += n; }
+	return n;
+}
+
+/* asks for @events on @w, taking it out of the epoll set for none
+ *
+ * Out of the set, a hung up stdin or stdout cannot wake the loop while it
+ * has nothing to do with it.
+ */
+static void watch_set(struct watch *w, enum source src, uint32_t events)
+{
+	struct epoll_event ev = { .events = events, .data.u32 = src };
+	int op = !w->events ? EPOLL_CTL_ADD : !events ? EPOLL_CTL_DEL : EPOLL_CTL_MOD;
+
+	if (w->always || w->events == events) { return; }
+	if (epoll_ctl(epfd, op, w->fd, &ev) < 0) {
+		if (errno != EPERM) {
+			perror("Could not change the epoll set");
+			shutdown(1);
+		}
+		w->always = true;	// a regular file
+		return;
+	}
+	w->events = events;
+}
+
+static void watch_init(struct watch *w, int fd, enum source src, uint32_t events)
+{
+	w->fd = fd;
+	w->events = 0;
+	w->always = false;
+	watch_set(w, src, events);
+}
+
+static void set_nonblock(int fd, int *saved)
+{
+	int flags = fcntl(fd, F_GETFL);
+
+	if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+		perror("Could not make stdin/stdout non-blocking");
+		shutdown(1);
+	}
+	*saved = flags;
+}
+
+static int buffer_poll_fd(struct iio_buffer *buf)
+{
+	int fd;
+
+	if (iio_buffer_set_blocking_mode(buf, false) < 0) {
+		fprintf(stderr, "Could not make the IIO buffers non-blocking\n");
+		shutdown(1);
+	}
+	fd = iio_buffer_get_poll_fd(buf);
+	if (fd < 0) {
+		fprintf(stderr, "No poll fd for the IIO buffers: %s\n", strerror(-fd));
+		shutdown(1);
+	}
+	return fd;
+}
+
+/* refills the RX buffer and queues its audio for stdout
+ *
+ * Returns 0 when a block was received or the buffer was not ready after
+ * all, a negative error code when the RX failed.
+ */
+static int rx_block(struct demod *demod, int16_t *audio, struct ring *out,
+		    struct loop_stats *st)
+{
+	ssize_t ret = iio_buffer_refill(trx.rxbuf);
+	size_t n;
+
+	if (ret == -EAGAIN) {
+		st->spurious++;
+		return 0;
+	}
+	if (ret < 0) { return ret; }
+
+	n = demod_block(demod, iio_buffer_first(trx.rxbuf, trx.rx0_i),
+			((char *)iio_buffer_end(trx.rxbuf) - (char *)iio_buffer_start(trx.rxbuf)) / iio_buffer_step(trx.rxbuf),
+			audio, NULL);
+	if (10 * log10(demod->power / (FULL_SCALE * FULL_SCALE) / demod->count + 1e-20) < squelch_level) {
+		memset(audio, 0, n * sizeof(*audio));
+	}
+
+	if (ring_space(out) < n * sizeof(*audio)) {
+		st->dropped += n;
+	} else {
+		ring_put(out, audio, n * sizeof(*audio));
+	}
+	st->rx_blocks++;
+	return 0;
+}
+
+/* modulates the next block of deviation samples into the TX buffer and
+ * pushes it
+ *
+ * A push that finds the queue full after all leaves the block in the
+ * buffer for the next wake-up.
+ */
+static int tx_block(struct fm_mod *mod, int16_t *dev, size_t block,
+		    struct ring *in, bool in_eof, bool *pending,
+		    struct loop_stats *st)
+{
+	ssize_t ret;
+
+	if (!*pending) {
+		size_t have = ring_fill(in) / sizeof(*dev);
+
+		if (have > block) { have = block; }
+		ring_get(in, dev, have * sizeof(*dev));
+		if (have < block) {
+			memset(dev + have, 0, (block - have) * sizeof(*dev));
+			if (!in_eof) { st->starved += block - have; }
+		}
+		fm_mod_block(mod, dev, iio_buffer_first(trx.txbuf, trx.tx0_i), block);
+		*pending = true;
+	}
+
+	ret = iio_buffer_push(trx.txbuf);
+	if (ret == -EAGAIN) {
+		st->spurious++;
+		return 0;
+	}
+	if (ret < 0) { return ret; }
+
+	*pending = false;
+	st->tx_blocks++;
+	return 0;
+}
+
+/* handles the commands waiting on the control socket
+ *
+ * The LO, gain and squelch are the receiver's, the deviation and offset
+ * the transmitter's. Everything takes effect from the next block.
+ */
+static void control_poll(struct fm_mod *mod)
+{
+	struct iio_channel *rx_chn = ad9361_trx_phy_chan(&trx, "voltage0", false);
+	struct ctl_cmd cmd;
+	double v;
+	int ret;
+
+	while (ctl_poll(&ctl, &cmd)) {
+		v = cmd.value;
+		ret = 0;
+
+		switch (cmd.param) {
+		case CTL_LO:
+			if (!cmd.has_value) { break; }
+			if (v < 70e6 || v >= 6e9) {
+				ret = -ERANGE;
+				break;
+			}
+			ret = ad9361_trx_write(&trx, "altvoltage0", true, "frequency", (long long)v);
+			if (!ret) { rx_frequency = (long long)v; }
+			break;
+		case CTL_GAIN:
+			if (!cmd.has_value) { break; }
+			if (v < -3 || v > 71) {
+				ret = -ERANGE;
+				break;
+			}
+			ret = iio_channel_attr_write(rx_chn, "gain_control_mode", "manual");
+			if (ret >= 0) { ret = iio_channel_attr_write_longlong(rx_chn, "hardwaregain", (long long)v); }
+			if (ret >= 0) { rx_gain = (int)v; }
+			break;
+		case CTL_DEV:
+			if (!cmd.has_value) { break; }
+			if (v < 100 || v > 100000) {
+				ret = -ERANGE;
+				break;
+			}
+			deviation = v;
+			fm_mod_set(mod, deviation / 32767, offset_hz, sample_rate);
+			break;
+		case CTL_OFFSET:
+			if (!cmd.has_value) { break; }
+			if (fabs(v) >= sample_rate / 2) {
+				ret = -ERANGE;
+				break;
+			}
+			offset_hz = v;
+			fm_mod_set(mod, deviation / 32767, offset_hz, sample_rate);
+			break;
+		case CTL_SQUELCH:
+			if (cmd.has_value) { squelch_level = v; }
+			break;
+		case CTL_GET:
+			cmd.param = CTL_LO;
+			ctl_reply(&ctl, &cmd, 0, rx_frequency, 0);
+			cmd.param = CTL_GAIN;
+			ctl_reply(&ctl, &cmd, 0, rx_gain, 0);
+			cmd.param = CTL_DEV;
+			ctl_reply(&ctl, &cmd, 0, deviation, 0);
+			cmd.param = CTL_OFFSET;
+			ctl_reply(&ctl, &cmd, 0, offset_hz, 0);
+			cmd.param = CTL_SQUELCH;
+			ctl_reply(&ctl, &cmd, 0, squelch_level, 0);
+			continue;
+		default:
+			ret = -EOPNOTSUPP;
+			break;
+		}
+
+		v = cmd.param == CTL_LO ? rx_frequency :
+			cmd.param == CTL_GAIN ? rx_gain :
+			cmd.param == CTL_DEV ? deviation :
+			cmd.param == CTL_OFFSET ? offset_hz : squelch_level;
+		ctl_reply(&ctl, &cmd, ret < 0 ? ret : 0, v,
+			  (ctl_now_ns() - cmd.recv_ns) / 1e9);
+	}
+}
+
+/* prints what the loop did since @last, and makes @last the current */
+static void stats_print(const struct loop_stats *st, struct loop_stats *last, char end)
+{
+	unsigned long wakeups = st->wakeups - last->wakeups;
+	double wall = st->wall - last->wall;
+
+	if (wall <= 0) { return; }
+	fprintf(stderr, "\t%6.1f wake-ups/s, %4.1f%% idle, CPU %4.1f%%, RX %lu, TX %lu blocks, %llu starved, %llu dropped%c",
+		wakeups / wall, 100 * (st->idle - last->idle) / wall,
+		100 * (st->cpu - last->cpu) / wall, st->rx_blocks, st->tx_blocks,
+		st->starved, st->dropped, end);
+	*last = *st;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"fm-duplex, FM receiver and transmitter in one event loop\n\n"
+		"Usage:\tfm-duplex -i rx_freq -f tx_freq [-options] < deviation > audio\n\n"
+		"\tstdin is signed 16-bit deviation samples at the sample rate, as for tx-fm;\n"
+		"\tstdout is signed 16-bit audio at 48 kHz, as from iio_fm_radio.\n\n"
+		"\t-i rx_freq\tReceive frequency in Hz\n"
+		"\t-f tx_freq\tTransmit frequency in Hz\n"
+		"\t-s samplerate\tRX and TX sample rate in Hz, a multiple of 48 kHz, default 2304000\n"
+		"\t-b block\tBlock duration in ms, default 20\n"
+		"\t-m mode\t\tRX demodulation, wbfm|nbfm|am|usb|lsb, default wbfm\n"
+		"\t-d deviation\tTX deviation at sample value 0x7FFF in Hz, default 75000\n"
+		"\t-o offset\tTX signal offset from the LO in Hz\n"
+		"\t-Q squelch\tMute RX blocks below this level in dBFS\n"
+		"\t-g gain\t\tManual RX gain in dB, default AGC\n"
+		"\t-a attenuation\tTX attenuation in dB, default 10\n"
+		"\t-C path\t\tControl socket: lo, gain and squelch of the RX,\n"
+		"\t\t\tdev and offset of the TX\n"
+		"\t-u url\t\tlibiio context URL, default local:\n"
+		"\t-q\t\tQuiet status output\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct epoll_event ev[NUM_SOURCES];
+	struct watch w[NUM_SOURCES];
+	struct loop_stats st = { 0 }, last = { 0 };
+	struct ring in, out;
+	struct demod demod;
+	struct fm_mod mod;
+	int16_t *audio, *dev;
+	double t0, cpu0, t, next_status;
+	unsigned int decimation, sub;
+	bool in_eof = false, tx_pending = false, failed = false;
+	size_t block;
+	int ret;
+	int opt, n, k;
+
+	while ((opt = getopt(argc, argv, "i:f:s:b:m:d:o:Q:g:a:C:u:qh")) != -1) {
+		switch (opt) {
+		case 'i': rx_frequency = (long long)atof(optarg); break;
+		case 'f': tx_frequency = (long long)atof(optarg); break;
+		case 's': sample_rate = (long long)atof(optarg); break;
+		case 'b': block_ms = atof(optarg); break;
+		case 'm': mode_name = optarg; break;
+		case 'd': deviation = atof(optarg); break;
+		case 'o': offset_hz = atof(optarg); break;
+		case 'Q': squelch_level = atof(optarg); break;
+		case 'g': rx_gain = atoi(optarg); break;
+		case 'a': transmit_attenuation = atoi(optarg); break;
+		case 'C': control_path = optarg; break;
+		case 'u': strncpy(iio_context_url, optarg, MAX_CONTEXT_URL_LEN); break;
+		case 'q': status_display = false; break;
+		default: usage();
+		}
+	}
+
+	if (rx_frequency < 70e6 || rx_frequency >= 6e9 || tx_frequency < 70e6 || tx_frequency >= 6e9) {
+		fprintf(stderr, "RX and TX frequencies (-i, -f) must be between 70 MHz and 6 GHz.\n");
+		exit(1);
+	}
+	if (sample_rate <= 0 || sample_rate % AUDIO_SAMPLE_RATE) {
+		fprintf(stderr, "The sample rate (-s) must be a multiple of %d Hz.\n", AUDIO_SAMPLE_RATE);
+		exit(1);
+	}
+	if (deviation < 100 || deviation > 100000 || fabs(offset_hz) >= sample_rate / 2 ||
+	    transmit_attenuation < 0 || transmit_attenuation > 89) {
+		fprintf(stderr, "Deviation, offset or attenuation out of range.\n");
+		exit(1);
+	}
+
+	// Whole audio samples per block
+	decimation = sample_rate / AUDIO_SAMPLE_RATE;
+	block = (size_t)(block_ms / 1e3 * AUDIO_SAMPLE_RATE) * decimation;
+	if (block < 64) {
+		fprintf(stderr, "Blocks of %.1f ms are too short at %lld Hz.\n", block_ms, sample_rate);
+		exit(1);
+	}
+
+	// Skip samples in the discriminator where the rate allows
+	for (sub = sample_rate / DISCRIMINATOR_RATE; sub > 1; sub--)
+		if (decimation % sub == 0)
+			break;
+	if (!sub)
+		sub = 1;
+	if (demod_init(&demod, mode_name, decimation, sub, sample_rate) ||
+	    fm_demod_discriminator(&demod.fm, "lut", FM_DEVIATION, sample_rate)) {
+		fprintf(stderr, "Unknown mode %s\n", mode_name);
+		exit(1);
+	}
+	fm_mod_init(&mod, deviation / 32767, offset_hz, sample_rate);
+
+	signal(SIGINT, handle_sig);
+	signal(SIGTERM, handle_sig);
+	signal(SIGPIPE, SIG_IGN);
+
+	ret = ad9361_trx_open(&trx, iio_context_url);
+	if (ret) {
+		fprintf(stderr, "Could not open the AD9361 at %s, %s: %s\n",
+			iio_context_url, trx.failed, strerror(-ret));
+		shutdown(1);
+	}
+	cfg_ad9361();
+
+	ret = ad9361_trx_create_buffers(&trx, block, KERNEL_BUFFERS);
+	if (ret) {
+		fprintf(stderr, "Could not create the IIO buffers, %s: %s\n", trx.failed, strerror(-ret));
+		shutdown(1);
+	}
+	// Only I and Q are enabled, so both buffers are plain interleaved I/Q
+	if (iio_buffer_step(trx.rxbuf) != 2 * sizeof(int16_t) || iio_buffer_step(trx.txbuf) != 2 * sizeof(int16_t)) {
+		fprintf(stderr, "Unexpected IIO buffer layout\n");
+		shutdown(1);
+	}
+
+	audio = malloc(block / decimation * sizeof(*audio));
+	dev = malloc(block * sizeof(*dev));
+	if (!audio || !dev) {
+		perror("Could not allocate blocks");
+		shutdown(1);
+	}
+	ring_init(&in, IN_RING_BLOCKS * block * sizeof(*dev));
+	ring_init(&out, OUT_RING_BLOCKS * block / decimation * sizeof(*audio));
+
+	memset(w, 0, sizeof(w));
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) {
+		perror("Could not create an epoll set");
+		shutdown(1);
+	}
+	watch_init(&w[SRC_RX], buffer_poll_fd(trx.rxbuf), SRC_RX, EPOLLIN);
+	watch_init(&w[SRC_TX], buffer_poll_fd(trx.txbuf), SRC_TX, EPOLLOUT);
+	set_nonblock(STDIN_FILENO, &stdin_flags);
+	set_nonblock(STDOUT_FILENO, &stdout_flags);
+	watch_init(&w[SRC_STDIN], STDIN_FILENO, SRC_STDIN, EPOLLIN);
+	watch_init(&w[SRC_STDOUT], STDOUT_FILENO, SRC_STDOUT, 0);
+	if (control_path) {
+		ret = ctl_open(&ctl, control_path);
+		if (ret < 0) {
+			fprintf(stderr, "Could not open control socket %s: %s\n", control_path, strerror(-ret));
+			shutdown(1);
+		}
+		watch_init(&w[SRC_CTL], ctl_poll_fd(&ctl), SRC_CTL, EPOLLIN);
+	}
+
+	if (status_display) fprintf(stderr, "* %s receive, blocks of %zu samples (%.2f ms), %.1f blocks/s each way\n",
+		demod_mode_name(demod.mode), block, 1e3 * block / sample_rate, (double)sample_rate / block);
+
+	t0 = now_s();
+	cpu0 = cpu_s();
+	next_status = t0 + STATUS_INTERVAL;
+	while (!stop) {
+		unsigned int ready = 0;
+		int timeout = -1;
+
+		ret = 0;
+
+		// Read stdin only while there is room, write stdout only with audio
+		watch_set(&w[SRC_STDIN], SRC_STDIN, !in_eof && ring_space(&in) ? EPOLLIN : 0);
+		watch_set(&w[SRC_STDOUT], SRC_STDOUT, ring_fill(&out) ? EPOLLOUT : 0);
+
+		t = now_s();
+		if (status_display) { timeout = next_status > t ? (int)ceil((next_status - t) * 1e3) : 0; }
+		n = epoll_wait(epfd, ev, NUM_SOURCES, timeout);
+		st.idle += now_s() - t;
+		st.wakeups++;
+		if (n < 0) {
+			if (errno == EINTR) { continue; }
+			perror("epoll_wait");
+			failed = true;
+			break;
+		}
+		st.events += n;
+		for (k = 0; k < n; k++) { ready |= 1u << ev[k].data.u32; }
+		for (k = 0; k < NUM_SOURCES; k++) {
+			if (w[k].always) { ready |= 1u << k; }
+		}
+
+		if (ready & (1u << SRC_RX)) {
+			ret = rx_block(&demod, audio, &out, &st);
+			if (ret < 0) {
+				fprintf(stderr, "Error refilling RX buffer: %s\n", strerror(-ret));
+				failed = true;
+				break;
+			}
+		}
+		if ((ready & (1u << SRC_STDOUT)) && ring_fill(&out)) {
+			if (ring_write_fd(&out, STDOUT_FILENO) < 0 && errno != EAGAIN) {
+				perror("Error writing audio");
+				failed = true;
+				break;
+			}
+		}
+		if ((ready & (1u << SRC_STDIN)) && !in_eof && ring_space(&in)) {
+			ssize_t got = ring_read_fd(&in, STDIN_FILENO);
+
+			if (got == 0) {
+				in_eof = true;
+				if (status_display) fprintf(stderr, "* End of input, transmitting carrier\n");
+			} else if (got < 0 && errno != EAGAIN) {
+				perror("Error reading deviation samples");
+				failed = true;
+				break;
+			}
+		}
+		if (ready & (1u << SRC_TX)) {
+			ret = tx_block(&mod, dev, block, &in, in_eof, &tx_pending, &st);
+			if (ret < 0) {
+				fprintf(stderr, "Error pushing TX buffer: %s\n", strerror(-ret));
+				failed = true;
+				break;
+			}
+		}
+		if (ready & (1u << SRC_CTL)) { control_poll(&mod); }
+
+		t = now_s();
+		st.wall = t - t0;
+		st.cpu = cpu_s() - cpu0;
+		if (status_display && t >= next_status) {
+			stats_print(&st, &last, '\r');
+			next_status += STATUS_INTERVAL;
+			if (next_status < t) { next_status = t + STATUS_INTERVAL; }
+		}
+	}
+
+	st.wall = now_s() - t0;
+	st.cpu = cpu_s() - cpu0;
+	if (status_display) {
+		memset(&last, 0, sizeof(last));
+		stats_print(&st, &last, '\n');
+	}
+	if (st.wall > 0) {
+		fprintf(stderr, "* %lu wake-ups in %.2f s: %.1f/s for %.1f blocks/s, %.2f ready fds each, %lu found the buffer busy\n",
+			st.wakeups, st.wall, st.wakeups / st.wall, (st.rx_blocks + st.tx_blocks) / st.wall,
+			st.wakeups ? (double)st.events / st.wakeups : 0, st.spurious);
+		fprintf(stderr, "* %.1f%% of the time idle in epoll_wait, CPU %.1f%% of a core\n",
+			100 * st.idle / st.wall, 100 * st.cpu / st.wall);
+	}
+
+	if (ad9361_trx_write(&trx, "altvoltage1", true, "powerdown", 1)) {
+		fprintf(stderr, "Could not power down the TX LO\n");
+	}
+	free(audio);
+	free(dev);
+	free(in.buf);
+	free(out.buf);
+	demod_free(&demod);
+	shutdown(failed ? 1 : 0);
+	return 0;
+}
@@ -0,0 +1,389 @@
+/* fm-repeater.c : single-process FM repeater for the AD9361
+ *
+ * Receives on one frequency and retransmits on another through one IIO
+ * context. Each RX block is demodulated (or, with -T, only frequency
+ * translated) straight from the RX buffer into the TX buffer and pushed,
+ * all in one loop, so there are no pipes and no buffering beyond the two
+ * IIO buffers.
+ *
+ * The RX and TX share the AD9361 sample clock, so one TX block goes out
+ * per RX block received. The TX is started PREFILL_BLOCKS blocks ahead,
+ * which makes the end-to-end latency PREFILL_BLOCKS block durations; the
+ * block size follows from the latency asked for with -l. One of those
+ * blocks is the time a block has to be processed in before the TX runs
+ * dry. A TX underflow restarts the TX later and so adds latency; whole
+ * blocks of it are shed again by dropping RX blocks.
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <iio.h>
+
+#include "ad9361_trx.h"
+#include "fir.h"
+#include "fm_mod.h"
+
+#define MAX_CONTEXT_URL_LEN	80
+#define PREFILL_BLOCKS		2
+#define KERNEL_BUFFERS		4
+#define CHANNEL_TAPS		31
+#define STATUS_INTERVAL		0.5	/* seconds */
+
+static char iio_context_url[MAX_CONTEXT_URL_LEN + 1] = "local:";
+static long long rx_frequency = -1;
+static long long tx_frequency = -1;
+static long long sample_rate = -1;
+static double latency_ms = 40;
+static bool translate = false;		// -T: retransmit the I/Q, no demodulation
+static double offset_hz = 0;		// shift applied to the retransmitted signal
+static double deviation_ratio = 1.0;	// output deviation / input deviation
+static double channel_bw = 0;		// RX channel filter before the discriminator
+static int rx_gain = -1;		// manual RX gain in dB, -1 for the AGC
+static int transmit_attenuation = 10;
+static bool status_display = true;
+
+static struct ad9361_trx trx;
+
+static volatile bool stop;
+
+/**
+ * struct repeater - signal processing state carried from block to block
+ * @mod: output NCO; in demod mode its phase carries the modulation
+ * @prev_i, @prev_q: last RX sample of the previous block
+ * @chan: channel filter, used when channel_bw is set
+ **/
+struct repeater {
+	struct fm_mod mod;
+	float prev_i, prev_q;
+	float turn_scale;
+	struct fir_iq chan;
+};
+
+/**
+ * struct latency - where the samples of the current block are on air
+ * @rx_end: time the RX block finished being captured
+ * @tx_end: time the TX finishes sending everything pushed so far
+ *
+ * Both follow the sample clock from one block to the next and are only
+ * pulled back to the wall clock when it shows the model is off: an RX
+ * block that cannot have been captured yet, or a TX that ran dry.
+ **/
+struct latency {
+	double rx_end;
+	double tx_end;
+	double min, max, sum;
+	unsigned long blocks;
+	unsigned long underflows;
+	unsigned long overflows;
+	unsigned long dropped;
+	double busy;
+};
+
+static double now_s(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static void shutdown(int status)
+{
+	ad9361_trx_close(&trx);
+	exit(status);
+}
+
+static void handle_sig(int sig)
+{
+	(void)sig;
+	stop = true;
+}
+
+/* sets up both directions at sample_rate, see ad9361_trx_configure() */
+static void cfg_ad9361(void)
+{
+	struct ad9361_trx_config cfg = {
+		.sample_rate = sample_rate,
+		.rx_frequency = rx_frequency,
+		.tx_frequency = tx_frequency,
+		.rx_gain = rx_gain,
+		.tx_attenuation = transmit_attenuation,
+	};
+	int ret = ad9361_trx_configure(&trx, &cfg);
+
+	if (ret == -ERANGE && !trx.baseband) {
+		fprintf(stderr, "Sample rate %lld is out of range (%lld to %lld Hz)\n",
+			sample_rate, AD9361_MIN_RATE_FIR, AD9361_MAX_RATE);
+		shutdown(1);
+	}
+	if (ret) {
+		fprintf(stderr, "Could not configure the AD9361, %s: %s\n", trx.failed, strerror(-ret));
+		shutdown(1);
+	}
+	if (status_display && trx.fir.taps) printf("* Loaded %u-tap FIR profile, %ux decimation/interpolation\n", trx.fir.taps, trx.fir.ratio);
+	if (status_display) printf("* AD9361 sample rate %lld Hz, RX %lld Hz, TX %lld Hz\n", trx.baseband, rx_frequency, tx_frequency);
+}
+
+static void repeater_init(struct repeater *r)
+{
+	memset(r, 0, sizeof(*r));
+	fm_mod_init(&r->mod, 0, offset_hz, sample_rate);
+
+	// radians per sample to 2^32 per turn, scaled to the output deviation
+	r->turn_scale = (float)(4294967296.0 / (2 * M_PI) * deviation_ratio);
+
+	if (channel_bw > 0) { fir_iq_init(&r->chan, CHANNEL_TAPS, channel_bw / 2 / sample_rate, 6.0); }
+}
+
+static inline int16_t sat16(int32_t v)
+{
+	return v > 32767 ? 32767 : v < -32768 ? -32768 : v;
+}
+
+/* latency once the current RX block is pushed, beyond the set one */
+static double latency_excess(const struct latency *l, double dur)
+{
+	double tx_end = l->tx_end > now_s() ? l->tx_end : now_s();
+
+	return tx_end + dur - l->rx_end - PREFILL_BLOCKS * dur;
+}
+
+/* RX block to TX block, sample for sample
+ *
+ * Demodulation is the phase difference between successive samples, which
+ * becomes the phase increment of the output NCO. Translation rotates the
+ * RX I/Q by the offset and rescales the 12-bit ADC samples to the MSB
+ * aligned DAC.
+ */
+static void repeat_block(struct repeater *r)
+{
+	ptrdiff_t rx_inc = iio_buffer_step(trx.rxbuf);
+	ptrdiff_t tx_inc = iio_buffer_step(trx.txbuf);
+	const char *rx_end = iio_buffer_end(trx.rxbuf);
+	const char *rx_p = iio_buffer_first(trx.rxbuf, trx.rx0_i);
+	char *tx_p = iio_buffer_first(trx.txbuf, trx.tx0_i);
+	int16_t c, s;
+
+	for (; rx_p < rx_end; rx_p += rx_inc, tx_p += tx_inc) {
+		const int16_t *x = (const int16_t *)rx_p;
+		int16_t *y = (int16_t *)tx_p;
+
+		if (translate) {
+			r->mod.phase += r->mod.offset;
+			fm_mod_iq(r->mod.phase, &c, &s);
+			y[0] = sat16(((int32_t)x[0] * c - (int32_t)x[1] * s) >> 11);
+			y[1] = sat16(((int32_t)x[0] * s + (int32_t)x[1] * c) >> 11);
+		} else {
+			float i = x[0], q = x[1];
+			float dphi;
+
+			if (channel_bw > 0) { fir_iq_step(&r->chan, &i, &q); }
+			dphi = atan2f(q * r->prev_i - i * r->prev_q, i * r->prev_i + q * r->prev_q);
+			r->prev_i = i;
+			r->prev_q = q;
+
+			r->mod.phase += (uint32_t)(int32_t)lrintf(dphi * r->turn_scale) + r->mod.offset;
+			fm_mod_iq(r->mod.phase, &y[0], &y[1]);
+		}
+	}
+}
+
+static void latency_rx(struct latency *l, double dur)
+{
+	double t = now_s();
+
+	l->rx_end += dur;
+	if (!l->blocks || l->rx_end > t) {
+		l->rx_end = t;
+	} else if (t - l->rx_end > KERNEL_BUFFERS * dur) {
+		l->overflows++;		// fell behind and the kernel dropped data
+		l->rx_end = t;
+	}
+}
+
+static void latency_tx(struct latency *l, double dur, double t_rx)
+{
+	double t = now_s();
+	double lat;
+
+	if (l->tx_end < t) {
+		l->underflows++;
+		l->tx_end = t;
+	}
+	l->tx_end += dur;
+	l->busy += t - t_rx;
+
+	lat = l->tx_end - l->rx_end;
+	if (!l->blocks || lat < l->min) { l->min = lat; }
+	if (!l->blocks || lat > l->max) { l->max = lat; }
+	l->sum += lat;
+	l->blocks++;
+}
+
+static void latency_print(const struct latency *l, double dur, char end)
+{
+	if (!l->blocks) { return; }
+	printf("\tlatency %7.2f ms (min %7.2f, max %7.2f), load %3.0f%%, %lu underflows, %lu overflows, %lu dropped%c",
+	       (l->tx_end - l->rx_end) * 1e3, l->min * 1e3, l->max * 1e3,
+	       100 * l->busy / (l->blocks * dur), l->underflows, l->overflows, l->dropped, end);
+	fflush(stdout);
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"fm-repeater, single-process FM repeater for the AD9361\n\n"
+		"Usage:\tfm-repeater -i rx_freq -f tx_freq -s samplerate [-options]\n\n"
+		"\t-i rx_freq\tReceive frequency in Hz\n"
+		"\t-f tx_freq\tTransmit frequency in Hz\n"
+		"\t-s samplerate\tRX and TX sample rate in Hz, 520834 and up\n"
+		"\t-l latency\tEnd-to-end latency in ms, default 40. Sets the block size\n"
+		"\t\t\tto latency / %d; 10 ms needs the loop to keep up with 5 ms blocks.\n"
+		"\t-T\t\tRetransmit the I/Q as received, frequency translated only\n"
+		"\t-o offset\tShift the retransmitted signal by this many Hz\n"
+		"\t-D ratio\tOutput deviation relative to the input, default 1.0\n"
+		"\t-w bandwidth\tRX channel filter in Hz before demodulation, default none\n"
+		"\t-g gain\t\tManual RX gain in dB, default AGC\n"
+		"\t-a attenuation\tTX attenuation in dB, default 10\n"
+		"\t-u url\t\tlibiio context URL, default local:\n"
+		"\t-q\t\tQuiet status output\n",
+		PREFILL_BLOCKS);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct repeater rep;
+	struct latency lat = { 0 };
+	double dur, t_rx, next_status;
+	size_t block;
+	bool failed = false;
+	int ret;
+	unsigned int k;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "i:f:s:l:o:D:w:g:a:u:Tqh")) != -1) {
+		switch (opt) {
+		case 'i': rx_frequency = (long long)atof(optarg); break;
+		case 'f': tx_frequency = (long long)atof(optarg); break;
+		case 's': sample_rate = (long long)atof(optarg); break;
+		case 'l': latency_ms = atof(optarg); break;
+		case 'o': offset_hz = atof(optarg); break;
+		case 'D': deviation_ratio = atof(optarg); break;
+		case 'w': channel_bw = atof(optarg); break;
+		case 'g': rx_gain = atoi(optarg); break;
+		case 'a': transmit_attenuation = atoi(optarg); break;
+		case 'u': strncpy(iio_context_url, optarg, MAX_CONTEXT_URL_LEN); break;
+		case 'T': translate = true; break;
+		case 'q': status_display = false; break;
+		default: usage();
+		}
+	}
+
+	if (rx_frequency < 70e6 || rx_frequency >= 6e9 || tx_frequency < 70e6 || tx_frequency >= 6e9) {
+		fprintf(stderr, "RX and TX frequencies (-i, -f) must be between 70 MHz and 6 GHz.\n");
+		exit(1);
+	}
+	if (sample_rate <= 0) {
+		fprintf(stderr, "You must supply a sample rate (-s samplerate).\n");
+		exit(1);
+	}
+	if (fabs(offset_hz) >= sample_rate / 2 || transmit_attenuation < 0 || transmit_attenuation > 89) {
+		fprintf(stderr, "Offset or attenuation out of range.\n");
+		exit(1);
+	}
+
+	block = (size_t)(latency_ms / 1e3 * sample_rate / PREFILL_BLOCKS);
+	if (block < 64) {
+		fprintf(stderr, "Latency %.1f ms is too short at %lld Hz.\n", latency_ms, sample_rate);
+		exit(1);
+	}
+	dur = (double)block / sample_rate;
+
+	signal(SIGINT, handle_sig);
+	signal(SIGTERM, handle_sig);
+
+	ret = ad9361_trx_open(&trx, iio_context_url);
+	if (ret) {
+		fprintf(stderr, "Could not open the AD9361 at %s, %s: %s\n",
+			iio_context_url, trx.failed, strerror(-ret));
+		shutdown(1);
+	}
+	cfg_ad9361();
+
+	if (status_display) printf("* %s, blocks of %zu samples (%.2f ms)\n",
+		translate ? "Translating" : "Demodulating", block, dur * 1e3);
+
+	// The overflow check in latency_rx() needs the RX queue depth
+	ret = ad9361_trx_create_buffers(&trx, block, KERNEL_BUFFERS);
+	if (ret) {
+		fprintf(stderr, "Could not create the IIO buffers, %s: %s\n", trx.failed, strerror(-ret));
+		shutdown(1);
+	}
+
+	repeater_init(&rep);
+
+	// Start the TX PREFILL_BLOCKS ahead with silence; a push can hand out
+	// another block, so clear each one
+	for (k = 0; k < PREFILL_BLOCKS; k++) {
+		memset(iio_buffer_start(trx.txbuf), 0, (char *)iio_buffer_end(trx.txbuf) - (char *)iio_buffer_start(trx.txbuf));
+		if (iio_buffer_push(trx.txbuf) < 0) {
+			fprintf(stderr, "Error pushing TX buffer\n");
+			shutdown(1);
+		}
+	}
+	lat.tx_end = now_s() + PREFILL_BLOCKS * dur;
+
+	next_status = now_s() + STATUS_INTERVAL;
+	while (!stop) {
+		ssize_t ret = iio_buffer_refill(trx.rxbuf);
+
+		if (ret < 0) {
+			fprintf(stderr, "Error refilling RX buffer %zd\n", ret);
+			failed = !stop;
+			break;
+		}
+		latency_rx(&lat, dur);
+		t_rx = now_s();
+
+		// A block over the set latency after a hiccup: skip one to get back
+		if (lat.blocks && latency_excess(&lat, dur) > dur / 2) {
+			lat.dropped++;
+			continue;
+		}
+
+		repeat_block(&rep);
+
+		latency_tx(&lat, dur, t_rx);
+		ret = iio_buffer_push(trx.txbuf);
+		if (ret < 0) {
+			fprintf(stderr, "Error pushing TX buffer %zd\n", ret);
+			failed = !stop;
+			break;
+		}
+
+		if (status_display && t_rx >= next_status) {
+			latency_print(&lat, dur, '\r');
+			next_status += STATUS_INTERVAL;
+		}
+	}
+
+	if (status_display) {
+		latency_print(&lat, dur, '\n');
+		if (lat.blocks) printf("* Mean latency %.2f ms over %lu blocks\n", lat.sum / lat.blocks * 1e3, lat.blocks);
+	}
+
+	if (ad9361_trx_write(&trx, "altvoltage1", true, "powerdown", 1)) {
+		fprintf(stderr, "Could not power down the TX LO\n");
+	}
+	shutdown(failed ? 1 : 0);
+	return 0;
+}
@@ -0,0 +1,235 @@
+/* fm-transcode.c : offline audio to FM I/Q transcoder
+ *
+ * Runs the TX chain (pre-emphasis, resampling, limiter, modulator) as fast
+ * as the CPUs allow and writes interleaved 16-bit I/Q, ready for
+ * tx-fm-zed-preload -I. Input is a 16-bit PCM WAV file or raw s16le audio.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "audio.h"
+#include "tx_chain.h"
+
+#define CHUNK_FRAMES	65536
+
+static const char *input_filename = NULL;
+static const char *output_filename = NULL;
+static long long tx_rate = 2304000;
+static long long center_frequency = 0;
+static unsigned int raw_rate = 48000;
+static unsigned int raw_channels = 1;
+static double deviation = 75000;
+static double preemph_us = 50;
+static double audio_bw = 15000;
+static double gain_db = 0;
+static unsigned int nthreads = 0;
+static bool sigmf = false;
+static bool status_display = true;
+
+/* Read up to n frames as mono floats */
+static size_t audio_read_float(struct audio_in *in, float *out, size_t n)
+{
+	static int16_t pcm[CHUNK_FRAMES];
+	size_t got, k;
+
+	got = audio_read(in, pcm, n);
+	for (k = 0; k < got; k++)
+		out[k] = pcm[k] / 32768.0f;
+
+	return got;
+}
+
+static int write_sigmf_meta(const char *base, long long samples)
+{
+	char name[1024];
+	FILE *fp;
+
+	snprintf(name, sizeof(name), "%s.sigmf-meta", base);
+	fp = fopen(name, "w");
+	if (!fp) {
+		perror(name);
+		return -1;
+	}
+
+	fprintf(fp,
+		"{\n"
+		"    \"global\": {\n"
+		"        \"core:datatype\": \"ci16_le\",\n"
+		"        \"core:sample_rate\": %lld,\n"
+		"        \"core:version\": \"1.0.0\",\n"
+		"        \"core:recorder\": \"fm-transcode\",\n"
+		"        \"core:description\": \"FM, %.0f Hz deviation, %.0f us pre-emphasis, %lld samples\"\n"
+		"    },\n"
+		"    \"captures\": [\n"
+		"        {\n"
+		"            \"core:sample_start\": 0",
+		tx_rate, deviation, preemph_us, samples);
+	if (center_frequency)
+		fprintf(fp, ",\n            \"core:frequency\": %lld", center_frequency);
+	fprintf(fp,
+		"\n"
+		"        }\n"
+		"    ],\n"
+		"    \"annotations\": []\n"
+		"}\n");
+
+	return fclose(fp);
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"fm-transcode, offline audio to FM I/Q converter\n\n"
+		"Usage:\tfm-transcode -i input -o output [-options]\n\n"
+		"\t-i input\tWAV (16-bit PCM) or raw s16le audio file\n"
+		"\t-o output\tI/Q output file (interleaved s16 I/Q)\n"
+		"\t-s samplerate\tI/Q sample rate in Hz (default 2304000)\n"
+		"\t-r rate\t\tRaw input sample rate in Hz (default 48000)\n"
+		"\t-c channels\tRaw input channel count, down-mixed to mono (default 1)\n"
+		"\t-d deviation\tPeak deviation in Hz (default 75000)\n"
+		"\t-p microseconds\tPre-emphasis time constant, 50, 75 or 0 for none (default 50)\n"
+		"\t-b bandwidth\tAudio bandwidth in Hz (default 15000)\n"
+		"\t-g gain\t\tGain in dB ahead of the limiter (default 0)\n"
+		"\t-j threads\tWorker threads (default one per CPU)\n"
+		"\t-m\t\tWrite SigMF: output.sigmf-data and output.sigmf-meta\n"
+		"\t-f frequency\tCenter frequency recorded in the SigMF metadata\n"
+		"\t-q\t\tQuiet\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	static float audio[CHUNK_FRAMES + RESAMPLER_TAPS];
+	struct timespec t0, t1;
+	struct tx_chain chain;
+	struct audio_in in;
+	long long total = 0;
+	char data_name[1024];
+	size_t max_out, frames;
+	int16_t *iq;
+	FILE *out;
+	double secs;
+	bool eof = false;
+	int opt, ret;
+
+	while ((opt = getopt(argc, argv, "i:o:s:r:c:d:p:b:g:j:f:mqh")) != -1) {
+		switch (opt) {
+		case 'i': input_filename = optarg; break;
+		case 'o': output_filename = optarg; break;
+		case 's': tx_rate = (long long)atof(optarg); break;
+		case 'r': raw_rate = (unsigned int)atof(optarg); break;
+		case 'c': raw_channels = atoi(optarg); break;
+		case 'd': deviation = atof(optarg); break;
+		case 'p': preemph_us = atof(optarg); break;
+		case 'b': audio_bw = atof(optarg); break;
+		case 'g': gain_db = atof(optarg); break;
+		case 'j': nthreads = atoi(optarg); break;
+		case 'f': center_frequency = (long long)atof(optarg); break;
+		case 'm': sigmf = true; break;
+		case 'q': status_display = false; break;
+		case 'h':
+		default:
+			usage();
+		}
+	}
+
+	if (!input_filename || !output_filename)
+		usage();
+
+	ret = audio_open(&in, input_filename, raw_rate, raw_channels);
+	if (ret == -ENOTSUP) {
+		fprintf(stderr, "%s: only 16-bit PCM with 1 to %d channels is supported\n",
+			input_filename, AUDIO_MAX_CHANNELS);
+		return 1;
+	} else if (ret == -EINVAL) {
+		fprintf(stderr, "%s: malformed WAV file\n", input_filename);
+		return 1;
+	} else if (ret) {
+		fprintf(stderr, "%s: %s\n", input_filename, strerror(-ret));
+		return 1;
+	}
+
+	if (tx_chain_init(&chain, in.rate, tx_rate, preemph_us * 1e-6,
+			  audio_bw, deviation, gain_db)) {
+		fprintf(stderr, "Failed to set up the TX chain\n");
+		return 1;
+	}
+	chain.nthreads = nthreads;
+
+	max_out = tx_chain_max_output(&chain, CHUNK_FRAMES + 2 * RESAMPLER_TAPS);
+	iq = malloc(max_out * 2 * sizeof(*iq));
+	if (!iq) {
+		perror("malloc");
+		return 1;
+	}
+
+	snprintf(data_name, sizeof(data_name), sigmf ? "%s.sigmf-data" : "%s",
+		 output_filename);
+	out = fopen(data_name, "wb");
+	if (!out) {
+		perror(data_name);
+		return 1;
+	}
+
+	if (status_display)
+		fprintf(stderr, "* %s: %s, %u Hz, %u channel(s) -> %lld S/s I/Q\n",
+			input_filename, in.wav ? "WAV" : "raw", in.rate,
+			in.channels, tx_rate);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	while (!eof) {
+		ssize_t n;
+
+		frames = audio_read_float(&in, audio, CHUNK_FRAMES);
+		if (frames < CHUNK_FRAMES) {
+			/* Flush the resampler history with silence */
+			eof = true;
+			memset(audio + frames, 0, RESAMPLER_TAPS * sizeof(*audio));
+			frames += RESAMPLER_TAPS;
+		}
+
+		n = tx_chain_process(&chain, audio, frames, iq, max_out);
+		if (n < 0) {
+			fprintf(stderr, "TX chain failed (%zd)\n", n);
+			return 1;
+		}
+		if (fwrite(iq, 2 * sizeof(*iq), n, out) != (size_t)n) {
+			perror(data_name);
+			return 1;
+		}
+		total += n;
+
+		if (status_display) {
+			fprintf(stderr, "\t%8.2f MSmp\r", total / 1e6);
+			fflush(stderr);
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	if (fclose(out)) {
+		perror(data_name);
+		return 1;
+	}
+	audio_close(&in);
+
+	if (sigmf && write_sigmf_meta(output_filename, total))
+		return 1;
+
+	secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	if (status_display)
+		fprintf(stderr, "* %lld samples (%.1f s of air time) in %.3f s: "
+			"%.2f MS/s, %.1fx real time\n", total,
+			(double)total / tx_rate, secs, total / secs / 1e6,
+			total / (double)tx_rate / secs);
+
+	tx_chain_free(&chain);
+	free(iq);
+	return 0;
+}
@@ -9,9 +9,15 @@
 #include <string.h>
 #include <time.h>
 #include <math.h>
+#include <errno.h>
+
+#include "fm_mod.h"
+#include "tx_sched.h"
 
 #define DEFAULT_BUFFER_TIME 0.1
 #define DEFAULT_ATTENUATION -10
+#define KERNEL_BUFFERS 4        // pinned, the schedule counts on it
+#define REPORT_BLOCKS (KERNEL_BUFFERS + 2)
 
 static struct iio_context *ctx = NULL;
 static struct iio_channel *tx0_i = NULL;
@@ -23,48 +29,194 @@ static struct iio_buffer *txbuf = NULL;
 static volatile bool stop = false;
 
 static int16_t *samples = NULL;
+static int16_t *iq_samples = NULL;
 static size_t total_samples = 0;
 static long long center_freq = 96500000;
 static long long sample_rate = 2304000;
 static const char *input_filename = NULL;
+static unsigned int mod_threads = 0;
+static bool check_serial = false;
+static bool iq_input = false;
+
+// -S, -E, -P, -L: transmit only in these windows, times on sched_clock
+static const char *start_arg = NULL;
+static const char *stop_arg = NULL;
+static double period_s = 0;
+static double length_s = 0;
+static clockid_t sched_clock = CLOCK_REALTIME;
+static struct tx_sched sched;
+
+// Windows that start in a pushed buffer, reported once it is on air
+struct window_report {
+    uint64_t push;          // the buffer's push
+    int64_t base_ns;        // the buffer's on-air time when it was filled
+    unsigned int windows;   // windows starting in it
+    int64_t window_ns;      // the first one's requested start
+    double first_us, min_us, max_us;  // start offsets as filled
+};
+static struct window_report reports[REPORT_BLOCKS];
+static unsigned long windows_total;
+static double offset_min_us = INFINITY, offset_max_us = -INFINITY;
 
 static double deviation_scale = 1.0;
-static double time_per_sample = 1.0;
-static double phase_accum = 0.0;
 
 static void handle_sig(int sig) {
+    (void)sig;
     stop = true;
 }
 
-static void wait_until(struct timespec *target) {
-    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, target, NULL);
+/* Seconds since the epoch of sched_clock, or +seconds from now */
+static int parse_time(const char *arg, int64_t *ns) {
+    const char *p = arg[0] == '+' ? arg + 1 : arg;
+    char *end;
+    long long sec = strtoll(p, &end, 10);
+    double frac = *end == '.' ? atof(end) : 0;
+
+    if (end == p && *end != '.')
+        return -EINVAL;
+    if (*end && *end != '.')
+        return -EINVAL;
+    *ns = sec * 1000000000LL + llround(frac * 1e9);
+    if (arg[0] == '+')
+        *ns += tx_sched_now(sched_clock);
+    return 0;
+}
+
+static double elapsed_s(const struct timespec *a, const struct timespec *b) {
+    return (b->tv_sec - a->tv_sec) + (b->tv_nsec - a->tv_nsec) / 1e9;
 }
 
-static void time_add_ns(struct timespec *t, long ns) {
-    t->tv_nsec += ns;
-    while (t->tv_nsec >= 1000000000L) {
-        t->tv_nsec -= 1000000000L;
-        t->tv_sec += 1;
+/* Fill one buffer's samples from sample on, silent outside the windows */
+static void fill_scheduled(int16_t *iq, size_t n, uint64_t sample, size_t *index) {
+    struct window_report *rep = &reports[sched.pushes % REPORT_BLOCKS];
+    static int64_t last_window = TX_SCHED_NEVER;
+    int64_t window_ns;
+    size_t k = 0, run, j;
+    uint64_t end;
+    double us;
+    bool on;
+
+    memset(rep, 0, sizeof(*rep));
+    rep->push = sched.pushes;
+    rep->base_ns = tx_sched_time(&sched, sample);
+    while (k < n) {
+        end = tx_sched_run(&sched, sample + k, &on, &window_ns);
+        run = end - (sample + k) < n - k ? end - (sample + k) : n - k;
+        if (!on) {
+            memset(iq + 2 * k, 0, 2 * run * sizeof(*iq));
+            k += run;
+            continue;
+        }
+
+        // Only ceil() to a whole sample so far; the estimate moves later
+        if (window_ns != last_window) {
+            last_window = window_ns;
+            us = (tx_sched_time(&sched, sample + k) - window_ns) / 1e3;
+            if (!rep->windows++) {
+                rep->window_ns = window_ns;
+                rep->first_us = rep->min_us = rep->max_us = us;
+            }
+            rep->min_us = us < rep->min_us ? us : rep->min_us;
+            rep->max_us = us > rep->max_us ? us : rep->max_us;
+        }
+        for (j = 0; j < run; j++) {
+            iq[2 * (k + j)] = iq_samples[2 * *index];
+            iq[2 * (k + j) + 1] = iq_samples[2 * *index + 1];
+            if (++*index == total_samples)
+                *index = 0;
+        }
+        k += run;
     }
 }
 
-static void modulate_sample(int16_t deviation, int16_t *i_sample, int16_t *q_sample) {
-    double dev_hz = deviation * deviation_scale;
-    double dphi = 2 * M_PI * dev_hz * time_per_sample;
-    phase_accum = fmod(phase_accum + dphi, 2 * M_PI);
-    *i_sample = (int16_t)(cos(phase_accum) * 0x7FFF);
-    *q_sample = (int16_t)(sin(phase_accum) * 0x7FFF);
+/* Report the windows of the buffer that just went on air */
+static void report_windows(void) {
+    struct window_report *rep;
+    double drift_us;
+
+    if (sched.pushes < REPORT_BLOCKS - 1)
+        return;
+    rep = &reports[(sched.pushes + 1) % REPORT_BLOCKS];
+    if (!rep->windows || rep->push + REPORT_BLOCKS - 1 != sched.pushes)
+        return;
+
+    drift_us = (tx_sched_time(&sched, rep->push * sched.block) - rep->base_ns) / 1e3;
+    windows_total += rep->windows;
+    offset_min_us = fmin(offset_min_us, rep->min_us + drift_us);
+    offset_max_us = fmax(offset_max_us, rep->max_us + drift_us);
+    fprintf(stderr, "Window at %lld.%06lld: first sample on air %+.1f us from it\n",
+            (long long)(rep->window_ns / 1000000000LL),
+            (long long)(rep->window_ns % 1000000000LL / 1000),
+            rep->first_us + drift_us);
+    rep->windows = 0;
+}
+
+// Modulate the whole file up front; the phase is a prefix sum of the
+// per-sample increments, so the chunks can be generated on all cores.
+static int preload_modulate(void) {
+    struct fm_mod mod;
+    struct timespec t0, t1;
+    int chunks;
+
+    iq_samples = malloc(total_samples * 2 * sizeof(int16_t));
+    if (!iq_samples) {
+        perror("malloc");
+        return -1;
+    }
+
+    fm_mod_init(&mod, deviation_scale, 0, sample_rate);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    chunks = fm_mod_block_parallel(&mod, samples, iq_samples, total_samples, mod_threads);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    fprintf(stderr, "Modulated %zu samples in %.3f s (%.2f MS/s, %d threads)\n",
+            total_samples, elapsed_s(&t0, &t1),
+            total_samples / elapsed_s(&t0, &t1) / 1e6, chunks);
+
+    if (check_serial) {
+        int16_t *ref = malloc(total_samples * 2 * sizeof(int16_t));
+        int same;
+
+        if (!ref) {
+            perror("malloc");
+            return -1;
+        }
+        fm_mod_init(&mod, deviation_scale, 0, sample_rate);
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        fm_mod_block(&mod, samples, ref, total_samples);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        same = !memcmp(ref, iq_samples, total_samples * 2 * sizeof(int16_t));
+        fprintf(stderr, "Serial modulation took %.3f s (%.2f MS/s), output %s\n",
+                elapsed_s(&t0, &t1), total_samples / elapsed_s(&t0, &t1) / 1e6,
+                same ? "identical" : "DIFFERS");
+        free(ref);
+        if (!same)
+            return -1;
+    }
+
+    return 0;
 }
 
 int main(int argc, char **argv) {
     int opt;
-    while ((opt = getopt(argc, argv, "f:s:i:")) != -1) {
+    while ((opt = getopt(argc, argv, "f:s:i:j:cIS:E:P:L:t")) != -1) {
         switch (opt) {
             case 'f': center_freq = atoll(optarg); break;
             case 's': sample_rate = atoll(optarg); break;
             case 'i': input_filename = optarg; break;
+            case 'j': mod_threads = atoi(optarg); break;
+            case 'c': check_serial = true; break;
+            case 'I': iq_input = true; break;
+            case 'S': start_arg = optarg; break;
+            case 'E': stop_arg = optarg; break;
+            case 'P': period_s = atof(optarg); break;
+            case 'L': length_s = atof(optarg); break;
+            case 't': sched_clock = CLOCK_TAI; break;
             default:
-                fprintf(stderr, "Usage: %s -f freq -s samplerate -i input.raw\n", argv[0]);
+                fprintf(stderr, "Usage: %s -f freq -s samplerate -i input.raw [-j threads] [-c] [-I]\n"
+                        "          [-S start] [-E stop] [-P period -L length] [-t]\n"
+                        "  times are seconds since the epoch, or +seconds from now;\n"
+                        "  -t takes them on CLOCK_TAI instead of CLOCK_REALTIME\n", argv[0]);
                 return 1;
         }
     }
@@ -74,6 +226,14 @@ int main(int argc, char **argv) {
         return 1;
     }
 
+    bool scheduled = start_arg || stop_arg || period_s > 0 || length_s > 0;
+    int64_t start_ns = 0, stop_ns = TX_SCHED_NEVER;
+    if ((start_arg && parse_time(start_arg, &start_ns)) ||
+        (stop_arg && parse_time(stop_arg, &stop_ns))) {
+        fprintf(stderr, "Times are seconds since the epoch, or +seconds from now\n");
+        return 1;
+    }
+
     signal(SIGINT, handle_sig);
 
     FILE *fp = fopen(input_filename, "rb");
@@ -95,9 +255,17 @@ int main(int argc, char **argv) {
     total_samples = fread(samples, sizeof(int16_t), fsize / 2, fp);
     fclose(fp);
 
-    time_per_sample = 1.0 / sample_rate;
     deviation_scale = 7500.0 / 32767.0;
 
+    // -I: the file already holds interleaved I/Q, e.g. from fm-transcode
+    if (iq_input) {
+        iq_samples = samples;
+        samples = NULL;
+        total_samples /= 2;
+    } else if (preload_modulate()) {
+        return 1;
+    }
+
     ctx = iio_create_default_context();
     if (!ctx) {
         fprintf(stderr, "Could not create IIO context\n");
@@ -116,51 +284,118 @@ int main(int argc, char **argv) {
     tx0_i = iio_device_find_channel(tx, "voltage0", true);
     tx0_q = iio_device_find_channel(tx, "voltage1", true);
 
-    iio_channel_attr_write_longlong(lo_chan, "frequency", center_freq);
-    iio_channel_attr_write_longlong(lo_chan, "powerdown", 0);
-    iio_channel_attr_write_double(phy_chan, "hardwaregain", DEFAULT_ATTENUATION);
-    iio_channel_attr_write_longlong(phy_chan, "sampling_frequency", sample_rate);
+    if (!phy_chan || !lo_chan || !tx0_i || !tx0_q ||
+        iio_channel_attr_write_longlong(lo_chan, "frequency", center_freq) < 0 ||
+        iio_channel_attr_write_longlong(lo_chan, "powerdown", 0) < 0 ||
+        iio_channel_attr_write_double(phy_chan, "hardwaregain", DEFAULT_ATTENUATION) < 0 ||
+        iio_channel_attr_write_longlong(phy_chan, "sampling_frequency", sample_rate) < 0) {
+        fprintf(stderr, "Could not configure the TX path\n");
+        return 1;
+    }
+
+    // The schedule runs on the rate the device actually took
+    long long actual_rate = sample_rate;
+    if (iio_channel_attr_read_longlong(phy_chan, "sampling_frequency", &actual_rate) ||
+        actual_rate <= 0)
+        actual_rate = sample_rate;
+    if (actual_rate != sample_rate)
+        fprintf(stderr, "Sample rate is %lld, not %lld\n", actual_rate, sample_rate);
 
     iio_channel_enable(tx0_i);
     iio_channel_enable(tx0_q);
 
     size_t buffer_size = (size_t)(DEFAULT_BUFFER_TIME * sample_rate);
+    if (iio_device_set_kernel_buffers_count(tx, KERNEL_BUFFERS)) {
+        fprintf(stderr, "Could not set %d kernel buffers\n", KERNEL_BUFFERS);
+        return 1;
+    }
     txbuf = iio_device_create_buffer(tx, buffer_size, false);
     if (!txbuf) {
         fprintf(stderr, "Failed to create buffer\n");
         return 1;
     }
 
+    if (scheduled) {
+        // Without -S, the first window opens as soon as the stream is timed
+        if (tx_sched_init(&sched, sched_clock, 0, stop_ns, period_s * 1e9, length_s * 1e9,
+                          actual_rate, buffer_size, KERNEL_BUFFERS)) {
+            fprintf(stderr, "Stop must follow start, and the length be within the period\n");
+            return 1;
+        }
+        int64_t lead = tx_sched_lead_ns(&sched);
+        int64_t now = tx_sched_now(sched_clock);
+        if (!start_arg)
+            start_ns = now + lead;
+        if (tx_sched_init(&sched, sched_clock, start_ns, stop_ns, period_s * 1e9, length_s * 1e9,
+                          actual_rate, buffer_size, KERNEL_BUFFERS)) {
+            fprintf(stderr, "Stop must follow start, and the length be within the period\n");
+            return 1;
+        }
+        if (start_ns - lead < now) {
+            fprintf(stderr, "Start is less than %.3f s away\n", lead / 1e9);
+            return 1;
+        }
+
+        struct timespec t = {
+            .tv_sec = (start_ns - lead) / 1000000000LL,
+            .tv_nsec = (start_ns - lead) % 1000000000LL,
+        };
+        while (!stop && clock_nanosleep(sched_clock, TIMER_ABSTIME, &t, NULL) == EINTR)
+            ;
+    }
+
+    // The push blocks while the kernel queue is full, which paces the loop
+    uint64_t sample = 0;
+    size_t index = 0;
+    unsigned int tail = 0;
+    bool failed = false;
     while (!stop) {
-        phase_accum = 0.0;
-        size_t index = 0;
-        struct timespec t;
-        clock_gettime(CLOCK_MONOTONIC, &t);
-
-        while (!stop && index < total_samples) {
-            ptrdiff_t p_inc = iio_buffer_step(txbuf);
-            char *p_end = iio_buffer_end(txbuf);
-            char *p = iio_buffer_first(txbuf, tx0_i);
-
-            for (; p < p_end && index < total_samples; p += p_inc) {
-                int16_t i, q;
-                modulate_sample(samples[index++], &i, &q);
-                ((int16_t*)p)[0] = i;
-                ((int16_t*)p)[1] = q;
+        ptrdiff_t p_inc = iio_buffer_step(txbuf);
+        char *p_end = iio_buffer_end(txbuf);
+        char *p = iio_buffer_first(txbuf, tx0_i);
+        size_t n = (p_end - p) / p_inc;
+
+        if (scheduled && !sched.pushes) {
+            // No sample has a time before the first push; the lead is silent
+            memset(p, 0, p_end - p);
+        } else if (scheduled) {
+            // Once nothing more goes out, push until the last window has
+            if (tx_sched_done(&sched, sample) && ++tail > KERNEL_BUFFERS)
+                break;
+            fill_scheduled((int16_t *)p, n, sample, &index);
+        } else {
+            for (; p < p_end; p += p_inc) {
+                ((int16_t*)p)[0] = iq_samples[2 * index];
+                ((int16_t*)p)[1] = iq_samples[2 * index + 1];
+                if (++index == total_samples)
+                    index = 0;
             }
+        }
 
-            iio_buffer_push(txbuf);
-            time_add_ns(&t, DEFAULT_BUFFER_TIME * 1e9);
-            wait_until(&t);
+        if (iio_buffer_push(txbuf) < 0) {
+            fprintf(stderr, "Buffer push failed\n");
+            failed = true;
+            break;
+        }
+        sample += n;
+        if (scheduled) {
+            tx_sched_pushed(&sched, tx_sched_now(CLOCK_MONOTONIC));
+            report_windows();
         }
     }
 
-    iio_channel_attr_write_longlong(lo_chan, "powerdown", 1);
+    if (windows_total)
+        fprintf(stderr, "%lu windows, first samples on air %+.1f to %+.1f us from them\n",
+                windows_total, offset_min_us, offset_max_us);
+
+    if (iio_channel_attr_write_longlong(lo_chan, "powerdown", 1) < 0)
+        fprintf(stderr, "Could not power down the TX LO\n");
     iio_buffer_destroy(txbuf);
     iio_channel_disable(tx0_i);
     iio_channel_disable(tx0_q);
     iio_context_destroy(ctx);
     free(samples);
-    return 0;
+    free(iq_samples);
+    return failed ? 1 : 0;
 }
 
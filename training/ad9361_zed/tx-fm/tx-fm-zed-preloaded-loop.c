@@ -9,9 +9,13 @@
 #include <string.h>
 #include <time.h>
 #include <math.h>
+#include <errno.h>
+#include "fm_mod.h"
+#include "playlist.h"
 
 #define DEFAULT_BUFFER_TIME 0.1
 #define DEFAULT_ATTENUATION -10
+#define PREFETCH_TIME 2.0       // seconds decoded ahead, covers opening the next item
 
 static struct iio_context *ctx = NULL;
 static struct iio_channel *tx0_i = NULL;
@@ -24,77 +28,83 @@ static volatile bool stop = false;
 
 static long long center_freq = 96500000;
 static long long sample_rate = 2304000;
-static const char *input_filename = NULL;
+static const char *list_path = NULL;
+static double crossfade = 0;
+static struct playlist playlist;
 
 static double deviation_scale = 75000.0 / 32767.0;
-static double time_per_sample = 1.0;
-static double phase_accum = 0.0;
 
 static void handle_sig(int sig) {
+    (void)sig;
     stop = true;
 }
 
-static void wait_until(struct timespec *target) {
-    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, target, NULL);
+static void usage(const char *name) {
+    fprintf(stderr,
+            "Usage: %s -f freq -s samplerate {-i input ... | -l list | -D dir} [-x seconds]\n"
+            "  -i input   raw s16le or 16-bit PCM WAV at the sample rate, repeat for more\n"
+            "  -l list    file of one input per line, read again when it changes\n"
+            "  -D dir     play the files in dir in name order, following changes\n"
+            "  -x seconds crossfade between inputs, default 0 joins them end to start\n"
+            "The list loops, a single input included, with no gap in the carrier.\n",
+            name);
+    exit(1);
 }
 
-static void time_add_ns(struct timespec *t, long ns) {
-    t->tv_nsec += ns;
-    while (t->tv_nsec >= 1000000000L) {
-        t->tv_nsec -= 1000000000L;
-        t->tv_sec += 1;
+/* Print the item changes that just went on air */
+static void report_marks(void) {
+    struct playlist_mark mark;
+
+    while (playlist_next_mark(&playlist, &mark)) {
+        if (!mark.err)
+            fprintf(stderr, "Playing %s\n", mark.name);
+        else if (mark.err == -ERANGE)
+            fprintf(stderr, "Skipping %s: not at %lld Hz\n", mark.name, sample_rate);
+        else if (mark.err == -ENOTSUP || mark.err == -EINVAL)
+            fprintf(stderr, "Skipping %s: not raw or 16-bit PCM WAV\n", mark.name);
+        else
+            fprintf(stderr, "Skipping %s: %s\n", mark.name, strerror(-mark.err));
     }
 }
 
-static void modulate_sample(int16_t deviation, int16_t *i_sample, int16_t *q_sample) {
-    double dev_hz = deviation * deviation_scale;
-    double dphi = 2 * M_PI * dev_hz * time_per_sample;
-    phase_accum = fmod(phase_accum + dphi, 2 * M_PI);
-    *i_sample = (int16_t)(cos(phase_accum) * 0x7FFF);
-    *q_sample = (int16_t)(sin(phase_accum) * 0x7FFF);
-}
-
 int main(int argc, char **argv) {
-    int opt;
-    while ((opt = getopt(argc, argv, "f:s:i:")) != -1) {
+    const char **inputs = calloc(argc, sizeof(*inputs));
+    unsigned long underruns = 0;
+    int opt, ret, ninputs = 0, k;
+
+    if (!inputs) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        return 1;
+    }
+    while ((opt = getopt(argc, argv, "f:s:i:l:D:x:")) != -1) {
         switch (opt) {
             case 'f': center_freq = atoll(optarg); break;
             case 's': sample_rate = atoll(optarg); break;
-            case 'i': input_filename = optarg; break;
-            default:
-                fprintf(stderr, "Usage: %s -f freq -s samplerate -i input.raw\n", argv[0]);
-                return 1;
+            case 'i': inputs[ninputs++] = optarg; break;
+            case 'l': case 'D': list_path = optarg; break;
+            case 'x': crossfade = atof(optarg); break;
+            default: usage(argv[0]);
         }
     }
 
-    if (!input_filename) {
-        fprintf(stderr, "Input file is required.\n");
+    ret = playlist_init(&playlist, sample_rate, crossfade, PREFETCH_TIME);
+    for (k = 0; !ret && k < ninputs; k++)
+        ret = playlist_add(&playlist, inputs[k]);
+    free(inputs);
+    if (ret) {
+        fprintf(stderr, "Could not set up the playlist: %s\n", strerror(-ret));
         return 1;
     }
-
-    signal(SIGINT, handle_sig);
-
-    FILE *fp = fopen(input_filename, "rb");
-    if (!fp) {
-        perror("fopen");
+    if (list_path && (ret = playlist_watch(&playlist, list_path))) {
+        fprintf(stderr, "Could not watch %s: %s\n", list_path, strerror(-ret));
         return 1;
     }
-
-    fseek(fp, 0, SEEK_END);
-    long filesize = ftell(fp);
-    rewind(fp);
-
-    size_t total_samples = filesize / sizeof(int16_t);
-    int16_t *samples = malloc(filesize);
-    if (!samples) {
-        fprintf(stderr, "Failed to allocate memory\n");
+    if (!playlist.len && !list_path) {
+        fprintf(stderr, "Input file is required.\n");
         return 1;
     }
 
-    fread(samples, sizeof(int16_t), total_samples, fp);
-    fclose(fp);
-
-    time_per_sample = 1.0 / sample_rate;
+    signal(SIGINT, handle_sig);
 
     ctx = iio_create_default_context();
     if (!ctx) {
@@ -114,10 +124,14 @@ int main(int argc, char **argv) {
     tx0_i = iio_device_find_channel(tx, "voltage0", true);
     tx0_q = iio_device_find_channel(tx, "voltage1", true);
 
-    iio_channel_attr_write_longlong(lo_chan, "frequency", center_freq);
-    iio_channel_attr_write_longlong(lo_chan, "powerdown", 0);
-    iio_channel_attr_write_double(phy_chan, "hardwaregain", DEFAULT_ATTENUATION);
-    iio_channel_attr_write_longlong(phy_chan, "sampling_frequency", sample_rate);
+    if (!phy_chan || !lo_chan || !tx0_i || !tx0_q ||
+        iio_channel_attr_write_longlong(lo_chan, "frequency", center_freq) < 0 ||
+        iio_channel_attr_write_longlong(lo_chan, "powerdown", 0) < 0 ||
+        iio_channel_attr_write_double(phy_chan, "hardwaregain", DEFAULT_ATTENUATION) < 0 ||
+        iio_channel_attr_write_longlong(phy_chan, "sampling_frequency", sample_rate) < 0) {
+        fprintf(stderr, "Could not configure the TX path\n");
+        return 1;
+    }
 
     iio_channel_enable(tx0_i);
     iio_channel_enable(tx0_q);
@@ -129,37 +143,61 @@ int main(int argc, char **argv) {
         return 1;
     }
 
-    struct timespec t;
-    clock_gettime(CLOCK_MONOTONIC, &t);
 
-    size_t index = 0;
+    struct fm_mod mod;
+    int16_t *samples = malloc(buffer_size * sizeof(int16_t));
+    int16_t *iq = malloc(buffer_size * 2 * sizeof(int16_t));
+    if (!samples || !iq) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        return 1;
+    }
+    fm_mod_init(&mod, deviation_scale, 0, sample_rate);
+
+    // The prefetch thread fills its ring before the first buffer
+    ret = playlist_start(&playlist);
+    if (ret) {
+        fprintf(stderr, "Could not start the playlist: %s\n", strerror(-ret));
+        return 1;
+    }
+
+    // A push blocks while the kernel buffers are full, which paces the loop
+    bool failed = false;
     while (!stop) {
         ptrdiff_t p_inc = iio_buffer_step(txbuf);
         char *p_end = iio_buffer_end(txbuf);
         char *p = iio_buffer_first(txbuf, tx0_i);
+        size_t k;
+
+        // Items follow each other in the ring, so the phase carries on
+        playlist_read(&playlist, samples, buffer_size);
+        report_marks();
+        if (playlist.underruns != underruns) {
+            underruns = playlist.underruns;
+            fprintf(stderr, "Playlist underrun, %lu so far\n", underruns);
+        }
+        fm_mod_block(&mod, samples, iq, buffer_size);
 
-        for (; p < p_end; p += p_inc) {
-            int16_t i, q;
-            modulate_sample(samples[index++], &i, &q);
-            ((int16_t*)p)[0] = i;
-            ((int16_t*)p)[1] = q;
-            if (index >= total_samples) {
-                index = 0;
-                phase_accum = 0.0;
-            }
+        for (k = 0; p < p_end; p += p_inc, k++) {
+            ((int16_t*)p)[0] = iq[2 * k];
+            ((int16_t*)p)[1] = iq[2 * k + 1];
         }
 
-        iio_buffer_push(txbuf);
-        time_add_ns(&t, DEFAULT_BUFFER_TIME * 1e9);
-        wait_until(&t);
+        if (iio_buffer_push(txbuf) < 0) {
+            fprintf(stderr, "Error pushing buffer\n");
+            failed = true;
+            break;
+        }
     }
 
-    iio_channel_attr_write_longlong(lo_chan, "powerdown", 1);
+    if (iio_channel_attr_write_longlong(lo_chan, "powerdown", 1) < 0)
+        fprintf(stderr, "Could not power down the TX LO\n");
     iio_buffer_destroy(txbuf);
     iio_channel_disable(tx0_i);
     iio_channel_disable(tx0_q);
     iio_context_destroy(ctx);
+    playlist_free(&playlist);
     free(samples);
-    return 0;
+    free(iq);
+    return failed ? 1 : 0;
 }
 
@@ -1,5 +1,6 @@
 // tx-fm-zed.c : FM transmitter for ZedBoard + FMCOMMS2 (no Pluto dependency)
-// Build: gcc -o tx-fm-zed tx-fm-zed.c -liio -lm
+// Build: make tx-fm-zed, which links the -w filter, DMA error recovery and the
+// -Z zero-copy block stream from ../libsdr
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -9,26 +10,35 @@
 #include <unistd.h>
 #include <math.h>
 #include <signal.h>
+#include <errno.h>
+#include <time.h>
 #include <iio.h>
 
+#include "audio.h"
+#include "conv.h"
+#include "dma_tx.h"
+#include "recover.h"
+
 #define MAX_SAMPLE_VALUE 0x7FFF
-#define DEFAULT_BANDWIDTH 200000  // 200 kHz
+#define DEFAULT_BANDWIDTH 200000  // 200 kHz, also the analog filter's minimum
 #define DEFAULT_ATTENUATION -10   // -10 dB TX gain
 #define DEFAULT_BUFFER_TIME 0.04  // 40ms buffer
+#define FILTER_TRANSITION 0.2     // -w passes +-0.4 times the bandwidth
+#define FILTER_ATTEN_DB 60.0      // and is this far down at its edges
+#define FILTER_GAIN 0.9           // headroom, full-scale FM clips as the filter rings
+#define DMA_BLOCKS 4              // -Z blocks in flight
 
 static volatile bool stop = false;
 
 void signal_handler(int signum) {
+    (void)signum;
     stop = true;
 }
 
-int16_t get_next_sample(void) {
-    int16_t value;
-    if (read(STDIN_FILENO, &value, 2) != 2) {
-        stop = true;
-        return 0;
-    }
-    return value;
+double now_s(clockid_t clock) {
+    struct timespec t;
+    clock_gettime(clock, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
 }
 
 void modulate_sample(int16_t deviation, int16_t* i_sample, int16_t* q_sample,
@@ -40,19 +50,57 @@ void modulate_sample(int16_t deviation, int16_t* i_sample, int16_t* q_sample,
     *q_sample = (int16_t)(sin(*signal) * MAX_SAMPLE_VALUE);
 }
 
+void write_buffer(struct iio_buffer* txbuf, struct iio_channel* tx0_i,
+                  const int16_t* iq, size_t len) {
+    ptrdiff_t p_inc = iio_buffer_step(txbuf);
+    char* p_end = iio_buffer_end(txbuf);
+    char* p_dat;
+    size_t k = 0;
+
+    for (p_dat = iio_buffer_first(txbuf, tx0_i); p_dat < p_end && k < len; p_dat += p_inc, k++) {
+        ((int16_t*)p_dat)[0] = iq[2 * k];
+        ((int16_t*)p_dat)[1] = iq[2 * k + 1];
+    }
+}
+
+// After a DMA block error, map the blocks afresh; returns nonzero to give up
+int recover_dma(struct dma_tx* dma, struct recover* rec, int err) {
+    enum recover_action action = recover_error(rec, err);
+
+    while (!stop) {
+        fprintf(stderr, "DMA block error: %s, %s\n", strerror(-err), recover_action_name(action));
+        if (action == RECOVER_FATAL)
+            return err;
+        if (action == RECOVER_RETRY)
+            return 0;
+        err = dma_tx_rebuild(dma);
+        if (!err)
+            return 0;
+        action = recover_error(rec, err);
+    }
+    return err;
+}
+
 int main(int argc, char** argv) {
     long long center_freq = -1, sample_rate = -1;
+    long long bandwidth = DEFAULT_BANDWIDTH;
+    bool band_limit = false;
+    bool zero_copy = false;
     double deviation_hz = 10000;
 
     // Parse arguments
     int opt;
-    while ((opt = getopt(argc, argv, "f:s:d:")) != -1) {
+    while ((opt = getopt(argc, argv, "f:s:d:w:Z")) != -1) {
         switch (opt) {
             case 'f': center_freq = atoll(optarg); break;
             case 's': sample_rate = atoll(optarg); break;
             case 'd': deviation_hz = atof(optarg); break;
+            case 'w': bandwidth = atoll(optarg); band_limit = true; break;
+            case 'Z': zero_copy = true; break;
             default:
-                fprintf(stderr, "Usage: %s -f freq -s samplerate [-d deviation]\n", argv[0]);
+                fprintf(stderr, "Usage: %s -f freq -s samplerate [-d deviation] [-w bandwidth] [-Z]\n"
+                        "  -Z: modulate straight into mmapped DMA blocks instead of pushing libiio buffers\n",
+                        argv[0]);
                 return 1;
         }
     }
@@ -65,6 +113,24 @@ int main(int argc, char** argv) {
         fprintf(stderr, "Invalid sample rate. Must be between 1 MHz and 61.44 MHz.\n");
         return 1;
     }
+    if (bandwidth < 1000 || bandwidth > 56000000) {
+        fprintf(stderr, "Invalid bandwidth. Must be between 1 kHz and 56 MHz.\n");
+        return 1;
+    }
+
+    // -w filters the FM signal to the RF bandwidth, which the AD9361 alone barely does
+    struct conv band;
+    if (band_limit && bandwidth < sample_rate) {
+        double edge = bandwidth / 2.0 / sample_rate;
+        if (conv_lowpass(&band, (1 - FILTER_TRANSITION / 2) * edge,
+                         FILTER_TRANSITION * edge, FILTER_ATTEN_DB, FILTER_GAIN)) {
+            fprintf(stderr, "Could not set up the TX filter.\n");
+            return 1;
+        }
+        fprintf(stderr, "TX filter: %u taps, %s\n", band.taps, conv_method_name(band.method));
+    } else {
+        band_limit = false;
+    }
 
     struct iio_context* ctx = iio_create_default_context();
     if (!ctx) {
@@ -90,19 +156,38 @@ int main(int argc, char** argv) {
     }
 
     // Set frequency, gain, bandwidth
-    iio_channel_attr_write_longlong(lo_chan, "frequency", center_freq);
-    iio_channel_attr_write_longlong(lo_chan, "powerdown", 0);
-    iio_channel_attr_write_double(phy_chan, "hardwaregain", DEFAULT_ATTENUATION);
-    iio_channel_attr_write_longlong(phy_chan, "sampling_frequency", sample_rate);
-    iio_channel_attr_write_longlong(phy_chan, "rf_bandwidth", DEFAULT_BANDWIDTH);
-
-    iio_channel_enable(tx0_i);
-    iio_channel_enable(tx0_q);
+    if (iio_channel_attr_write_longlong(lo_chan, "frequency", center_freq) < 0 ||
+        iio_channel_attr_write_longlong(lo_chan, "powerdown", 0) < 0 ||
+        iio_channel_attr_write_double(phy_chan, "hardwaregain", DEFAULT_ATTENUATION) < 0 ||
+        iio_channel_attr_write_longlong(phy_chan, "sampling_frequency", sample_rate) < 0 ||
+        iio_channel_attr_write_longlong(phy_chan, "rf_bandwidth",
+                                        bandwidth < DEFAULT_BANDWIDTH ? DEFAULT_BANDWIDTH : bandwidth) < 0) {
+        fprintf(stderr, "Could not configure the TX path\n");
+        return 1;
+    }
 
     size_t buffer_len = (size_t)(DEFAULT_BUFFER_TIME * sample_rate);
-    struct iio_buffer* txbuf = iio_device_create_buffer(tx_dev, buffer_len, false);
-    if (!txbuf) {
-        fprintf(stderr, "Could not create TX buffer\n");
+    struct iio_buffer* txbuf = NULL;
+    struct dma_tx dma;
+    if (zero_copy) {
+        int err = dma_tx_open(&dma, "cf-ad9361-dds-core-lpc", buffer_len, DMA_BLOCKS);
+        if (err) {
+            fprintf(stderr, "Could not map the TX DMA blocks: %s\n", strerror(-err));
+            return 1;
+        }
+    } else {
+        iio_channel_enable(tx0_i);
+        iio_channel_enable(tx0_q);
+        txbuf = iio_device_create_buffer(tx_dev, buffer_len, false);
+        if (!txbuf) {
+            fprintf(stderr, "Could not create TX buffer\n");
+            return 1;
+        }
+    }
+    int16_t* input = malloc(buffer_len * sizeof(*input));
+    int16_t* iq = malloc(2 * buffer_len * sizeof(*iq));
+    if (!input || !iq) {
+        fprintf(stderr, "Could not allocate the I/Q block\n");
         return 1;
     }
 
@@ -110,37 +195,135 @@ int main(int argc, char** argv) {
     double time_per_sample = 1.0 / sample_rate;
     double signal_phase = 0.0;
 
+    struct recover rec;
+    recover_init(&rec);
+
+    // What handing a buffer to the DMA costs: the copy and push, or the
+    // block dequeue and enqueue, including any wait for the DMA
+    double handoff_cpu = 0, handoff_wall = 0, cpu0, wall0;
+    unsigned long buffers = 0;
+    bool failed = false;
+
     signal(SIGINT, signal_handler);
     fprintf(stderr, "Starting transmission at %.1f MHz\n", center_freq / 1e6);
+    double cpu_start = now_s(CLOCK_PROCESS_CPUTIME_ID);
 
     while (!stop) {
-        ptrdiff_t p_inc = iio_buffer_step(txbuf);
-        char* p_end = iio_buffer_end(txbuf);
-        char* p_dat;
-
-        for (p_dat = iio_buffer_first(txbuf, tx0_i); p_dat < p_end; p_dat += p_inc) {
-            int16_t sample = get_next_sample();
-            int16_t i, q;
-            modulate_sample(sample, &i, &q, &signal_phase, deviation_scale, time_per_sample);
-            ((int16_t*)p_dat)[0] = i;
-            ((int16_t*)p_dat)[1] = q;
+        int16_t* out = iq;
+        bool sent = true;
+        size_t k;
+        int ret;
+
+        // -Z: the samples go straight into the DMA block, only a filtered
+        // signal is built in iq first since the filter reads what it wrote
+        if (zero_copy) {
+            cpu0 = now_s(CLOCK_THREAD_CPUTIME_ID);
+            wall0 = now_s(CLOCK_MONOTONIC);
+            while ((ret = dma_tx_get(&dma, &out)) && !recover_dma(&dma, &rec, ret))
+                ;
+            handoff_cpu += now_s(CLOCK_THREAD_CPUTIME_ID) - cpu0;
+            handoff_wall += now_s(CLOCK_MONOTONIC) - wall0;
+            if (ret) {
+                failed = !stop;
+                break;
+            }
         }
 
-        ssize_t nbytes = iio_buffer_push(txbuf);
-        if (nbytes < 0) {
-            fprintf(stderr, "Error pushing buffer\n");
-            break;
+        // A buffer of deviation samples from stdin, padded with silence at the end
+        if (audio_read_fd(STDIN_FILENO, input, buffer_len) < buffer_len)
+            stop = true;
+        int16_t* mod_out = band_limit ? iq : out;
+        for (k = 0; k < buffer_len; k++) {
+            modulate_sample(input[k], &mod_out[2 * k], &mod_out[2 * k + 1], &signal_phase,
+                            deviation_scale, time_per_sample);
         }
+        if (band_limit) {
+            conv_block_s16(&band, iq, out, buffer_len);
+        }
+
+        cpu0 = now_s(CLOCK_THREAD_CPUTIME_ID);
+        wall0 = now_s(CLOCK_MONOTONIC);
+        if (zero_copy) {
+            // A rebuild drops the block, there is none being filled after it
+            while ((ret = dma_tx_put(&dma, buffer_len)) && dma.filling >= 0 &&
+                   !recover_dma(&dma, &rec, ret))
+                ;
+            if (ret && dma.filling >= 0) {
+                failed = !stop;
+                break;
+            }
+            sent = !ret;
+        } else {
+            write_buffer(txbuf, tx0_i, iq, buffer_len);
+            ssize_t nbytes = iio_buffer_push(txbuf);
+
+            // After a DMA error, recreate just the buffer; the PHY stays set up
+            while (nbytes < 0 && !stop) {
+                enum recover_action action = recover_error(&rec, nbytes);
+
+                fprintf(stderr, "Error pushing buffer: %s, %s\n", strerror(-nbytes),
+                        recover_action_name(action));
+                if (action == RECOVER_FATAL)
+                    break;
+                // A failed rebuild left no buffer to push, so build it again
+                if (action == RECOVER_REBUILD || !txbuf) {
+                    if (txbuf)
+                        iio_buffer_destroy(txbuf);
+                    txbuf = iio_device_create_buffer(tx_dev, buffer_len, false);
+                    if (!txbuf) {
+                        nbytes = -errno;
+                        continue;
+                    }
+                    write_buffer(txbuf, tx0_i, iq, buffer_len);
+                }
+                nbytes = iio_buffer_push(txbuf);
+            }
+            if (nbytes < 0) {
+                failed = !stop;
+                break;
+            }
+        }
+        handoff_cpu += now_s(CLOCK_THREAD_CPUTIME_ID) - cpu0;
+        handoff_wall += now_s(CLOCK_MONOTONIC) - wall0;
+        // Only an enqueued block is back on air, not the one a rebuild dropped
+        if (!sent)
+            continue;
+        buffers++;
+        if (recover_ok(&rec))
+            fprintf(stderr, "Back on air after %.1f ms\n", rec.last_ns / 1e6);
     }
 
     fprintf(stderr, "Stopping transmission\n");
+    if (zero_copy)
+        dma_tx_close(&dma);
+    if (buffers) {
+        double cpu = now_s(CLOCK_PROCESS_CPUTIME_ID) - cpu_start;
+        double msamples = buffers * buffer_len / 1e6;
+        fprintf(stderr, "%s: %.1f ms CPU per MS, %.1f%% of a core at %.3f MS/s\n",
+                zero_copy ? "DMA blocks" : "libiio push", cpu * 1e3 / msamples,
+                cpu / msamples * sample_rate / 1e4, sample_rate / 1e6);
+        fprintf(stderr, "Hand-off per buffer: %.1f us CPU, %.2f ms with the wait for the DMA\n",
+                handoff_cpu / buffers * 1e6, handoff_wall / buffers * 1e3);
+    }
+    if (rec.retries || rec.rebuilds)
+        fprintf(stderr, "%lu DMA errors recovered (%lu retries, %lu buffer rebuilds), worst %.1f ms off air\n",
+                rec.outages, rec.retries, rec.rebuilds, rec.worst_ns / 1e6);
 
-    iio_channel_attr_write_longlong(lo_chan, "powerdown", 1); // 👈 เพิ่มบรรทัดนี้
+    if (iio_channel_attr_write_longlong(lo_chan, "powerdown", 1) < 0) // 👈 เพิ่มบรรทัดนี้
+        fprintf(stderr, "Could not power down the TX LO\n");
 
-    iio_buffer_destroy(txbuf);
-    iio_channel_disable(tx0_i);
-    iio_channel_disable(tx0_q);
+    if (txbuf)
+        iio_buffer_destroy(txbuf);
+    free(iq);
+    free(input);
+    if (band_limit) {
+        conv_free(&band);
+    }
+    if (!zero_copy) {
+        iio_channel_disable(tx0_i);
+        iio_channel_disable(tx0_q);
+    }
     iio_context_destroy(ctx);
-    return 0;
+    return failed ? 1 : 0;
 }
 
@@ -1,5 +1,7 @@
+#include <errno.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <signal.h>
 #include <stdio.h>
@@ -8,9 +10,24 @@
 #include <math.h>
 #include "getopt.h"
 
+#include "ad9361_fir.h"
+#include "audio.h"
+#include "conv.h"
+#include "ctl.h"
+#include "dsp.h"
+#include "metrics.h"
+#include "mod.h"
+#include "recover.h"
+#include "trace.h"
+
 #define	MAX_CONTEXT_URL_LEN 80
 #define MAX_SAMPLE_VALUE	0x7FFF
 
+/* -w TX filter: passband to +-0.4 times the bandwidth, stop band from its edge, this far down */
+#define TX_FILTER_TRANSITION	0.2
+#define TX_FILTER_ATTEN_DB		60.0
+#define TX_FILTER_GAIN			0.9		// headroom so full-scale FM does not clip as the filter rings
+
 size_t buffer_size = 0;				// computed from sample_rate if not specified
 long long sample_rate = -1;			// command line must specify this
 long long center_frequency = -1;	// command line must specify this
@@ -21,6 +38,17 @@ char iio_context_url[MAX_CONTEXT_URL_LEN+1] = "local:";	// default value often w
 bool status_display = 1;			// default to chatty status display (change with -q)
 bool offset_lo = 0;					// default to signal centered on the LO frequency
 long long offset_lo_offset = 0;		// frequency offset used with -E flag
+const char *control_path = NULL;	// control socket (-C), none by default
+double squelch_level = -INFINITY;	// blank the carrier below this input level (dBFS)
+const char *hop_path = NULL;		// hop table (-H), no hopping by default
+double hop_settle_us = 100;			// IQ blanked at the start of each hop (-B)
+const char *trace_path = NULL;		// event trace dump prefix (-T), no tracing by default
+const char *metrics_path = NULL;	// Prometheus textfile (-M), none by default
+int metrics_port = 0;				// Prometheus HTTP port on localhost (-P), none by default
+const char *dsp_name = NULL;		// DSP kernel instruction set (-K), the best the CPU has by default
+const char *mode_name = "fm";		// modulation (-m), FM by default
+long long rf_bandwidth = 200000;	// TX bandwidth, the analog filter's no less than 200 kHz (-w)
+bool band_limit = 0;				// default to no digital TX filter (enable with -w)
 
 double time_per_sample;				// reciprocal of sample_rate
 double deviation_scale_factor;		// multiply this by incoming sample to get deviation in Hz
@@ -63,8 +91,27 @@ static struct iio_buffer  *txbuf = NULL;
 
 static bool stop;
 
-/* cleanup and exit */
-static void shutdown(void)
+/* live control socket, see control_poll() */
+static struct ctl ctl = { .fd = -1 };
+
+/* input to IQ in the -m mode, retuned by the control socket */
+static struct mod mod;
+
+/* Band-limits the modulator output to rf_bandwidth with -w */
+static struct conv band;
+static int64_t band_ns;				// time spent in the filter
+static unsigned long long band_samples;	// and the samples it filtered
+
+/* DMA error recovery, see push_tx() */
+static struct recover rec;
+
+/* exported with -M or -P, see setup_metrics() */
+static struct metric *m_samples, *m_buffers, *m_underflows, *m_squelched;
+static struct metric *m_queue, *m_push, *m_read, *m_modulate, *m_filter;
+static struct metric *m_recoveries, *m_recovery;
+
+/* cleanup and exit with status */
+static void shutdown(int status)
 {	
 	if (status_display) printf("* Destroying buffers\n");
 //	if (rxbuf) { iio_buffer_destroy(rxbuf); }
@@ -78,7 +125,12 @@ static void shutdown(void)
 
 	if (status_display) printf("* Destroying context\n");
 	if (ctx) { iio_context_destroy(ctx); }
-	exit(0);
+	ctl_close(&ctl);
+	conv_free(&band);
+	mod_free(&mod);
+	trace_close();
+	metrics_stop();
+	exit(status);
 }
 
 static void handle_sig(int sig)
@@ -87,14 +139,20 @@ static void handle_sig(int sig)
 	stop = true;
 }
 
+static void handle_dump(int sig)
+{
+	(void)sig;
+	trace_request_dump();
+}
+
 /* check return value of iio_attr_write function (for whole device) */
 static void errchk_dev(int v) {
-	if (v < 0) { fprintf(stderr, "Error %d writing to IIO device\n", v); shutdown(); }
+	if (v < 0) { fprintf(stderr, "Error %d writing to IIO device\n", v); shutdown(1); }
 }
 
 /* check return value of iio_channel_attr_write function */
 static void errchk_chn(int v, const char* what) {
-	 if (v < 0) { fprintf(stderr, "Error %d writing to channel \"%s\"\nvalue may not be supported.\n", v, what); shutdown(); }
+	 if (v < 0) { fprintf(stderr, "Error %d writing to channel \"%s\"\nvalue may not be supported.\n", v, what); shutdown(1); }
 }
 
 /* write attribute: long long int */
@@ -165,8 +223,8 @@ static bool get_int8_chan(struct iio_channel **chn)
 	return *chn != NULL;
 }
 
-/* enables or disables Pluto's FPGA 8x interpolator for tx */
-static bool set_pluto_8x_interpolator(bool enable)
+/* reads the rates of Pluto's FPGA 8x interpolator, if the FPGA has one */
+static bool get_pluto_8x_interpolator(struct iio_channel **chn, long long *sf1, long long *sf2)
 {
 	// The tx interpolator is set by channel-specific attributes
 	// 		of the channel named voltage0
@@ -176,40 +234,47 @@ static bool set_pluto_8x_interpolator(bool enable)
 	// which should differ by a factor of 8 (within a few counts).
 	// The higher value is the sample clock rate when interpolation is not used;
 	// the lower value is the effective sample clock rate when interpolation is used.
-	// Set the attribute sampling_frequency to the value corresponding to the range of
-	// sample rates you want to use.
-
-	struct iio_channel *tx_int8_chn;
-	long long sf1, sf2;
-
-	if (status_display) printf("* %s 8x transmit interpolation\n", enable ? "Enabling" : "Disabling");
+	// HDL without the interpolator (like the FMCOMMS2 reference design) has no
+	// sampling_frequency_available attribute.
 
 	// obtain the transmit interpolator's config channel,
 	// namely device cf-ad9361-dds-core-lpc, channel voltage0
-	if (!get_int8_chan(&tx_int8_chn)) { return false; }
-	
+	if (!get_int8_chan(chn)) { return false; }
+
 	// read the attribute sampling_frequency_available,
 	// which should be a list of two, like '30720000 3840000 '
-	if(iio_channel_attr_read(	tx_int8_chn,
-								"sampling_frequency_available",
-								tmpstr, sizeof(tmpstr)
-							) <= 0) {
-		fprintf(stderr, "No sampling_frequency_available attribute\n");
+	if (iio_channel_attr_read(*chn, "sampling_frequency_available", tmpstr, sizeof(tmpstr)) <= 0) {
 		return false;
-		}
+	}
 
 	// parse the returned pair of numbers
-	if (2 != sscanf(tmpstr, "%lld %lld ", &sf1, &sf2)) {
+	if (2 != sscanf(tmpstr, "%lld %lld ", sf1, sf2)) {
 		fprintf(stderr, "sampling_frequency_available format unexpected\n");
 		return false;
 	}
 
 	// validate that they're in approximate 8x ratio
-	if (llabs(8 * sf2 - sf1) > 20) {
+	if (llabs(8 * *sf2 - *sf1) > 20) {
 		fprintf(stderr, "sampling_frequency_available values not in ~8x ratio\n");
 		return false;
 	}
 
+	return true;
+}
+
+/* enables or disables Pluto's FPGA 8x interpolator for tx */
+static bool set_pluto_8x_interpolator(bool enable)
+{
+	// Set the attribute sampling_frequency to the value corresponding to the range of
+	// sample rates you want to use.
+
+	struct iio_channel *tx_int8_chn;
+	long long sf1, sf2;
+
+	if (status_display) printf("* %s 8x transmit interpolation\n", enable ? "Enabling" : "Disabling");
+
+	if (!get_pluto_8x_interpolator(&tx_int8_chn, &sf1, &sf2)) { return false; }
+
 	// Now we can enable or disable interpolation
 	if (enable) {
 		// write the lower of the two values into attribute sampling_frequency
@@ -226,30 +291,83 @@ static bool set_pluto_8x_interpolator(bool enable)
 	return true;
 }
 
-/* sets TX sample rate, always using Pluto's FPGA 8x interpolator */
-static bool set_tx_sample_rate(struct iio_channel *phy_chn, long long sample_rate)
+/* loads a FIR profile for the rate plan and enables it, or disables the FIR
+ *
+ * The enable is the attribute in_out_voltage_filter_fir_en, which libiio
+ * presents as voltage_filter_fir_en of the input channel named "out".
+ */
+static bool cfg_ad9361_fir(const struct ad9361_rate_plan *plan, long long bw_hz)
 {
-	long long ad9361_sample_rate;
-/*Weetit
-	if (sample_rate < 260417) {
-		fprintf(stderr, "Pluto can't sample slower than 260417 Hz\n");
-		shutdown();
-	} else if (sample_rate >= 2083333) {
-		fprintf(stderr, "Pluto can't sample faster than 2.083333 MHz with the 8x interpolator enabled.\n");
-		shutdown();
+	static char config[AD9361_FIR_CONFIG_MAX];
+	struct iio_channel *chn;
+	struct ad9361_fir fir;
+
+	chn = iio_device_find_channel(get_ad9361_phy(), "out", false);
+	if (!chn) { return false; }
+
+	if (!plan->fir_ratio) {
+		return iio_channel_attr_write_bool(chn, "voltage_filter_fir_en", false) >= 0;
 	}
 
-	if (!set_pluto_8x_interpolator(1)) {
+	if (ad9361_fir_design(&fir, plan->baseband, bw_hz, plan->fir_ratio) ||
+	    ad9361_fir_config(&fir, config, sizeof(config)) < 0) {
+		return false;
+	}
+
+	if (status_display) printf("* Loading %u-tap FIR profile, %ux interpolation\n", fir.taps, fir.ratio);
+	errchk_dev(iio_device_attr_write(get_ad9361_phy(), "filter_fir_config", config));
+	errchk_chn(iio_channel_attr_write_bool(chn, "voltage_filter_fir_en", true), "voltage_filter_fir_en");
+	return true;
+}
+
+/* sets TX sample rate, using the AD9361 FIR and Pluto's FPGA 8x interpolator as needed
+ *
+ * Rates down to 2.083 MHz need neither. Below that the AD9361's FIR has to
+ * interpolate by 4, which reaches 520.834 kHz, and below that the FPGA
+ * interpolator has to take another factor of 8, down to 65.105 kHz.
+ */
+static bool set_tx_sample_rate(struct iio_channel *phy_chn, long long sample_rate, long long bw_hz)
+{
+	struct ad9361_rate_plan plan;
+	struct iio_channel *tx_int8_chn;
+	long long sf1, sf2;
+	bool have_int8;
+	bool fir_off = false;
+
+	have_int8 = get_pluto_8x_interpolator(&tx_int8_chn, &sf1, &sf2);
+	if (ad9361_rate_plan(&plan, sample_rate, have_int8 ? 8 : 1)) {
+		fprintf(stderr, "Sample rate %lld is out of range (%lld to %lld Hz%s)\n",
+			sample_rate, have_int8 ? (AD9361_MIN_RATE_FIR + 7) / 8 : AD9361_MIN_RATE_FIR,
+			AD9361_MAX_RATE, have_int8 ? "" : ", no FPGA interpolator");
+		shutdown(1);
+	}
+
+	if (have_int8 && !set_pluto_8x_interpolator(plan.fpga_ratio > 1)) {
 		fprintf(stderr, "Failed to set Pluto 8x interpolator\n");
-		shutdown();
+		shutdown(1);
+	}
+
+	// The FIR must be loaded and enabled before a rate that needs it is set.
+	// Disabling it can fail while the current rate still needs it, so then
+	// it is disabled again once the new rate is set.
+	if (plan.fir_ratio) {
+		if (!cfg_ad9361_fir(&plan, bw_hz)) {
+			fprintf(stderr, "Failed to load the AD9361 FIR profile\n");
+			shutdown(1);
+		}
+	} else {
+		fir_off = cfg_ad9361_fir(&plan, bw_hz);
 	}
 
 	// Now we can set the sample rate at the AD9361, which is actually
 	// the sample rate after interpolation.
-	ad9361_sample_rate = sample_rate * 8;
-	if (status_display) printf("* Setting AD9361 sample rate to %lld Hz\n", ad9361_sample_rate);
-*/
-	wr_ch_lli(phy_chn, "sampling_frequency", ad9361_sample_rate);
+	if (status_display) printf("* Setting AD9361 sample rate to %lld Hz\n", plan.baseband);
+	wr_ch_lli(phy_chn, "sampling_frequency", plan.baseband);
+
+	if (!plan.fir_ratio && !fir_off && !cfg_ad9361_fir(&plan, bw_hz)) {
+		fprintf(stderr, "Failed to disable the AD9361 FIR\n");
+		shutdown(1);
+	}
 
 	return true;
 }
@@ -268,7 +386,7 @@ bool cfg_ad9361_streaming_tx_ch(struct stream_cfg *cfg, int chid)
 	wr_ch_str(chn, "rf_port_select", cfg->rfport);
 	wr_ch_lli(chn, "rf_bandwidth", cfg->bw_hz);
 	wr_ch_lli(chn, "hardwaregain", cfg->tx_gain);
-	if (!set_tx_sample_rate(chn, cfg->fs_hz)) {
+	if (!set_tx_sample_rate(chn, cfg->fs_hz, cfg->bw_hz)) {
 		return false;
 		}
 
@@ -305,34 +423,407 @@ static void cfg_ad9361_manual_tx_quad(void)
 }
 
 
-/* Obtain a sample from stdin */
-int16_t get_next_sample(void)
+/* Frequency hopping (-H)
+ *
+ * The distinct frequencies of the hop table, up to FASTLOCK_PROFILES of
+ * them, are tuned once at startup and stored as TX LO fastlock profiles.
+ * A hop then only recalls a profile, which skips the VCO calibration a
+ * frequency write goes through.
+ *
+ * Hops happen at buffer boundaries. The first hop_settle_us of IQ of the
+ * buffer that starts a hop are blanked at the DAC, and the recall is issued
+ * once that buffer reaches the DAC, KERNEL_BUFFERS - 1 pushes later. With
+ * the TX filter (-w) the blank is moved ahead of the filter, see
+ * hop_blank().
+ */
+#define KERNEL_BUFFERS	4	/* libiio default */
+#define FASTLOCK_PROFILES	8
+#define MAX_HOPS	64
+
+struct hop {
+	long long lo_hz;		// RF frequency
+	unsigned int buffers;	// dwell time in buffers
+	unsigned int profile;	// fastlock profile holding lo_hz
+};
+
+struct timing {
+	unsigned long n;
+	double sum, min, max;	// seconds
+};
+
+static struct hop hops[MAX_HOPS];
+static unsigned int nhops;
+static unsigned long long hop_period;	// buffers in one pass of the table
+static long long profile_hz[FASTLOCK_PROFILES];
+static unsigned int nprofiles;
+
+static struct timing tune_timing;	// frequency writes, at startup
+static struct timing recall_timing;	// fastlock recalls, per hop
+static unsigned long late_hops;		// recalls slower than the blanking
+
+static double now_s(void)
 {
-	int16_t value;
+	return ctl_now_ns() / 1e9;
+}
 
-	if (read(STDIN_FILENO, (void *)&value, 2) != 2) {	// detect EOF or error (dumbly)
-		stop = true;
-		return 0;
+static void timing_add(struct timing *t, double s)
+{
+	if (!t->n || s < t->min) { t->min = s; }
+	if (!t->n || s > t->max) { t->max = s; }
+	t->sum += s;
+	t->n++;
+}
+
+static void timing_print(const char *what, const struct timing *t)
+{
+	if (!t->n) { return; }
+	printf("* %-22s %5lu, min %7.3f ms, mean %7.3f ms, max %7.3f ms\n", what, t->n,
+		t->min * 1e3, t->sum / t->n * 1e3, t->max * 1e3);
+}
+
+/* reads "frequency buffers" lines, # starts a comment */
+static bool load_hop_table(const char *path)
+{
+	FILE *f = fopen(path, "r");
+	char line[128];
+	unsigned int k, lineno = 0;
+
+	if (!f) {
+		perror(path);
+		return false;
 	}
 
-	return value;
+	while (fgets(line, sizeof(line), f)) {
+		struct hop *h = &hops[nhops];
+		double freq;
+		int n;
+
+		lineno++;
+		line[strcspn(line, "#")] = '\0';
+		n = sscanf(line, "%lf %u", &freq, &h->buffers);
+		if (n <= 0) { continue; }
+		if (n == 1) { h->buffers = 1; }
+
+		if (nhops == MAX_HOPS) {
+			fprintf(stderr, "%s:%u: more than %d hops\n", path, lineno, MAX_HOPS);
+			goto err;
+		}
+		if (freq < 70e6 || freq >= 6e9 || !h->buffers) {
+			fprintf(stderr, "%s:%u: bad hop\n", path, lineno);
+			goto err;
+		}
+		h->lo_hz = (long long)freq;
+
+		for (k = 0; k < nprofiles && profile_hz[k] != h->lo_hz; k++)
+			;
+		if (k == nprofiles) {
+			if (nprofiles == FASTLOCK_PROFILES) {
+				fprintf(stderr, "%s:%u: more than %d hop frequencies\n", path, lineno, FASTLOCK_PROFILES);
+				goto err;
+			}
+			profile_hz[nprofiles++] = h->lo_hz;
+		}
+		h->profile = k;
+		hop_period += h->buffers;
+		nhops++;
+	}
+	fclose(f);
+
+	if (!nhops) {
+		fprintf(stderr, "%s: no hops\n", path);
+		return false;
+	}
+	return true;
+
+err:
+	fclose(f);
+	return false;
+}
+
+/* index of the hop that starts with buffer number buf, or -1 */
+static int hop_starting(unsigned long long buf)
+{
+	unsigned long long pos;
+	unsigned int k;
+
+	if (!nhops || !buf) { return -1; }
+	pos = buf % hop_period;
+	for (k = 0; k < nhops; k++) {
+		if (!pos) { return nhops > 1 ? (int)k : -1; }
+		if (pos < hops[k].buffers) { return -1; }
+		pos -= hops[k].buffers;
+	}
+	return -1;
+}
+
+/* part [from, to) of the modulator input of buffer buf to blank for hops
+ *
+ * Out of the filter, sample m depends on the inputs from m - delay - (taps
+ * - 1) to m - delay. For the first hop_settle_us of a hop to be silent the
+ * blank therefore starts delay + taps - 1 samples before the hop, reaching
+ * back into the buffers before it, and ends delay samples early. The
+ * carrier ramps down before the hop and up after the blank. Returns false
+ * when there is nothing to blank.
+ */
+static bool hop_blank(unsigned long long buf, size_t *from, size_t *to)
+{
+	long long settle = (long long)(hop_settle_us * 1e-6 * sample_rate);
+	long long delay = band_limit ? (long long)band.delay : 0;
+	long long lead = band_limit ? delay + band.taps - 1 : 0;
+	unsigned long long j;
+	bool any = false;
+
+	for (j = buf; j <= buf + (lead + buffer_size - 1) / buffer_size; j++) {
+		long long start = (long long)(j - buf) * buffer_size;
+		long long b = start - lead, e = start + settle - delay;
+
+		if (hop_starting(j) < 0) { continue; }
+		if (b < 0) { b = 0; }
+		if (e > (long long)buffer_size) { e = buffer_size; }
+		if (b >= e) { continue; }
+		if (!any || (size_t)b < *from) { *from = b; }
+		if (!any || (size_t)e > *to) { *to = e; }
+		any = true;
+	}
+	return any;
 }
 
+/* tunes to each hop frequency once and stores it as a fastlock profile */
+static bool cfg_ad9361_fastlock_profiles(void)
+{
+	struct iio_channel *chn = NULL;
+	unsigned int k;
+
+	if (!get_tx_lo_chan(&chn)) { return false; }
+
+	for (k = 0; k < nprofiles; k++) {
+		double t = now_s();
+
+		if (status_display) printf("* Storing fastlock profile %u: %lld Hz\n", k, profile_hz[k]);
+		wr_ch_lli(chn, "frequency", profile_hz[k] - offset_lo_offset);
+		timing_add(&tune_timing, now_s() - t);
+		wr_ch_lli(chn, "fastlock_store", k);
+	}
+	wr_ch_lli(chn, "fastlock_recall", hops[0].profile);
+	return true;
+}
 
-/* Convert a sample of FM deviation into an I/Q sample in an FM signal */
-void modulate_sample(int16_t deviation, int16_t * const i_sample, int16_t * const q_sample)
+/* switches the TX LO to a stored profile, timing the switch */
+static void hop_recall(unsigned int profile)
 {
-    static double signal = 0.0;	//start the signal at 0, keep its instantaneous value here.
+	static struct iio_channel *chn;
+	double t;
+
+	if (!chn && !get_tx_lo_chan(&chn)) { return; }
 
-	double deviation_in_hertz = deviation * deviation_scale_factor + offset_lo_offset;
-	double phase_increment_this_sample = 2 * M_PI * deviation_in_hertz * time_per_sample;
+	t = now_s();
+	errchk_chn(iio_channel_attr_write_longlong(chn, "fastlock_recall", profile), "fastlock_recall");
+	t = now_s() - t;
 
-    signal = fmod(signal + phase_increment_this_sample, 2 * M_PI);
-    *i_sample = (int16_t)(cos(signal) * MAX_SAMPLE_VALUE);  // scale to 16-bit integer (12 MSbits used)
-    *q_sample = (int16_t)(sin(signal) * MAX_SAMPLE_VALUE);
+	timing_add(&recall_timing, t);
+	if (t * 1e6 > hop_settle_us) { late_hops++; }
+	center_frequency = profile_hz[profile];
+}
+
+static void hop_report(void)
+{
+	if (!nhops || !status_display) { return; }
+	timing_print("LO frequency writes:", &tune_timing);
+	timing_print("Fastlock hops:", &recall_timing);
+	if (late_hops)
+		printf("* %lu hops took longer than the %.0f us blanking\n", late_hops, hop_settle_us);
 }
 
 
+/* Live control (-C)
+ *
+ * Commands are applied between buffers. The LO and attenuation are
+ * attribute writes that take effect at RF once they return; deviation,
+ * offset and squelch take effect with the next buffer filled, which
+ * reaches RF behind the buffers already queued in the kernel, so those
+ * replies wait until that buffer has been pushed.
+ */
+#define MAX_PENDING	16
+
+static struct ctl_cmd pending[MAX_PENDING];
+static unsigned int npending;
+
+static double control_value(enum ctl_param param)
+{
+	switch (param) {
+	case CTL_LO:		return center_frequency;
+	case CTL_GAIN:		return -transmit_attenuation;
+	case CTL_DEV:		return max_deviation;
+	case CTL_OFFSET:	return offset_lo_offset;
+	case CTL_SQUELCH:	return squelch_level;
+	default:		return 0;
+	}
+}
+
+/* replies to the commands that went out with the buffer just pushed */
+static void control_pushed(void)
+{
+	double queued = (KERNEL_BUFFERS - 1) * buffer_size * time_per_sample;
+	int64_t now = ctl_now_ns();
+	unsigned int k;
+
+	for (k = 0; k < npending; k++)
+		ctl_reply(&ctl, &pending[k], 0, pending[k].value,
+			  (now - pending[k].recv_ns) / 1e9 + queued);
+	npending = 0;
+}
+
+static int control_apply(struct ctl_cmd *cmd)
+{
+	struct iio_channel *chn = NULL;
+	double v = cmd->value;
+
+	switch (cmd->param) {
+	case CTL_LO:
+		if (nhops) { return -EBUSY; }	// the hop table owns the LO
+		if (v < 70e6 || v >= 6e9) { return -ERANGE; }
+		if (!get_tx_lo_chan(&chn)) { return -ENODEV; }
+		if (iio_channel_attr_write_longlong(chn, "frequency", (long long)v - offset_lo_offset) < 0) { return -EIO; }
+		center_frequency = (long long)v;
+		return 0;
+
+	case CTL_GAIN:
+		if (v > 0 || v < -89) { return -ERANGE; }
+		if (!get_tx_phy_chan(0, &chn)) { return -ENODEV; }
+		if (iio_channel_attr_write_longlong(chn, "hardwaregain", (long long)v) < 0) { return -EIO; }
+		transmit_attenuation = (int)-v;
+		return 0;
+
+	case CTL_DEV:
+		if (v < 100 || v > 100000) { return -ERANGE; }
+		max_deviation = (long)v;
+		deviation_scale_factor = (double)max_deviation / MAX_SAMPLE_VALUE;
+		mod_set(&mod, deviation_scale_factor, offset_lo_offset, sample_rate);
+		return 1;
+
+	case CTL_OFFSET:
+		if (fabs(v) > sample_rate / 2) { return -ERANGE; }
+		offset_lo_offset = (long long)v;
+		mod_set(&mod, deviation_scale_factor, offset_lo_offset, sample_rate);
+		return 1;
+
+	case CTL_SQUELCH:
+		if (v > 0) { return -ERANGE; }
+		squelch_level = v;
+		return 1;
+
+	default:
+		return -EINVAL;
+	}
+}
+
+/* applies all pending control commands at a buffer boundary */
+static void control_poll(void)
+{
+	struct ctl_cmd cmd;
+	int ret;
+
+	while (ctl_poll(&ctl, &cmd)) {
+		if (cmd.param == CTL_GET) {
+			for (cmd.param = 0; cmd.param < CTL_GET; cmd.param++)
+				ctl_reply(&ctl, &cmd, 0, control_value(cmd.param), 0);
+			continue;
+		}
+		if (!cmd.has_value) {
+			ctl_reply(&ctl, &cmd, 0, control_value(cmd.param), 0);
+			continue;
+		}
+
+		ret = control_apply(&cmd);
+		cmd.value = control_value(cmd.param);
+		if (ret == 1 && npending < MAX_PENDING) {
+			pending[npending++] = cmd;
+		} else {
+			ctl_reply(&ctl, &cmd, ret < 0 ? ret : 0, cmd.value,
+				  (ctl_now_ns() - cmd.recv_ns) / 1e9);
+		}
+	}
+}
+
+
+static void setup_metrics(void)
+{
+	static const char stage[] = "Time spent in a stage of the TX loop per buffer";
+	int err;
+
+	m_samples = metrics_counter("sdr_tx_samples_total", NULL, "IQ samples pushed to the DAC");
+	m_buffers = metrics_counter("sdr_tx_buffers_total", NULL, "Buffers pushed to the DAC");
+	m_underflows = metrics_counter("sdr_tx_underflows_total", NULL,
+		"Buffers ready after the kernel queue had drained, leaving the DAC idle");
+	m_squelched = metrics_counter("sdr_tx_squelched_buffers_total", NULL, "Buffers blanked by the squelch");
+	m_recoveries = metrics_counter("sdr_tx_recoveries_total", NULL,
+		"Failed pushes retried, or followed by a rebuild of the TX buffer");
+	m_recovery = metrics_histogram("sdr_tx_recovery_seconds", NULL,
+		"Time from a push failing to a push going through again", NULL, 0);
+	m_queue = metrics_gauge("sdr_tx_queue_seconds", NULL,
+		"Signal left in the kernel queue when the last buffer was pushed");
+	m_push = metrics_histogram("sdr_tx_stage_seconds", "stage=\"push\"", stage, NULL, 0);
+	m_read = metrics_histogram("sdr_tx_stage_seconds", "stage=\"read\"", stage, NULL, 0);
+	m_modulate = metrics_histogram("sdr_tx_stage_seconds", "stage=\"modulate\"", stage, NULL, 0);
+	m_filter = metrics_histogram("sdr_tx_stage_seconds", "stage=\"filter\"", stage, NULL, 0);
+
+	err = metrics_start(metrics_path, metrics_port);
+	if (err) {
+		fprintf(stderr, "Could not export metrics: %s\n", strerror(-err));
+		shutdown(1);
+	}
+	if (status_display && metrics_path) printf("* Writing metrics to %s\n", metrics_path);
+	if (status_display && metrics_port) printf("* Serving metrics on http://127.0.0.1:%d/metrics\n", metrics_port);
+}
+/* Copy a buffer of IQ samples into the TX buffer */
+static void write_tx(const int16_t *iq)
+{
+	ptrdiff_t p_inc = iio_buffer_step(txbuf);
+	char *p_end = iio_buffer_end(txbuf);
+	char *p_dat;
+	size_t k = 0;
+
+	for (p_dat = (char *)iio_buffer_first(txbuf, tx0_i); p_dat < p_end; p_dat += p_inc) {
+		((int16_t*)p_dat)[0] = iq[2 * k]; // Real (I)
+		((int16_t*)p_dat)[1] = iq[2 * k + 1]; // Imag (Q)
+		k++;
+	}
+}
+
+/* Push the TX buffer, which holds iq. After a DMA error the buffer is
+   recreated with the same samples, leaving the PHY and the context alone. */
+static ssize_t push_tx(struct iio_device *tx, size_t buffer_size, const int16_t *iq)
+{
+	enum recover_action action;
+	ssize_t ret = iio_buffer_push(txbuf);
+
+	while (ret < 0 && !stop) {
+		action = recover_error(&rec, ret);
+		fprintf(stderr, "Error pushing buf %d, %s\n", (int) ret, recover_action_name(action));
+		trace_anomaly("tx push error", -ret);
+		if (action == RECOVER_FATAL) { return ret; }
+		metric_add(m_recoveries, 1);
+
+		// A failed rebuild left no buffer to push, so build it again
+		if (action == RECOVER_REBUILD || !txbuf) {
+			if (txbuf) { iio_buffer_destroy(txbuf); }
+			txbuf = iio_device_create_buffer(tx, buffer_size, false);
+			if (!txbuf) {
+				ret = -errno;
+				continue;
+			}
+			write_tx(iq);
+		}
+		ret = iio_buffer_push(txbuf);
+	}
+
+	if (ret >= 0 && recover_ok(&rec)) {
+		metric_observe(m_recovery, rec.last_ns / 1e9);
+		if (status_display) printf("* TX back on air after %.1f ms\n", rec.last_ns / 1e6);
+	}
+	return ret;
+}
+
 void usage(void)
 {
 	fprintf(stderr,
@@ -342,12 +833,19 @@ void usage(void)
 		"\t\tCenter frequency in Hz (no default)\n\n"
 
 		"\t-s samplerate\n"
-		"\t\tSample rate in Hz. Used on both the input stream and the transmitted output.\n\n"
+		"\t\tSample rate in Hz. Used on both the input stream and the transmitted output.\n"
+		"\t\tBelow 2083334 Hz the AD9361 FIR interpolates by 4 (down to 520834 Hz);\n"
+		"\t\tbelow that the FPGA 8x interpolator is needed, where present.\n\n"
 
 		"\t-u iio_context_url\n"
 		"\t\tURL of the Pluto device, in libiio format.\n"
 		"\t\tDefault: ip:pluto.local\n\n"
 
+		"\t-m fm|am|usb|lsb\n"
+		"\t\tModulation. Default fm; NBFM is fm with a small deviation, e.g. -d 2500.\n"
+		"\t\tam is 100%% modulated at full-scale input; usb and lsb pass 150 Hz to\n"
+		"\t\t2850 Hz of the input. -d only applies to fm.\n\n"
+
 		"\t-d deviation\n"
 		"\t\tDesired FM deviation corresponding to the maximum positive sample value 0x7FFF.\n"
 		"\t\tThis is internally translated to a sensitivity factor.\n"
@@ -355,6 +853,13 @@ void usage(void)
 		"\t\tnegative sample values result in negative deviations.\n"
 		"\t\tDefault deviation 10000.\n\n"
 
+		"\t-w bandwidth\n"
+		"\t\tTX bandwidth in Hz. Filters the modulated signal digitally to it so\n"
+		"\t\twide deviations do not splatter over the whole sample rate, and sets\n"
+		"\t\tthe analog filter to it, 200000 at least. The digital filter passes 0.8\n"
+		"\t\ttimes the bandwidth, centred on the LO, and is down 60 dB at its edges;\n"
+		"\t\tits cost per sample is printed on exit. Default 200000 and no filter.\n\n"
+
 		"\t-a transmit_attenuation\n"
 		"\t\tspecifies in dB the amount by which the output power of the Pluto\n"
 		"\t\tshould be reduced from full scale. Default is 10, the minimum attentuation\n"
@@ -371,6 +876,37 @@ void usage(void)
 		"\t-E\n"
 		"\t\tEnable offset tuning, moving the Pluto's local oscillator frequency -1.5*deviation\n\n"
 		
+		"\t-C control_socket\n"
+		"\t\tListen for live parameter changes on this Unix socket, one command\n"
+		"\t\tper line: lo, gain, dev, offset or squelch followed by a value\n"
+		"\t\t(k, M and G suffixes allowed), a name alone to query it, or get.\n"
+		"\t\tsquelch is in dBFS of the input; quieter buffers are not transmitted.\n\n"
+
+		"\t-H hop_table\n"
+		"\t\tHop through the frequencies in this file, one \"frequency buffers\" line\n"
+		"\t\tper hop, repeating at the end. At most 8 distinct frequencies, which are\n"
+		"\t\tstored as AD9361 fastlock profiles. -f is not needed.\n\n"
+
+		"\t-B settle_us\n"
+		"\t\tMicroseconds of IQ blanked at the start of each hop. Default 100.\n\n"
+
+		"\t-T trace_prefix\n"
+		"\t\tRecord the last push, read and modulate events of the TX loop and dump\n"
+		"\t\tthem as Chrome trace JSON to trace_prefix-N.json on SIGUSR1, or when a\n"
+		"\t\tbuffer is ready too late to keep the DAC fed.\n\n"
+
+		"\t-M metrics_file\n"
+		"\t\tRewrite this file every second with Prometheus counters of samples,\n"
+		"\t\tbuffers, underflows, queue depth and stage times, for the node\n"
+		"\t\texporter textfile collector.\n\n"
+
+		"\t-P port\n"
+		"\t\tServe the same metrics over HTTP on 127.0.0.1:port.\n\n"
+
+		"\t-K isa\n"
+		"\t\tRun the modulator built for this instruction set: scalar, neon, sse4.1,\n"
+		"\t\tavx2 or avx512. Default is the best one the CPU has.\n\n"
+
 		"\t-q\n"
 		"\t\tQuiet status output\n\n"
 		);
@@ -386,10 +922,15 @@ int main (int argc, char **argv)
 
 	// TX sample counter
 	size_t ntx = 0;
+
+	// Buffers pushed, the first one silent
+	unsigned long long npushed = 0;
+
+	// When the last push returned, and how long the DAC can wait for the next
+	int64_t pushed_ns = 0, late_ns, t_ns;
 	
-	// Buffer pointers
-	char *p_dat, *p_end;
-	ptrdiff_t p_inc;
+	// Deviation samples of one buffer, and their IQ
+	int16_t *input, *iq;
 
 	// Stream configuration
 	struct stream_cfg txcfg;
@@ -398,7 +939,7 @@ int main (int argc, char **argv)
 	signal(SIGINT, handle_sig);
 
 	int opt;
-	while ((opt = getopt(argc, argv, "f:s:u:d:a:b:x:hqE")) != -1) {
+	while ((opt = getopt(argc, argv, "f:s:u:d:m:w:a:b:x:C:H:B:T:M:P:K:hqE")) != -1) {
 		switch (opt) {
 			case 'f':
 				center_frequency = (long long)atof(optarg);
@@ -432,9 +973,46 @@ int main (int argc, char **argv)
 				status_display = 0;
 				break;
 
+			case 'C':
+				control_path = optarg;
+				break;
+
 			case 'E':
 				offset_lo = 1;
 				break;
+
+			case 'H':
+				hop_path = optarg;
+				break;
+
+			case 'B':
+				hop_settle_us = atof(optarg);
+				break;
+
+			case 'T':
+				trace_path = optarg;
+				break;
+
+			case 'M':
+				metrics_path = optarg;
+				break;
+
+			case 'P':
+				metrics_port = atoi(optarg);
+				break;
+
+			case 'K':
+				dsp_name = optarg;
+				break;
+
+			case 'm':
+				mode_name = optarg;
+				break;
+
+			case 'w':
+				rf_bandwidth = (long long)atof(optarg);
+				band_limit = 1;
+				break;
 			
 			case 'h':
 			default:
@@ -443,6 +1021,12 @@ int main (int argc, char **argv)
 		}
 	}
 
+	if (hop_path) {
+		if (!load_hop_table(hop_path)) { exit(1); }
+		center_frequency = hops[0].lo_hz;
+		if (status_display) printf("* Hopping over %u frequencies, %u hops\n", nprofiles, nhops);
+	}
+
 	if (center_frequency == -1) {
 		fprintf(stderr, "You must supply a center frequency (-f freq).\n");
 		exit(1);
@@ -460,11 +1044,8 @@ int main (int argc, char **argv)
 	if (sample_rate == -1) {
 		fprintf(stderr, "You must supply a sample rate (-s samplerate).\n");
 		exit(1);
-	} else if (sample_rate < 260417) {
-		fprintf(stderr, "Sample rate %lld is lower than the Pluto's limit of 260418 Hz.\n", sample_rate);
-		exit(1);
-	} else if (sample_rate >= 2083333) {
-		fprintf(stderr, "Sample rate %lld is higher than the Pluto's limit (with interpolation) of 2083333 Hz.\n", center_frequency);
+	} else if (sample_rate > AD9361_MAX_RATE) {
+		fprintf(stderr, "Sample rate %lld is higher than the AD9361's limit of %lld Hz.\n", sample_rate, AD9361_MAX_RATE);
 		exit(1);
 	} else {
 		txcfg.fs_hz = sample_rate;	// baseband sample rate
@@ -485,6 +1066,11 @@ int main (int argc, char **argv)
 		deviation_scale_factor = (double)max_deviation / MAX_SAMPLE_VALUE;
 	}
 
+	if (rf_bandwidth < 1000 || rf_bandwidth > 56000000) {
+		fprintf(stderr, "Bandwidth %lld out of range (1000-56000000)\n", rf_bandwidth);
+		exit(1);
+	}
+
 	if (transmit_attenuation < 0 || transmit_attenuation > 89) {
 		fprintf(stderr, "Transmit attenuation %d out of range (0-89)\n\n", transmit_attenuation);
 		exit(1);
@@ -498,6 +1084,12 @@ int main (int argc, char **argv)
 	}
 	if (status_display) printf("* Buffer size = %lu bytes\n", buffer_size);
 
+	if (dsp_select(dsp_name)) {
+		fprintf(stderr, "DSP kernels %s are not available on this CPU.\n", dsp_name);
+		exit(1);
+	}
+	if (status_display) printf("* DSP kernels = %s\n", dsp_isa_name(dsp_isa));
+
 	if (offset_lo) {
 		offset_lo_offset = 1.5 * max_deviation;
 		txcfg.lo_hz = center_frequency - offset_lo_offset;	// LO offset from RF center frequency
@@ -505,7 +1097,7 @@ int main (int argc, char **argv)
 	}
 
 	// TX stream config constant values
-	txcfg.bw_hz = 200000;	// 200 kHz RF bandwidth, Pluto's minimum
+	txcfg.bw_hz = rf_bandwidth < 200000 ? 200000 : rf_bandwidth;	// the AD9361's minimum
 	txcfg.rfport = "A"; // port A (select for rf freq.)
 
 	if (status_display) printf("* Created IIO context %s\n", iio_context_url);
@@ -523,6 +1115,7 @@ int main (int argc, char **argv)
 
 	if (status_display) printf("* Configuring AD9361 for streaming\n");
 	IIO_ENSURE(cfg_ad9361_streaming_tx_ch(&txcfg, 0) && "TX port 0 not found");
+	if (nhops) { IIO_ENSURE(cfg_ad9361_fastlock_profiles() && "TX LO not found"); }
 
 	if (status_display) printf("* Initializing AD9361 IIO streaming channels\n");
 	IIO_ENSURE(get_ad9361_stream_ch(tx, 0, &tx0_i) && "TX chan i not found");
@@ -534,13 +1127,67 @@ int main (int argc, char **argv)
 	
 	if (status_display) printf("* Creating a non-cyclic IIO buffer of %lu samples\n", buffer_size);
 
+	// Hops are scheduled KERNEL_BUFFERS - 1 pushes ahead, so pin the count
+	if (nhops) { errchk_dev(iio_device_set_kernel_buffers_count(tx, KERNEL_BUFFERS)); }
+
 	txbuf = iio_device_create_buffer(tx, buffer_size, false);
 	if (!txbuf) {
 		perror("Could not create TX buffer");
-		shutdown();
+		shutdown(1);
 		return 0;
 	}
 	
+	input = malloc(buffer_size * sizeof(*input));
+	iq = calloc(2 * buffer_size, sizeof(*iq));
+	if (!input || !iq) {
+		perror("Could not allocate input buffer");
+		shutdown(1);
+	}
+	if (mod_init(&mod, mode_name, deviation_scale_factor, offset_lo_offset, sample_rate)) {
+		fprintf(stderr, "Unknown modulation %s\n", mode_name);
+		shutdown(1);
+	}
+	if (status_display) printf("* Modulation = %s\n", mod_mode_name(mod.mode));
+	if (band_limit && rf_bandwidth >= sample_rate) {
+		if (status_display) printf("* TX filter off, %lld Hz passes the whole sample rate\n", rf_bandwidth);
+		band_limit = 0;
+	}
+	if (band_limit) {
+		double edge = rf_bandwidth / 2.0 / sample_rate;
+		int err = conv_lowpass(&band, (1 - TX_FILTER_TRANSITION / 2) * edge,
+				       TX_FILTER_TRANSITION * edge, TX_FILTER_ATTEN_DB, TX_FILTER_GAIN);
+
+		if (err) {
+			fprintf(stderr, "Could not set up the TX filter: %s\n", strerror(-err));
+			shutdown(1);
+		}
+		if (status_display) printf("* TX filter = %lld Hz, %u taps, %s\n", rf_bandwidth, band.taps, conv_method_name(band.method));
+	}
+
+	if (control_path) {
+		int err = ctl_open(&ctl, control_path);
+
+		if (err) {
+			fprintf(stderr, "Could not open control socket %s: %s\n", control_path, strerror(-err));
+			shutdown(1);
+		}
+		if (status_display) printf("* Listening for control commands on %s\n", control_path);
+	}
+
+	if (trace_path) {
+		int err = trace_init(trace_path);
+
+		if (err) {
+			fprintf(stderr, "Could not start tracing to %s: %s\n", trace_path, strerror(-err));
+			shutdown(1);
+		}
+		trace_thread_name("tx");
+		signal(SIGUSR1, handle_dump);
+		if (status_display) printf("* Tracing, kill -USR1 %d dumps to %s-N.json\n", (int)getpid(), trace_path);
+	}
+
+	if (metrics_path || metrics_port) { setup_metrics(); }
+
 	if (status_display) printf("* Ready to transmit\n");
 
 
@@ -605,44 +1252,120 @@ int main (int argc, char **argv)
 
 
 	// Write first TX buf with all zeroes, for cleaner startup 
-	p_inc = iio_buffer_step(txbuf);
-	p_end = iio_buffer_end(txbuf);
-	for (p_dat = (char *)iio_buffer_first(txbuf, tx0_i); p_dat < p_end; p_dat += p_inc) {
-			((int16_t*)p_dat)[0] = 0 << 4; // Real (I)
-			((int16_t*)p_dat)[1] = 0 << 4; // Imag (Q)
-		}
+	write_tx(iq);
 
 	cfg_ad9361_txlo_powerdown(0);
 
+	late_ns = (int64_t)((KERNEL_BUFFERS - 1) * buffer_size * time_per_sample * 1e9);
+
 	if (status_display) printf("* Starting tx streaming (press CTRL+C to cancel)\n");
 	while (!stop)
 	{
 		ssize_t nbytes_tx;
-		int16_t sample;
+		double power = 0;
+		bool squelched;
+		size_t k, blank_from = 0, blank_to = 0;
+		int hop;
+
+		// A buffer filled slower than the queue drains leaves the DAC idle
+		t_ns = ctl_now_ns();
+		if (npushed > KERNEL_BUFFERS) {
+			int64_t gap = t_ns - pushed_ns;
+
+			metric_set(m_queue, gap < late_ns ? (late_ns - gap) / 1e9 : 0);
+			if (gap > late_ns) {
+				metric_add(m_underflows, 1);
+				trace_anomaly("tx late", gap / 1000);
+			}
+		}
 
 		// Schedule TX buffer
-		nbytes_tx = iio_buffer_push(txbuf);
-		if (nbytes_tx < 0) { fprintf(stderr, "Error pushing buf %d\n", (int) nbytes_tx); shutdown(); }
-
-		// WRITE: Get pointers to TX buf and write IQ to TX buf port 0
-		p_inc = iio_buffer_step(txbuf);
-		p_end = iio_buffer_end(txbuf);
-		for (p_dat = (char *)iio_buffer_first(txbuf, tx0_i); p_dat < p_end; p_dat += p_inc) {
-			sample = get_next_sample();
-			modulate_sample(sample, (int16_t*)p_dat, (int16_t*)(p_dat+2));
+		trace_begin("push");
+		nbytes_tx = push_tx(tx, buffer_size, iq);
+		trace_end("push");
+		if (nbytes_tx < 0) { shutdown(stop ? 0 : 1); }
+		pushed_ns = ctl_now_ns();
+		metric_observe(m_push, (pushed_ns - t_ns) / 1e9);
+
+		// Buffer boundary: report changes that just went out, apply new ones
+		control_pushed();
+		control_poll();
+
+		// Hop when the buffer blanked for it starts on air
+		if (npushed >= KERNEL_BUFFERS - 1 && (hop = hop_starting(npushed - (KERNEL_BUFFERS - 1))) >= 0) {
+			hop_recall(hops[hop].profile);
+		}
+		npushed++;
+		if (!hop_blank(npushed, &blank_from, &blank_to)) {
+			blank_from = blank_to = 0;
+		}
+
+		// READ: a buffer of deviation samples, and its level for the squelch
+		trace_begin("read");
+		t_ns = ctl_now_ns();
+		if (audio_read_fd(STDIN_FILENO, input, buffer_size) < buffer_size) { stop = true; }
+		for (k = 0; k < buffer_size; k++) {
+			power += (double)input[k] * input[k];
+		}
+		squelched = 10 * log10(power / buffer_size / (32768.0 * 32768.0) + 1e-20) < squelch_level;
+		trace_end("read");
+		metric_observe(m_read, (ctl_now_ns() - t_ns) / 1e9);
+		if (squelched) { metric_add(m_squelched, 1); }
+
+		// MODULATE: the carrier is off while blanked, and the phase holds
+		trace_begin("modulate");
+		t_ns = ctl_now_ns();
+		if (squelched) {
+			blank_from = 0;
+			blank_to = buffer_size;
+		}
+		if (blank_from) { mod_block(&mod, input, iq, blank_from); }
+		memset(iq + 2 * blank_from, 0, 2 * (blank_to - blank_from) * sizeof(*iq));
+		if (blank_to < buffer_size) {
+			mod_block(&mod, input + blank_to, iq + 2 * blank_to, buffer_size - blank_to);
+		}
+
+		// FILTER: the blanked part too, so the carrier ramps rather than steps;
+		// hop_blank() put the blank ahead of the filter delay
+		if (band_limit) {
+			int64_t f_ns = ctl_now_ns();
+
+			trace_begin("filter");
+			conv_block_s16(&band, iq, iq, buffer_size);
+			trace_end("filter");
+			f_ns = ctl_now_ns() - f_ns;
+			metric_observe(m_filter, f_ns / 1e9);
+			band_ns += f_ns;
+			band_samples += buffer_size;
 		}
 
+		// WRITE: IQ to TX buf port 0
+		write_tx(iq);
+		trace_end("modulate");
+		metric_observe(m_modulate, (ctl_now_ns() - t_ns) / 1e9);
+
 		// Sample counter increment and status output
 		ntx += nbytes_tx / iio_device_get_sample_size(tx);
+		metric_add(m_samples, nbytes_tx / iio_device_get_sample_size(tx));
+		metric_add(m_buffers, 1);
 		if (status_display) {
 			printf("\tTX %8.2f MSmp\r", ntx/1e6);
 			fflush(stdout);
 		}
 	}
 	if (status_display) printf("\n");
+	hop_report();
+	if (status_display && (rec.retries || rec.rebuilds)) {
+		printf("* %lu DMA errors recovered (%lu retries, %lu buffer rebuilds), worst %.1f ms off air\n",
+			rec.outages, rec.retries, rec.rebuilds, rec.worst_ns / 1e6);
+	}
+	if (status_display && band_samples) {
+		printf("* TX filter took %.1f ns per sample, %.1f%% of the sample period\n",
+			(double)band_ns / band_samples, 100.0 * band_ns / band_samples * 1e-9 * sample_rate);
+	}
 
 	cfg_ad9361_txlo_powerdown(1);
-	shutdown();
+	shutdown(0);
 
 	return 0;
 }